@@ -131,7 +131,7 @@ DEPENDPATH += src src/json src/cryptopp src/qt
 
 HUNTERCOIN_HEADERS = headers.h strlcpy.h serialize.h uint256.h util.h key.h bignum.h base58.h scrypt.h \
     script.h allocators.h db.h walletdb.h crypter.h net.h irc.h keystore.h main.h wallet.h bitcoinrpc.h uibase.h ui.h noui.h init.h auxpow.h \
-    gamestate.h gamemap.h gamedb.h gametx.h gamemovecreator.h
+    gamestate.h gamemap.h gamedb.h gametx.h gamemovecreator.h gamecommitment.h gamejson.h gameindex.h gameleaderboard.h gamedelta.h gamestore.h gamesnapshot.h gamedistance.h
 
 HUNTERCOIN_SOURCES = \
     auxpow.cpp \
@@ -156,7 +156,15 @@ HUNTERCOIN_SOURCES = \
     gamemap.cpp \
     gamedb.cpp \
     gametx.cpp \
-    gamemovecreator.cpp
+    gamemovecreator.cpp \
+    gamecommitment.cpp \
+    gamejson.cpp \
+    gameindex.cpp \
+    gameleaderboard.cpp \
+    gamedelta.cpp \
+    gamestore.cpp \
+    gamesnapshot.cpp \
+    gamedistance.cpp
 
 #HEADERS += $$join(HUNTERCOIN_HEADERS, " src/", " src/",)
 #SOURCES += $$join(HUNTERCOIN_SOURCES, " src/", " src/",)
@@ -164,7 +172,7 @@ HUNTERCOIN_SOURCES = \
 HEADERS += \
     src/headers.h src/strlcpy.h src/serialize.h src/uint256.h src/util.h src/key.h src/bignum.h src/base58.h src/scrypt.h \
     src/script.h src/allocators.h src/db.h src/walletdb.h src/crypter.h src/net.h src/irc.h src/keystore.h src/main.h src/wallet.h src/bitcoinrpc.h src/uibase.h src/ui.h src/noui.h src/init.h src/auxpow.h \
-    src/gamestate.h src/gamemap.h src/gamedb.h src/gametx.h src/gamemovecreator.h \
+    src/gamestate.h src/gamemap.h src/gamedb.h src/gametx.h src/gamemovecreator.h src/gamecommitment.h src/gamejson.h src/gameindex.h src/gameleaderboard.h src/gamedelta.h src/gamestore.h src/gamesnapshot.h src/gamedistance.h \
     src/qt/netbase.h \
     src/qt/bitcoingui.h \
     src/qt/transactiontablemodel.h \
@@ -239,6 +247,14 @@ SOURCES += \
     src/gamedb.cpp \
     src/gametx.cpp \
     src/gamemovecreator.cpp \
+    src/gamecommitment.cpp \
+    src/gamejson.cpp \
+    src/gameindex.cpp \
+    src/gameleaderboard.cpp \
+    src/gamedelta.cpp \
+    src/gamestore.cpp \
+    src/gamesnapshot.cpp \
+    src/gamedistance.cpp \
     src/qt/netbase.cpp \
     src/qt/bitcoin.cpp \
     src/qt/bitcoingui.cpp \
@@ -11,6 +11,7 @@
 #include "main.h"
 #include "auxpow.h"
 #include "gametx.h"
+#include "gamedb.h"
 
 #undef printf
 
@@ -759,6 +760,14 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("mininput",      ValueFromAmount(nMinimumInputValue)));
     if (pwalletMain->IsCrypted())
         obj.push_back(Pair("unlocked_until", (boost::int64_t)nWalletUnlockTime / 1000));
+    int nRebuildHeight, nRebuildTarget;
+    if (GetGameDBRebuildProgress(nRebuildHeight, nRebuildTarget))
+    {
+        Object rebuild;
+        rebuild.push_back(Pair("height", nRebuildHeight));
+        rebuild.push_back(Pair("target", nRebuildTarget));
+        obj.push_back(Pair("gamedbrebuild", rebuild));
+    }
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     return obj;
 }
@@ -3769,6 +3778,33 @@ string pCallAsync[] =
 };
 set<string> setCallAsync(pCallAsync, pCallAsync + sizeof(pCallAsync)/sizeof(pCallAsync[0]));
 
+/* Methods that need the current game state and are refused while the
+   game DB is rebuilt in the background.  */
+string pCallNeedsGameState[] =
+{
+    "getwork",
+    "getworkaux",
+    "getauxblock",
+    "getmemorypool",
+};
+set<string> setCallNeedsGameState(pCallNeedsGameState, pCallNeedsGameState + sizeof(pCallNeedsGameState)/sizeof(pCallNeedsGameState[0]));
+
+/* Methods with a raw JSON text result, filled in by huntercoin.cpp.  */
+map<string, rpcrawfn_type> mapRawCallTable;
+
+/* Throw if the method needs the game state and it is not yet available
+   because the game DB is being rebuilt.  */
+static void
+CheckGameStateAvailable (const string& strMethod)
+{
+  int nHeight, nTarget;
+  if (setCallNeedsGameState.count (strMethod)
+      && GetGameDBRebuildProgress (nHeight, nTarget))
+    throw JSONRPCError (RPC_GAME_REBUILDING,
+                        strprintf ("rebuilding game state (%d of %d)",
+                                   nHeight, nTarget));
+}
+
 
 
 
@@ -3970,6 +4006,17 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
     return write_string(Value(reply), false) + "\n";
 }
 
+/* Reply with a result that is already encoded as JSON text.  */
+string JSONRPCRawReply(const string& strResult, const Value& id)
+{
+    string strReply = "{\"result\":";
+    strReply += strResult;
+    strReply += ",\"error\":null,\"id\":";
+    strReply += write_string(id, false);
+    strReply += "}\n";
+    return strReply;
+}
+
 void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
 {
     // Send error reply from json-rpc error object
@@ -4117,15 +4164,20 @@ public:
 /* Execute an RPC call, can be used as thread object for async calls.  */
 static void
 ExecuteRpcCall (ClientConnectionOutput* out, rpcfn_type method,
+                rpcrawfn_type rawMethod,
                 json_spirit::Array params, json_spirit::Value id)
 {
   try
     {
-      // Execute
-      Value result = method (params, false);
-
-      // Send reply
-      string strReply = JSONRPCReply (result, json_spirit::Value::null, id);
+      // Execute and send reply
+      string strReply;
+      if (rawMethod)
+        strReply = JSONRPCRawReply (rawMethod (params, false), id);
+      else
+        {
+          Value result = method (params, false);
+          strReply = JSONRPCReply (result, json_spirit::Value::null, id);
+        }
       out->getStream () << HTTPReply (200, strReply) << std::flush;
     }
   catch (Object& objError)
@@ -4366,16 +4418,25 @@ void ThreadRPCServer2(void* parg)
             if (strWarning != "" && !GetBoolArg("-disablesafemode") && !setAllowInSafeMode.count(strMethod))
                 throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+            // Refuse game methods until the game DB is rebuilt
+            CheckGameStateAvailable(strMethod);
+
+            // Prefer the raw variant of the method if there is one
+            rpcrawfn_type rawMethod = NULL;
+            map<string, rpcrawfn_type>::const_iterator miRaw = mapRawCallTable.find(strMethod);
+            if (miRaw != mapRawCallTable.end())
+                rawMethod = miRaw->second;
+
             // Check for asynchronous execution and call the method.
             const bool async = (setCallAsync.count(strMethod) > 0);
             if (!async)
-                ExecuteRpcCall(out.release(), (*mi).second, params, id);
+                ExecuteRpcCall(out.release(), (*mi).second, rawMethod, params, id);
             else
             {
                 std::auto_ptr<boost::thread> runner;
                 runner.reset (new boost::thread (&ExecuteRpcCall,
                                   out.release(),
-                                  (*mi).second, params, id));
+                                  (*mi).second, rawMethod, params, id));
                 asyncThreads.push_back (runner.release());
             }
         }
@@ -4553,8 +4614,22 @@ void RPCConvertValues(const std::string &strMethod, json_spirit::Array &params)
     if (strMethod == "signrawtransaction"     && n > 2) ConvertTo<Array>(params[2], true);
     if (strMethod == "game_getstate"          && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "game_getplayerstate"    && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "game_getstateroot"      && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "game_getstateroot"      && n > 1) ConvertTo<bool>(params[1]);
+    if (strMethod == "game_findplayers"       && n > 0) ConvertTo<Object>(params[0]);
+    if (strMethod == "game_findplayers"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "game_leaderboard"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "game_getdistancefield"  && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "game_getpath"           && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "game_getpath"           && n > 1) ConvertTo<Array>(params[1]);
+    if (strMethod == "game_getpaths"          && n > 0) ConvertTo<Array>(params[0]);
+    if (strMethod == "game_getpaths"          && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "game_benchpath"         && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "game_checksnapshot"     && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "game_verifyhistory"     && n > 0) ConvertTo<boost::int64_t>(params[0]);
+    if (strMethod == "game_verifyhistory"     && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "game_dumpsnapshot"      && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "game_checksnapshotfile" && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "prune_gamedb"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "prune_nameindex"        && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "getauxblock" && (n == 1 || n == 3)) ConvertTo<boost::int64_t>(params[n - 1]);
@@ -4649,6 +4724,8 @@ json_spirit::Value ExecuteRPC(const std::string &strMethod, const Array &params)
     if (strWarning != "" && !GetBoolArg("-disablesafemode") && !setAllowInSafeMode.count(strMethod))
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    CheckGameStateAvailable(strMethod);
+
     // Execute
     Value result = (*(*mi).second)(params, false);
     return result;
@@ -38,6 +38,13 @@ json_spirit::Value ValueFromAmount(int64 amount);
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
 extern std::map<std::string, rpcfn_type> mapCallTable;
 extern std::set<std::string> setCallAsync;
+extern std::set<std::string> setCallNeedsGameState;
+
+/* Methods that produce their result as already encoded JSON text.  The RPC
+   server calls them instead of the mapCallTable entry of the same name,
+   which is still required for help and calls from the GUI.  */
+typedef std::string(*rpcrawfn_type)(const json_spirit::Array& params, bool fHelp);
+extern std::map<std::string, rpcrawfn_type> mapRawCallTable;
 
 
 // Bitcoin RPC error codes
@@ -79,6 +86,8 @@ enum RPCErrorCode
     RPC_ASYNC_INTERRUPT             = -100,
     // Daemon in warm-up phase.
     RPC_IN_WARMUP                   = -101,
+    // Game DB is being rebuilt, no current game state yet.
+    RPC_GAME_REBUILDING             = -102,
 };
 
 /* Keep track of current "warmup status".  This is set to a descriptive
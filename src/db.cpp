@@ -280,6 +280,51 @@ bool CDB::Rewrite(const string& strFile)
     return false;
 }
 
+bool
+CDB::CompactStep (CDataStream& ssKey, unsigned nPages)
+{
+  if (!pdb)
+    return false;
+
+  DB_COMPACT data;
+  memset (&data, 0, sizeof (data));
+  data.compact_pages = nPages;
+
+  Dbt datStart;
+  if (!ssKey.empty ())
+    {
+      datStart.set_data (&ssKey[0]);
+      datStart.set_size (ssKey.size ());
+    }
+  Dbt datEnd;
+  datEnd.set_flags (DB_DBT_MALLOC);
+
+  /* Without a transaction handle, BDB protects the compaction with its
+     own (short) transactions, so that other writers are not blocked for
+     long.  */
+  const int ret = pdb->compact (NULL, ssKey.empty () ? NULL : &datStart,
+                                NULL, &data, DB_FREE_SPACE, &datEnd);
+  if (ret != 0)
+    return error ("CDB::CompactStep: compact failed with %d", ret);
+
+  /* The call returns early only if it freed the requested number of
+     pages.  Otherwise it went through to the end.  */
+  ssKey.clear ();
+  if (datEnd.get_data () != NULL)
+    {
+      if (data.compact_pages_free >= nPages)
+        ssKey.write ((char*)datEnd.get_data (), datEnd.get_size ());
+      free (datEnd.get_data ());
+    }
+
+  if (fDebug)
+    printf ("CDB::CompactStep: %s freed %u pages, truncated %u\n",
+            strFile.c_str (), data.compact_pages_free,
+            data.compact_pages_truncated);
+
+  return true;
+}
+
 /* Internal struct to accumulate db stats.  */
 struct DbstatsPerKeyData
 {
@@ -776,6 +821,58 @@ CNameDB::ReadName (const vchType& name, CNameIndex& nidx)
   return true;
 }
 
+bool
+CNameDB::ReadNames (const std::set<vchType>& names,
+                    std::map<vchType, CNameIndex>& out)
+{
+  out.clear ();
+  if (names.empty ())
+    return true;
+
+  /* Sort by the serialised keys, which is the order in the database.
+     It differs from the order of the names, since the length comes
+     first in the serialisation.  */
+  std::map<std::string, vchType> keys;
+  BOOST_FOREACH (const vchType& name, names)
+    {
+      CDataStream ssKey(SER_DISK, VERSION);
+      ssKey << std::make_pair (std::string ("namei"), name);
+      keys.insert (std::make_pair (ssKey.str (), name));
+    }
+
+  /* This runs within the transaction of the block being connected,
+     which may already have written some of the names.  */
+  Dbc* pcursor = GetCursor (GetTxn ());
+  if (!pcursor)
+    return error ("CNameDB::ReadNames: cannot get cursor");
+
+  for (std::map<std::string, vchType>::const_iterator i = keys.begin ();
+       i != keys.end (); ++i)
+    {
+      CDataStream ssKey(i->first.data (), i->first.data () + i->first.size (),
+                        SER_DISK, VERSION);
+      CDataStream ssValue(SER_DISK, VERSION);
+      SetStreamVersion (ssValue);
+
+      const int ret = ReadAtCursor (pcursor, ssKey, ssValue, DB_SET);
+      if (ret == DB_NOTFOUND)
+        continue;
+      if (ret != 0)
+        {
+          pcursor->close ();
+          return error ("CNameDB::ReadNames: cursor error %d", ret);
+        }
+
+      std::vector<CNameIndex> vec;
+      ssValue >> vec;
+      if (!vec.empty ())
+        out.insert (std::make_pair (i->second, vec.back ()));
+    }
+  pcursor->close ();
+
+  return true;
+}
+
 bool
 CNameDB::PushEntry (const vchType& name, const CNameIndex& value)
 {
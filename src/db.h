@@ -7,6 +7,7 @@
 #include "key.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -170,11 +171,19 @@ protected:
     }
 
     Dbc* GetCursor()
+    {
+        return GetCursor(NULL);
+    }
+
+    // Cursor that belongs to the given transaction, so that it sees the
+    // transaction's own writes and does not wait for its locks.  It must
+    // be closed before the transaction ends.
+    Dbc* GetCursor(DbTxn* ptxn)
     {
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        int ret = pdb->cursor(ptxn, &pcursor, 0);
         if (ret != 0)
             return NULL;
         return pcursor;
@@ -219,6 +228,38 @@ protected:
         return 0;
     }
 
+    /* Like ReadAtCursor, but only read the key.  This avoids copying
+       large values when only the keys are of interest.  */
+    int
+    ReadKeyAtCursor (Dbc* pcursor, CDataStream& ssKey,
+                     unsigned int fFlags = DB_NEXT)
+    {
+        Dbt datKey;
+        if (fFlags == DB_SET || fFlags == DB_SET_RANGE)
+        {
+            datKey.set_data(&ssKey[0]);
+            datKey.set_size(ssKey.size());
+        }
+        datKey.set_flags(DB_DBT_MALLOC);
+        Dbt datValue;
+        datValue.set_flags(DB_DBT_PARTIAL);
+        datValue.set_doff(0);
+        datValue.set_dlen(0);
+        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        if (ret != 0)
+            return ret;
+        else if (datKey.get_data() == NULL)
+            return 99999;
+
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write((char*)datKey.get_data(), datKey.get_size());
+
+        memset(datKey.get_data(), 0, datKey.get_size());
+        free(datKey.get_data());
+        return 0;
+    }
+
     /* Update the stream to our serialisation version.  This is useful
        for ReadAtCursor users.  */
     inline void
@@ -318,6 +359,16 @@ public:
       Rewrite (strFile);
     }
 
+    /**
+     * Compact the database file in place, a limited number of pages at a
+     * time.  In contrast to Rewrite, this can run while the DB is in use.
+     * @param ssKey Key at which to start (empty for the beginning).  Set
+     *              to the key at which to continue, or cleared when done.
+     * @param nPages Stop after freeing this many pages.
+     * @return False on error.
+     */
+    bool CompactStep (CDataStream& ssKey, unsigned nPages);
+
     /**
      * Print some storage stats about the database file for debugging
      * purposes.
@@ -414,6 +465,13 @@ public:
        the active CNameIndex object.  */
     bool ReadName (const vchType& name, CNameIndex& nidx);
 
+    /* Batch version of ReadName.  The names are looked up in the order
+       of their database keys with a single cursor, which avoids random
+       accesses for many names.  Names that are not found are simply
+       missing from the result.  */
+    bool ReadNames (const std::set<vchType>& names,
+                    std::map<vchType, CNameIndex>& out);
+
     /* Return all states of the name in the index.  This is used for
        name_history but nothing else (except things like name_debug1 which
        do not really matter).  It may be incomplete if some
@@ -0,0 +1,592 @@
+#include "gamecommitment.h"
+
+#include "headers.h"
+
+#include <algorithm>
+#include <iterator>
+
+using namespace Game;
+
+/* Number of commitments kept in memory.  They share most of their nodes,
+   so this is cheap.  */
+static const unsigned COMMITMENT_CACHE_SIZE = 20;
+
+/* ************************************************************************** */
+/* CollectChanges.  */
+
+template<typename T>
+  static inline bool
+  EntriesEqual (const T& a, const T& b)
+{
+  return a == b;
+}
+
+#ifdef PERMANENT_LUGGAGE
+/* StorageVault has lots of (mostly reserved) fields.  Simply compare
+   the serialised data for it.  */
+template<>
+  inline bool
+  EntriesEqual<StorageVault> (const StorageVault& a, const StorageVault& b)
+{
+  CDataStream sa(SER_DISK, VERSION);
+  CDataStream sb(SER_DISK, VERSION);
+  sa << a;
+  sb << b;
+  return sa.str () == sb.str ();
+}
+#endif
+
+/**
+ * Walk two maps in parallel and add all keys to the output set that
+ * are only in one of them or have differing values.
+ */
+template<typename K, typename V>
+  static void
+  DiffMaps (const std::map<K, V>& a, const std::map<K, V>& b,
+            std::set<K>& out)
+{
+  typename std::map<K, V>::const_iterator i = a.begin ();
+  typename std::map<K, V>::const_iterator j = b.begin ();
+  while (i != a.end () || j != b.end ())
+    {
+      if (j == b.end () || (i != a.end () && i->first < j->first))
+        {
+          out.insert (i->first);
+          ++i;
+        }
+      else if (i == a.end () || j->first < i->first)
+        {
+          out.insert (j->first);
+          ++j;
+        }
+      else
+        {
+          if (!EntriesEqual (i->second, j->second))
+            out.insert (i->first);
+          ++i;
+          ++j;
+        }
+    }
+}
+
+void
+Game::CollectChanges (const GameState& a, const GameState& b,
+                      StateChangeSet& out)
+{
+  DiffMaps (a.players, b.players, out.players);
+  DiffMaps (a.dead_players_chat, b.dead_players_chat, out.deadPlayersChat);
+  DiffMaps (a.loot, b.loot, out.loot);
+  DiffMaps (a.banks, b.banks, out.banks);
+#ifdef PERMANENT_LUGGAGE
+  DiffMaps (a.vault, b.vault, out.vaults);
+#endif
+
+  std::set_symmetric_difference (a.hearts.begin (), a.hearts.end (),
+                                 b.hearts.begin (), b.hearts.end (),
+                                 std::inserter (out.hearts,
+                                                out.hearts.end ()));
+}
+
+/**
+ * Log all elements of the full set that are missing in the recorded one.
+ * Returns true if there are none.
+ */
+template<typename K>
+  static bool
+  CheckSubset (const std::set<K>& full, const std::set<K>& recorded,
+               const char* what)
+{
+  unsigned nMissing = 0;
+  BOOST_FOREACH (const K& k, full)
+    if (recorded.count (k) == 0)
+      ++nMissing;
+
+  if (nMissing > 0)
+    printf ("CheckChanges: %u changed %s not recorded\n", nMissing, what);
+  return nMissing == 0;
+}
+
+bool
+Game::CheckChanges (const GameState& a, const GameState& b,
+                    const StateChangeSet& changes)
+{
+  StateChangeSet full;
+  CollectChanges (a, b, full);
+
+  bool ok = true;
+  ok &= CheckSubset (full.players, changes.players, "players");
+  ok &= CheckSubset (full.deadPlayersChat, changes.deadPlayersChat,
+                     "dead players' chat");
+  ok &= CheckSubset (full.loot, changes.loot, "loot tiles");
+  ok &= CheckSubset (full.hearts, changes.hearts, "hearts");
+  ok &= CheckSubset (full.banks, changes.banks, "banks");
+  ok &= CheckSubset (full.vaults, changes.vaults, "vaults");
+
+  return ok;
+}
+
+/* ************************************************************************** */
+/* StateCommitment.  */
+
+/* Node of the tree.  Inner nodes have (possibly NULL) children, while
+   the nodes at depth DEPTH are buckets holding the entity hashes.  Nodes
+   are never changed after construction, since they may be shared
+   between multiple commitments.  */
+struct StateCommitment::Node
+{
+  uint256 hash;
+
+  NodePtr left, right;
+  std::map<std::string, uint256> entries;
+};
+
+StateCommitment::StateCommitment ()
+  : root(), nHeight(-1), hashBlock(0), nEntities(0)
+{}
+
+template<typename T>
+  static std::string
+  SerialiseKey (char prefix, const T& obj)
+{
+  CDataStream ss(SER_DISK, VERSION);
+  ss << obj;
+
+  std::string res(1, prefix);
+  res += ss.str ();
+  return res;
+}
+
+std::string
+StateCommitment::PlayerKey (const std::string& name)
+{
+  return "P" + name;
+}
+
+std::string
+StateCommitment::DeadPlayerChatKey (const std::string& name)
+{
+  return "D" + name;
+}
+
+std::string
+StateCommitment::LootKey (const Coord& c)
+{
+  return SerialiseKey ('L', c);
+}
+
+std::string
+StateCommitment::HeartKey (const Coord& c)
+{
+  return SerialiseKey ('H', c);
+}
+
+std::string
+StateCommitment::BankKey (const Coord& c)
+{
+  return SerialiseKey ('B', c);
+}
+
+std::string
+StateCommitment::VaultKey (const std::string& addr)
+{
+  return "V" + addr;
+}
+
+std::string
+StateCommitment::GlobalsKey ()
+{
+  return "G";
+}
+
+uint256
+StateCommitment::HashGlobals (const GameState& state)
+{
+  CDataStream ss(SER_DISK, VERSION);
+  ss << state.crownPos << state.crownHolder.player << state.crownHolder.index
+     << state.gameFund << state.nHeight << state.nDisasterHeight;
+
+#ifdef PERMANENT_LUGGAGE
+  ss << state.gemSpawnPos << state.gemSpawnState
+     << state.feed_nextexp_price << state.feed_prevexp_price
+     << state.feed_reward_dividend << state.feed_reward_divisor
+     << state.feed_reward_remaining << state.upgrade_test
+     << state.liquidity_reward_remaining << state.auction_settle_price
+     << state.auction_last_price << state.auction_last_chronon;
+#ifdef AUX_STORAGE_VERSION2
+#ifdef AUX_STORAGE_VERSION3
+  ss << state.gs_reserve31 << state.gs_reserve32
+     << state.gs_reserve33 << state.gs_reserve34
+     << state.crd_nextexp_price;
+#endif
+  ss << state.crd_last_price << state.crd_last_size
+     << state.crd_prevexp_price << state.crd_mm_orderlimits
+     << state.crd_last_chronon << state.zhunt_gemSpawnState
+     << state.zhunt_RNG << state.gs_reserve8
+     << state.auction_settle_conservative << state.gs_reserve10
+     << state.gs_str_reserve1 << state.gs_str_reserve2;
+#endif
+#endif
+
+  return Hash (ss.begin (), ss.end ());
+}
+
+unsigned
+StateCommitment::GetBucket (const std::string& key)
+{
+  uint256 h = Hash (key.begin (), key.end ());
+  const unsigned char* p = h.begin ();
+  const unsigned val = p[0] | (static_cast<unsigned> (p[1]) << 8);
+
+  return val & ((1 << DEPTH) - 1);
+}
+
+uint256
+StateCommitment::HashNode (const Node& n)
+{
+  if (!n.entries.empty ())
+    return SerializeHash (n.entries, SER_DISK);
+
+  uint256 l = (n.left ? n.left->hash : uint256 (0));
+  uint256 r = (n.right ? n.right->hash : uint256 (0));
+  return Hash (l.begin (), l.end (), r.begin (), r.end ());
+}
+
+StateCommitment::NodePtr
+StateCommitment::BuildNode (unsigned depth, unsigned index,
+                            const std::vector<Bucket>& buckets)
+{
+  if (depth == DEPTH)
+    {
+      if (buckets[index].empty ())
+        return NodePtr ();
+
+      Node* n = new Node ();
+      n->entries = buckets[index];
+      n->hash = HashNode (*n);
+      return NodePtr (n);
+    }
+
+  NodePtr left = BuildNode (depth + 1, 2 * index, buckets);
+  NodePtr right = BuildNode (depth + 1, 2 * index + 1, buckets);
+  if (!left && !right)
+    return NodePtr ();
+
+  Node* n = new Node ();
+  n->left = left;
+  n->right = right;
+  n->hash = HashNode (*n);
+  return NodePtr (n);
+}
+
+void
+StateCommitment::CollectLeaves (const NodePtr& node,
+                                std::vector<std::pair<std::string, uint256> >& out)
+{
+  if (!node)
+    return;
+
+  out.insert (out.end (), node->entries.begin (), node->entries.end ());
+  CollectLeaves (node->left, out);
+  CollectLeaves (node->right, out);
+}
+
+StateCommitment::NodePtr
+StateCommitment::UpdateNode (const NodePtr& node, unsigned depth,
+                             unsigned bucket, const std::string& key,
+                             const uint256* value)
+{
+  Node* n = new Node ();
+  NodePtr res(n);
+
+  if (depth == DEPTH)
+    {
+      if (node)
+        n->entries = node->entries;
+
+      if (value)
+        {
+          if (n->entries.count (key) == 0)
+            ++nEntities;
+          n->entries[key] = *value;
+        }
+      else if (n->entries.erase (key) > 0)
+        --nEntities;
+
+      if (n->entries.empty ())
+        return NodePtr ();
+    }
+  else
+    {
+      if (node)
+        {
+          n->left = node->left;
+          n->right = node->right;
+        }
+
+      const bool bit = (bucket >> (DEPTH - depth - 1)) & 1;
+      if (bit)
+        n->right = UpdateNode (n->right, depth + 1, bucket, key, value);
+      else
+        n->left = UpdateNode (n->left, depth + 1, bucket, key, value);
+
+      if (!n->left && !n->right)
+        return NodePtr ();
+    }
+
+  n->hash = HashNode (*n);
+  return res;
+}
+
+void
+StateCommitment::SetEntity (const std::string& key, const uint256* value)
+{
+  root = UpdateNode (root, 0, GetBucket (key), key, value);
+}
+
+void
+StateCommitment::Build (const GameState& state)
+{
+  std::vector<Bucket> buckets(1 << DEPTH);
+  nEntities = 0;
+
+#define ADD_ENTITY(key, hash) \
+  do { \
+    const std::string k = (key); \
+    buckets[GetBucket (k)][k] = (hash); \
+    ++nEntities; \
+  } while (false)
+
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p, state.players)
+    ADD_ENTITY (PlayerKey (p.first), SerializeHash (p.second, SER_DISK));
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p,
+                 state.dead_players_chat)
+    ADD_ENTITY (DeadPlayerChatKey (p.first),
+                SerializeHash (p.second, SER_DISK));
+  BOOST_FOREACH (const PAIRTYPE(Coord, LootInfo)& l, state.loot)
+    ADD_ENTITY (LootKey (l.first), SerializeHash (l.second, SER_DISK));
+  BOOST_FOREACH (const Coord& h, state.hearts)
+    ADD_ENTITY (HeartKey (h), SerializeHash (h, SER_DISK));
+  BOOST_FOREACH (const PAIRTYPE(Coord, unsigned)& b, state.banks)
+    ADD_ENTITY (BankKey (b.first), SerializeHash (b.second, SER_DISK));
+#ifdef PERMANENT_LUGGAGE
+  BOOST_FOREACH (const PAIRTYPE(std::string, StorageVault)& v, state.vault)
+    ADD_ENTITY (VaultKey (v.first), SerializeHash (v.second, SER_DISK));
+#endif
+  ADD_ENTITY (GlobalsKey (), HashGlobals (state));
+
+#undef ADD_ENTITY
+
+  root = BuildNode (0, 0, buckets);
+  nHeight = state.nHeight;
+  hashBlock = state.hashBlock;
+}
+
+/**
+ * Update the entities of one type in a commitment.  For each changed key,
+ * the entry is either set to the hash of the new value or removed.
+ */
+template<typename K, typename V>
+  static void
+  UpdateEntities (const std::set<K>& changed, const std::map<K, V>& entries,
+                  std::string (*keyFcn) (const K&),
+                  std::vector<std::pair<std::string, uint256> >& set,
+                  std::vector<std::string>& removed)
+{
+  BOOST_FOREACH (const K& k, changed)
+    {
+      typename std::map<K, V>::const_iterator mi = entries.find (k);
+      if (mi == entries.end ())
+        removed.push_back (keyFcn (k));
+      else
+        set.push_back (std::make_pair (keyFcn (k),
+                                       SerializeHash (mi->second, SER_DISK)));
+    }
+}
+
+void
+StateCommitment::Update (const GameState& state,
+                         const StateChangeSet& changes)
+{
+  std::vector<std::pair<std::string, uint256> > set;
+  std::vector<std::string> removed;
+
+  UpdateEntities (changes.players, state.players, &PlayerKey, set, removed);
+  UpdateEntities (changes.deadPlayersChat, state.dead_players_chat,
+                  &DeadPlayerChatKey, set, removed);
+  UpdateEntities (changes.loot, state.loot, &LootKey, set, removed);
+  UpdateEntities (changes.banks, state.banks, &BankKey, set, removed);
+#ifdef PERMANENT_LUGGAGE
+  UpdateEntities (changes.vaults, state.vault, &VaultKey, set, removed);
+#endif
+
+  BOOST_FOREACH (const Coord& c, changes.hearts)
+    if (state.hearts.count (c) > 0)
+      set.push_back (std::make_pair (HeartKey (c),
+                                     SerializeHash (c, SER_DISK)));
+    else
+      removed.push_back (HeartKey (c));
+
+  set.push_back (std::make_pair (GlobalsKey (), HashGlobals (state)));
+
+  for (unsigned i = 0; i < set.size (); ++i)
+    SetEntity (set[i].first, &set[i].second);
+  BOOST_FOREACH (const std::string& k, removed)
+    SetEntity (k, NULL);
+
+  nHeight = state.nHeight;
+  hashBlock = state.hashBlock;
+}
+
+void
+StateCommitment::GetLeaves (std::vector<std::pair<std::string, uint256> >& out) const
+{
+  out.clear ();
+  out.reserve (nEntities);
+  CollectLeaves (root, out);
+}
+
+void
+StateCommitment::SetLeaves (const std::vector<std::pair<std::string, uint256> >& leaves,
+                            int height, const uint256& hash)
+{
+  std::vector<Bucket> buckets(1 << DEPTH);
+  nEntities = 0;
+  for (unsigned i = 0; i < leaves.size (); ++i)
+    {
+      Bucket& b = buckets[GetBucket (leaves[i].first)];
+      if (b.count (leaves[i].first) == 0)
+        ++nEntities;
+      b[leaves[i].first] = leaves[i].second;
+    }
+
+  root = BuildNode (0, 0, buckets);
+  nHeight = height;
+  hashBlock = hash;
+}
+
+uint256
+StateCommitment::GetRoot () const
+{
+  if (!root)
+    return 0;
+  return root->hash;
+}
+
+bool
+StateCommitment::GetEntityHash (const std::string& key, uint256& hash) const
+{
+  const unsigned bucket = GetBucket (key);
+
+  NodePtr n = root;
+  for (unsigned depth = 0; n && depth < DEPTH; ++depth)
+    {
+      const bool bit = (bucket >> (DEPTH - depth - 1)) & 1;
+      n = (bit ? n->right : n->left);
+    }
+  if (!n)
+    return false;
+
+  std::map<std::string, uint256>::const_iterator mi = n->entries.find (key);
+  if (mi == n->entries.end ())
+    return false;
+
+  hash = mi->second;
+  return true;
+}
+
+/* ************************************************************************** */
+/* Commitment cache.  */
+
+static CCriticalSection cs_commitments;
+static std::map<uint256, StateCommitment> commitments;
+
+/* Insert a commitment into the cache and drop the lowest ones if the
+   cache is too large.  Must be called with cs_commitments held.  */
+static void
+StoreCommitment (const StateCommitment& c)
+{
+  commitments[c.GetBlockHash ()] = c;
+
+  while (commitments.size () > COMMITMENT_CACHE_SIZE)
+    {
+      std::map<uint256, StateCommitment>::iterator lowest, mi;
+      lowest = commitments.begin ();
+      for (mi = commitments.begin (); mi != commitments.end (); ++mi)
+        if (mi->second.GetHeight () < lowest->second.GetHeight ())
+          lowest = mi;
+      commitments.erase (lowest);
+    }
+}
+
+bool
+Game::GetCachedStateCommitment (const uint256& hashBlock, StateCommitment& c)
+{
+  CRITICAL_BLOCK(cs_commitments)
+    {
+      std::map<uint256, StateCommitment>::const_iterator mi;
+      mi = commitments.find (hashBlock);
+      if (mi != commitments.end ())
+        {
+          c = mi->second;
+          return true;
+        }
+    }
+
+  return false;
+}
+
+void
+Game::CacheStateCommitment (const StateCommitment& c)
+{
+  CRITICAL_BLOCK(cs_commitments)
+    StoreCommitment (c);
+}
+
+StateCommitment
+Game::GetStateCommitment (const GameState& state)
+{
+  CRITICAL_BLOCK(cs_commitments)
+    {
+      std::map<uint256, StateCommitment>::const_iterator mi;
+      mi = commitments.find (state.hashBlock);
+      if (mi != commitments.end () && mi->second.GetHeight () == state.nHeight)
+        return mi->second;
+    }
+
+  StateCommitment res;
+  res.Build (state);
+  if (fDebug)
+    printf ("Built state commitment @%d from scratch: %s\n",
+            state.nHeight, res.GetRoot ().GetHex ().c_str ());
+
+  CRITICAL_BLOCK(cs_commitments)
+    StoreCommitment (res);
+
+  return res;
+}
+
+void
+Game::AdvanceStateCommitment (const GameState& inState,
+                              const GameState& outState,
+                              const StateChangeSet& changes)
+{
+  StateCommitment c;
+  bool found = false;
+  CRITICAL_BLOCK(cs_commitments)
+    {
+      std::map<uint256, StateCommitment>::const_iterator mi;
+      mi = commitments.find (inState.hashBlock);
+      if (mi != commitments.end () && mi->second.GetHeight () == inState.nHeight)
+        {
+          c = mi->second;
+          found = true;
+        }
+    }
+  if (!found)
+    return;
+
+  c.Update (outState, changes);
+
+  CRITICAL_BLOCK(cs_commitments)
+    StoreCommitment (c);
+}
@@ -0,0 +1,252 @@
+#ifndef GAMECOMMITMENT_H
+#define GAMECOMMITMENT_H
+
+#include "gamestate.h"
+#include "uint256.h"
+
+#ifndef Q_MOC_RUN
+#include <boost/shared_ptr.hpp>
+#endif
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Incrementally maintained hash tree ("commitment") over the contents of
+// a game state.  Two states have the same root iff their players, loot,
+// hearts, banks, vaults and global fields are the same.
+
+namespace Game
+{
+
+/**
+ * Compute the set of changed entities between two game states by comparing
+ * all their entities.  PerformStep records the changes it makes, so this
+ * is only needed where that is not possible (the luggage code) and to
+ * check the recorded changes after each step.
+ * @param a The first (usually older) state.
+ * @param b The second (usually newer) state.
+ * @param out Fill in the changes here.
+ */
+void CollectChanges (const GameState& a, const GameState& b,
+                     StateChangeSet& out);
+
+/**
+ * Check that a change set contains all entities that differ between two
+ * game states.  Missing entities are logged.
+ * @param a The older state.
+ * @param b The newer state.
+ * @param changes The changes to check.
+ * @return True iff no changed entity is missing.
+ */
+bool CheckChanges (const GameState& a, const GameState& b,
+                   const StateChangeSet& changes);
+
+/**
+ * Hash tree over all entities of a game state.  Each entity (player with
+ * its characters, loot tile, heart, bank, vault, dead player chat and one
+ * leaf for the global fields) is stored under a key in one of 2^DEPTH
+ * buckets, and the buckets form the leaves of a complete binary tree.
+ *
+ * The tree is persistent:  Updates copy only the path from the root to the
+ * changed bucket and share all other nodes.  Copying a commitment is thus
+ * cheap, and updating a single entity costs O(DEPTH) hashes plus the
+ * (small) bucket.
+ */
+class StateCommitment
+{
+
+public:
+
+  /** Depth of the tree, i. e., there are 2^DEPTH buckets.  */
+  static const unsigned DEPTH = 12;
+
+private:
+
+  struct Node;
+  typedef boost::shared_ptr<const Node> NodePtr;
+  typedef std::map<std::string, uint256> Bucket;
+
+  /** Root of the tree.  NULL for the empty tree.  */
+  NodePtr root;
+
+  /** Height and block hash of the state this commits to.  */
+  int nHeight;
+  uint256 hashBlock;
+
+  /** Number of entity leaves in the tree.  */
+  unsigned nEntities;
+
+  static unsigned GetBucket (const std::string& key);
+  static uint256 HashNode (const Node& n);
+
+  static NodePtr BuildNode (unsigned depth, unsigned index,
+                            const std::vector<Bucket>& buckets);
+  static void CollectLeaves (const NodePtr& node,
+                             std::vector<std::pair<std::string, uint256> >& out);
+  NodePtr UpdateNode (const NodePtr& node, unsigned depth, unsigned bucket,
+                      const std::string& key, const uint256* value);
+
+  /** Set or remove (if value is NULL) a single entity.  */
+  void SetEntity (const std::string& key, const uint256* value);
+
+public:
+
+  StateCommitment ();
+
+  /**
+   * Compute the commitment from scratch.
+   * @param state The state to commit to.
+   */
+  void Build (const GameState& state);
+
+  /**
+   * Update the commitment to a new state, given the changed entities.
+   * The current object must be the commitment of the state from which
+   * the changes were computed.
+   * @param state The new state.
+   * @param changes Entities that differ from the old state.
+   */
+  void Update (const GameState& state, const StateChangeSet& changes);
+
+  /** Return the root hash.  The empty tree has root 0.  */
+  uint256 GetRoot () const;
+
+  /**
+   * Get all entity keys with their hashes, i. e., the leaves of the tree.
+   * @param out Set to the leaves, ordered by bucket.
+   */
+  void GetLeaves (std::vector<std::pair<std::string, uint256> >& out) const;
+
+  /**
+   * Restore the commitment from its leaves.  This recomputes the inner
+   * nodes, but does not need the state itself.
+   * @param leaves The entity keys and hashes.
+   * @param height Height of the committed state.
+   * @param hash Block hash of the committed state.
+   */
+  void SetLeaves (const std::vector<std::pair<std::string, uint256> >& leaves,
+                  int height, const uint256& hash);
+
+  /* Serialisation writes the leaves and the root.  The root is checked
+     against the restored tree when reading.  */
+
+  unsigned int
+  GetSerializeSize (int nType = 0, int nVersion = VERSION) const
+  {
+    std::vector<std::pair<std::string, uint256> > leaves;
+    GetLeaves (leaves);
+    return ::GetSerializeSize (nHeight, nType, nVersion)
+            + ::GetSerializeSize (hashBlock, nType, nVersion)
+            + ::GetSerializeSize (leaves, nType, nVersion)
+            + ::GetSerializeSize (GetRoot (), nType, nVersion);
+  }
+
+  template<typename Stream>
+    void
+    Serialize (Stream& s, int nType = 0, int nVersion = VERSION) const
+  {
+    std::vector<std::pair<std::string, uint256> > leaves;
+    GetLeaves (leaves);
+    ::Serialize (s, nHeight, nType, nVersion);
+    ::Serialize (s, hashBlock, nType, nVersion);
+    ::Serialize (s, leaves, nType, nVersion);
+    ::Serialize (s, GetRoot (), nType, nVersion);
+  }
+
+  template<typename Stream>
+    void
+    Unserialize (Stream& s, int nType = 0, int nVersion = VERSION)
+  {
+    int height;
+    uint256 hash, hashRoot;
+    std::vector<std::pair<std::string, uint256> > leaves;
+    ::Unserialize (s, height, nType, nVersion);
+    ::Unserialize (s, hash, nType, nVersion);
+    ::Unserialize (s, leaves, nType, nVersion);
+    ::Unserialize (s, hashRoot, nType, nVersion);
+
+    SetLeaves (leaves, height, hash);
+    if (GetRoot () != hashRoot)
+      throw std::ios_base::failure ("state commitment root mismatch");
+  }
+
+  /**
+   * Look up the leaf hash of a single entity.
+   * @param key The entity key as returned by one of the *Key functions.
+   * @param hash Set to the entity's hash.
+   * @return True iff the entity exists.
+   */
+  bool GetEntityHash (const std::string& key, uint256& hash) const;
+
+  inline int
+  GetHeight () const
+  {
+    return nHeight;
+  }
+
+  inline const uint256&
+  GetBlockHash () const
+  {
+    return hashBlock;
+  }
+
+  inline unsigned
+  GetNumEntities () const
+  {
+    return nEntities;
+  }
+
+  /* Construct the keys used for the various entity types.  */
+  static std::string PlayerKey (const std::string& name);
+  static std::string DeadPlayerChatKey (const std::string& name);
+  static std::string LootKey (const Coord& c);
+  static std::string HeartKey (const Coord& c);
+  static std::string BankKey (const Coord& c);
+  static std::string VaultKey (const std::string& addr);
+  static std::string GlobalsKey ();
+
+  /* Hash the global (non-map) fields of a state.  */
+  static uint256 HashGlobals (const GameState& state);
+
+};
+
+/**
+ * Get the commitment for the given state.  Commitments of recent states are
+ * cached, and a state whose parent's commitment is cached is derived from
+ * it incrementally.  Otherwise it is built from scratch.
+ * @param state The game state.
+ * @return Its commitment.
+ */
+StateCommitment GetStateCommitment (const GameState& state);
+
+/**
+ * Look up a commitment in the cache without building it.
+ * @param hashBlock Block hash of the state.
+ * @param c Set to the commitment if found.
+ * @return True iff it is cached.
+ */
+bool GetCachedStateCommitment (const uint256& hashBlock, StateCommitment& c);
+
+/**
+ * Put a commitment into the cache, e. g., after reading it back from disk.
+ * @param c The commitment.
+ */
+void CacheStateCommitment (const StateCommitment& c);
+
+/**
+ * Notify about a performed game step.  If the commitment of the old state
+ * is known, the new one is derived from it incrementally and cached.  If it
+ * is not known, nothing is done (commitments are only computed on demand).
+ * @param inState The state before the step.
+ * @param outState The state after it.
+ * @param changes Changed entities between both states.
+ */
+void AdvanceStateCommitment (const GameState& inState,
+                             const GameState& outState,
+                             const StateChangeSet& changes);
+
+}
+
+#endif // GAMECOMMITMENT_H
@@ -1,19 +1,74 @@
+#include "gamecommitment.h"
 #include "gamedb.h"
+#include "gamedelta.h"
+#include "gamedistance.h"
+#include "gameindex.h"
+#include "gamejson.h"
+#include "gameleaderboard.h"
+#include "gamesnapshot.h"
 #include "gamestate.h"
+#include "gamestore.h"
 #include "gametx.h"
 
 #include "headers.h"
 #include "huntercoin.h"
 
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <list>
 #include <map>
 
 using namespace Game;
 
-static const int KEEP_EVERY_NTH_STATE = 2000;
-static const unsigned IN_MEMORY_STATE_CACHE = 10;
+/* Full states (keyframes) are kept in the game DB with a spacing that
+   grows with the depth below the tip:  The most recent KEYFRAMES_PER_TIER
+   keyframes are DEFAULT_KEYFRAME_SPACING blocks apart, the next ones
+   twice as far, and so on.  All other heights only have deltas to their
+   parent.  Spacings are powers of two, so that a keyframe that is dropped
+   as the chain grows is never needed again.  A stored state is only
+   dropped if the keyframe below it in its tier exists, though.  */
+static const int DEFAULT_KEYFRAME_SPACING = 64;
+static const int KEYFRAMES_PER_TIER = 32;
+/* Default disk budget for the keyframes in MB.  If they would need more,
+   the spacing of all tiers is increased.  Deltas and undo records are
+   not part of it:  They are needed for every block regardless of the
+   spacing.  */
+static const unsigned KEYFRAME_BUDGET = 1024;
+/* Default size of the in-memory game state cache in MB.  */
+static const unsigned IN_MEMORY_STATE_CACHE = 200;
+
+/* While integrating forward from a stored state, every Nth intermediate
+   state is put into the state cache.  Queries for nearby heights then
+   need to replay at most that many blocks.  */
+static const int REPLAY_CACHE_STRIDE = 100;
+
+/* Blocks to process during a replay are read ahead in a separate thread
+   if there are at least this many of them.  At most PREFETCH_QUEUE_SIZE
+   blocks are kept in memory ahead of the replay.  */
+static const unsigned PREFETCH_MIN_BLOCKS = 4;
+static const unsigned PREFETCH_QUEUE_SIZE = 32;
+
+/* Undo records are kept for this many blocks below the tip.  Reorgs up
+   to that depth restore each parent state directly from its child.  */
+static const int UNDO_DEPTH = 2000;
+
+/* Format of the stored deltas and undo records.  Records of an older
+   format cannot be decoded and are dropped on startup.
+     1: The delta holds the commitment root of the new state.
+     2: The undo record holds the commitment root of the parent.  */
+static const int DELTA_FORMAT = 2;
+
+/* The alternative storage engine for full game states, if selected with
+   -gamestore=segment.  Deltas and the version stay in the BDB file.  */
+static CGameStore* pgameStore = NULL;
+
+static boost::filesystem::path
+GetGameStorePath ()
+{
+  return boost::filesystem::path (GetDataDir ()) / "gamestates";
+}
 
 class CGameDB : public CDB
 {
@@ -38,968 +93,2775 @@ public:
       ownTxn.push_back (false);
     }
 
+    /* Full states are kept in the game store instead of the DB if it is
+       enabled.  */
+
     inline bool
     Exists (unsigned nHeight) 
     {
+      if (pgameStore)
+        return pgameStore->Exists (nHeight);
       return CDB::Exists (nHeight);
     }
 
     bool Read(unsigned int nHeight, GameState &gameState)
     {
+        if (pgameStore)
+            return pgameStore->Read(nHeight, gameState);
         return CDB::Read(nHeight, gameState);
     }
 
     bool Write(unsigned int nHeight, const GameState &gameState)
     {
+        if (pgameStore)
+            return pgameStore->Write(nHeight, gameState);
         return CDB::Write(nHeight, gameState);
     }
 
     bool Erase(unsigned int nHeight)
     {
+        if (pgameStore)
+            return pgameStore->Erase(nHeight);
         return CDB::Erase(nHeight);
     }
-};
-
-class GameStepValidator
-{
-    bool fOwnState;
-    bool fOwnDb;
-    
-    DatabaseSet* pdbset;
-
-    // Detect duplicates (multiple moves per block). Probably already handled by NameDB and not needed.
-    std::set<PlayerID> dup;
-
-    // Temporary variables
-    vchType vchName;
-    vchType vchValue;
 
-protected:
-    const GameState *pstate;
+    /* Access the full states in the BDB file even if the game store
+       is enabled.  This is used for the conversion.  */
 
-public:
-    GameStepValidator(const GameState *pstate_)
-        : fOwnState(false), fOwnDb(false), pdbset(NULL), pstate(pstate_)
+    bool ReadFromDB(unsigned int nHeight, GameState &gameState)
     {
+        return CDB::Read(nHeight, gameState);
     }
 
-    GameStepValidator(DatabaseSet& dbset, CBlockIndex *pindex)
-        : fOwnState(true), fOwnDb(false), pdbset(&dbset)
+    bool WriteToDB(unsigned int nHeight, const GameState &gameState)
     {
-        GameState *newState = new GameState;
-        if (!GetGameState (dbset, pindex, *newState))
-        {
-            delete newState;
-            throw std::runtime_error("GameStepValidator : cannot get previous game state");
-        }
-        pstate = newState;
+        return CDB::Write(nHeight, gameState);
     }
 
-    ~GameStepValidator()
+    bool EraseFromDB(unsigned int nHeight)
     {
-      if (fOwnState)
-        delete pstate;
-      if (pdbset && fOwnDb)
-        delete pdbset;
+        return CDB::Erase(nHeight);
     }
 
-    // Returns:
-    //   false - invalid move tx
-    //   true  - non-move tx or valid tx
-    bool IsValid(const CTransaction& tx, Move &outMove)
+    /**
+     * List the heights of all full states in the BDB file and of all
+     * deltas in a single pass of a cursor over the keys.
+     * @param states Put the heights of full states here if not NULL.
+     * @param deltas Put the heights of deltas here if not NULL.
+     * @return False on error.
+     */
+    bool
+    ListHeights (std::vector<unsigned>* states, std::vector<unsigned>* deltas)
     {
-        if (tx.nVersion != NAMECOIN_TX_VERSION)
-        {
-#ifdef AUX_STORAGE_VOTING
-            int64 tmp_tag_official = 0;
-            int64 tmp_tag_min = 0;
-            int64 tmp_tag_max = 0;
-            int64 tmp_txid60bit = 0;
-            if (pstate->nHeight >= AUX_MINHEIGHT_VOTING(fTestNet))
-            {
-                int tmp_blocks = (pstate->nHeight % AUX_VOTING_INTERVAL(fTestNet));
-                tmp_tag_official = pstate->nHeight - tmp_blocks + AUX_VOTING_INTERVAL(fTestNet) - 25; // xxx9975 (testnet: xxx975)
-                tmp_tag_min = pstate->nHeight + 1;
-                tmp_tag_max = pstate->nHeight + (AUX_VOTING_INTERVAL(fTestNet) * 2) - 25;
-                if ((tmp_tag_official < tmp_tag_min) || (tmp_tag_official > tmp_tag_max)) tmp_tag_official == 0;
-
-                char buf[100];
-                strncpy(buf, tx.GetHash().GetHex().c_str(), 64);
-                buf[15] = '\0';
-                tmp_txid60bit = strtoll (buf, NULL, 16);
-
-                if (votingcache_idx)
-                {
-                    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                    {
-                        if (!tx.IsCoinBase())
-                        {
-                            if (!tx.IsGameTx())
-                            {
-                                strncpy(buf, txin.prevout.hash.GetHex().c_str(), 64);
-                                buf[15] = '\0';
-                                int64 tmp_txid60bit_input = strtoll (buf, NULL, 16);
+      if (states)
+        states->clear ();
+      if (deltas)
+        deltas->clear ();
 
-                                printf("scanning votes: scanning input, txid60bit_input: %15"PRI64d"\n", tmp_txid60bit_input);
+      const unsigned nDeltaKeySize
+        = ::GetSerializeSize (std::make_pair (std::string ("delta"), 0u),
+                              SER_DISK, VERSION);
 
-                                for (int i = 0; i < votingcache_idx; i++)
-                                {
-                                    if (votingcache_zhunt_test[i]) continue; // otherwise 2 such transactions (from same wallet) in the same block would fail
+      Dbc* pcursor = GetCursor ();
+      if (!pcursor)
+        return false;
 
-                                    if (votingcache_txid60bit[i] == tmp_txid60bit_input)
-                                    {
-                                        votingcache_amount[i] = -1;
-                                        printf("scanning votes: delete vote: vault address %s\n", votingcache_vault_addr[i].c_str(), FormatMoney(votingcache_amount[i]).c_str());
-                                        break;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-#endif
-#ifdef PERMANENT_LUGGAGE_AUCTION
-#ifdef AUX_STORAGE_ZHUNT_TAGTEST
-            std::string tag_msg;
-            int64 tag_amount = 0;
-            bool tag_exists = false;
-#endif
-            // gems and storage
-            for (unsigned int i = 0; i < tx.vout.size(); i++)
+      try
+        {
+          loop
             {
-                const CTxOut& txout = tx.vout[i];
-                int64 nSingleValueOut = txout.nValue;
-                std::string address;
-                CScript script(txout.scriptPubKey);
-#ifdef AUX_STORAGE_ZHUNT_TAGTEST
-                bool tag_in_this_output = false;
-                if (txout.scriptPubKey.GetTag (tag_msg))
+              CDataStream ssKey;
+              const int ret = ReadKeyAtCursor (pcursor, ssKey);
+              if (ret == DB_NOTFOUND)
+                break;
+              if (ret != 0)
                 {
-                    tag_exists = tag_in_this_output = true;
-                    printf("luggage test: tag %s\n", tag_msg.c_str());
+                  pcursor->close ();
+                  return false;
                 }
-#endif
-                if (ExtractDestination(script, address))
+
+              /* Full states are keyed by the height only, other entries
+                 start with a string.  None of those strings has three
+                 characters, which would give a key of the same size.  */
+              unsigned nHeight;
+              if (ssKey.size () == sizeof (nHeight))
                 {
-                    bool fv = false;
+                  ssKey >> nHeight;
+                  if (states)
+                    states->push_back (nHeight);
+                  continue;
+                }
 
-                    if (pstate->vault.count(address) > 0)
-                    {
-                        if (paymentcache_idx < PAYMENTCACHE_MAX)
-                        {
-                            paymentcache_vault_addr[paymentcache_idx] = address;
-                            paymentcache_amount[paymentcache_idx] = nSingleValueOut;
-                            paymentcache_idx++;
-                        }
-                        printf("luggage test: storage address %s received payment: %15"PRI64d" ", address.c_str(), nSingleValueOut);
-                        printf(" height %d, block hash %s\n", pstate->nHeight, pstate->hashBlock.GetHex().c_str());
+              if (!deltas || ssKey.size () != nDeltaKeySize)
+                continue;
+              std::string strType;
+              ssKey >> strType;
+              if (strType == "delta")
+                {
+                  ssKey >> nHeight;
+                  deltas->push_back (nHeight);
+                }
+            }
+        }
+      catch (const std::exception& e)
+        {
+          pcursor->close ();
+          return error ("ListHeights: %s", e.what ());
+        }
+      pcursor->close ();
 
-#ifdef AUX_STORAGE_ZHUNT_TAGTEST
-                        if (tag_in_this_output) printf("luggage test: tag %s, amount %15"PRI64d"\n", tag_msg.c_str(), nSingleValueOut);
+      return true;
+    }
 
-                        if (address == AUX_ZHUNT_TESTADDRESS(fTestNet))
-                        {
-                            if (nSingleValueOut > tag_amount) tag_amount = nSingleValueOut;
-                        }
-#endif
+    /* Return the heights of all full states in the BDB file.  */
+    inline bool
+    GetHeightsInDB (std::vector<unsigned>& out)
+    {
+      return ListHeights (&out, NULL);
+    }
 
-#ifdef AUX_STORAGE_VOTING
-#ifdef AUX_STORAGE_ZHUNT
-                        // "zhunt orders" work somewhat different than "votes"
-                        // - spending these coins (or the change) will not delete it
-                        // - vault must already exist
-                        if ((pstate->nHeight >= AUX_MINHEIGHT_ZHUNT(fTestNet)) &&
-                            (nSingleValueOut % 10000 == 5501) && (nSingleValueOut >= 3000 * COIN) &&
-                            (votingcache_idx < VOTINGCACHE_MAX))
-                        {
-                            votingcache_vault_addr[votingcache_idx] = address;
-                            votingcache_vault_exists[votingcache_idx] = true;
-                            votingcache_zhunt_test[votingcache_idx] = false;
-                            votingcache_amount[votingcache_idx] = nSingleValueOut;
-                            votingcache_txid60bit[votingcache_idx] = tmp_txid60bit;
-                            votingcache_idx++;
+    /* Deltas are stored next to the full states, with their own key.  */
 
-                            printf("zhunt order cached (existing vault)\n");
-                        }
-                        else
-#endif
-                        if (pstate->nHeight >= AUX_MINHEIGHT_VOTING(fTestNet))
-                        {
-                            if ((nSingleValueOut % 10000000 >= tmp_tag_min) && (nSingleValueOut % 10000000 <= tmp_tag_max) &&
-                                (nSingleValueOut >= 1000 * COIN))
-                            {
-                                fv = true;
-                            }
+    inline bool
+    ExistsDelta (unsigned nHeight)
+    {
+      return CDB::Exists (std::make_pair (std::string ("delta"), nHeight));
+    }
 
-                            if ((fv) && (votingcache_idx < VOTINGCACHE_MAX))
-                            {
-                                votingcache_vault_addr[votingcache_idx] = address;
-                                votingcache_vault_exists[votingcache_idx] = true;
-                                votingcache_zhunt_test[votingcache_idx] = false;
-                                votingcache_amount[votingcache_idx] = nSingleValueOut;
-                                votingcache_txid60bit[votingcache_idx] = tmp_txid60bit;
-                                votingcache_idx++;
+    inline bool
+    ReadDelta (unsigned nHeight, StateDelta& delta)
+    {
+      return CDB::Read (std::make_pair (std::string ("delta"), nHeight), delta);
+    }
 
-                                printf("scanning votes: cached (existing vault)\n");
-                            }
-                        }
-#endif
-                    }
-#ifdef AUX_STORAGE_VOTING
-                    else if ((pstate->nHeight >= AUX_MINHEIGHT_VOTING(fTestNet)) &&
-                             (tmp_tag_official) && (nSingleValueOut % 10000000 == tmp_tag_official) &&
-                             (nSingleValueOut >= 25000 * COIN))
-                    {
-                        fv = true;
+    inline bool
+    WriteDelta (unsigned nHeight, const StateDelta& delta)
+    {
+      return CDB::Write (std::make_pair (std::string ("delta"), nHeight), delta);
+    }
 
-                        if ((fv) && (votingcache_idx < VOTINGCACHE_MAX))
-                        {
-                            votingcache_vault_addr[votingcache_idx] = address;
-                            votingcache_vault_exists[votingcache_idx] = false;
-                            votingcache_zhunt_test[votingcache_idx] = false;
-                            votingcache_amount[votingcache_idx] = nSingleValueOut;
-                            votingcache_txid60bit[votingcache_idx] = tmp_txid60bit;
-                            votingcache_idx++;
+    inline bool
+    EraseDelta (unsigned nHeight)
+    {
+      return CDB::Erase (std::make_pair (std::string ("delta"), nHeight));
+    }
 
-                            printf("luggage test: address %s received payment: %15"PRI64d" ", address.c_str(), nSingleValueOut);
-                            printf(" height %d, block hash %s\n", pstate->nHeight, pstate->hashBlock.GetHex().c_str());
-                            printf("scanning votes: cached (need new vault)\n");
-                        }
-                    }
-#endif
-#ifdef PERMANENT_LUGGAGE_LOG_PAYMENTS
-                    else
-                    {
-                        printf("luggage test: address %s received payment: %15"PRI64d" ", address.c_str(), nSingleValueOut);
-                        printf(" height %d, block hash %s\n", pstate->nHeight, pstate->hashBlock.GetHex().c_str());
-                    }
-#endif
-                }
-            }
-#ifdef AUX_STORAGE_ZHUNT_TAGTEST
-            // do this only once per transaction
-            if (((pstate->nHeight >= AUX_MINHEIGHT_ZHUNT(fTestNet))) &&
-                (tag_exists) && (tag_amount > 0) && (tag_msg.substr(0, 4) == "GEM ") && (tag_msg.length() > 4) &&
-                (votingcache_idx < VOTINGCACHE_MAX))
-            {
-                if (IsValidBitcoinAddress(tag_msg.substr(4)))
-                {
-                    votingcache_vault_addr[votingcache_idx] = tag_msg.substr(4);
-                    votingcache_vault_exists[votingcache_idx] = true; // technically true but useless
-                    votingcache_zhunt_test[votingcache_idx] = true;
-                    votingcache_amount[votingcache_idx] = tag_amount;
-                    votingcache_txid60bit[votingcache_idx] = tmp_txid60bit; // not used
-                    votingcache_idx++;
-                    printf("convert to gems: add to cache: tag %s, amount %15"PRI64d"\n", tag_msg.c_str(), tag_amount);
-                }
-            }
-#endif
-#endif
-            return true;
-        }
+    /* Undo records of recent blocks, keyed like the deltas.  */
 
-        std::vector<vchType> vvchArgs;
-        int op, nOut;
-        if (!DecodeNameTx (tx, op, nOut, vvchArgs))
-          return error ("GameStepValidator: could not decode a name tx");
+    inline bool
+    ReadUndo (unsigned nHeight, StateUndo& undo)
+    {
+      return CDB::Read (std::make_pair (std::string ("undo"), nHeight), undo);
+    }
 
-        vchType vchName, vchValue;
-        switch (op)
-        {
-        case OP_NAME_FIRSTUPDATE:
-          vchName = vvchArgs[0];
-          if (vvchArgs.size () == 3)
-            vchValue = vvchArgs[2];
-          else
-            {
-              assert (vvchArgs.size () == 2);
-              vchValue = vvchArgs[1];
-            }
-          break;
+    inline bool
+    WriteUndo (unsigned nHeight, const StateUndo& undo)
+    {
+      return CDB::Write (std::make_pair (std::string ("undo"), nHeight), undo);
+    }
 
-        case OP_NAME_UPDATE:
-          vchName = vvchArgs[0];
-          vchValue = vvchArgs[1];
-          break;
+    inline bool
+    EraseUndo (unsigned nHeight)
+    {
+      return CDB::Erase (std::make_pair (std::string ("undo"), nHeight));
+    }
 
-        case OP_NAME_NEW:
-          return true;
+    /* Kills of each block for the leaderboard, stored only for blocks with
+       kills.  They are written with the delta when a block is processed
+       and kept for all blocks since the height stored as "killssince",
+       which is set when the game DB is created or first sees a block.  */
 
-        default:
-          return error ("GameStepValidator: invalid name tx found");
-        }
+    inline bool
+    ReadKills (unsigned nHeight, KillList& kills)
+    {
+      return CDB::Read (std::make_pair (std::string ("kills"), nHeight), kills);
+    }
 
-        const std::string sName = stringFromVch(vchName);
-        const std::string sValue = stringFromVch(vchValue);
-        if (dup.count(sName))
-            return error ("GameStepValidator: duplicate player name %s",
-                          sName.c_str ());
-        dup.insert(sName);
+    inline bool
+    WriteKills (unsigned nHeight, const KillList& kills)
+    {
+      return CDB::Write (std::make_pair (std::string ("kills"), nHeight), kills);
+    }
 
-        Move m;
-        m.newLocked = tx.vout[nOut].nValue;
+    inline bool
+    EraseKills (unsigned nHeight)
+    {
+      return CDB::Erase (std::make_pair (std::string ("kills"), nHeight));
+    }
 
-        m.Parse(sName, sValue);
-        if (!m)
-            return error("GameStepValidator: cannot parse move %s for player %s", sValue.c_str(), sName.c_str());
-        if (!m.IsValid(*pstate))
-            return error("GameStepValidator: invalid move for the game state: move %s for player %s", sValue.c_str(), sName.c_str());
+    inline bool
+    ReadKillsSince (int& nHeight)
+    {
+      return CDB::Read (std::string ("killssince"), nHeight);
+    }
 
-        if (m.IsSpawn ())
-          {
-            if (op != OP_NAME_FIRSTUPDATE)
-              return error ("GameStepValidator: spawn is not firstupdate");
-          }
-        else if (op != OP_NAME_UPDATE)
-          return error ("GameStepValidator: name_firstupdate is not spawn");
+    inline bool
+    WriteKillsSince (int nHeight)
+    {
+      return CDB::Write (std::string ("killssince"), nHeight);
+    }
 
-        std::string addressLock = m.AddressOperationPermission(*pstate);
+    /**
+     * Sum up the kills of all blocks in the given height range with a
+     * cursor pass over the kill records.
+     */
+    bool
+    SumKills (int nFrom, int nTo, std::map<PlayerID, int64_t>& counts)
+    {
+      counts.clear ();
 
-#ifdef GUI
-        // pending tx monitor
-        if ((pmon_tx_count) && (pmon_why_validate == WHYVALIDATE_CONNECTBLOCK))
+      const unsigned nKeySize
+        = ::GetSerializeSize (std::make_pair (std::string ("kills"), 0u),
+                              SER_DISK, VERSION);
+
+      Dbc* pcursor = GetCursor ();
+      if (!pcursor)
+        return false;
+
+      try
         {
-            for (int k2 = 0; k2 < pmon_tx_count; k2++)
+          unsigned int fFlags = DB_SET_RANGE;
+          loop
             {
-                if (pmon_tx_names[k2] == sName)
+              CDataStream ssKey(SER_DISK, VERSION);
+              if (fFlags == DB_SET_RANGE)
+                ssKey << std::make_pair (std::string ("kills"), 0u);
+              CDataStream ssValue(SER_DISK, VERSION);
+              const int ret = ReadAtCursor (pcursor, ssKey, ssValue, fFlags);
+              fFlags = DB_NEXT;
+              if (ret == DB_NOTFOUND)
+                break;
+              if (ret != 0)
                 {
-                    pmon_tx_names[k2] = "";
-                    break;
+                  pcursor->close ();
+                  return false;
                 }
+
+              /* All keys with the prefix of the kill records have their
+                 size.  Anything else is behind the range, e. g. a full
+                 state whose height happens to start like the prefix.  */
+              if (ssKey.size () != nKeySize)
+                break;
+              std::string strType;
+              ssKey >> strType;
+              if (strType != "kills")
+                break;
+              unsigned nHeight;
+              ssKey >> nHeight;
+              if (static_cast<int> (nHeight) < nFrom
+                  || static_cast<int> (nHeight) > nTo)
+                continue;
+
+              KillList kills;
+              ssValue >> kills;
+              BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerID)& k, kills)
+                ++counts[k.first];
             }
         }
-#endif
-#ifdef PERMANENT_LUGGAGE
-        // gems and storage
-        if (GEM_ALLOW_SPAWN(fTestNet, pstate->nHeight))
+      catch (const std::exception& e)
         {
-            std::string sa;
-            GetNameAddress(tx, sa);
-            m.playernameaddress = sa;
-            printf("luggage test: move for name %s, playernameaddr %s\n", sName.c_str(), sa.c_str());
+          pcursor->close ();
+          return error ("SumKills: %s", e.what ());
         }
-#endif
+      pcursor->close ();
 
-        if (!addressLock.empty())
+      return true;
+    }
+
+    /* While the DB is being rebuilt in the background, the height of the
+       last checkpoint is stored.  The entry is removed when the rebuild
+       is done.  */
+
+    inline bool
+    ReadRebuildHeight (int& nHeight)
+    {
+      return CDB::Read (std::string ("rebuild"), nHeight);
+    }
+
+    inline bool
+    WriteRebuildHeight (int nHeight)
+    {
+      return CDB::Write (std::string ("rebuild"), nHeight);
+    }
+
+    inline bool
+    EraseRebuildHeight ()
+    {
+      return CDB::Erase (std::string ("rebuild"));
+    }
+
+    /* Spacing of keyframes near the tip for which old keyframes have
+       been pruned.  */
+
+    inline bool
+    ReadKeyframeSpacing (int& nSpacing)
+    {
+      return CDB::Read (std::string ("keyframespacing"), nSpacing);
+    }
+
+    inline bool
+    WriteKeyframeSpacing (int nSpacing)
+    {
+      return CDB::Write (std::string ("keyframespacing"), nSpacing);
+    }
+
+    /* Set while stored states remain that the retention policy does not
+       want, but that cannot be pruned yet since the keyframes taking over
+       their range are missing.  This is the case for game DBs written
+       before the policy, which only have a state every 2000 blocks.  */
+
+    inline bool
+    HasUncoveredStates ()
+    {
+      return CDB::Exists (std::string ("uncoveredstates"));
+    }
+
+    inline bool
+    WriteUncoveredStates ()
+    {
+      return CDB::Write (std::string ("uncoveredstates"), true);
+    }
+
+    inline bool
+    EraseUncoveredStates ()
+    {
+      return CDB::Erase (std::string ("uncoveredstates"));
+    }
+
+    /* Format of the deltas and undo records, see DELTA_FORMAT.  */
+
+    inline bool
+    ReadDeltaFormat (int& nFormat)
+    {
+      return CDB::Read (std::string ("deltaformat"), nFormat);
+    }
+
+    inline bool
+    WriteDeltaFormat (int nFormat)
+    {
+      return CDB::Write (std::string ("deltaformat"), nFormat);
+    }
+
+    /* Return the heights of all full states, wherever they are kept.  */
+    bool
+    GetHeights (std::vector<unsigned>& out)
+    {
+      if (pgameStore)
         {
-            // If one of inputs has address equal to addressLock, then that input has been signed by the address owner
-            // and thus authorizes the address change operation
-            bool found = false;
-            if (!pdbset)
-            {
-                pdbset = new DatabaseSet("r");
-                fOwnDb = true;
-            }
-            for (int i = 0; i < tx.vin.size(); i++)
+          pgameStore->GetHeights (out);
+          return true;
+        }
+      return GetHeightsInDB (out);
+    }
+};
+
+/* ************************************************************************** */
+/* Online compaction of the game DB.  */
+
+/* Pages to free per compaction step, and pause between steps (in ms).  */
+static const unsigned COMPACT_PAGES_PER_STEP = 256;
+static const int COMPACT_STEP_PAUSE = 200;
+
+/* Whether a compaction is pending and the key at which it continues.
+   Each request increments nCompactRequest, so that the thread notices
+   requests that came in during a step.  Protected by cs_compact.  */
+static CCriticalSection cs_compact;
+static bool fCompactPending = false;
+static unsigned nCompactRequest = 0;
+static CDataStream ssCompactKey;
+
+/* Start (or restart) compacting the game DB file in the background.  This
+   is done after many entries have been removed.  */
+static void
+RequestGameDBCompaction ()
+{
+  CRITICAL_BLOCK(cs_compact)
+    {
+      fCompactPending = true;
+      ++nCompactRequest;
+      ssCompactKey.clear ();
+    }
+}
+
+static void
+ThreadGameDBCompaction (void* parg)
+{
+  printf ("ThreadGameDBCompaction started\n");
+
+  while (!fShutdown)
+    {
+      bool fPending;
+      unsigned nRequest;
+      CDataStream ssKey;
+      CRITICAL_BLOCK(cs_compact)
+        {
+          fPending = fCompactPending;
+          nRequest = nCompactRequest;
+          ssKey = ssCompactKey;
+        }
+      if (!fPending)
+        {
+          MilliSleep (1000);
+          continue;
+        }
+
+      /* The DB is only opened for each step, so that it can be closed
+         at shutdown between them.  Errors (e. g., deadlocks with block
+         processing) are not fatal, the step is just retried.  */
+      bool fOk;
+      {
+        CGameDB gameDb("r+");
+        fOk = gameDb.CompactStep (ssKey, COMPACT_PAGES_PER_STEP);
+      }
+
+      /* If a new request came in meanwhile, start over.  */
+      if (fOk)
+        CRITICAL_BLOCK(cs_compact)
+          if (nRequest == nCompactRequest)
             {
-                COutPoint prevout = tx.vin[i].prevout;
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!pdbset->tx ().ReadTxIndex (prevout.hash, txindex)
-                    || txindex.pos == CDiskTxPos(1,1,1))
-                    continue;
-                else if (!txPrev.ReadFromDisk(txindex.pos))
-                    continue;
-                if (prevout.n >= txPrev.vout.size())
-                    continue;
-                const CTxOut &vout = txPrev.vout[prevout.n];
-                std::string address;
-                if (ExtractDestination(vout.scriptPubKey, address) && address == addressLock)
+              ssCompactKey = ssKey;
+              if (ssKey.empty ())
                 {
-                    found = true;
-                    break;
+                  fCompactPending = false;
+                  printf ("Game DB compaction finished\n");
                 }
             }
-            if (!found)
-                return error("GameStepValidator: address operation permission denied: move %s for player %s", sValue.c_str(), sName.c_str());
+
+      MilliSleep (COMPACT_STEP_PAUSE);
+    }
+
+  printf ("ThreadGameDBCompaction exiting\n");
+}
+
+/* ************************************************************************** */
+/* Keyframe retention policy.  */
+
+/* Current spacing of keyframes near the tip and the estimated size of a
+   stored state (zero until a keyframe has been written in this session).
+   Both are protected by cs_main.  */
+static int nKeyframeSpacing = -1;
+static int64 nKeyframeSize = 0;
+
+/* Return the spacing of keyframes near the tip configured with
+   -gamekeyframes, rounded down to a power of two.  */
+static int
+GetConfiguredKeyframeSpacing ()
+{
+  static int nSpacing = -1;
+  if (nSpacing == -1)
+    {
+      const int nConfigured = GetArg ("-gamekeyframes",
+                                      DEFAULT_KEYFRAME_SPACING);
+      nSpacing = 1;
+      while (nSpacing <= nConfigured / 2)
+        nSpacing *= 2;
+    }
+  return nSpacing;
+}
+
+/* Return the spacing of keyframes near the tip currently in effect.  This
+   may be larger than the configured one to fit the disk budget.  */
+static int
+GetKeyframeInterval ()
+{
+  if (nKeyframeSpacing == -1)
+    nKeyframeSpacing = GetConfiguredKeyframeSpacing ();
+  return nKeyframeSpacing;
+}
+
+/**
+ * Return the keyframe spacing in effect for the tier that begins at the
+ * given depth below the tip, and set nEnd to the depth where the next
+ * tier begins.
+ */
+static int
+GetTierSpacing (int64 nStart, int nBase, int64& nEnd)
+{
+  int64 nTierStart = 0;
+  int nSpacing = nBase;
+  loop
+    {
+      nEnd = nTierStart + static_cast<int64> (nSpacing) * KEYFRAMES_PER_TIER;
+      if (nStart < nEnd)
+        return nSpacing;
+      nTierStart = nEnd;
+      nSpacing *= 2;
+    }
+}
+
+/* Return whether a full state should be kept at the given height.  */
+static bool
+IsKeyframe (int nHeight, int nTip)
+{
+  int64 nEnd;
+  const int nSpacing = GetTierSpacing (std::max (0, nTip - nHeight),
+                                       GetKeyframeInterval (), nEnd);
+  return nHeight % nSpacing == 0;
+}
+
+/**
+ * Return whether the stored state at the given height may be erased by
+ * the retention policy.  This requires that the keyframe of its tier
+ * below it is stored, so that heights above are not left further from
+ * a stored state than the spacing allows.
+ */
+static bool
+CanEraseState (CGameDB& gameDb, int nHeight, int nTip)
+{
+  int64 nEnd;
+  const int nSpacing = GetTierSpacing (std::max (0, nTip - nHeight),
+                                       GetKeyframeInterval (), nEnd);
+  const int nCover = nHeight - nHeight % nSpacing;
+  return nCover != nHeight && gameDb.Exists (nCover);
+}
+
+/* Count the keyframes kept up to the tip for the given spacing.  */
+static int64
+CountKeyframes (int nTip, int nBase)
+{
+  int64 nCount = 0;
+  int64 nStart = 0;
+  while (nStart <= nTip)
+    {
+      int64 nEnd;
+      const int nSpacing = GetTierSpacing (nStart, nBase, nEnd);
+
+      /* Multiples of nSpacing among the heights in the tier.  */
+      const int64 nHigh = nTip - nStart;
+      const int64 nLow = std::max<int64> (0, nTip - nEnd + 1);
+      nCount += nHigh / nSpacing + 1;
+      if (nLow > 0)
+        nCount -= (nLow - 1) / nSpacing + 1;
+
+      nStart = nEnd;
+    }
+
+  return nCount;
+}
+
+/**
+ * Apply the retention policy after the tip advanced to nTip.  Normally
+ * this only needs to look at the heights that just moved into the next
+ * tier.  If the spacing had to be increased to fit the disk budget, all
+ * heights that may hold a keyframe of the previous spacing are checked.
+ */
+static void
+PruneKeyframes (CGameDB& gameDb, int nTip)
+{
+  int nPruned;
+  if (!gameDb.ReadKeyframeSpacing (nPruned))
+    nPruned = GetKeyframeInterval ();
+
+  /* Until the size of a state is known, keep the previous spacing.  */
+  int nBase = GetConfiguredKeyframeSpacing ();
+  const int64 nBudget = GetArg ("-gamekeyframebudget", KEYFRAME_BUDGET) << 20;
+  if (nKeyframeSize == 0)
+    nBase = std::max (nBase, nPruned);
+  else if (nBudget > 0)
+    while (CountKeyframes (nTip, nBase) * nKeyframeSize > nBudget
+           && nBase < (1 << 20))
+      nBase *= 2;
+
+  if (nBase != GetKeyframeInterval ())
+    printf ("Game state keyframe spacing is now %d\n", nBase);
+  nKeyframeSpacing = nBase;
+
+  if (nPruned != nBase)
+    {
+      if (nPruned < nBase)
+        {
+          unsigned nErased = 0;
+          for (int h = 0; h < nTip; h += nPruned)
+            if (!IsKeyframe (h, nTip) && gameDb.Exists (h))
+              {
+                if (!CanEraseState (gameDb, h, nTip))
+                  {
+                    gameDb.WriteUncoveredStates ();
+                    continue;
+                  }
+                gameDb.Erase (h);
+                ++nErased;
+              }
+          printf ("Pruned %u stored game states\n", nErased);
+          if (nErased > 0)
+            RequestGameDBCompaction ();
         }
-        outMove = m;
-        return true;
+      gameDb.WriteKeyframeSpacing (nBase);
+      return;
     }
 
-    bool IsValid(const CTransaction& tx)
+  /* A height that enters the next tier is kept only if it is also a
+     multiple of that tier's spacing.  */
+  int64 nStart = 0;
+  loop
     {
-        Move m;
-        if (!IsValid(tx, m))
-            return false;
-        return true;
+      int64 nEnd;
+      const int nSpacing = GetTierSpacing (nStart, nBase, nEnd);
+      if (nEnd > nTip)
+        break;
+
+      const int nHeight = nTip - nEnd;
+      if (nHeight % nSpacing == 0 && nHeight % (2 * nSpacing) != 0
+          && gameDb.Exists (nHeight))
+        {
+          if (CanEraseState (gameDb, nHeight, nTip))
+            gameDb.Erase (nHeight);
+          else
+            gameDb.WriteUncoveredStates ();
+        }
+
+      nStart = nEnd;
+    }
+}
+
+/**
+ * Remove all stored states that are not kept by the retention policy and
+ * whose range is covered by a keyframe below them.  This is done on
+ * startup for game DBs that were written before the policy was
+ * introduced, since their keyframes need not be at heights that the
+ * incremental pruning looks at.  States that are still needed are kept,
+ * and the sweep is repeated on later startups until they are gone.
+ */
+static bool
+SweepKeyframes ()
+{
+  CGameDB gameDb("r+");
+
+  int nPruned;
+  if (gameDb.ReadKeyframeSpacing (nPruned) && !gameDb.HasUncoveredStates ())
+    return true;
+
+  std::vector<unsigned> heights;
+  if (!gameDb.GetHeights (heights))
+    return error ("SweepKeyframes: failed to list stored states");
+
+  /* Go from the bottom up, so that the keyframes checked for each state
+     have already been decided on.  */
+  std::sort (heights.begin (), heights.end ());
+  unsigned nErased = 0, nKept = 0;
+  BOOST_FOREACH (unsigned h, heights)
+    {
+      if (static_cast<int> (h) >= nBestHeight || IsKeyframe (h, nBestHeight))
+        continue;
+      if (CanEraseState (gameDb, h, nBestHeight))
+        {
+          gameDb.Erase (h);
+          ++nErased;
+        }
+      else
+        ++nKept;
     }
+  printf ("Pruned %u of %u stored game states for the keyframe policy,"
+          " %u kept until their keyframes are written\n",
+          nErased, static_cast<unsigned> (heights.size ()), nKept);
+
+  if (!gameDb.WriteKeyframeSpacing (GetKeyframeInterval ()))
+    return false;
+  if (nKept > 0)
+    gameDb.WriteUncoveredStates ();
+  else
+    gameDb.EraseUncoveredStates ();
+  if (nErased > 0)
+    RequestGameDBCompaction ();
+
+  return true;
+}
+
+/**
+ * Drop the deltas and undo records if they were written in an older
+ * format.  Deltas are recreated when the states are replayed the next
+ * time.  Without undo records, reorgs below the tip reconstruct the
+ * parent states instead.
+ */
+static bool
+UpgradeDeltas ()
+{
+  CGameDB gameDb("r+");
+
+  int nFormat;
+  if (gameDb.ReadDeltaFormat (nFormat) && nFormat >= DELTA_FORMAT)
+    return true;
+
+  std::vector<unsigned> heights;
+  if (!gameDb.ListHeights (NULL, &heights))
+    return error ("UpgradeDeltas: failed to list deltas");
+  BOOST_FOREACH (unsigned h, heights)
+    gameDb.EraseDelta (h);
+  printf ("Dropped %u game state deltas of an old format\n",
+          static_cast<unsigned> (heights.size ()));
+
+  /* Undo records are only kept close to the tip.  */
+  for (int h = std::max (0, nBestHeight - UNDO_DEPTH); h <= nBestHeight; ++h)
+    gameDb.EraseUndo (h);
+
+  if (!gameDb.WriteDeltaFormat (DELTA_FORMAT))
+    return false;
+  if (!heights.empty ())
+    RequestGameDBCompaction ();
+
+  return true;
+}
+
+/* A move tx decoded and parsed independently of the game state.  This
+   can be done in advance, e. g. by the block prefetcher.  */
+struct DecodedMove
+{
+    /* False if the tx is invalid, with the reason in strError.  */
+    bool fOk;
+    std::string strError;
+
+    /* True for name_new, which is not a move.  */
+    bool fNameNew;
+
+    int op;
+    std::string sName;
+    std::string sValue;
+    Move m;
+
+    DecodedMove ()
+      : fOk(false), fNameNew(false), op(0)
+    {}
 };
 
-bool
-IsMoveValid (const GameState& state, const CTransaction& tx)
+/* Decode a name tx and parse its move.  */
+static void
+DecodeMoveTx (const CTransaction& tx, DecodedMove& res)
 {
-  GameStepValidator validator(&state);
-  return validator.IsValid (tx);
+    res.fOk = false;
+
+    std::vector<vchType> vvchArgs;
+    int nOut;
+    if (!DecodeNameTx (tx, res.op, nOut, vvchArgs))
+    {
+        res.strError = "GameStepValidator: could not decode a name tx";
+        return;
+    }
+
+    vchType vchName, vchValue;
+    switch (res.op)
+    {
+    case OP_NAME_FIRSTUPDATE:
+      vchName = vvchArgs[0];
+      if (vvchArgs.size () == 3)
+        vchValue = vvchArgs[2];
+      else
+        {
+          assert (vvchArgs.size () == 2);
+          vchValue = vvchArgs[1];
+        }
+      break;
+
+    case OP_NAME_UPDATE:
+      vchName = vvchArgs[0];
+      vchValue = vvchArgs[1];
+      break;
+
+    case OP_NAME_NEW:
+      res.fNameNew = true;
+      res.fOk = true;
+      return;
+
+    default:
+      res.strError = "GameStepValidator: invalid name tx found";
+      return;
+    }
+
+    res.sName = stringFromVch(vchName);
+    res.sValue = stringFromVch(vchValue);
+
+    res.m.newLocked = tx.vout[nOut].nValue;
+    res.m.Parse(res.sName, res.sValue);
+    if (!res.m)
+    {
+        res.strError = strprintf("GameStepValidator: cannot parse move %s for player %s", res.sValue.c_str(), res.sName.c_str());
+        return;
+    }
+
+    res.fOk = true;
+}
+
+class GameStepValidator
+{
+    bool fOwnDb;
+    
+    DatabaseSet* pdbset;
+
+    // Detect duplicates (multiple moves per block). Probably already handled by NameDB and not needed.
+    std::set<PlayerID> dup;
+
+    // Temporary variables
+    vchType vchName;
+    vchType vchValue;
+
+protected:
+    const GameState *pstate;
+
+    /* Keeps the state alive if we obtained it ourselves.  */
+    GameStatePtr stateRef;
+
+public:
+    GameStepValidator(const GameState *pstate_)
+        : fOwnDb(false), pdbset(NULL), pstate(pstate_)
+    {
+    }
+
+    GameStepValidator(DatabaseSet& dbset, CBlockIndex *pindex)
+        : fOwnDb(false), pdbset(&dbset)
+    {
+        if (!GetGameState (dbset, pindex, stateRef))
+            throw std::runtime_error("GameStepValidator : cannot get previous game state");
+        pstate = stateRef.get ();
+    }
+
+    ~GameStepValidator()
+    {
+      if (pdbset && fOwnDb)
+        delete pdbset;
+    }
+
+    // Returns:
+    //   false - invalid move tx
+    //   true  - non-move tx or valid tx
+    // pdecoded may hold the result of DecodeMoveTx for the tx.
+    bool IsValid(const CTransaction& tx, Move &outMove,
+                 const DecodedMove* pdecoded = NULL)
+    {
+        if (tx.nVersion != NAMECOIN_TX_VERSION)
+        {
+#ifdef AUX_STORAGE_VOTING
+            int64 tmp_tag_official = 0;
+            int64 tmp_tag_min = 0;
+            int64 tmp_tag_max = 0;
+            int64 tmp_txid60bit = 0;
+            if (pstate->nHeight >= AUX_MINHEIGHT_VOTING(fTestNet))
+            {
+                int tmp_blocks = (pstate->nHeight % AUX_VOTING_INTERVAL(fTestNet));
+                tmp_tag_official = pstate->nHeight - tmp_blocks + AUX_VOTING_INTERVAL(fTestNet) - 25; // xxx9975 (testnet: xxx975)
+                tmp_tag_min = pstate->nHeight + 1;
+                tmp_tag_max = pstate->nHeight + (AUX_VOTING_INTERVAL(fTestNet) * 2) - 25;
+                if ((tmp_tag_official < tmp_tag_min) || (tmp_tag_official > tmp_tag_max)) tmp_tag_official == 0;
+
+                char buf[100];
+                strncpy(buf, tx.GetHash().GetHex().c_str(), 64);
+                buf[15] = '\0';
+                tmp_txid60bit = strtoll (buf, NULL, 16);
+
+                if (votingcache_idx)
+                {
+                    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    {
+                        if (!tx.IsCoinBase())
+                        {
+                            if (!tx.IsGameTx())
+                            {
+                                strncpy(buf, txin.prevout.hash.GetHex().c_str(), 64);
+                                buf[15] = '\0';
+                                int64 tmp_txid60bit_input = strtoll (buf, NULL, 16);
+
+                                printf("scanning votes: scanning input, txid60bit_input: %15"PRI64d"\n", tmp_txid60bit_input);
+
+                                for (int i = 0; i < votingcache_idx; i++)
+                                {
+                                    if (votingcache_zhunt_test[i]) continue; // otherwise 2 such transactions (from same wallet) in the same block would fail
+
+                                    if (votingcache_txid60bit[i] == tmp_txid60bit_input)
+                                    {
+                                        votingcache_amount[i] = -1;
+                                        printf("scanning votes: delete vote: vault address %s\n", votingcache_vault_addr[i].c_str(), FormatMoney(votingcache_amount[i]).c_str());
+                                        break;
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+#endif
+#ifdef PERMANENT_LUGGAGE_AUCTION
+#ifdef AUX_STORAGE_ZHUNT_TAGTEST
+            std::string tag_msg;
+            int64 tag_amount = 0;
+            bool tag_exists = false;
+#endif
+            // gems and storage
+            for (unsigned int i = 0; i < tx.vout.size(); i++)
+            {
+                const CTxOut& txout = tx.vout[i];
+                int64 nSingleValueOut = txout.nValue;
+                std::string address;
+                CScript script(txout.scriptPubKey);
+#ifdef AUX_STORAGE_ZHUNT_TAGTEST
+                bool tag_in_this_output = false;
+                if (txout.scriptPubKey.GetTag (tag_msg))
+                {
+                    tag_exists = tag_in_this_output = true;
+                    printf("luggage test: tag %s\n", tag_msg.c_str());
+                }
+#endif
+                if (ExtractDestination(script, address))
+                {
+                    bool fv = false;
+
+                    if (pstate->vault.count(address) > 0)
+                    {
+                        if (paymentcache_idx < PAYMENTCACHE_MAX)
+                        {
+                            paymentcache_vault_addr[paymentcache_idx] = address;
+                            paymentcache_amount[paymentcache_idx] = nSingleValueOut;
+                            paymentcache_idx++;
+                        }
+                        printf("luggage test: storage address %s received payment: %15"PRI64d" ", address.c_str(), nSingleValueOut);
+                        printf(" height %d, block hash %s\n", pstate->nHeight, pstate->hashBlock.GetHex().c_str());
+
+#ifdef AUX_STORAGE_ZHUNT_TAGTEST
+                        if (tag_in_this_output) printf("luggage test: tag %s, amount %15"PRI64d"\n", tag_msg.c_str(), nSingleValueOut);
+
+                        if (address == AUX_ZHUNT_TESTADDRESS(fTestNet))
+                        {
+                            if (nSingleValueOut > tag_amount) tag_amount = nSingleValueOut;
+                        }
+#endif
+
+#ifdef AUX_STORAGE_VOTING
+#ifdef AUX_STORAGE_ZHUNT
+                        // "zhunt orders" work somewhat different than "votes"
+                        // - spending these coins (or the change) will not delete it
+                        // - vault must already exist
+                        if ((pstate->nHeight >= AUX_MINHEIGHT_ZHUNT(fTestNet)) &&
+                            (nSingleValueOut % 10000 == 5501) && (nSingleValueOut >= 3000 * COIN) &&
+                            (votingcache_idx < VOTINGCACHE_MAX))
+                        {
+                            votingcache_vault_addr[votingcache_idx] = address;
+                            votingcache_vault_exists[votingcache_idx] = true;
+                            votingcache_zhunt_test[votingcache_idx] = false;
+                            votingcache_amount[votingcache_idx] = nSingleValueOut;
+                            votingcache_txid60bit[votingcache_idx] = tmp_txid60bit;
+                            votingcache_idx++;
+
+                            printf("zhunt order cached (existing vault)\n");
+                        }
+                        else
+#endif
+                        if (pstate->nHeight >= AUX_MINHEIGHT_VOTING(fTestNet))
+                        {
+                            if ((nSingleValueOut % 10000000 >= tmp_tag_min) && (nSingleValueOut % 10000000 <= tmp_tag_max) &&
+                                (nSingleValueOut >= 1000 * COIN))
+                            {
+                                fv = true;
+                            }
+
+                            if ((fv) && (votingcache_idx < VOTINGCACHE_MAX))
+                            {
+                                votingcache_vault_addr[votingcache_idx] = address;
+                                votingcache_vault_exists[votingcache_idx] = true;
+                                votingcache_zhunt_test[votingcache_idx] = false;
+                                votingcache_amount[votingcache_idx] = nSingleValueOut;
+                                votingcache_txid60bit[votingcache_idx] = tmp_txid60bit;
+                                votingcache_idx++;
+
+                                printf("scanning votes: cached (existing vault)\n");
+                            }
+                        }
+#endif
+                    }
+#ifdef AUX_STORAGE_VOTING
+                    else if ((pstate->nHeight >= AUX_MINHEIGHT_VOTING(fTestNet)) &&
+                             (tmp_tag_official) && (nSingleValueOut % 10000000 == tmp_tag_official) &&
+                             (nSingleValueOut >= 25000 * COIN))
+                    {
+                        fv = true;
+
+                        if ((fv) && (votingcache_idx < VOTINGCACHE_MAX))
+                        {
+                            votingcache_vault_addr[votingcache_idx] = address;
+                            votingcache_vault_exists[votingcache_idx] = false;
+                            votingcache_zhunt_test[votingcache_idx] = false;
+                            votingcache_amount[votingcache_idx] = nSingleValueOut;
+                            votingcache_txid60bit[votingcache_idx] = tmp_txid60bit;
+                            votingcache_idx++;
+
+                            printf("luggage test: address %s received payment: %15"PRI64d" ", address.c_str(), nSingleValueOut);
+                            printf(" height %d, block hash %s\n", pstate->nHeight, pstate->hashBlock.GetHex().c_str());
+                            printf("scanning votes: cached (need new vault)\n");
+                        }
+                    }
+#endif
+#ifdef PERMANENT_LUGGAGE_LOG_PAYMENTS
+                    else
+                    {
+                        printf("luggage test: address %s received payment: %15"PRI64d" ", address.c_str(), nSingleValueOut);
+                        printf(" height %d, block hash %s\n", pstate->nHeight, pstate->hashBlock.GetHex().c_str());
+                    }
+#endif
+                }
+            }
+#ifdef AUX_STORAGE_ZHUNT_TAGTEST
+            // do this only once per transaction
+            if (((pstate->nHeight >= AUX_MINHEIGHT_ZHUNT(fTestNet))) &&
+                (tag_exists) && (tag_amount > 0) && (tag_msg.substr(0, 4) == "GEM ") && (tag_msg.length() > 4) &&
+                (votingcache_idx < VOTINGCACHE_MAX))
+            {
+                if (IsValidBitcoinAddress(tag_msg.substr(4)))
+                {
+                    votingcache_vault_addr[votingcache_idx] = tag_msg.substr(4);
+                    votingcache_vault_exists[votingcache_idx] = true; // technically true but useless
+                    votingcache_zhunt_test[votingcache_idx] = true;
+                    votingcache_amount[votingcache_idx] = tag_amount;
+                    votingcache_txid60bit[votingcache_idx] = tmp_txid60bit; // not used
+                    votingcache_idx++;
+                    printf("convert to gems: add to cache: tag %s, amount %15"PRI64d"\n", tag_msg.c_str(), tag_amount);
+                }
+            }
+#endif
+#endif
+            return true;
+        }
+
+        /* Decode the move unless this was already done in advance.  */
+        DecodedMove decodedHere;
+        if (!pdecoded)
+        {
+            DecodeMoveTx (tx, decodedHere);
+            pdecoded = &decodedHere;
+        }
+        if (!pdecoded->fOk)
+            return error ("%s", pdecoded->strError.c_str ());
+        if (pdecoded->fNameNew)
+            return true;
+
+        const int op = pdecoded->op;
+        const std::string& sName = pdecoded->sName;
+        const std::string& sValue = pdecoded->sValue;
+        if (dup.count(sName))
+            return error ("GameStepValidator: duplicate player name %s",
+                          sName.c_str ());
+        dup.insert(sName);
+
+        Move m = pdecoded->m;
+        if (!m.IsValid(*pstate))
+            return error("GameStepValidator: invalid move for the game state: move %s for player %s", sValue.c_str(), sName.c_str());
+
+        if (m.IsSpawn ())
+          {
+            if (op != OP_NAME_FIRSTUPDATE)
+              return error ("GameStepValidator: spawn is not firstupdate");
+          }
+        else if (op != OP_NAME_UPDATE)
+          return error ("GameStepValidator: name_firstupdate is not spawn");
+
+        std::string addressLock = m.AddressOperationPermission(*pstate);
+
+#ifdef GUI
+        // pending tx monitor
+        if ((pmon_tx_count) && (pmon_why_validate == WHYVALIDATE_CONNECTBLOCK))
+        {
+            for (int k2 = 0; k2 < pmon_tx_count; k2++)
+            {
+                if (pmon_tx_names[k2] == sName)
+                {
+                    pmon_tx_names[k2] = "";
+                    break;
+                }
+            }
+        }
+#endif
+#ifdef PERMANENT_LUGGAGE
+        // gems and storage
+        if (GEM_ALLOW_SPAWN(fTestNet, pstate->nHeight))
+        {
+            std::string sa;
+            GetNameAddress(tx, sa);
+            m.playernameaddress = sa;
+            printf("luggage test: move for name %s, playernameaddr %s\n", sName.c_str(), sa.c_str());
+        }
+#endif
+
+        if (!addressLock.empty())
+        {
+            // If one of inputs has address equal to addressLock, then that input has been signed by the address owner
+            // and thus authorizes the address change operation
+            bool found = false;
+            if (!pdbset)
+            {
+                pdbset = new DatabaseSet("r");
+                fOwnDb = true;
+            }
+            for (int i = 0; i < tx.vin.size(); i++)
+            {
+                COutPoint prevout = tx.vin[i].prevout;
+                CTransaction txPrev;
+                CTxIndex txindex;
+                if (!pdbset->tx ().ReadTxIndex (prevout.hash, txindex)
+                    || txindex.pos == CDiskTxPos(1,1,1))
+                    continue;
+                else if (!txPrev.ReadFromDisk(txindex.pos))
+                    continue;
+                if (prevout.n >= txPrev.vout.size())
+                    continue;
+                const CTxOut &vout = txPrev.vout[prevout.n];
+                std::string address;
+                if (ExtractDestination(vout.scriptPubKey, address) && address == addressLock)
+                {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+                return error("GameStepValidator: address operation permission denied: move %s for player %s", sValue.c_str(), sName.c_str());
+        }
+        outMove = m;
+        return true;
+    }
+
+    bool IsValid(const CTransaction& tx)
+    {
+        Move m;
+        if (!IsValid(tx, m))
+            return false;
+        return true;
+    }
+};
+
+bool
+IsMoveValid (const GameState& state, const CTransaction& tx)
+{
+  GameStepValidator validator(&state);
+  return validator.IsValid (tx);
+}
+
+static void InitStepData(StepData &stepData, const GameState &state)
+{
+    const int64_t nSubsidy = GetBlockValue(state.nHeight + 1, 0);
+    // Miner subsidy is 10%, thus game treasure is 9 times the subsidy
+    stepData.nTreasureAmount = nSubsidy * 9;
+}
+
+class GameStepMinerImpl : public GameStepValidator
+{
+    StepData stepData;
+public:
+    GameStepMinerImpl (DatabaseSet& dbset, CBlockIndex *pindex)
+      : GameStepValidator (dbset, pindex)
+    {
+      InitStepData (stepData, *pstate);
+    }
+
+    bool AddTx(const CTransaction& tx)
+    {
+        Move m;
+        if (!IsValid(tx, m))
+            return false;
+        if (m)
+            stepData.vMoves.push_back(m);
+
+        return true;
+    }
+
+    int64 ComputeTax()
+    {
+        StepResult stepResult;
+        Game::GameState outState;
+        if (!Game::PerformStep(*pstate, stepData, outState, stepResult))
+        {
+            error("GameStepMinerImpl::ComputeTax failed");
+            return 0;
+        }
+
+        return stepResult.nTaxAmount;
+    }
+};
+
+// A simple wrapper (pImpl pattern) to remove dependency on the game-related headers when miner just wants to check transactions
+// (declared in hooks.h)
+GameStepMiner::GameStepMiner (DatabaseSet& dbset, CBlockIndex *pindex)
+  : pImpl(new GameStepMinerImpl(dbset, pindex))
+{}
+
+GameStepMiner::~GameStepMiner()
+{
+    delete pImpl;
+}
+
+bool GameStepMiner::AddTx(const CTransaction& tx)
+{
+    return pImpl->AddTx(tx);
+}
+
+int64 GameStepMiner::ComputeTax()
+{
+    return pImpl->ComputeTax();
+}
+
+/* PerformStep, optionally with the moves of the block's transactions
+   already decoded (indexed like block->vtx).  */
+static bool
+PerformStep (CNameDB& nameDb, const GameState& inState, const CBlock* block,
+             const std::vector<DecodedMove>* decoded,
+             int64& nTax, GameState& outState,
+             std::vector<CTransaction>* outvgametx, StepResult* outStepResult)
+{
+    if (block->hashPrevBlock != inState.hashBlock)
+        return error("PerformStep: game state for wrong block");
+
+    StepData stepData;
+    InitStepData(stepData, inState);
+    stepData.newHash = block->GetHash();
+
+#ifdef PERMANENT_LUGGAGE_AUCTION
+    paymentcache_instate_blockhash = inState.hashBlock;
+    paymentcache_idx = 0;
+#endif
+#ifdef AUX_STORAGE_VOTING
+    if (inState.nHeight >= AUX_MINHEIGHT_VOTING(fTestNet))
+    {
+      votingcache_instate_blockhash = inState.hashBlock;
+      votingcache_idx = 0;
+      BOOST_FOREACH(const PAIRTYPE(const std::string, StorageVault) &st, inState.vault)
+      {
+        if ((st.second.vote_raw_amount > 0) || (st.second.vote_txid60bit > 0))
+        {
+            int64 tmp_txid60bit = st.second.vote_txid60bit;
+            if (votingcache_idx < VOTINGCACHE_MAX)
+            {
+                votingcache_vault_addr[votingcache_idx] = st.first;
+                votingcache_vault_exists[votingcache_idx] = true;
+                votingcache_zhunt_test[votingcache_idx] = false;
+                votingcache_amount[votingcache_idx] = 0;
+
+                // cleanup
+                if (int(st.second.vote_raw_amount % 10000000) < inState.nHeight - AUX_VOTING_CLEANUP_PERIOD(fTestNet))
+                    votingcache_amount[votingcache_idx] = -1;
+
+                votingcache_txid60bit[votingcache_idx] = tmp_txid60bit;
+                votingcache_idx++;
+
+                printf("scanning votes: existing vote, addr %s, amount %15"PRI64d", txid60bit %15"PRI64d"\n", st.first.c_str(), st.second.vote_raw_amount, tmp_txid60bit);
+            }
+        }
+      }
+      printf("scanning votes: %d existing votes, height %d\n", votingcache_idx, inState.nHeight);
+    }
+#endif
+
+    if (decoded && decoded->size () != block->vtx.size ())
+        return error("PerformStep: wrong number of decoded moves");
+
+    GameStepValidator gameStepValidator(&inState);
+    // Create moves for all move transactions
+    for (unsigned i = 0; i < block->vtx.size (); ++i)
+    {
+        const CTransaction& tx = block->vtx[i];
+        const DecodedMove* pdecoded = NULL;
+        if (decoded && tx.nVersion == NAMECOIN_TX_VERSION)
+            pdecoded = &(*decoded)[i];
+
+        Move m;
+        if (!gameStepValidator.IsValid(tx, m, pdecoded))
+            return error("GameStepValidator rejected transaction %s in block %s", tx.GetHash().ToString().substr(0,10).c_str(), block->GetHash().ToString().c_str());
+        if (m)
+            stepData.vMoves.push_back(m);
+    }
+
+    StepResult stepResult;
+    if (!Game::PerformStep(inState, stepData, outState, stepResult))
+        return error("PerformStep failed for block %s", block->GetHash().ToString().c_str());
+
+#ifdef PERMANENT_LUGGAGE
+    /* The luggage code changes vaults and characters in too many places
+       to record them.  Compare the states instead.  */
+    stepResult.changes = StateChangeSet ();
+    CollectChanges (inState, outState, stepResult.changes);
+#else
+    /* The deltas, undo records and the incremental commitment are all
+       derived from the recorded changes, so an entity that PerformStep
+       failed to record would silently corrupt them.  Comparing the states
+       costs far less than the step itself.  */
+    if (!CheckChanges (inState, outState, stepResult.changes))
+      {
+        error ("PerformStep: incomplete changes recorded @%d",
+               outState.nHeight);
+        CollectChanges (inState, outState, stepResult.changes);
+      }
+#endif
+
+    nTax = stepResult.nTaxAmount;
+    if (outStepResult)
+      *outStepResult = stepResult;
+
+    if (!outvgametx)
+      return true;
+
+    return CreateGameTransactions (nameDb, outState, stepResult, *outvgametx);
+}
+
+bool
+PerformStep (CNameDB& nameDb, const GameState& inState, const CBlock* block,
+             int64& nTax, GameState& outState,
+             std::vector<CTransaction>* outvgametx, StepResult* outStepResult)
+{
+  return PerformStep (nameDb, inState, block, NULL, nTax, outState,
+                      outvgametx, outStepResult);
+}
+
+/* ************************************************************************** */
+/* BlockPrefetcher.  */
+
+/**
+ * Reads blocks for a replay ahead of time in a separate thread.  The
+ * blocks are read from disk and their moves decoded (which does not depend
+ * on the game state), so that the replaying thread only needs to perform
+ * the steps.  The number of blocks read ahead is bounded.
+ */
+class BlockPrefetcher : private boost::noncopyable
+{
+
+public:
+
+  struct Item
+  {
+    CBlockIndex* pindex;
+    bool fOk;
+    CBlock block;
+    std::vector<DecodedMove> moves;
+  };
+  typedef boost::shared_ptr<Item> ItemPtr;
+
+private:
+
+  /* The blocks to read, in order.  */
+  const std::vector<CBlockIndex*> blocks;
+  const unsigned nMaxQueue;
+
+  boost::mutex mut;
+  boost::condition_variable cvChanged;
+  /* Protected by mut.  */
+  std::deque<ItemPtr> queue;
+  bool fStop;
+  bool fDone;
+
+  boost::thread thread;
+
+  void Run ();
+
+public:
+
+  /**
+   * Start prefetching the given blocks.
+   * @param b The blocks in the order in which they will be requested.
+   * @param nQueue Maximum number of blocks read ahead.
+   */
+  BlockPrefetcher (const std::vector<CBlockIndex*>& b, unsigned nQueue)
+    : blocks(b), nMaxQueue(nQueue), fStop(false), fDone(false),
+      thread(boost::bind (&BlockPrefetcher::Run, this))
+  {}
+
+  ~BlockPrefetcher ();
+
+  /**
+   * Get the prefetched block for the given index.  Blocks that were
+   * skipped over in the mean time are dropped.
+   * @param pindex The block to get.
+   * @return The item, or NULL if the block is not prefetched.
+   */
+  ItemPtr Get (const CBlockIndex* pindex);
+
+};
+
+BlockPrefetcher::~BlockPrefetcher ()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mut);
+    fStop = true;
+  }
+  cvChanged.notify_all ();
+  thread.join ();
+}
+
+void
+BlockPrefetcher::Run ()
+{
+  BOOST_FOREACH (CBlockIndex* pindex, blocks)
+    {
+      {
+        boost::lock_guard<boost::mutex> lock(mut);
+        if (fStop)
+          return;
+      }
+
+      ItemPtr item(new Item ());
+      item->pindex = pindex;
+      item->fOk = item->block.ReadFromDisk (pindex);
+      if (item->fOk)
+        {
+          item->moves.resize (item->block.vtx.size ());
+          for (unsigned i = 0; i < item->block.vtx.size (); ++i)
+            if (item->block.vtx[i].nVersion == NAMECOIN_TX_VERSION)
+              DecodeMoveTx (item->block.vtx[i], item->moves[i]);
+        }
+
+      boost::unique_lock<boost::mutex> lock(mut);
+      while (!fStop && queue.size () >= nMaxQueue)
+        cvChanged.wait (lock);
+      if (fStop)
+        return;
+      queue.push_back (item);
+      cvChanged.notify_all ();
+    }
+
+  boost::lock_guard<boost::mutex> lock(mut);
+  fDone = true;
+  cvChanged.notify_all ();
+}
+
+BlockPrefetcher::ItemPtr
+BlockPrefetcher::Get (const CBlockIndex* pindex)
+{
+  boost::unique_lock<boost::mutex> lock(mut);
+  while (true)
+    {
+      /* Drop blocks before the requested one.  */
+      while (!queue.empty () && queue.front ()->pindex->nHeight < pindex->nHeight)
+        {
+          queue.pop_front ();
+          cvChanged.notify_all ();
+        }
+
+      if (!queue.empty ())
+        {
+          if (queue.front ()->pindex != pindex)
+            return ItemPtr ();
+
+          const ItemPtr res = queue.front ();
+          queue.pop_front ();
+          cvChanged.notify_all ();
+          return res;
+        }
+
+      /* The queue is empty.  Wait for the reader if it still has the
+         requested block ahead of it.  */
+      if (fDone || blocks.empty ()
+          || blocks.back ()->nHeight < pindex->nHeight)
+        return ItemPtr ();
+      cvChanged.wait (lock);
+    }
+}
+
+/* ************************************************************************** */
+/* GameStateCache.  */
+
+/**
+ * This class holds a cache of recently calculated game states just in memory
+ * (this is never written to disk) and can be used to get the current state
+ * as well as very recent "old" ones efficiently (without recalculation).
+ * The recent (but not current) states are necessary to perform efficient
+ * reorganisations after orphan blocks.
+ */
+class GameStateCache
+{
+
+private:
+
+  /** Block hashes in LRU order, most recently used first.  */
+  typedef std::list<uint256> lruList;
+
+  struct Entry
+  {
+    GameStatePtr state;
+    /** Estimated memory usage of the state.  */
+    size_t size;
+    /** Position in the LRU list.  */
+    lruList::iterator lruPos;
+  };
+
+  /** Type used for the map blockhash -> state.  */
+  typedef std::map<uint256, Entry> gameStateMap;
+
+  /** Map holding the data.  */
+  gameStateMap map;
+  lruList lru;
+
+  /** Total estimated size of all cached states.  */
+  size_t totalSize;
+
+  /** Maximum total size in bytes, after which elements are pruned.  */
+  size_t maxSize;
+
+  /** Move the entry to the front of the LRU list.  */
+  inline void
+  touch (Entry& e)
+  {
+    lru.splice (lru.begin (), lru, e.lruPos);
+  }
+
+  void remove (gameStateMap::iterator i);
+  void prune (const uint256& keep);
+
+  /**
+   * Estimate the memory used by a state from the number of entities.
+   * This is called for every stored state, so it must not serialise the
+   * state.  Each map entry is counted with about 48 bytes of node and
+   * allocation overhead, and each string with about 64 bytes.
+   */
+  static size_t estimateSize (const GameState& state);
+
+public:
+
+  /**
+   * Construct it empty.
+   * @param sz Maximum total size in bytes after which we remove old entries.
+   */
+  inline GameStateCache (size_t sz)
+    : map(), lru(), totalSize(0), maxSize(sz)
+  {}
+
+  inline void
+  setMaxSize (size_t sz)
+  {
+    maxSize = sz;
+  }
+
+  /**
+   * Retrieve a game state if it is stored.  This marks it as recently used.
+   * @param hash Block hash for which we want the state.
+   * @return Shared pointer to the stored state or NULL.
+   */
+  inline GameStatePtr
+  query (const uint256& hash)
+  {
+    const gameStateMap::iterator i = map.find (hash);
+    if (i == map.end ())
+      return GameStatePtr ();
+
+    touch (i->second);
+    return i->second.state;
+  }
+
+  /**
+   * Insert the given game state into the cache.  It is shared with the
+   * caller, which must not modify it afterwards.
+   * @param state Game state to store.
+   */
+  void store (const GameStatePtr& state);
+
+  /**
+   * Insert a copy of the given game state into the cache.
+   * @param state Game state to store.
+   */
+  inline void
+  store (const GameState& state)
+  {
+    store (GameStatePtr (new GameState (state)));
+  }
+
+  /**
+   * Return the most recently used states of blocks on the main chain.
+   * @param count Return at most that many states.
+   * @param out Put the states here, most recently used first.
+   */
+  void getRecent (unsigned count, std::vector<GameStatePtr>& out) const;
+
+};
+
+size_t
+GameStateCache::estimateSize (const GameState& state)
+{
+  static const size_t NODE_OVERHEAD = 48;
+  static const size_t STRING_SIZE = 64;
+  static const size_t PLAYER_SIZE = sizeof (PlayerID) + sizeof (PlayerState)
+                                      + NODE_OVERHEAD + 3 * STRING_SIZE;
+
+  size_t nCharacters = 0;
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p, state.players)
+    nCharacters += p.second.characters.size ();
+
+  size_t res = sizeof (GameState);
+  res += (state.players.size () + state.dead_players_chat.size ())
+          * PLAYER_SIZE;
+  res += nCharacters
+          * (sizeof (int) + sizeof (CharacterState) + NODE_OVERHEAD);
+  res += state.loot.size ()
+          * (sizeof (Coord) + sizeof (LootInfo) + NODE_OVERHEAD);
+  res += state.hearts.size () * (sizeof (Coord) + NODE_OVERHEAD);
+  res += state.banks.size ()
+          * (sizeof (Coord) + sizeof (unsigned) + NODE_OVERHEAD);
+#ifdef PERMANENT_LUGGAGE
+  res += state.vault.size ()
+          * (sizeof (std::string) + sizeof (StorageVault) + NODE_OVERHEAD
+              + STRING_SIZE);
+#endif
+
+  return res;
+}
+
+void
+GameStateCache::getRecent (unsigned count,
+                           std::vector<GameStatePtr>& out) const
+{
+  out.clear ();
+  for (lruList::const_iterator i = lru.begin ();
+       i != lru.end () && out.size () < count; ++i)
+    {
+      std::map<uint256, CBlockIndex*>::const_iterator mi;
+      mi = mapBlockIndex.find (*i);
+      if (mi == mapBlockIndex.end () || !mi->second->IsInMainChain ())
+        continue;
+
+      const gameStateMap::const_iterator j = map.find (*i);
+      assert (j != map.end ());
+      out.push_back (j->second.state);
+    }
 }
 
-static void InitStepData(StepData &stepData, const GameState &state)
+void
+GameStateCache::remove (gameStateMap::iterator i)
 {
-    const int64_t nSubsidy = GetBlockValue(state.nHeight + 1, 0);
-    // Miner subsidy is 10%, thus game treasure is 9 times the subsidy
-    stepData.nTreasureAmount = nSubsidy * 9;
+  assert (totalSize >= i->second.size);
+  totalSize -= i->second.size;
+  lru.erase (i->second.lruPos);
+  map.erase (i);
 }
 
-class GameStepMinerImpl : public GameStepValidator
+void
+GameStateCache::store (const GameStatePtr& state)
 {
-    StepData stepData;
-public:
-    GameStepMinerImpl (DatabaseSet& dbset, CBlockIndex *pindex)
-      : GameStepValidator (dbset, pindex)
+  gameStateMap::iterator i;
+  const uint256& hash = state->hashBlock;
+
+  /* See if the state is there first, and overwrite it if yes.  Callers
+     holding the old state keep it.  */
+  i = map.find (hash);
+  if (i != map.end ())
     {
-      InitStepData (stepData, *pstate);
+      totalSize -= i->second.size;
+      i->second.state = state;
+      i->second.size = estimateSize (*state);
+      totalSize += i->second.size;
+      touch (i->second);
+      return;
     }
 
-    bool AddTx(const CTransaction& tx)
+  /* Insert the new entry.  */
+  if (fDebug)
+    printf ("GameStateCache: storing for block @%d %s\n",
+            state->nHeight, hash.GetHex ().c_str ());
+
+  Entry e;
+  e.state = state;
+  e.size = estimateSize (*state);
+  e.lruPos = lru.insert (lru.begin (), hash);
+  map.insert (std::make_pair (hash, e));
+  totalSize += e.size;
+
+  prune (hash);
+}
+
+void
+GameStateCache::prune (const uint256& keep)
+{
+  /* Drop entries until we reach the maximal size goal.  The entry just
+     stored is always kept.  It may be the state of a block being
+     connected, which is not yet in the main chain.  */
+  while (totalSize > maxSize && map.size () > 1)
     {
-        Move m;
-        if (!IsValid(tx, m))
-            return false;
-        if (m)
-            stepData.vMoves.push_back(m);
+      /* See if there are entries for blocks not on the main chain.  Remove
+         those first.  */
+      gameStateMap::iterator victim = map.end ();
+      for (gameStateMap::iterator i = map.begin (); i != map.end (); ++i)
+        {
+          if (i->first == keep)
+            continue;
 
-        return true;
-    }
+          std::map<uint256, CBlockIndex*>::const_iterator j;
+          j = mapBlockIndex.find (i->first);
 
-    int64 ComputeTax()
-    {
-        StepResult stepResult;
-        Game::GameState outState;
-        if (!Game::PerformStep(*pstate, stepData, outState, stepResult))
+          if (j == mapBlockIndex.end () || !j->second->IsInMainChain ())
+            {
+              if (j == mapBlockIndex.end ())
+                printf ("Warning: Block in GameStateCache not found in"
+                        " mapBlockIndex.  Removing.\n");
+
+              printf ("GameStateCache: removing block %s not in main chain\n",
+                      i->first.GetHex ().c_str ());
+              victim = i;
+              break;
+            }
+        }
+
+      /* Else remove the least recently used entry.  */
+      if (victim == map.end ())
         {
-            error("GameStepMinerImpl::ComputeTax failed");
-            return 0;
+          lruList::reverse_iterator r = lru.rbegin ();
+          if (*r == keep)
+            ++r;
+          assert (r != lru.rend ());
+          victim = map.find (*r);
+          assert (victim != map.end ());
+
+          if (fDebug)
+            printf ("GameStateCache: removing least recently used block"
+                    " @%d\n", victim->second.state->nHeight);
         }
 
-        return stepResult.nTaxAmount;
+      remove (victim);
     }
-};
+}
 
-// A simple wrapper (pImpl pattern) to remove dependency on the game-related headers when miner just wants to check transactions
-// (declared in hooks.h)
-GameStepMiner::GameStepMiner (DatabaseSet& dbset, CBlockIndex *pindex)
-  : pImpl(new GameStepMinerImpl(dbset, pindex))
-{}
+/** Our game state cache instance.  The size is set from
+    -gamestatecache in InitGameStore.  */
+static GameStateCache stateCache(IN_MEMORY_STATE_CACHE << 20);
 
-GameStepMiner::~GameStepMiner()
-{
-    delete pImpl;
-}
+/* ************************************************************************** */
 
-bool GameStepMiner::AddTx(const CTransaction& tx)
+// Caller must hold cs_main lock
+GameStatePtr GetCurrentGameState()
 {
-    return pImpl->AddTx(tx);
-}
+    /* If the state is in the cache, return it immediately.  */
+    GameStatePtr state = stateCache.query (*pindexBest->phashBlock);
+    if (state)
+      return state;
 
-int64 GameStepMiner::ComputeTax()
-{
-    return pImpl->ComputeTax();
+    /* Else, calulate the state.  This also puts it into the cache.  */
+    DatabaseSet dbset("r");
+    if (!GetGameState (dbset, pindexBest, state))
+      error ("GetCurrentGameState: GetGameState failed");
+    assert (state);
+
+    return state;
 }
 
+// pindex must belong to the main branch, i.e. corresponding blocks must be connected
+// Returns a shared handle to the game state
 bool
-PerformStep (CNameDB& nameDb, const GameState& inState, const CBlock* block,
-             int64& nTax, GameState& outState,
-             std::vector<CTransaction>* outvgametx)
+GetGameState (DatabaseSet& dbset, CBlockIndex *pindex, GameStatePtr &outState)
 {
-    if (block->hashPrevBlock != inState.hashBlock)
-        return error("PerformStep: game state for wrong block");
+    if (!pindex)
+    {
+        outState.reset (new GameState ());
+        return true;
+    }
 
-    StepData stepData;
-    InitStepData(stepData, inState);
-    stepData.newHash = block->GetHash();
+    /* See if we have the block in the state cache.  */
+    outState = stateCache.query (*pindex->phashBlock);
+    if (outState)
+      return true;
 
-#ifdef PERMANENT_LUGGAGE_AUCTION
-    paymentcache_instate_blockhash = inState.hashBlock;
-    paymentcache_idx = 0;
-#endif
-#ifdef AUX_STORAGE_VOTING
-    if (inState.nHeight >= AUX_MINHEIGHT_VOTING(fTestNet))
+    // Get the latest saved state
+    CGameDB gameDb("r", dbset.tx ());
+
+    boost::shared_ptr<GameState> stored(new GameState ());
+    if (gameDb.Read(pindex->nHeight, *stored))
     {
-      votingcache_instate_blockhash = inState.hashBlock;
-      votingcache_idx = 0;
-      BOOST_FOREACH(const PAIRTYPE(const std::string, StorageVault) &st, inState.vault)
-      {
-        if ((st.second.vote_raw_amount > 0) || (st.second.vote_txid60bit > 0))
+        if (stored->nHeight != pindex->nHeight)
+            return error("GetGameState: wrong height");
+        if (stored->hashBlock == *pindex->phashBlock)
         {
-            int64 tmp_txid60bit = st.second.vote_txid60bit;
-            if (votingcache_idx < VOTINGCACHE_MAX)
-            {
-                votingcache_vault_addr[votingcache_idx] = st.first;
-                votingcache_vault_exists[votingcache_idx] = true;
-                votingcache_zhunt_test[votingcache_idx] = false;
-                votingcache_amount[votingcache_idx] = 0;
+            outState = stored;
+            stateCache.store (outState);
+            return true;
+        }
 
-                // cleanup
-                if (int(st.second.vote_raw_amount % 10000000) < inState.nHeight - AUX_VOTING_CLEANUP_PERIOD(fTestNet))
-                    votingcache_amount[votingcache_idx] = -1;
+        /* The game store is not part of the DB transactions, so it may
+           contain a state from a block whose connection was aborted.
+           Reconstruct the state in this case.  */
+        if (!pgameStore)
+            return error("GetGameState: wrong hash");
+        printf ("GetGameState: ignoring stored state @%d with wrong hash\n",
+                pindex->nHeight);
+    }
 
-                votingcache_txid60bit[votingcache_idx] = tmp_txid60bit;
-                votingcache_idx++;
+    if (!pindex->IsInMainChain())
+        return error("GetGameState called for non-main chain");
 
-                printf("scanning votes: existing vote, addr %s, amount %15"PRI64d", txid60bit %15"PRI64d"\n", st.first.c_str(), st.second.vote_raw_amount, tmp_txid60bit);
-            }
+    printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+    printf("GetGameState: need to integrate state for height %d (current %d)\n",
+           pindex->nHeight, nBestHeight);
+
+    /* The state being integrated is allocated such that it can be put
+       into the cache at the end without copying it.  */
+    boost::shared_ptr<GameState> pLastState(new GameState ());
+    GameState& lastState = *pLastState;
+
+    CBlockIndex *plast = pindex;
+    for (; plast->pprev; plast = plast->pprev)
+    {
+        const GameStatePtr cached = stateCache.query (*plast->pprev->phashBlock);
+        if (cached)
+        {
+            lastState = *cached;
+            break;
+        }
+        if (gameDb.Read(plast->pprev->nHeight, lastState))
+        {
+            if (lastState.hashBlock == *plast->pprev->phashBlock)
+                break;
+            lastState = GameState();
         }
-      }
-      printf("scanning votes: %d existing votes, height %d\n", votingcache_idx, inState.nHeight);
     }
-#endif
 
-    GameStepValidator gameStepValidator(&inState);
-    // Create moves for all move transactions
-    BOOST_FOREACH(const CTransaction& tx, block->vtx)
+    printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+    printf("GetGameState: last saved block has height %d\n", lastState.nHeight);
+
+    /* The commitment is carried along the replay, since each delta is
+       checked against the state root stored with it.  */
+    StateCommitment commitment = GetStateCommitment (lastState);
+
+    /* Integrate steps starting from the last saved state.  If a delta is
+       stored for the block, it is applied in-place.  Otherwise the block
+       is processed with PerformStep, and the delta saved for later.  */
+    unsigned nDeltas = 0, nSteps = 0;
+    GameState next;
+
+    /* Blocks without a delta have to be processed.  Read them ahead in
+       a separate thread if there are enough of them.  */
+    std::vector<CBlockIndex*> toRead;
+    for (CBlockIndex* p = plast; p; p = p->pnext)
     {
-        Move m;
-        if (!gameStepValidator.IsValid(tx, m))
-            return error("GameStepValidator rejected transaction %s in block %s", tx.GetHash().ToString().substr(0,10).c_str(), block->GetHash().ToString().c_str());
-        if (m)
-            stepData.vMoves.push_back(m);
+        if (!gameDb.ExistsDelta (p->nHeight))
+            toRead.push_back (p);
+        if (p == pindex)
+            break;
     }
+    boost::scoped_ptr<BlockPrefetcher> prefetcher;
+    if (toRead.size () >= PREFETCH_MIN_BLOCKS)
+        prefetcher.reset (new BlockPrefetcher (toRead, PREFETCH_QUEUE_SIZE));
+    loop
+    {
+        StateChangeSet changes;
+        bool fApplied = false;
 
-    StepResult stepResult;
-    if (!Game::PerformStep(inState, stepData, outState, stepResult))
-        return error("PerformStep failed for block %s", block->GetHash().ToString().c_str());
+        StateDelta delta;
+        if (gameDb.ReadDelta (plast->nHeight, delta)
+            && delta.GetBlockHash () == *plast->phashBlock)
+          {
+            delta.GetChanges (lastState, changes);
+            fApplied = delta.Apply (lastState);
+            if (fApplied)
+              {
+                ++nDeltas;
+                commitment.Update (lastState, changes);
+              }
+
+            /* A delta that does not reproduce the state it was created
+               for would corrupt every state replayed through it.  The
+               parent is gone at this point, so drop the delta and
+               start over, which processes the block again.  */
+            if (fApplied && commitment.GetRoot () != delta.GetStateRoot ())
+              {
+                error ("GetGameState: delta @%d does not match its state root",
+                       plast->nHeight);
+                CGameDB gameDbDelta("r+", dbset.tx ());
+                if (!gameDbDelta.EraseDelta (plast->nHeight))
+                  return error ("GetGameState: failed to erase the delta");
+                gameDbDelta.Close ();
+                gameDb.Close ();
+                return GetGameState (dbset, pindex, outState);
+              }
+          }
 
-    nTax = stepResult.nTaxAmount;
+        if (!fApplied)
+          {
+            BlockPrefetcher::ItemPtr item;
+            if (prefetcher.get ())
+              item = prefetcher->Get (plast);
+            if (!item || !item->fOk)
+              {
+                item.reset (new BlockPrefetcher::Item ());
+                item->pindex = plast;
+                item->block.ReadFromDisk(plast);
+              }
+            const CBlock& block = item->block;
+            const std::vector<DecodedMove>* decoded = NULL;
+            if (!item->moves.empty ())
+              decoded = &item->moves;
+
+            int64 nTax;
+            StepResult stepResult;
+            if (!PerformStep (dbset.name (), lastState, &block, decoded, nTax,
+                              next, NULL, &stepResult))
+                return false;
+            ++nSteps;
+
+            changes = stepResult.changes;
+            const uint256 hashParentRoot = commitment.GetRoot ();
+            commitment.Update (next, changes);
+
+            delta.Create (lastState, next, changes, commitment.GetRoot ());
+            CGameDB gameDbDelta("r+", dbset.tx ());
+            gameDbDelta.WriteDelta (next.nHeight, delta);
+            KillList kills;
+            GetStepKills (stepResult, kills);
+            if (!kills.empty ())
+              gameDbDelta.WriteKills (next.nHeight, kills);
+            if (next.nHeight + UNDO_DEPTH > nBestHeight)
+              {
+                StateUndo undo;
+                undo.Create (lastState, next, changes, hashParentRoot);
+                gameDbDelta.WriteUndo (next.nHeight, undo);
+              }
+
+            lastState = next;
+          }
 
-    if (!outvgametx)
-      return true;
+        if (lastState.nHeight != plast->nHeight)
+            return error("GetGameState: wrong height");
+        if (lastState.hashBlock != *plast->phashBlock)
+            return error("GetGameState: wrong hash");
+        if (fDebug)
+            printf ("GetGameState: state root @%d %s\n", lastState.nHeight,
+                    commitment.GetRoot ().GetHex ().c_str ());
+        if (plast == pindex)
+            break;
+        plast = plast->pnext;
 
-    return CreateGameTransactions (nameDb, outState, stepResult, *outvgametx);
+        /* Keep intermediate states at a fixed stride in memory, so that
+           further queries close to this one need not replay from the
+           stored state again.  */
+        if (lastState.nHeight % REPLAY_CACHE_STRIDE == 0)
+            stateCache.store (lastState);
+
+        /* Write the state to DB.  This is done during integration already
+           so that it is ensured that every other state is stored even
+           if the game db is reconstructed from scratch.  (Otherwise,
+           it would only contain the last state in that case.)  */
+        if (IsKeyframe (lastState.nHeight, nBestHeight))
+          {
+            CGameDB gameDb("r+", dbset.tx ());
+            gameDb.Write(lastState.nHeight, lastState);
+            printf ("Saved game state @%d to database.\n", lastState.nHeight);
+          }
+    }
+    outState = pLastState;
+
+    printf ("GetGameState: applied %u deltas and performed %u steps\n",
+            nDeltas, nSteps);
+
+    /* Store into game state cache, and the commitment along with it, so
+       that the next block can derive its own incrementally.  */
+    stateCache.store (outState);
+    CacheStateCommitment (commitment);
+
+    printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+    printf("GetGameState: done integrating\n");
+
+    return true;
 }
 
-/* ************************************************************************** */
-/* GameStateCache.  */
+// Called from ConnectBlock
+/* Collect the names updated by name txs in the block.  The addresses
+   holding them may have changed.  */
+static void
+GetUpdatedNames (const CBlock& block, std::set<PlayerID>& names)
+{
+  names.clear ();
+  BOOST_FOREACH (const CTransaction& tx, block.vtx)
+    {
+      if (tx.nVersion != NAMECOIN_TX_VERSION)
+        continue;
 
-/**
- * This class holds a cache of recently calculated game states just in memory
- * (this is never written to disk) and can be used to get the current state
- * as well as very recent "old" ones efficiently (without recalculation).
- * The recent (but not current) states are necessary to perform efficient
- * reorganisations after orphan blocks.
- */
-class GameStateCache
+      int op, nOut;
+      std::vector<vchType> vvch;
+      if (!DecodeNameTx (tx, op, nOut, vvch) || op == OP_NAME_NEW)
+        continue;
+      names.insert (stringFromVch (vvch[0]));
+    }
+}
+
+bool
+AdvanceGameState (DatabaseSet& dbset, CBlockIndex* pindex,
+                  CBlock* block, int64& nFees)
 {
+    GameStatePtr pCurrentState;
+    if (!GetGameState (dbset, pindex->pprev, pCurrentState))
+        return error("AdvanceGameState: cannot get current game state");
+    const GameState& currentState = *pCurrentState;
 
-private:
+    boost::shared_ptr<GameState> pOutState(new GameState ());
+    GameState& outState = *pOutState;
 
-  /** Type used for the map blockhash -> state.  */
-  typedef std::map<uint256, GameState*> gameStateMap;
+    if (currentState.nHeight != pindex->nHeight - 1)
+        return error("AdvanceGameState: incorrect height encountered");
+    if (currentState.hashBlock != block->hashPrevBlock)
+        return error("AdvanceGameState: incorrect hash encountered");
 
-  /** Map holding the data.  */
-  gameStateMap map;
+    /* Make sure the commitment of the previous state is known, so that
+       the new one can be derived incrementally.  This is a full build only
+       the first time, after an unclean shutdown or after a reorg deeper
+       than the undo records.  */
+    const uint256 hashParentRoot = GetStateCommitment (currentState).GetRoot ();
 
-  /** Maximum size, after which elements are pruned.  */
-  unsigned maxSize;
+    int64 nTax = 0;
+    StepResult stepResult;
 
-public:
+    if (!PerformStep (dbset.name (), currentState, block, nTax,
+                      outState, &block->vgametx, &stepResult))
+      return false;
 
-  /**
-   * Construct it empty.
-   * @param sz Maximum size after which we remove old entries.
-   */
-  inline GameStateCache (unsigned sz)
-    : map(), maxSize(sz)
-  {}
+    if (outState.nHeight != pindex->nHeight)
+        return error("AdvanceGameState: incorrect height stored");
+    if (outState.hashBlock != *pindex->phashBlock)
+        return error("AdvanceGameState: incorrect hash stored");
 
-  /**
-   * Destruct and free all memory.
-   */
-  ~GameStateCache ();
+    /* Update the data derived from the game state incrementally.  */
+    const StateChangeSet& changes = stepResult.changes;
+    AdvanceStateCommitment (currentState, outState, changes);
+    AdvanceGameStateJson (currentState, outState, changes);
+    std::set<PlayerID> updatedNames;
+    GetUpdatedNames (*block, updatedNames);
+    AdvancePlayerIndex (currentState, outState, changes, updatedNames);
+    KillList kills;
+    GetStepKills (stepResult, kills);
+    AdvanceLeaderboards (currentState, outState, changes, kills);
+    AdvanceDistanceFields (currentState, outState, changes);
 
-  /**
-   * Retrieve a game state if it is stored.
-   * @param hash Block hash for which we want the state.
-   * @return Pointer to stored state or NULL.
-   */
-  inline const GameState*
-  query (const uint256& hash) const
-  {
-    const gameStateMap::const_iterator i = map.find (hash);
-    if (i == map.end ())
-      return NULL;
+    /* Create the db if necessary.  This is the case when we attach
+       the genesis block initially in LoadBlockIndex.  */
+    CGameDB gameDb("cr+", dbset.tx ());
 
-    return i->second;
-  }
+    /* Store only the delta to the previous state, and the full state
+       as keyframe if the retention policy wants one at the tip.
+       Intermediate states are obtained by applying the deltas.  */
+    StateDelta delta;
+    delta.Create (currentState, outState, changes,
+                  GetStateCommitment (outState).GetRoot ());
+    if (!gameDb.WriteDelta (pindex->nHeight, delta))
+        return error("AdvanceGameState: failed to write delta");
+
+    /* Keep the kills for the leaderboard.  If the DB has none yet, they
+       are recorded from this block on.  */
+    int nKillsSince;
+    if (!gameDb.ReadKillsSince (nKillsSince))
+        gameDb.WriteKillsSince (pindex->nHeight);
+    if (!kills.empty () && !gameDb.WriteKills (pindex->nHeight, kills))
+        return error("AdvanceGameState: failed to write kills");
+
+    /* Keep the undo record for reorgs, and drop the one that is now too
+       deep to be needed.  */
+    StateUndo undo;
+    undo.Create (currentState, outState, changes, hashParentRoot);
+    if (!gameDb.WriteUndo (pindex->nHeight, undo))
+        return error("AdvanceGameState: failed to write undo record");
+    if (pindex->nHeight >= UNDO_DEPTH)
+        gameDb.EraseUndo (pindex->nHeight - UNDO_DEPTH);
+    if (IsKeyframe (pindex->nHeight, pindex->nHeight))
+      {
+        gameDb.Write(pindex->nHeight, outState);
+        nKeyframeSize = ::GetSerializeSize (outState, SER_DISK, VERSION);
+      }
+    PruneKeyframes (gameDb, pindex->nHeight);
 
-  /**
-   * Retrieve a game state if it is stored.
-   * @param hash Block hash for which we want the state.
-   * @param out Write the game state here.
-   * @return True iff the state was found.
-   */
-  inline bool
-  query (const uint256& hash, GameState& out) const
-  {
-    const GameState* ptr = query (hash);
-    if (!ptr)
-      return false;
+    /* Keep the new state in memory, so that the next block need not
+       reconstruct it from the deltas.  */
+    stateCache.store (pOutState);
+
+    nFees += nTax;
 
-    out = *ptr;
     return true;
-  }
+}
+
+// Called from DisconnectBlock
+void RollbackGameState(DatabaseSet& dbset, CBlockIndex* pindex,
+                       const CBlock& block)
+{
+    if (!pindex->IsInMainChain())
+    {
+        error("RollbackGameState called for non-main chain");
+        return;
+    }
 
-  /**
-   * Insert the given game state into the cache.
-   * @param state Game state to store.
-   */
-  void store (const GameState& state);
+    CGameDB gameDb("r+", dbset.tx ());
+
+    /* Restore the parent state from the disconnected one with the undo
+       record, so that the next block need not replay up to the fork
+       point from a keyframe.  Without a record, the parent is just
+       reconstructed when it is needed.  */
+    StateUndo undo;
+    GameStatePtr pstate;
+    if (pindex->pprev && gameDb.ReadUndo (pindex->nHeight, undo)
+        && undo.GetBlockHash () == *pindex->phashBlock
+        && GetGameState (dbset, pindex, pstate))
+    {
+        /* Derive the parent's commitment as well.  It is checked against
+           the root stored with the record, and need not be rebuilt when
+           the next block is connected.  */
+        StateChangeSet changes;
+        undo.GetChanges (*pstate, changes);
+        StateCommitment commitment = GetStateCommitment (*pstate);
+        boost::shared_ptr<GameState> parent(new GameState (*pstate));
+        bool fOk = undo.Apply (*parent)
+                    && parent->hashBlock == *pindex->pprev->phashBlock;
+        if (fOk)
+          {
+            commitment.Update (*parent, changes);
+            fOk = (commitment.GetRoot () == undo.GetStateRoot ());
+          }
 
-};
+        if (fOk)
+          {
+            CacheStateCommitment (commitment);
+            std::set<PlayerID> updatedNames;
+            GetUpdatedNames (block, updatedNames);
+            AdvancePlayerIndex (*pstate, *parent, changes, updatedNames);
+            KillList kills;
+            gameDb.ReadKills (pindex->nHeight, kills);
+            RollbackLeaderboards (*pstate, *parent, changes, kills);
+            stateCache.store (parent);
+          }
+        else
+            error ("RollbackGameState: undo record does not match @%d",
+                   pindex->nHeight);
+    }
 
-GameStateCache::~GameStateCache ()
-{
-  for (gameStateMap::iterator i = map.begin (); i != map.end (); ++i)
-    delete i->second;
+    gameDb.Erase(pindex->nHeight);
+    gameDb.EraseDelta(pindex->nHeight);
+    gameDb.EraseUndo(pindex->nHeight);
+    gameDb.EraseKills(pindex->nHeight);
 }
 
-void
-GameStateCache::store (const GameState& state)
+bool
+ReadKillCounts (int nHeight, int& nSince,
+                std::map<std::string, int64_t>& counts)
 {
-  gameStateMap::iterator i;
-
-  /* See if the state is there first, and overwrite it if yes.  */
-  i = map.find (state.hashBlock);
-  if (i != map.end ())
+    CGameDB gameDb("r");
+    if (!gameDb.ReadKillsSince (nSince))
     {
-      *i->second = state;
-      return;
+        /* Nothing recorded yet, kills are counted from the next block.  */
+        nSince = nHeight + 1;
+        counts.clear ();
+        return true;
     }
 
-  /* Insert the new entry.  */
-  printf ("GameStateCache: storing for block @%d %s\n",
-          state.nHeight, state.hashBlock.GetHex ().c_str ());
-  map.insert (std::make_pair (state.hashBlock, new GameState (state)));
+    return gameDb.SumKills (nSince, nHeight, counts);
+}
+
+extern CWallet* pwalletMain;
+
+// Erase unconfirmed transactions, that should not be re-broadcasted, because they're not
+// valid for the current game state (e.g. attack on some player who's already killed)
+void EraseBadMoveTransactions()
+{
+    /* If we do not have a wallet yet, nothing to do.  This can happen
+       with a completely fresh initialisation.  */
+    if (!pwalletMain)
+        return;
+
+    /* The current state is not available yet.  */
+    if (IsGameDBRebuilding ())
+        return;
 
-  /* Drop entries until we reach the maximal size goal.  */
-  while (map.size () > maxSize)
+    CRITICAL_BLOCK(cs_main)
+    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
     {
-      bool deleted = false;
+        std::map<uint256, CWalletTx> mapRemove;
+        std::vector<unsigned char> vchName;
 
-      /* See if there are entries for blocks not on the main chain.  Remove
-         those first.  */
-      for (i = map.begin (); i != map.end () && !deleted; ++i)
-        {
-          std::map<uint256, CBlockIndex*>::const_iterator j;
-          j = mapBlockIndex.find (i->second->hashBlock);
+        const GameStatePtr state = GetCurrentGameState ();
+        GameStepValidator gameStepValidator(state.get ());
 
-          if (j == mapBlockIndex.end () || !j->second->IsInMainChain ())
+        {
+            DatabaseSet dbset("r");
+            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, pwalletMain->mapWallet)
             {
-              if (j == mapBlockIndex.end ())
-                printf ("Warning: Block in GameStateCache not found in"
-                        " mapBlockIndex.  Removing.\n");
-
-              printf ("GameStateCache: removing block %s not in main chain\n", 
-                      i->second->hashBlock.GetHex ().c_str ());
+                CWalletTx& wtx = item.second;
 
-              delete i->second;
-              map.erase (i);
-              deleted = true;
+                if (wtx.GetDepthInMainChain () < 1
+                    && (IsConflictedTx (dbset, wtx, vchName)
+                        || !gameStepValidator.IsValid (wtx)))
+                  mapRemove[wtx.GetHash()] = wtx;
             }
         }
-      
-      /* If we already deleted something, check size again.  */
-      if (deleted)
-        continue;
 
-      /* Remove entry with lowest block height.  */
+        if (mapRemove.empty())
+            return;
+
+        int countRemove = mapRemove.size();
+        printf("EraseBadMoveTransactions : erasing %d transactions\n", countRemove);
 
-      gameStateMap::iterator bestPosition = map.end ();
-      for (i = map.begin (); i != map.end (); ++i)
+        bool fRepeat = true;
+        while (fRepeat)
         {
-          if (bestPosition == map.end ()
-              || i->second->nHeight < bestPosition->second->nHeight)
-            bestPosition = i;
+            fRepeat = false;
+            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, pwalletMain->mapWallet)
+            {
+                CWalletTx& wtx = item.second;
+                BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+                {
+                    uint256 hash = wtx.GetHash();
+
+                    // If this tx depends on a tx to be removed, remove it too
+                    if (mapRemove.count(txin.prevout.hash) && !mapRemove.count(hash))
+                    {
+                        mapRemove[hash] = wtx;
+                        fRepeat = true;
+                    }
+                }
+            }
         }
-      assert (bestPosition != map.end ());
-      printf ("GameStateCache: removing block with lowest height %d\n",
-              bestPosition->second->nHeight);
+        if (mapRemove.size() > countRemove)
+            printf("EraseBadMoveTransactions : erasing additional %d dependent transactions\n", mapRemove.size() - countRemove);
+
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapRemove)
+        {
+            CWalletTx& wtx = item.second;
 
-      delete bestPosition->second;
-      map.erase (bestPosition);
+            UnspendInputs(wtx);
+            wtx.RemoveFromMemoryPool();
+            pwalletMain->EraseFromWallet(wtx.GetHash());
+            if (GetNameOfTx(wtx, vchName) && mapNamePending.count(vchName))
+            {
+                std::string name = stringFromVch(vchName);
+                printf("EraseBadMoveTransactions : erase %s from pending of name %s",
+                        wtx.GetHash().GetHex().c_str(), name.c_str());
+                if (!mapNamePending[vchName].erase(wtx.GetHash()))
+                    error("EraseBadMoveTransactions : erase but it was not pending");
+            }
+            wtx.print();
+        }
     }
 }
 
-/** Our game state cache instance.  */
-static GameStateCache stateCache(IN_MEMORY_STATE_CACHE);
+void
+PruneGameDB (unsigned nHeight)
+{
+  CGameDB gameDb("r+");
 
-/* ************************************************************************** */
+  /* Find what is stored with one pass over the keys, instead of looking
+     up each height individually.  */
+  std::vector<unsigned> states, deltas;
+  if (!gameDb.ListHeights (pgameStore ? NULL : &states, &deltas))
+    {
+      error ("PruneGameDB: failed to list the game DB");
+      return;
+    }
+  if (pgameStore)
+    pgameStore->GetHeights (states);
 
-// Caller must hold cs_main lock
-const GameState& GetCurrentGameState()
-{
-    const GameState* state;
+  bool fFound = false;
+  unsigned last = 0;
+  BOOST_FOREACH(unsigned i, states)
+    if (i < nHeight && (!fFound || i > last))
+      {
+        fFound = true;
+        last = i;
+      }
 
-    /* If the state is in the cache, return it immediately.  */
-    state = stateCache.query (*pindexBest->phashBlock);
-    if (state)
-      return *state;
+  unsigned cnt = 0;
+  BOOST_FOREACH(unsigned i, states)
+    if (fFound && i < last)
+      {
+        gameDb.Erase (i);
+        ++cnt;
+      }
+  printf ("Pruning %d game states before %d from the GameDB...\n", cnt, last);
 
-    /* Else, calulate the state.  */
-    GameState cur;
-    DatabaseSet dbset("r");
-    GetGameState (dbset, pindexBest, cur);
+  /* Deltas up to the kept state are no longer needed.  */
+  BOOST_FOREACH(unsigned i, deltas)
+    if (fFound && i <= last)
+      gameDb.EraseDelta (i);
 
-    /* If it is still not in the cache, store it explicitly.  */
-    state = stateCache.query (*pindexBest->phashBlock);
-    if (state)
-      return *state;
-    stateCache.store (cur);
+  gameDb.Close ();
+  RequestGameDBCompaction ();
+}
 
-    /* Finally, it should indeed be there.  */
-    state = stateCache.query (*pindexBest->phashBlock);
-    assert (state);
+/* ************************************************************************** */
+/* Background rebuild of the game DB.  */
+
+/* Number of blocks to replay between two checkpoints of the rebuild.  */
+static const int REBUILD_CHECKPOINT_INTERVAL = 200;
 
-    return *state;
+static CCriticalSection cs_rebuild;
+static bool fRebuilding = false;
+/* Height of the last checkpoint (-1 before the genesis state).  */
+static int nRebuildHeight = -1;
+
+bool
+IsGameDBRebuilding ()
+{
+  bool res;
+  CRITICAL_BLOCK(cs_rebuild)
+    res = fRebuilding;
+  return res;
 }
 
-// pindex must belong to the main branch, i.e. corresponding blocks must be connected
-// Returns a copy of the game state
 bool
-GetGameState (DatabaseSet& dbset, CBlockIndex *pindex, GameState &outState)
+GetGameDBRebuildProgress (int& nHeight, int& nTarget)
 {
-    if (!pindex)
+  bool res;
+  CRITICAL_BLOCK(cs_rebuild)
     {
-        outState = GameState();
-        return true;
+      res = fRebuilding;
+      nHeight = nRebuildHeight;
     }
+  nTarget = nBestHeight;
+  return res;
+}
 
-    /* See if we have the block in the state cache.  */
-    if (stateCache.query (*pindex->phashBlock, outState))
-      return true;
+/**
+ * Replay the game states up to the next checkpoint after nCheckpoint.
+ * The state there is written as full state and the previous checkpoint
+ * is removed again unless it is a keyframe.  This is done under cs_main,
+ * which is released between checkpoints.
+ * @param nCheckpoint Height of the last checkpoint.
+ * @param nNext Set to the height of the new checkpoint.
+ * @return False on error.
+ */
+static bool
+RebuildGameDBStep (int nCheckpoint, int& nNext)
+{
+  nNext = nCheckpoint + REBUILD_CHECKPOINT_INTERVAL;
+  if (nCheckpoint < 0)
+    nNext = 0;
+  nNext = std::min (nNext, nBestHeight);
 
-    // Get the latest saved state
-    CGameDB gameDb("r", dbset.tx ());
+  CBlockIndex* pindex = FindBlockByHeight (nNext);
+  if (!pindex)
+    return error ("RebuildGameDBStep: no block at height %d", nNext);
 
-    if (gameDb.Read(pindex->nHeight, outState))
-    {
-        if (outState.nHeight != pindex->nHeight)
-            return error("GetGameState: wrong height");
-        if (outState.hashBlock != *pindex->phashBlock)
-            return error("GetGameState: wrong hash");
-        return true;
-    }
+  DatabaseSet dbset("r");
+  GameStatePtr state;
+  if (!GetGameState (dbset, pindex, state))
+    return error ("RebuildGameDBStep: GetGameState failed at height %d",
+                  nNext);
 
-    if (!pindex->IsInMainChain())
-        return error("GetGameState called for non-main chain");
+  CGameDB gameDb("r+");
+  if (!gameDb.Write (nNext, *state))
+    return error ("RebuildGameDBStep: failed to write checkpoint");
+  if (nCheckpoint >= 0 && nCheckpoint < nNext
+      && !IsKeyframe (nCheckpoint, nBestHeight))
+    gameDb.Erase (nCheckpoint);
+
+  if (nNext >= nBestHeight)
+    return gameDb.EraseRebuildHeight ();
+  return gameDb.WriteRebuildHeight (nNext);
+}
 
-    printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-    printf("GetGameState: need to integrate state for height %d (current %d)\n",
-           pindex->nHeight, nBestHeight);
+static void
+ThreadRebuildGameDB (void* parg)
+{
+  printf ("ThreadRebuildGameDB started\n");
 
-    CBlockIndex *plast = pindex;
-    GameState lastState;
-    for (; plast->pprev; plast = plast->pprev)
+  int nCheckpoint;
+  CRITICAL_BLOCK(cs_rebuild)
+    nCheckpoint = nRebuildHeight;
+
+  bool fDone = false;
+  while (!fShutdown && !fDone)
     {
-        if (stateCache.query (*plast->pprev->phashBlock, lastState))
-            break;
-        if (gameDb.Read(plast->pprev->nHeight, lastState))
-            break;
-    }
+      int nNext;
+      bool fOk;
+      CRITICAL_BLOCK(cs_main)
+        {
+          fOk = RebuildGameDBStep (nCheckpoint, nNext);
+          fDone = (fOk && nNext >= nBestHeight);
+        }
 
-    printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-    printf("GetGameState: last saved block has height %d\n", lastState.nHeight);
+      /* On errors, the rebuild stays pending and is retried from the
+         last checkpoint on the next start.  */
+      if (!fOk)
+        {
+          printf ("ThreadRebuildGameDB: giving up for now\n");
+          break;
+        }
 
-    // Integrate steps starting from the last saved state
-    // FIXME: Might want to store intermediate steps in stateCache, too.
-    loop
-    {
-        CBlock block;
-        block.ReadFromDisk(plast);
+      nCheckpoint = nNext;
+      CRITICAL_BLOCK(cs_rebuild)
+        {
+          nRebuildHeight = nCheckpoint;
+          if (fDone)
+            fRebuilding = false;
+        }
+      if (nCheckpoint % 5000 < REBUILD_CHECKPOINT_INTERVAL)
+        printf ("Rebuilding game DB: %d of %d\n", nCheckpoint, nBestHeight);
 
-        int64 nTax;
-        if (!PerformStep (dbset.name (), lastState, &block, nTax, outState))
-            return false;
-        if (outState.nHeight != plast->nHeight)
-            return error("GetGameState: wrong height");
-        if (outState.hashBlock != *plast->phashBlock)
-            return error("GetGameState: wrong hash");
-        if (plast == pindex)
-            break;
-        plast = plast->pnext;
-        lastState = outState;
+      /* Give others the chance to take cs_main.  */
+      MilliSleep (10);
+    }
 
-        /* Write the state to DB.  This is done during integration already
-           so that it is ensured that every other state is stored even
-           if the game db is reconstructed from scratch.  (Otherwise,
-           it would only contain the last state in that case.)  */
-        if (outState.nHeight % KEEP_EVERY_NTH_STATE == 0)
+  /* Blocks and their invs were ignored during the rebuild.  Ask the peers
+     for them now instead of waiting until the next block is announced.
+     The duplicate filter is reset, since the last getblocks may have been
+     for the same best block.  */
+  if (fDone)
+    {
+      printf ("Game DB rebuild finished\n");
+      CRITICAL_BLOCK(cs_main)
+      CRITICAL_BLOCK(cs_vNodes)
+        BOOST_FOREACH (CNode* pnode, vNodes)
           {
-            CGameDB gameDb("r+", dbset.tx ());
-            gameDb.Write(outState.nHeight, outState);
-            printf ("Saved game state @%d to database.\n", outState.nHeight);
+            pnode->pindexLastGetBlocksBegin = NULL;
+            pnode->PushGetBlocks (pindexBest, uint256 (0));
           }
     }
+  printf ("ThreadRebuildGameDB exiting\n");
+}
 
-    /* Store into game state cache.  */
-    stateCache.store (outState);
+/* Start the rebuild thread if a rebuild is pending in the game DB.  */
+static bool
+StartGameDBRebuild ()
+{
+  int nHeight;
+  {
+    CGameDB gameDb("r");
+    if (!gameDb.ReadRebuildHeight (nHeight))
+      return true;
+  }
 
-    printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
-    printf("GetGameState: done integrating\n");
+  if (nHeight < 0)
+    printf ("Rebuilding the game DB in the background...\n");
+  else
+    printf ("Resuming the game DB rebuild from height %d...\n", nHeight);
 
-    return true;
+  CRITICAL_BLOCK(cs_rebuild)
+    {
+      fRebuilding = true;
+      nRebuildHeight = nHeight;
+    }
+
+  if (!CreateThread (ThreadRebuildGameDB, NULL))
+    return error ("CreateThread(ThreadRebuildGameDB) failed");
+
+  return true;
 }
 
-// Called from ConnectBlock
-bool
-AdvanceGameState (DatabaseSet& dbset, CBlockIndex* pindex,
-                  CBlock* block, int64& nFees)
+/* ************************************************************************** */
+/* Parallel verification of the stored history.  */
+
+/* Results of verifying one segment.  */
+enum
 {
-    GameState currentState, outState;
+  SEGMENT_OK = 0,
+  SEGMENT_MISMATCH,
+  SEGMENT_SKIPPED,
+  SEGMENT_FAILED
+};
 
-    if (!GetGameState (dbset, pindex->pprev, currentState))
-        return error("AdvanceGameState: cannot get current game state");
+/* Part of the chain between two stored states, which can be replayed
+   independently of all others.  */
+struct ReplaySegment
+{
+  /* Heights of the start and end states.  The start is -1 for the
+     segment that begins before the genesis block.  */
+  int nStart;
+  int nEnd;
+  /* The state expected at the end.  If not set, the stored state at nEnd
+     is read instead.  */
+  GameStatePtr expected;
+
+  int nResult;
+
+  ReplaySegment (int s, int e)
+    : nStart(s), nEnd(e), nResult(SEGMENT_SKIPPED)
+  {}
 
-    if (currentState.nHeight != pindex->nHeight - 1)
-        return error("AdvanceGameState: incorrect height encountered");
-    if (currentState.hashBlock != block->hashPrevBlock)
-        return error("AdvanceGameState: incorrect hash encountered");
+  /* Longer segments are handed out first, so that no thread is left
+     with a long one at the end.  */
+  inline bool
+  operator< (const ReplaySegment& b) const
+  {
+    return nEnd - nStart > b.nEnd - b.nStart;
+  }
+};
 
-    int64 nTax = 0;
+/* Read the stored state at the block's height, if it belongs to the
+   block.  It may not after a reorg during the verification.  */
+static bool
+ReadStoredState (const CBlockIndex* pindex, GameState& state)
+{
+  CGameDB gameDb("r");
+  return gameDb.Read (pindex->nHeight, state)
+          && state.hashBlock == *pindex->phashBlock;
+}
 
-    if (!PerformStep (dbset.name (), currentState, block, nTax,
-                      outState, &block->vgametx))
-      return false;
+/**
+ * Replay the blocks of a segment from its start state and compare the
+ * result to the expected end state.
+ * @param chain The main chain's blocks indexed by height.
+ * @param seg The segment to verify.
+ * @return The result (SEGMENT_*).
+ */
+static int
+VerifyReplaySegment (const std::vector<CBlockIndex*>& chain,
+                     const ReplaySegment& seg)
+{
+  GameState state;
+  if (seg.nStart >= 0 && !ReadStoredState (chain[seg.nStart], state))
+    return SEGMENT_SKIPPED;
 
-    if (outState.nHeight != pindex->nHeight)
-        return error("AdvanceGameState: incorrect height stored");
-    if (outState.hashBlock != *pindex->phashBlock)
-        return error("AdvanceGameState: incorrect hash stored");
+  DatabaseSet dbset("r");
+  GameState next;
+  for (int h = seg.nStart + 1; h <= seg.nEnd; ++h)
+    {
+      if (fShutdown)
+        return SEGMENT_SKIPPED;
 
-    /* Create the db if necessary.  This is the case when we attach
-       the genesis block initially in LoadBlockIndex.  */
-    CGameDB gameDb("cr+", dbset.tx ());
+      CBlock block;
+      if (!block.ReadFromDisk (chain[h]))
+        {
+          error ("VerifyReplaySegment: failed to read block %d", h);
+          return SEGMENT_FAILED;
+        }
+
+      int64 nTax;
+      if (!PerformStep (dbset.name (), state, &block, nTax, next))
+        {
+          error ("VerifyReplaySegment: step failed at height %d", h);
+          return SEGMENT_FAILED;
+        }
+      state = next;
+    }
 
-    gameDb.Write(pindex->nHeight, outState);
-    // Prune old states from DB, keeping every Nth for quick lookup (intermediate states can be obtained by integrating blocks)
-    if (pindex->nHeight - 1 <= 0 || (pindex->nHeight - 1) % KEEP_EVERY_NTH_STATE != 0)
-        gameDb.Erase(pindex->nHeight - 1);
+  GameStatePtr expected = seg.expected;
+  if (!expected)
+    {
+      boost::shared_ptr<GameState> stored(new GameState ());
+      if (!ReadStoredState (chain[seg.nEnd], *stored))
+        return SEGMENT_SKIPPED;
+      expected = stored;
+    }
 
-    nFees += nTax;
+  CDataStream ssReplayed(SER_DISK, VERSION);
+  ssReplayed << state;
+  CDataStream ssExpected(SER_DISK, VERSION);
+  ssExpected << *expected;
+  if (ssReplayed.size () != ssExpected.size ()
+      || !std::equal (ssReplayed.begin (), ssReplayed.end (),
+                      ssExpected.begin ()))
+    {
+      printf ("VerifyReplaySegment: state @%d does not match the replay"
+              " from @%d\n", seg.nEnd, seg.nStart);
+      return SEGMENT_MISMATCH;
+    }
 
-    return true;
+  return SEGMENT_OK;
 }
 
-// Called from DisconnectBlock
-void RollbackGameState(CTxDB& txdb, CBlockIndex* pindex)
+/* Segments shared between the verification threads.  */
+struct ReplayWork
 {
-    if (!pindex->IsInMainChain())
+  const std::vector<CBlockIndex*>* chain;
+  std::vector<ReplaySegment>* segments;
+
+  boost::mutex mut;
+  size_t nNext;
+};
+
+static void
+ReplayWorker (ReplayWork* work)
+{
+  loop
     {
-        error("RollbackGameState called for non-main chain");
-        return;
-    }
+      size_t i;
+      {
+        boost::lock_guard<boost::mutex> lock(work->mut);
+        if (work->nNext >= work->segments->size ())
+          return;
+        i = work->nNext++;
+      }
 
-    CGameDB("r+", txdb).Erase(pindex->nHeight);
+      ReplaySegment& seg = (*work->segments)[i];
+      seg.nResult = VerifyReplaySegment (*work->chain, seg);
+    }
 }
 
-extern CWallet* pwalletMain;
-
-// Erase unconfirmed transactions, that should not be re-broadcasted, because they're not
-// valid for the current game state (e.g. attack on some player who's already killed)
-void EraseBadMoveTransactions()
+bool
+VerifyGameHistory (int nFromHeight, unsigned nThreads, GameHistoryCheck& res)
 {
-    /* If we do not have a wallet yet, nothing to do.  This can happen
-       with a completely fresh initialisation.  */
-    if (!pwalletMain)
-        return;
+  res = GameHistoryCheck ();
+
+  /* Take a snapshot of the main chain and the stored states.  The
+     replays themselves run without cs_main.  */
+  std::vector<CBlockIndex*> chain;
+  std::vector<unsigned> heights;
+  GameStatePtr tip;
+  CRITICAL_BLOCK(cs_main)
+    {
+      if (!pindexBest)
+        return true;
 
-    CRITICAL_BLOCK(cs_main)
-    CRITICAL_BLOCK(pwalletMain->cs_mapWallet)
+      chain.resize (nBestHeight + 1);
+      for (CBlockIndex* p = pindexBest; p; p = p->pprev)
+        chain[p->nHeight] = p;
+
+      CGameDB gameDb("r");
+      if (!gameDb.GetHeights (heights))
+        return error ("VerifyGameHistory: failed to list stored states");
+
+      DatabaseSet dbset("r");
+      if (!GetGameState (dbset, pindexBest, tip))
+        return error ("VerifyGameHistory: failed to get the current state");
+    }
+  std::sort (heights.begin (), heights.end ());
+
+  /* Each stored state starts a segment that ends at the next one.  The
+     segment from the last one to the tip is verified against the current
+     state after all others.  */
+  std::vector<ReplaySegment> segments;
+  int nPrev = -1;
+  BOOST_FOREACH (unsigned h, heights)
     {
-        std::map<uint256, CWalletTx> mapRemove;
-        std::vector<unsigned char> vchName;
+      const int nHeight = h;
+      if (nHeight >= static_cast<int> (chain.size ()))
+        break;
+      if (nHeight > nFromHeight)
+        segments.push_back (ReplaySegment (nPrev, nHeight));
+      nPrev = nHeight;
+    }
+  std::sort (segments.begin (), segments.end ());
 
-        GameStepValidator gameStepValidator(&GetCurrentGameState ());
+  ReplaySegment tipSegment(nPrev, chain.size () - 1);
+  tipSegment.expected = tip;
 
-        {
-            DatabaseSet dbset("r");
-            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, pwalletMain->mapWallet)
-            {
-                CWalletTx& wtx = item.second;
+  /* The game step fills process-wide caches when permanent luggage is
+     enabled, so steps must not run concurrently in that case.  */
+#ifdef PERMANENT_LUGGAGE
+  nThreads = 1;
+#endif
+  /* More threads than cores only add contention, and each of them holds
+     a game state of its own.  */
+  const unsigned nCores = std::max (1u, boost::thread::hardware_concurrency ());
+  if (nThreads == 0 || nThreads > nCores)
+    nThreads = nCores;
+  nThreads = std::min<unsigned> (nThreads, std::max<size_t> (segments.size (), 1));
+  res.nThreads = nThreads;
+
+  printf ("VerifyGameHistory: replaying %u segments with %u threads\n",
+          static_cast<unsigned> (segments.size () + 1), nThreads);
+
+  ReplayWork work;
+  work.chain = &chain;
+  work.segments = &segments;
+  work.nNext = 0;
+  boost::thread_group threads;
+  for (unsigned i = 0; i < nThreads; ++i)
+    threads.create_thread (boost::bind (&ReplayWorker, &work));
+  threads.join_all ();
+
+  if (tipSegment.nStart < tipSegment.nEnd)
+    {
+      tipSegment.nResult = VerifyReplaySegment (chain, tipSegment);
+      segments.push_back (tipSegment);
+    }
 
-                if (wtx.GetDepthInMainChain () < 1
-                    && (IsConflictedTx (dbset, wtx, vchName)
-                        || !gameStepValidator.IsValid (wtx)))
-                  mapRemove[wtx.GetHash()] = wtx;
-            }
+  BOOST_FOREACH (const ReplaySegment& seg, segments)
+    {
+      ++res.nSegments;
+      switch (seg.nResult)
+        {
+        case SEGMENT_OK:
+          ++res.nVerified;
+          break;
+        case SEGMENT_SKIPPED:
+          ++res.nSkipped;
+          break;
+        default:
+          res.mismatches.push_back (seg.nEnd);
+          break;
         }
+    }
+  std::sort (res.mismatches.begin (), res.mismatches.end ());
 
-        if (mapRemove.empty())
-            return;
+  printf ("VerifyGameHistory: %u segments verified, %u skipped, %u bad\n",
+          res.nVerified, res.nSkipped,
+          static_cast<unsigned> (res.mismatches.size ()));
 
-        int countRemove = mapRemove.size();
-        printf("EraseBadMoveTransactions : erasing %d transactions\n", countRemove);
+  return res.mismatches.empty ();
+}
 
-        bool fRepeat = true;
-        while (fRepeat)
-        {
-            fRepeat = false;
-            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, pwalletMain->mapWallet)
-            {
-                CWalletTx& wtx = item.second;
-                BOOST_FOREACH(const CTxIn& txin, wtx.vin)
-                {
-                    uint256 hash = wtx.GetHash();
+bool
+ReadGameSnapshot (const std::string& strFile, SnapshotFileHeader& hdr,
+                  GameState& state)
+{
+  if (!ReadSnapshotFile (strFile, hdr, state))
+    return false;
 
-                    // If this tx depends on a tx to be removed, remove it too
-                    if (mapRemove.count(txin.prevout.hash) && !mapRemove.count(hash))
-                    {
-                        mapRemove[hash] = wtx;
-                        fRepeat = true;
-                    }
-                }
-            }
-        }
-        if (mapRemove.size() > countRemove)
-            printf("EraseBadMoveTransactions : erasing additional %d dependent transactions\n", mapRemove.size() - countRemove);
+  CRITICAL_BLOCK(cs_main)
+    {
+      const std::map<uint256, CBlockIndex*>::const_iterator mi
+        = mapBlockIndex.find (hdr.hashBlock);
+      if (mi == mapBlockIndex.end () || !mi->second->IsInMainChain ()
+          || mi->second->nHeight != hdr.nHeight)
+        return error ("ReadGameSnapshot: block %s of the snapshot is not"
+                      " on the main chain",
+                      hdr.hashBlock.GetHex ().c_str ());
+    }
 
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapRemove)
+  return true;
+}
+
+/**
+ * Import the game state from a snapshot file (-loadgamesnapshot) as full
+ * state into the game DB.  States after it are then reconstructed from
+ * there instead of from the genesis block.  The state's block must be on
+ * the main chain, and its commitment root must be the expected one (as
+ * obtained from a trusted node).  A pending rebuild continues from the
+ * imported state.  This runs during startup, before blocks are connected,
+ * so the chain does not change between the check and the import.
+ */
+static bool
+LoadGameSnapshot (const std::string& strFile, const uint256& hashRoot)
+{
+  printf ("Importing game state from %s...\n", strFile.c_str ());
+
+  SnapshotFileHeader hdr;
+  GameState state;
+  if (!ReadGameSnapshot (strFile, hdr, state))
+    return false;
+  if (hdr.hashStateRoot != hashRoot)
+    return error ("LoadGameSnapshot: the snapshot has root %s instead of"
+                  " the expected %s",
+                  hdr.hashStateRoot.GetHex ().c_str (),
+                  hashRoot.GetHex ().c_str ());
+
+  CRITICAL_BLOCK(cs_main)
+    {
+      CGameDB gameDb("r+");
+      if (!gameDb.Write (hdr.nHeight, state))
+        return error ("LoadGameSnapshot: failed to write the state");
+
+      /* The rebuild skips the blocks up to the snapshot, so their kills
+         are not recorded.  */
+      int nRebuild;
+      if (gameDb.ReadRebuildHeight (nRebuild) && nRebuild < hdr.nHeight)
         {
-            CWalletTx& wtx = item.second;
+          if (hdr.nHeight >= nBestHeight)
+            gameDb.EraseRebuildHeight ();
+          else
+            gameDb.WriteRebuildHeight (hdr.nHeight);
 
-            UnspendInputs(wtx);
-            wtx.RemoveFromMemoryPool();
-            pwalletMain->EraseFromWallet(wtx.GetHash());
-            if (GetNameOfTx(wtx, vchName) && mapNamePending.count(vchName))
-            {
-                std::string name = stringFromVch(vchName);
-                printf("EraseBadMoveTransactions : erase %s from pending of name %s",
-                        wtx.GetHash().GetHex().c_str(), name.c_str());
-                if (!mapNamePending[vchName].erase(wtx.GetHash()))
-                    error("EraseBadMoveTransactions : erase but it was not pending");
-            }
-            wtx.print();
+          int nKillsSince;
+          if (!gameDb.ReadKillsSince (nKillsSince)
+              || nKillsSince <= hdr.nHeight)
+            gameDb.WriteKillsSince (hdr.nHeight + 1);
         }
     }
+
+  printf ("Imported game state @%d (root %s)\n", hdr.nHeight,
+          hdr.hashStateRoot.GetHex ().c_str ());
+  return true;
 }
 
-void
-PruneGameDB (unsigned nHeight)
+/* Import the snapshot given with -loadgamesnapshot, if any.  The
+   expected state root must be given with -loadgamesnapshotroot, since
+   anyone can write a file for a block on the main chain.  A bad file or
+   root is reported but does not prevent startup.  */
+static void
+ImportGameSnapshot ()
 {
-  CGameDB gameDb("r+");
+  if (!mapArgs.count ("-loadgamesnapshot"))
+    return;
 
-  std::set<unsigned> toRemove;
-  unsigned cnt = 0;
-  unsigned last = 0;
-  for (unsigned i = 0; i < nHeight; ++i)
-    if (gameDb.Exists (i))
-      {
-        ++cnt;
-        toRemove.insert (i);
-        last = i;
-      }
-  if (cnt > 0)
+  const std::string strFile = mapArgs["-loadgamesnapshot"];
+  const std::string strRoot = GetArg ("-loadgamesnapshotroot", "");
+  if (strRoot.size () != 64 || !IsHex (strRoot))
     {
-      toRemove.erase (last);
-      --cnt;
+      error ("Not importing the game snapshot %s: -loadgamesnapshotroot"
+             " must give the expected state root", strFile.c_str ());
+      return;
     }
 
-  printf ("Pruning %d game states before %d from the GameDB...\n", cnt, last);
-
-  BOOST_FOREACH(unsigned i, toRemove)
-    gameDb.Erase (i);
-
-  gameDb.Rewrite ();
+  uint256 hashRoot;
+  hashRoot.SetHex (strRoot);
+  if (!LoadGameSnapshot (strFile, hashRoot))
+    error ("Failed to import the game snapshot %s", strFile.c_str ());
 }
 
 bool UpgradeGameDB()
@@ -1031,14 +2893,24 @@ bool UpgradeGameDB()
 #endif
 #endif
         boost::filesystem::remove (fileGame);
+        if (pgameStore)
+          {
+            std::vector<unsigned> heights;
+            pgameStore->GetHeights (heights);
+            BOOST_FOREACH (unsigned h, heights)
+              pgameStore->Erase (h);
+          }
 
         CGameDB gameDb("cr+");
-        if (!gameDb.WriteVersion (VERSION))
+        if (!gameDb.WriteVersion (VERSION)
+            || !gameDb.WriteRebuildHeight (-1)
+            || !gameDb.WriteKillsSince (0)
+            || !gameDb.WriteDeltaFormat (DELTA_FORMAT))
           return error ("WriteVersion failed for new game DB.");
         gameDb.Close ();
 
-        GetCurrentGameState ();
-        return true;
+        ImportGameSnapshot ();
+        return StartGameDBRebuild ();
       }
 
     /* Upgrade the game state format in-place if this is possible.  */
@@ -1066,5 +2938,414 @@ bool UpgradeGameDB()
         printf("GameDB updated\n");
     }
 
+    if (!UpgradeDeltas () || !SweepKeyframes ())
+        return false;
+
+    ImportGameSnapshot ();
+
+    /* Resume a rebuild that was interrupted by a shutdown.  */
+    return StartGameDBRebuild ();
+}
+
+static void
+ThreadGameStoreCompaction (void* parg)
+{
+  printf ("ThreadGameStoreCompaction started\n");
+
+  while (!fShutdown)
+    {
+      /* Work in small steps while there is something to do, and check
+         only every few seconds otherwise.  */
+      if (pgameStore->CompactStep ())
+        {
+          MilliSleep (100);
+          continue;
+        }
+
+      for (unsigned i = 0; i < 20 && !fShutdown; ++i)
+        MilliSleep (500);
+    }
+
+  printf ("ThreadGameStoreCompaction exiting\n");
+}
+
+bool
+InitGameStore ()
+{
+  const int64 nCacheMB = GetArg ("-gamestatecache", IN_MEMORY_STATE_CACHE);
+  stateCache.setMaxSize (std::max<int64> (1, nCacheMB) << 20);
+
+  if (!CreateThread (ThreadGameDBCompaction, NULL))
+    printf ("Error: CreateThread(ThreadGameDBCompaction) failed\n");
+
+  const std::string strEngine = GetArg ("-gamestore", "bdb");
+  if (strEngine == "bdb")
     return true;
+  if (strEngine != "segment")
+    return error ("Invalid -gamestore engine '%s'", strEngine.c_str ());
+
+  printf ("Opening game state store...\n");
+  CGameStore* store = new CGameStore (GetGameStorePath ());
+  if (!store->Open ())
+    {
+      delete store;
+      return error ("Failed to open the game state store");
+    }
+  pgameStore = store;
+
+  if (!CreateThread (ThreadGameStoreCompaction, NULL))
+    printf ("Error: CreateThread(ThreadGameStoreCompaction) failed\n");
+
+  return true;
+}
+
+/* ************************************************************************** */
+/* Snapshot of the state cache across restarts.  */
+
+/* The tip state and up to this many other recently used states are saved
+   at shutdown, so that they need not be reconstructed after a restart.  */
+static const unsigned CACHE_SNAPSHOT_STATES = 8;
+static const unsigned CACHE_SNAPSHOT_MAGIC = 0x48474333;
+
+static boost::filesystem::path
+GetCacheSnapshotPath ()
+{
+  return boost::filesystem::path (GetDataDir ()) / "gamecache.dat";
+}
+
+/**
+ * Write the tip state and the most recently used cached states to the
+ * snapshot file.  The states are encoded as compressed snapshots, each
+ * followed by a checksum and the hash of the state's normal
+ * serialisation.  The latter is checked against the decoded state, so
+ * that an encoding bug cannot put a wrong state into the cache.  The file
+ * is written under a temporary name first, so that an interrupted write
+ * leaves no partial snapshot.
+ */
+static void
+SaveGameStateCache ()
+{
+  std::vector<GameStatePtr> states;
+  CRITICAL_BLOCK(cs_main)
+    {
+      if (!pindexBest || IsGameDBRebuilding ())
+        return;
+
+      const GameStatePtr tip = stateCache.query (*pindexBest->phashBlock);
+      stateCache.getRecent (CACHE_SNAPSHOT_STATES + 1, states);
+      if (tip && (states.empty () || states.front () != tip))
+        {
+          states.insert (states.begin (), tip);
+          states.resize (std::min<size_t> (states.size (),
+                                           CACHE_SNAPSHOT_STATES + 1));
+        }
+    }
+  if (states.empty ())
+    return;
+
+  const boost::filesystem::path path = GetCacheSnapshotPath ();
+  boost::filesystem::path tmpPath = path;
+  tmpPath.replace_extension (".tmp");
+
+  FILE* file = fopen (tmpPath.string ().c_str (), "wb");
+  if (!file)
+    {
+      error ("SaveGameStateCache: failed to open %s",
+             tmpPath.string ().c_str ());
+      return;
+    }
+
+  try
+    {
+      {
+        CAutoFile fileout(file, SER_DISK, VERSION);
+        const unsigned nCount = states.size ();
+        fileout << CACHE_SNAPSHOT_MAGIC << VERSION << nCount;
+
+        BOOST_FOREACH (const GameStatePtr& state, states)
+          {
+            std::vector<unsigned char> data;
+            EncodeSnapshot (*state, true, data);
+            const uint256 hash = Hash (data.begin (), data.end ());
+            const unsigned nSize = data.size ();
+            fileout << nSize;
+            fileout.write (reinterpret_cast<const char*> (&data[0]), nSize);
+            fileout << hash << SerializeHash (*state);
+          }
+      }
+
+      boost::filesystem::rename (tmpPath, path);
+    }
+  catch (const std::exception& e)
+    {
+      error ("SaveGameStateCache: %s", e.what ());
+      boost::filesystem::remove (tmpPath);
+      return;
+    }
+
+  printf ("Saved %u game states for the next start\n",
+          static_cast<unsigned> (states.size ()));
+}
+
+/* The commitment of the tip is saved along with the states, so that it
+   need not be rebuilt from the full state after a restart.  */
+static const unsigned COMMITMENT_SNAPSHOT_MAGIC = 0x48474334;
+
+static boost::filesystem::path
+GetCommitmentSnapshotPath ()
+{
+  return boost::filesystem::path (GetDataDir ()) / "gamecommitment.dat";
+}
+
+/**
+ * Write the commitment of the tip state to its snapshot file, if it is
+ * known.  The file holds the leaf hashes of the tree and its root, which
+ * is checked when the tree is restored.
+ */
+static void
+SaveStateCommitment ()
+{
+  uint256 hashTip;
+  CRITICAL_BLOCK(cs_main)
+    {
+      if (!pindexBest || IsGameDBRebuilding ())
+        return;
+      hashTip = *pindexBest->phashBlock;
+    }
+
+  StateCommitment c;
+  if (!GetCachedStateCommitment (hashTip, c))
+    return;
+
+  const boost::filesystem::path path = GetCommitmentSnapshotPath ();
+  boost::filesystem::path tmpPath = path;
+  tmpPath.replace_extension (".tmp");
+
+  FILE* file = fopen (tmpPath.string ().c_str (), "wb");
+  if (!file)
+    {
+      error ("SaveStateCommitment: failed to open %s",
+             tmpPath.string ().c_str ());
+      return;
+    }
+
+  try
+    {
+      {
+        CAutoFile fileout(file, SER_DISK, VERSION);
+        fileout << COMMITMENT_SNAPSHOT_MAGIC << VERSION << c;
+      }
+
+      boost::filesystem::rename (tmpPath, path);
+    }
+  catch (const std::exception& e)
+    {
+      error ("SaveStateCommitment: %s", e.what ());
+      boost::filesystem::remove (tmpPath);
+      return;
+    }
+
+  printf ("Saved the state commitment @%d for the next start\n",
+          c.GetHeight ());
+}
+
+/**
+ * Put the commitment saved by SaveStateCommitment back into the cache,
+ * if its block is still on the main chain.
+ */
+static void
+LoadStateCommitment ()
+{
+  const boost::filesystem::path path = GetCommitmentSnapshotPath ();
+  FILE* file = fopen (path.string ().c_str (), "rb");
+  if (!file)
+    return;
+
+  StateCommitment c;
+  bool fOk = true;
+  try
+    {
+      CAutoFile filein(file, SER_DISK, VERSION);
+      unsigned nMagic;
+      int nFileVersion;
+      filein >> nMagic >> nFileVersion;
+      if (nMagic != COMMITMENT_SNAPSHOT_MAGIC || nFileVersion != VERSION)
+        throw std::runtime_error ("invalid header");
+      filein >> c;
+    }
+  catch (const std::exception& e)
+    {
+      printf ("LoadStateCommitment: ignoring snapshot: %s\n", e.what ());
+      fOk = false;
+    }
+
+  /* Like the states, the file is only valid once.  */
+  boost::filesystem::remove (path);
+  if (!fOk)
+    return;
+
+  CRITICAL_BLOCK(cs_main)
+    {
+      std::map<uint256, CBlockIndex*>::const_iterator mi;
+      mi = mapBlockIndex.find (c.GetBlockHash ());
+      if (mi == mapBlockIndex.end () || !mi->second->IsInMainChain ()
+          || mi->second->nHeight != c.GetHeight ())
+        return;
+    }
+
+  CacheStateCommitment (c);
+  printf ("Loaded the state commitment @%d\n", c.GetHeight ());
+}
+
+void
+LoadGameStateCache ()
+{
+  LoadStateCommitment ();
+
+  const boost::filesystem::path path = GetCacheSnapshotPath ();
+  FILE* file = fopen (path.string ().c_str (), "rb");
+  if (!file)
+    return;
+
+  /* States are only used if they match a block on the main chain.  They
+     are put into the cache in reverse order, so that the tip ends up as
+     the most recently used.  */
+  std::vector<GameStatePtr> states;
+  try
+    {
+      CAutoFile filein(file, SER_DISK, VERSION);
+      unsigned nMagic, nCount;
+      int nFileVersion;
+      filein >> nMagic >> nFileVersion >> nCount;
+      if (nMagic != CACHE_SNAPSHOT_MAGIC || nFileVersion != VERSION
+          || nCount > CACHE_SNAPSHOT_STATES + 1)
+        throw std::runtime_error ("invalid header");
+
+      for (unsigned i = 0; i < nCount; ++i)
+        {
+          unsigned nSize;
+          filein >> nSize;
+          std::vector<unsigned char> buf(nSize);
+          if (nSize > 0)
+            filein.read (reinterpret_cast<char*> (&buf[0]), nSize);
+          uint256 hash, hashState;
+          filein >> hash >> hashState;
+          if (nSize == 0 || Hash (buf.begin (), buf.end ()) != hash)
+            throw std::runtime_error ("checksum mismatch");
+
+          boost::shared_ptr<GameState> state(new GameState ());
+          DecodeSnapshot (&buf[0], nSize, *state);
+          if (SerializeHash (*state) != hashState)
+            {
+              printf ("LoadGameStateCache: state @%d does not match its"
+                      " hash, ignoring it\n", state->nHeight);
+              continue;
+            }
+          states.push_back (state);
+        }
+    }
+  catch (const std::exception& e)
+    {
+      printf ("LoadGameStateCache: ignoring snapshot: %s\n", e.what ());
+      states.clear ();
+    }
+
+  /* The file is only valid once.  States of blocks that are disconnected
+     later must not be picked up after an unclean shutdown.  */
+  boost::filesystem::remove (path);
+
+  unsigned nLoaded = 0;
+  CRITICAL_BLOCK(cs_main)
+    for (std::vector<GameStatePtr>::reverse_iterator i = states.rbegin ();
+         i != states.rend (); ++i)
+      {
+        const GameState& state = **i;
+        std::map<uint256, CBlockIndex*>::const_iterator mi;
+        mi = mapBlockIndex.find (state.hashBlock);
+        if (mi == mapBlockIndex.end () || !mi->second->IsInMainChain ()
+            || mi->second->nHeight != state.nHeight)
+          continue;
+
+        stateCache.store (*i);
+        ++nLoaded;
+      }
+
+  printf ("Loaded %u of %u saved game states\n",
+          nLoaded, static_cast<unsigned> (states.size ()));
+}
+
+void
+ShutdownGameStore ()
+{
+  SaveGameStateCache ();
+  SaveStateCommitment ();
+
+  /* The object itself is kept, since the compaction thread may still
+     refer to it.  It does nothing once the store is closed.  */
+  if (pgameStore)
+    pgameStore->Close ();
+}
+
+bool
+ConvertGameDB (bool fToStore)
+{
+  assert (!pgameStore);
+
+  CGameStore store(GetGameStorePath ());
+  if (!store.Open ())
+    return error ("ConvertGameDB: failed to open the game state store");
+
+  CGameDB gameDb("cr+");
+  std::vector<unsigned> heights;
+
+  if (fToStore)
+    {
+      if (!gameDb.GetHeightsInDB (heights))
+        return error ("ConvertGameDB: failed to list the game DB");
+      printf ("Moving %u game states from the game DB to the store...\n",
+              static_cast<unsigned> (heights.size ()));
+
+      BOOST_FOREACH (unsigned h, heights)
+        {
+          GameState state;
+          if (!gameDb.ReadFromDB (h, state) || !store.Write (h, state))
+            return error ("ConvertGameDB: failed to move state %u", h);
+        }
+      if (!store.Flush ())
+        return false;
+
+      /* Only remove the states from the DB after all are safely in
+         the store.  */
+      BOOST_FOREACH (unsigned h, heights)
+        gameDb.EraseFromDB (h);
+      gameDb.Rewrite ();
+      store.Close ();
+    }
+  else
+    {
+      store.GetHeights (heights);
+      printf ("Moving %u game states from the store to the game DB...\n",
+              static_cast<unsigned> (heights.size ()));
+
+      if (!gameDb.TxnBegin ())
+        return error ("ConvertGameDB: TxnBegin failed");
+      BOOST_FOREACH (unsigned h, heights)
+        {
+          GameState state;
+          if (!store.Read (h, state) || !gameDb.WriteToDB (h, state))
+            {
+              gameDb.TxnAbort ();
+              return error ("ConvertGameDB: failed to move state %u", h);
+            }
+        }
+      if (!gameDb.TxnCommit ())
+        return error ("ConvertGameDB: TxnCommit failed");
+      gameDb.Close ();
+
+      store.Close ();
+      boost::filesystem::remove_all (GetGameStorePath ());
+    }
+  printf ("Game state conversion done\n");
+
+  return true;
 }
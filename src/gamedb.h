@@ -3,6 +3,10 @@
 
 #include "uint256.h"
 
+#include <boost/shared_ptr.hpp>
+
+#include <map>
+#include <string>
 #include <vector>
 
 // This module acts as a connection between the game engine (gamestate.cpp) and the block chain hook (huntercoin.cpp)
@@ -10,6 +14,13 @@
 namespace Game
 {
     struct GameState;
+    struct SnapshotFileHeader;
+    class StepResult;
+
+    /* Shared handle to an immutable game state.  States are materialised
+       once (e. g., in the state cache) and shared between all readers.
+       Callers that want to modify a state have to copy it.  */
+    typedef boost::shared_ptr<const GameState> GameStatePtr;
 }
 
 class CBlock;
@@ -25,15 +36,23 @@ bool IsMoveValid (const Game::GameState& state, const CTransaction& tx);
 
 bool PerformStep (CNameDB& pnameDb, const Game::GameState& inState,
                   const CBlock* block, int64& nTax, Game::GameState& outState,
-                  std::vector<CTransaction>* outvgametx = NULL);
+                  std::vector<CTransaction>* outvgametx = NULL,
+                  Game::StepResult* outStepResult = NULL);
 
 // Caller of these functions must hold cs_main lock
 bool GetGameState (DatabaseSet& dbset, CBlockIndex* pindex,
-                   Game::GameState& outState);
+                   Game::GameStatePtr& outState);
 bool AdvanceGameState (DatabaseSet& dbset, CBlockIndex* pindex,
                        CBlock* block, int64& nFees);
-void RollbackGameState(CTxDB& txdb, CBlockIndex* pindex);
-const Game::GameState &GetCurrentGameState();
+void RollbackGameState(DatabaseSet& dbset, CBlockIndex* pindex,
+                       const CBlock& block);
+Game::GameStatePtr GetCurrentGameState();
+
+/* Sum up the kills per player stored in the game DB for the blocks up to
+   nHeight.  nSince is set to the height from which on the kills of all
+   blocks are stored.  */
+bool ReadKillCounts (int nHeight, int& nSince,
+                     std::map<std::string, int64_t>& counts);
 
 // Like name_clean; called in ResendWalletTransactions to remove outdated move transactions that are
 // no longer valid for the current game state
@@ -43,9 +62,66 @@ void EraseBadMoveTransactions();
    number of blocks.  Actually, we keep the newest state that is older
    than the treshold, so that we can integrate forward
    in time from there and (more or less) efficiently reconstruct
-   every state after the treshold.  */
+   every state after the treshold.  The freed space is reclaimed by
+   compacting the DB file in the background.  */
 void PruneGameDB (unsigned nHeight);
 
+/* Upgrade the game DB.  If it has to be recreated from scratch, this is
+   done by a background thread that writes periodic checkpoints and that
+   resumes from the last one after a restart.  */
 bool UpgradeGameDB();
 
+/* Whether the background rebuild is still running.  While it is, the
+   current game state is not available and blocks are not processed.  */
+bool IsGameDBRebuilding ();
+/* Return the height reached by the rebuild and its target height.
+   Returns false if no rebuild is running.  */
+bool GetGameDBRebuildProgress (int& nHeight, int& nTarget);
+
+/* Result of VerifyGameHistory.  */
+struct GameHistoryCheck
+{
+  unsigned nThreads;
+  /* Number of segments replayed, verified and skipped (because a stored
+     state changed during the verification or on shutdown).  */
+  unsigned nSegments;
+  unsigned nVerified;
+  unsigned nSkipped;
+  /* End heights of the segments whose replay failed or did not match.  */
+  std::vector<int> mismatches;
+
+  GameHistoryCheck ()
+    : nThreads(0), nSegments(0), nVerified(0), nSkipped(0)
+  {}
+};
+
+/* Re-verify the game history by replaying the blocks between each two
+   stored states and comparing the result to the later one.  The segments
+   are independent and replayed on nThreads threads (0 for one per core),
+   at most one per core.  Only segments ending after nFromHeight are
+   checked.  The segment up to the current state is replayed last.
+   Returns false on mismatches.  */
+bool VerifyGameHistory (int nFromHeight, unsigned nThreads,
+                        GameHistoryCheck& res);
+
+/* Read a snapshot file with all the checks of -loadgamesnapshot (chunk
+   hashes, commitment root and that its block is on the main chain), but
+   without importing the state.  */
+bool ReadGameSnapshot (const std::string& strFile,
+                       Game::SnapshotFileHeader& hdr, Game::GameState& state);
+
+/* Size the in-memory state cache (-gamestatecache), open the game state
+   store if selected with -gamestore and start its background compaction.  */
+bool InitGameStore ();
+void ShutdownGameStore ();
+
+/* Put the game states and the state commitment saved by ShutdownGameStore
+   back into their caches.  Only states of blocks on the main chain are
+   used.  This must be done after loading the block index.  */
+void LoadGameStateCache ();
+
+/* Move all full game states from the game DB to the game state store
+   (or back).  This must be done before InitGameStore.  */
+bool ConvertGameDB (bool fToStore);
+
 #endif // GAMEDB_H
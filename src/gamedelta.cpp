@@ -0,0 +1,201 @@
+#include "gamedelta.h"
+
+#include "gamecommitment.h"
+#include "headers.h"
+
+using namespace Game;
+
+/**
+ * Fill in the changed and removed entries of one entity map.
+ */
+template<typename K, typename V>
+  static void
+  CollectDelta (const std::set<K>& changed, const std::map<K, V>& entries,
+                std::map<K, V>& outChanged, std::set<K>& outRemoved)
+{
+  outChanged.clear ();
+  outRemoved.clear ();
+
+  BOOST_FOREACH (const K& k, changed)
+    {
+      typename std::map<K, V>::const_iterator mi = entries.find (k);
+      if (mi == entries.end ())
+        outRemoved.insert (k);
+      else
+        outChanged.insert (*mi);
+    }
+}
+
+/**
+ * Apply the changed and removed entries to one entity map.
+ */
+template<typename K, typename V>
+  static void
+  ApplyDelta (const std::map<K, V>& changed, const std::set<K>& removed,
+              std::map<K, V>& entries)
+{
+  BOOST_FOREACH (const K& k, removed)
+    entries.erase (k);
+  for (typename std::map<K, V>::const_iterator i = changed.begin ();
+       i != changed.end (); ++i)
+    entries[i->first] = i->second;
+}
+
+void
+StateDelta::Create (const GameState& from, const GameState& to,
+                    const StateChangeSet& changes, const uint256& hashRoot)
+{
+  hashParent = from.hashBlock;
+  hashStateRoot = hashRoot;
+
+  CollectDelta (changes.players, to.players, players, removedPlayers);
+  CollectDelta (changes.loot, to.loot, loot, removedLoot);
+  CollectDelta (changes.banks, to.banks, banks, removedBanks);
+#ifdef PERMANENT_LUGGAGE
+  CollectDelta (changes.vaults, to.vault, vaults, removedVaults);
+#endif
+
+  addedHearts.clear ();
+  removedHearts.clear ();
+  BOOST_FOREACH (const Coord& c, changes.hearts)
+    if (to.hearts.count (c) > 0)
+      addedHearts.insert (c);
+    else
+      removedHearts.insert (c);
+
+  deadPlayersChat = to.dead_players_chat;
+
+  globals = GameState ();
+  globals.CopyGlobals (to);
+  /* The constructor sets the original banks, which are not needed.  */
+  globals.banks.clear ();
+}
+
+bool
+StateDelta::Apply (GameState& state) const
+{
+  if (state.hashBlock != hashParent || state.nHeight + 1 != globals.nHeight)
+    return false;
+
+  ApplyDelta (players, removedPlayers, state.players);
+  ApplyDelta (loot, removedLoot, state.loot);
+  ApplyDelta (banks, removedBanks, state.banks);
+#ifdef PERMANENT_LUGGAGE
+  ApplyDelta (vaults, removedVaults, state.vault);
+#endif
+
+  BOOST_FOREACH (const Coord& c, removedHearts)
+    state.hearts.erase (c);
+  state.hearts.insert (addedHearts.begin (), addedHearts.end ());
+
+  state.dead_players_chat = deadPlayersChat;
+  state.CopyGlobals (globals);
+
+  return true;
+}
+
+/**
+ * Add the keys of changed and removed entries to the change set.
+ */
+template<typename K, typename V>
+  static void
+  AddDeltaKeys (const std::map<K, V>& changed, const std::set<K>& removed,
+                std::set<K>& out)
+{
+  out.insert (removed.begin (), removed.end ());
+  for (typename std::map<K, V>::const_iterator i = changed.begin ();
+       i != changed.end (); ++i)
+    out.insert (i->first);
+}
+
+void
+StateDelta::GetChanges (const GameState& parent,
+                        StateChangeSet& changes) const
+{
+  AddDeltaKeys (players, removedPlayers, changes.players);
+  AddDeltaKeys (loot, removedLoot, changes.loot);
+  AddDeltaKeys (banks, removedBanks, changes.banks);
+#ifdef PERMANENT_LUGGAGE
+  AddDeltaKeys (vaults, removedVaults, changes.vaults);
+#endif
+
+  changes.hearts.insert (addedHearts.begin (), addedHearts.end ());
+  changes.hearts.insert (removedHearts.begin (), removedHearts.end ());
+
+  const std::set<PlayerID> noRemoved;
+  AddDeltaKeys (parent.dead_players_chat, noRemoved, changes.deadPlayersChat);
+  AddDeltaKeys (deadPlayersChat, noRemoved, changes.deadPlayersChat);
+}
+
+void
+StateUndo::Create (const GameState& from, const GameState& to,
+                   const StateChangeSet& changes, const uint256& hashRoot)
+{
+  hashBlock = to.hashBlock;
+  hashStateRoot = hashRoot;
+
+  /* Entities that are missing in the parent were added by the block.  */
+  CollectDelta (changes.players, from.players, players, addedPlayers);
+  CollectDelta (changes.loot, from.loot, loot, addedLoot);
+  CollectDelta (changes.banks, from.banks, banks, addedBanks);
+#ifdef PERMANENT_LUGGAGE
+  CollectDelta (changes.vaults, from.vault, vaults, addedVaults);
+#endif
+
+  addedHearts.clear ();
+  removedHearts.clear ();
+  BOOST_FOREACH (const Coord& c, changes.hearts)
+    if (from.hearts.count (c) > 0)
+      removedHearts.insert (c);
+    else
+      addedHearts.insert (c);
+
+  deadPlayersChat = from.dead_players_chat;
+
+  globals = GameState ();
+  globals.CopyGlobals (from);
+  /* The constructor sets the original banks, which are not needed.  */
+  globals.banks.clear ();
+}
+
+bool
+StateUndo::Apply (GameState& state) const
+{
+  if (state.hashBlock != hashBlock || state.nHeight != globals.nHeight + 1)
+    return false;
+
+  ApplyDelta (players, addedPlayers, state.players);
+  ApplyDelta (loot, addedLoot, state.loot);
+  ApplyDelta (banks, addedBanks, state.banks);
+#ifdef PERMANENT_LUGGAGE
+  ApplyDelta (vaults, addedVaults, state.vault);
+#endif
+
+  BOOST_FOREACH (const Coord& c, addedHearts)
+    state.hearts.erase (c);
+  state.hearts.insert (removedHearts.begin (), removedHearts.end ());
+
+  state.dead_players_chat = deadPlayersChat;
+  state.CopyGlobals (globals);
+
+  return true;
+}
+
+void
+StateUndo::GetChanges (const GameState& state,
+                       StateChangeSet& changes) const
+{
+  AddDeltaKeys (players, addedPlayers, changes.players);
+  AddDeltaKeys (loot, addedLoot, changes.loot);
+  AddDeltaKeys (banks, addedBanks, changes.banks);
+#ifdef PERMANENT_LUGGAGE
+  AddDeltaKeys (vaults, addedVaults, changes.vaults);
+#endif
+
+  changes.hearts.insert (addedHearts.begin (), addedHearts.end ());
+  changes.hearts.insert (removedHearts.begin (), removedHearts.end ());
+
+  const std::set<PlayerID> noRemoved;
+  AddDeltaKeys (state.dead_players_chat, noRemoved, changes.deadPlayersChat);
+  AddDeltaKeys (deadPlayersChat, noRemoved, changes.deadPlayersChat);
+}
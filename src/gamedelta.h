@@ -0,0 +1,234 @@
+#ifndef GAMEDELTA_H
+#define GAMEDELTA_H
+
+#include "gamestate.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <string>
+
+// Compact difference between a game state and its parent.  The game DB
+// stores such a delta for each block and full states only as keyframes,
+// so that a state can be reconstructed by applying deltas to the last
+// keyframe instead of re-executing the game steps.
+//
+// For recent blocks, the game DB also stores the inverse:  an undo record
+// with the old values of all entities changed by the block.  This allows
+// disconnecting blocks during a reorg by restoring the parent state
+// directly from its child.
+
+namespace Game
+{
+
+struct StateChangeSet;
+
+class StateDelta
+{
+
+private:
+
+  /* Changed (or new) and removed entities.  */
+  std::map<PlayerID, PlayerState> players;
+  std::set<PlayerID> removedPlayers;
+  std::map<Coord, LootInfo> loot;
+  std::set<Coord> removedLoot;
+  std::set<Coord> addedHearts;
+  std::set<Coord> removedHearts;
+  std::map<Coord, unsigned> banks;
+  std::set<Coord> removedBanks;
+#ifdef PERMANENT_LUGGAGE
+  std::map<std::string, StorageVault> vaults;
+  std::set<std::string> removedVaults;
+#endif
+
+  /* The dead players' chat only refers to the current block, so it is
+     always stored in full.  */
+  std::map<PlayerID, PlayerState> deadPlayersChat;
+
+  /* Block hash of the parent state to which the delta applies.  */
+  uint256 hashParent;
+
+  /* Holds the new values of all fields that are not entity maps (the
+     maps of this state are empty).  This includes height and block hash
+     of the new state.  */
+  GameState globals;
+
+  /* Commitment root of the new state, so that a delta which does not
+     reproduce the state it was created for is detected.  */
+  uint256 hashStateRoot;
+
+public:
+
+  StateDelta ()
+    : hashParent(0), hashStateRoot(0)
+  {}
+
+  IMPLEMENT_SERIALIZE
+  (
+    READWRITE(hashParent);
+    READWRITE(players);
+    READWRITE(removedPlayers);
+    READWRITE(deadPlayersChat);
+    READWRITE(loot);
+    READWRITE(removedLoot);
+    READWRITE(addedHearts);
+    READWRITE(removedHearts);
+    READWRITE(banks);
+    READWRITE(removedBanks);
+#ifdef PERMANENT_LUGGAGE
+    READWRITE(vaults);
+    READWRITE(removedVaults);
+#endif
+    READWRITE(globals);
+    READWRITE(hashStateRoot);
+  )
+
+  /**
+   * Construct the delta between two states.
+   * @param from The parent state.
+   * @param to The new state.
+   * @param changes The changes between both (as recorded by PerformStep).
+   * @param hashRoot The commitment root of the new state.
+   */
+  void Create (const GameState& from, const GameState& to,
+               const StateChangeSet& changes, const uint256& hashRoot);
+
+  /**
+   * Apply the delta to a state.  The state must be the parent state for
+   * which the delta was created.
+   * @param state The state to update in-place.
+   * @return False if the state is not the delta's parent.
+   */
+  bool Apply (GameState& state) const;
+
+  /**
+   * Construct the set of entities changed by the delta.  The result may
+   * contain entities that are unchanged (e. g., for the dead players'
+   * chat), which is fine for incremental updates.
+   * @param parent The parent state (before applying the delta).
+   * @param changes Fill in the changes here.
+   */
+  void GetChanges (const GameState& parent, StateChangeSet& changes) const;
+
+  inline int
+  GetHeight () const
+  {
+    return globals.nHeight;
+  }
+
+  inline const uint256&
+  GetBlockHash () const
+  {
+    return globals.hashBlock;
+  }
+
+  inline const uint256&
+  GetStateRoot () const
+  {
+    return hashStateRoot;
+  }
+
+};
+
+class StateUndo
+{
+
+private:
+
+  /* Old values of changed or removed entities, and the entities that
+     were added by the block (and have to be removed again).  */
+  std::map<PlayerID, PlayerState> players;
+  std::set<PlayerID> addedPlayers;
+  std::map<Coord, LootInfo> loot;
+  std::set<Coord> addedLoot;
+  std::set<Coord> addedHearts;
+  std::set<Coord> removedHearts;
+  std::map<Coord, unsigned> banks;
+  std::set<Coord> addedBanks;
+#ifdef PERMANENT_LUGGAGE
+  std::map<std::string, StorageVault> vaults;
+  std::set<std::string> addedVaults;
+#endif
+
+  /* The parent's dead players' chat.  */
+  std::map<PlayerID, PlayerState> deadPlayersChat;
+
+  /* Block hash of the state to which the undo record applies.  */
+  uint256 hashBlock;
+
+  /* Old values of the fields that are not entity maps, including height
+     and block hash of the parent state.  */
+  GameState globals;
+
+  /* Commitment root of the parent state.  */
+  uint256 hashStateRoot;
+
+public:
+
+  StateUndo ()
+    : hashBlock(0), hashStateRoot(0)
+  {}
+
+  IMPLEMENT_SERIALIZE
+  (
+    READWRITE(hashBlock);
+    READWRITE(players);
+    READWRITE(addedPlayers);
+    READWRITE(deadPlayersChat);
+    READWRITE(loot);
+    READWRITE(addedLoot);
+    READWRITE(addedHearts);
+    READWRITE(removedHearts);
+    READWRITE(banks);
+    READWRITE(addedBanks);
+#ifdef PERMANENT_LUGGAGE
+    READWRITE(vaults);
+    READWRITE(addedVaults);
+#endif
+    READWRITE(globals);
+    READWRITE(hashStateRoot);
+  )
+
+  /**
+   * Construct the undo record for a block.
+   * @param from The parent state.
+   * @param to The state after the block.
+   * @param changes The changes between both (as recorded by PerformStep).
+   * @param hashRoot The commitment root of the parent state.
+   */
+  void Create (const GameState& from, const GameState& to,
+               const StateChangeSet& changes, const uint256& hashRoot);
+
+  /**
+   * Turn a state back into its parent.
+   * @param state The state to update in-place.
+   * @return False if the state is not the one the record was created for.
+   */
+  bool Apply (GameState& state) const;
+
+  /**
+   * Construct the set of entities changed by the undo record.
+   * @param state The state before applying the record.
+   * @param changes Fill in the changes here.
+   */
+  void GetChanges (const GameState& state, StateChangeSet& changes) const;
+
+  inline const uint256&
+  GetBlockHash () const
+  {
+    return hashBlock;
+  }
+
+  inline const uint256&
+  GetStateRoot () const
+  {
+    return hashStateRoot;
+  }
+
+};
+
+}
+
+#endif // GAMEDELTA_H
@@ -0,0 +1,435 @@
+#include "gamedistance.h"
+
+#include "gamecommitment.h"
+#include "gamemap.h"
+#include "headers.h"
+
+#include <boost/noncopyable.hpp>
+
+#include <queue>
+
+using namespace Game;
+
+bool
+Game::ParseDistanceFieldType (const std::string& name, DistanceFieldType& type)
+{
+  if (name == "banks")
+    type = DISTANCE_BANKS;
+  else if (name == "harvest")
+    type = DISTANCE_HARVEST;
+  else if (name == "crown")
+    type = DISTANCE_CROWN;
+  else
+    return false;
+
+  return true;
+}
+
+/* ************************************************************************** */
+/* DistanceField.  */
+
+static const int DISTANCE_CELLS = MAP_WIDTH * MAP_HEIGHT;
+static const unsigned short DISTANCE_UNREACHABLE = 0xFFFF;
+
+static inline int
+CellIndex (const Coord& c)
+{
+  return c.y * MAP_WIDTH + c.x;
+}
+
+static inline Coord
+CellCoord (int v)
+{
+  return Coord (v % MAP_WIDTH, v / MAP_WIDTH);
+}
+
+static inline bool
+WalkableCell (int x, int y)
+{
+  return IsInsideMap (x, y) && IsWalkable (x, y);
+}
+
+/**
+ * Distance of each tile to the nearest of a set of source tiles, together
+ * with that source.
+ */
+class DistanceField : private boost::noncopyable
+{
+
+private:
+
+  std::vector<unsigned short> dist;
+  /* Cell index of the nearest source, or -1.  */
+  std::vector<int> nearest;
+
+  /* Cells ordered by distance.  Entries may be outdated, in which case
+     their distance is larger than the cell's current one.  */
+  typedef std::pair<unsigned, int> QueueEntry;
+  typedef std::priority_queue<QueueEntry, std::vector<QueueEntry>,
+                              std::greater<QueueEntry> > Queue;
+
+  /* Spread the distances of the queued cells to their neighbours as far
+     as this improves them.  */
+  void Propagate (Queue& queue);
+
+public:
+
+  DistanceField ()
+    : dist(DISTANCE_CELLS, DISTANCE_UNREACHABLE), nearest(DISTANCE_CELLS, -1)
+  {}
+
+  void Clear ();
+
+  /* Add sources, which may only decrease distances.  */
+  void Add (const std::set<int>& sources);
+
+  /* Remove sources.  The tiles that were nearest to one of them are reset
+     and filled in again from their neighbours.  */
+  void Remove (const std::set<int>& sources);
+
+  void Lookup (const Coord& c, DistanceInfo& info) const;
+
+};
+
+void
+DistanceField::Propagate (Queue& queue)
+{
+  while (!queue.empty ())
+    {
+      const QueueEntry e = queue.top ();
+      queue.pop ();
+
+      const int u = e.second;
+      if (e.first > dist[u])
+        continue;
+
+      const int ux = u % MAP_WIDTH;
+      const int uy = u / MAP_WIDTH;
+      for (int dy = -1; dy <= 1; ++dy)
+        for (int dx = -1; dx <= 1; ++dx)
+          {
+            if ((dx == 0 && dy == 0) || !WalkableCell (ux + dx, uy + dy))
+              continue;
+
+            const int v = (uy + dy) * MAP_WIDTH + ux + dx;
+            if (dist[u] + 1 >= dist[v])
+              continue;
+
+            dist[v] = dist[u] + 1;
+            nearest[v] = nearest[u];
+            queue.push (QueueEntry (dist[v], v));
+          }
+    }
+}
+
+void
+DistanceField::Clear ()
+{
+  std::fill (dist.begin (), dist.end (), DISTANCE_UNREACHABLE);
+  std::fill (nearest.begin (), nearest.end (), -1);
+}
+
+void
+DistanceField::Add (const std::set<int>& sources)
+{
+  Queue queue;
+  BOOST_FOREACH (int s, sources)
+    {
+      dist[s] = 0;
+      nearest[s] = s;
+      queue.push (QueueEntry (0, s));
+    }
+
+  Propagate (queue);
+}
+
+void
+DistanceField::Remove (const std::set<int>& sources)
+{
+  if (sources.empty ())
+    return;
+
+  std::vector<int> reset;
+  for (int v = 0; v < DISTANCE_CELLS; ++v)
+    if (nearest[v] >= 0 && sources.count (nearest[v]) > 0)
+      {
+        dist[v] = DISTANCE_UNREACHABLE;
+        nearest[v] = -1;
+        reset.push_back (v);
+      }
+
+  /* Restart the search from the remaining tiles bordering the reset
+     region.  Their distances are still correct.  */
+  Queue queue;
+  BOOST_FOREACH (int v, reset)
+    {
+      const int vx = v % MAP_WIDTH;
+      const int vy = v / MAP_WIDTH;
+      for (int dy = -1; dy <= 1; ++dy)
+        for (int dx = -1; dx <= 1; ++dx)
+          {
+            if (!IsInsideMap (vx + dx, vy + dy))
+              continue;
+            const int n = (vy + dy) * MAP_WIDTH + vx + dx;
+            if (nearest[n] >= 0)
+              queue.push (QueueEntry (dist[n], n));
+          }
+    }
+
+  Propagate (queue);
+}
+
+void
+DistanceField::Lookup (const Coord& c, DistanceInfo& info) const
+{
+  info.tile = c;
+  info.fReachable = false;
+  info.nDistance = 0;
+  info.nArea = -1;
+
+  if (!IsInsideMap (c.x, c.y))
+    return;
+  const int v = CellIndex (c);
+  if (dist[v] == DISTANCE_UNREACHABLE)
+    return;
+
+  info.fReachable = true;
+  info.nDistance = dist[v];
+  info.target = CellCoord (nearest[v]);
+  info.next = c;
+
+  /* Prefer a step towards the same target, but any neighbour that is one
+     step closer to some target will do.  */
+  bool fFound = false;
+  for (int pass = 0; pass < 2 && !fFound && dist[v] > 0; ++pass)
+    for (int dy = -1; dy <= 1 && !fFound; ++dy)
+      for (int dx = -1; dx <= 1 && !fFound; ++dx)
+        {
+          if ((dx == 0 && dy == 0) || !WalkableCell (c.x + dx, c.y + dy))
+            continue;
+
+          const int n = (c.y + dy) * MAP_WIDTH + c.x + dx;
+          if (dist[n] + 1 != dist[v])
+            continue;
+          if (pass == 0 && nearest[n] != nearest[v])
+            continue;
+
+          info.next = CellCoord (n);
+          fFound = true;
+        }
+}
+
+/* ************************************************************************** */
+/* DistanceFields.  */
+
+/**
+ * All distance fields together with the state they refer to.
+ */
+class DistanceFields : private boost::noncopyable
+{
+
+private:
+
+  DistanceField fields[NUM_DISTANCE_FIELDS];
+
+  /* Whether each field has been built.  */
+  bool fBuilt[NUM_DISTANCE_FIELDS];
+
+  /* State that the bank field refers to.  */
+  int nHeight;
+  uint256 hashBlock;
+  unsigned nBanks;
+
+  /* Position of the crown the crown field was built for.  */
+  Coord crownPos;
+
+  /* Harvest area index of each harvest tile, -1 for other tiles.  */
+  std::vector<int> harvestArea;
+  unsigned nHarvestTiles;
+
+  static void
+  GetBankCells (const GameState& state, std::set<int>& out)
+  {
+    out.clear ();
+    for (std::map<Coord, unsigned>::const_iterator mi = state.banks.begin ();
+         mi != state.banks.end (); ++mi)
+      if (IsInsideMap (mi->first.x, mi->first.y))
+        out.insert (CellIndex (mi->first));
+  }
+
+  void BuildHarvest ();
+
+public:
+
+  DistanceFields ()
+    : nHeight(-1), hashBlock(0), nBanks(0), nHarvestTiles(0)
+  {
+    for (unsigned i = 0; i < NUM_DISTANCE_FIELDS; ++i)
+      fBuilt[i] = false;
+  }
+
+  inline bool
+  HasBanks (const GameState& state) const
+  {
+    return fBuilt[DISTANCE_BANKS]
+            && hashBlock == state.hashBlock && nHeight == state.nHeight;
+  }
+
+  void Update (const GameState& state, DistanceFieldType type);
+  void UpdateBanks (const GameState& inState, const GameState& outState,
+                    const StateChangeSet& changes);
+  void Query (DistanceFieldType type, const std::vector<Coord>& tiles,
+              DistanceFieldResult& res) const;
+
+};
+
+void
+DistanceFields::BuildHarvest ()
+{
+  harvestArea.assign (DISTANCE_CELLS, -1);
+  std::set<int> sources;
+  for (int i = 0; i < NUM_HARVEST_AREAS; ++i)
+    for (int a = 0; a < HarvestAreaSizes[i]; ++a)
+      {
+        const Coord c(HarvestAreas[i][2 * a], HarvestAreas[i][2 * a + 1]);
+        if (!IsInsideMap (c.x, c.y))
+          continue;
+        const int v = CellIndex (c);
+        if (harvestArea[v] < 0)
+          harvestArea[v] = i;
+        sources.insert (v);
+      }
+
+  fields[DISTANCE_HARVEST].Clear ();
+  fields[DISTANCE_HARVEST].Add (sources);
+  nHarvestTiles = sources.size ();
+}
+
+void
+DistanceFields::Update (const GameState& state, DistanceFieldType type)
+{
+  switch (type)
+    {
+    case DISTANCE_BANKS:
+      if (!HasBanks (state))
+        {
+          std::set<int> sources;
+          GetBankCells (state, sources);
+          fields[DISTANCE_BANKS].Clear ();
+          fields[DISTANCE_BANKS].Add (sources);
+          nBanks = sources.size ();
+          nHeight = state.nHeight;
+          hashBlock = state.hashBlock;
+        }
+      break;
+
+    case DISTANCE_HARVEST:
+      if (!fBuilt[DISTANCE_HARVEST])
+        BuildHarvest ();
+      break;
+
+    case DISTANCE_CROWN:
+      if (!fBuilt[DISTANCE_CROWN] || crownPos != state.crownPos)
+        {
+          std::set<int> sources;
+          if (IsInsideMap (state.crownPos.x, state.crownPos.y))
+            sources.insert (CellIndex (state.crownPos));
+          fields[DISTANCE_CROWN].Clear ();
+          fields[DISTANCE_CROWN].Add (sources);
+          crownPos = state.crownPos;
+        }
+      break;
+
+    default:
+      assert (false);
+    }
+
+  fBuilt[type] = true;
+}
+
+void
+DistanceFields::UpdateBanks (const GameState& inState,
+                             const GameState& outState,
+                             const StateChangeSet& changes)
+{
+  /* The life time of all banks changes in every step, so most entries
+     of the change set are banks that stay where they are.  */
+  std::set<int> added, removed;
+  BOOST_FOREACH (const Coord& c, changes.banks)
+    {
+      if (!IsInsideMap (c.x, c.y))
+        continue;
+      const bool fBefore = (inState.banks.count (c) > 0);
+      const bool fAfter = (outState.banks.count (c) > 0);
+      if (fBefore && !fAfter)
+        removed.insert (CellIndex (c));
+      else if (!fBefore && fAfter)
+        added.insert (CellIndex (c));
+    }
+
+  fields[DISTANCE_BANKS].Remove (removed);
+  fields[DISTANCE_BANKS].Add (added);
+
+  nBanks = nBanks + added.size () - removed.size ();
+  nHeight = outState.nHeight;
+  hashBlock = outState.hashBlock;
+}
+
+void
+DistanceFields::Query (DistanceFieldType type, const std::vector<Coord>& tiles,
+                       DistanceFieldResult& res) const
+{
+  assert (type >= 0 && type < NUM_DISTANCE_FIELDS);
+  const DistanceField& field = fields[type];
+
+  res.nHeight = nHeight;
+  res.hashBlock = hashBlock;
+  switch (type)
+    {
+    case DISTANCE_BANKS:
+      res.nTargets = nBanks;
+      break;
+    case DISTANCE_HARVEST:
+      res.nTargets = nHarvestTiles;
+      break;
+    default:
+      res.nTargets = 1;
+      break;
+    }
+
+  res.tiles.resize (tiles.size ());
+  for (unsigned i = 0; i < tiles.size (); ++i)
+    {
+      DistanceInfo& info = res.tiles[i];
+      field.Lookup (tiles[i], info);
+      if (type == DISTANCE_HARVEST && info.fReachable)
+        info.nArea = harvestArea[CellIndex (info.target)];
+    }
+}
+
+static CCriticalSection cs_distanceFields;
+static DistanceFields distanceFields;
+
+void
+Game::QueryDistanceField (const GameState& state, DistanceFieldType type,
+                          const std::vector<Coord>& tiles,
+                          DistanceFieldResult& res)
+{
+  CRITICAL_BLOCK(cs_distanceFields)
+    {
+      distanceFields.Update (state, type);
+      distanceFields.Query (type, tiles, res);
+      res.nHeight = state.nHeight;
+      res.hashBlock = state.hashBlock;
+    }
+}
+
+void
+Game::AdvanceDistanceFields (const GameState& inState,
+                             const GameState& outState,
+                             const StateChangeSet& changes)
+{
+  CRITICAL_BLOCK(cs_distanceFields)
+    if (distanceFields.HasBanks (inState))
+      distanceFields.UpdateBanks (inState, outState, changes);
+}
@@ -0,0 +1,111 @@
+#ifndef GAMEDISTANCE_H
+#define GAMEDISTANCE_H
+
+#include "gamestate.h"
+
+#include <string>
+#include <vector>
+
+// Distance fields over the walkable map tiles.  For each kind of target
+// (banks, harvest areas and the crown), a multi-source breadth-first search
+// stores the walking distance of every tile to the nearest target and
+// which target that is.  "Where is the nearest bank?" is then a single
+// lookup instead of a path search to each candidate, and the first step
+// towards the target follows from the distances of the neighbouring tiles.
+//
+// The harvest areas never change, so their field is computed once.  The
+// bank field is updated from each step's changes:  when banks disappear,
+// only the tiles that were nearest to them are recomputed, and new banks
+// are added by a search that stops where it does not improve distances.
+// The crown moves with its holder, so its field is recomputed when the
+// crown's position changed since the last query.
+
+namespace Game
+{
+
+struct StateChangeSet;
+
+/* The available distance fields.  */
+enum DistanceFieldType
+{
+  DISTANCE_BANKS = 0,
+  DISTANCE_HARVEST,
+  DISTANCE_CROWN,
+
+  NUM_DISTANCE_FIELDS
+};
+
+/**
+ * Parse the name of a distance field.
+ * @param name The name ("banks", "harvest" or "crown").
+ * @param type Set to the type.
+ * @return False if the name is unknown.
+ */
+bool ParseDistanceFieldType (const std::string& name, DistanceFieldType& type);
+
+/* Distance information for one tile.  */
+struct DistanceInfo
+{
+
+  Coord tile;
+
+  /* Whether any target can be reached from the tile.  The other fields
+     are only set if it can.  */
+  bool fReachable;
+
+  /* Number of steps to the nearest target.  */
+  unsigned nDistance;
+
+  /* The nearest target (one of them if there are several).  */
+  Coord target;
+
+  /* Next tile on a shortest path to it (the tile itself if it is the
+     target).  */
+  Coord next;
+
+  /* For the harvest field, index of the harvest area of the target.  */
+  int nArea;
+
+};
+
+/* Result of a distance field query.  */
+struct DistanceFieldResult
+{
+
+  /* Height and block of the state the field refers to.  */
+  int nHeight;
+  uint256 hashBlock;
+
+  /* Number of targets in the field.  */
+  unsigned nTargets;
+
+  std::vector<DistanceInfo> tiles;
+
+};
+
+/**
+ * Look up tiles in a distance field for the given (current) state.  If the
+ * field does not yet refer to it, it is rebuilt.
+ * @param state The game state.
+ * @param type The field to query.
+ * @param tiles The tiles to look up.
+ * @param res Fill in the result.
+ */
+void QueryDistanceField (const GameState& state, DistanceFieldType type,
+                         const std::vector<Coord>& tiles,
+                         DistanceFieldResult& res);
+
+/**
+ * Notify about a performed game step.  If the bank field refers to the
+ * old state, it is updated with the banks that changed.
+ * @param inState The state before the step.
+ * @param outState The state after it.
+ * @param changes Changed entities between both states.
+ */
+void AdvanceDistanceFields (const GameState& inState,
+                            const GameState& outState,
+                            const StateChangeSet& changes);
+
+}
+
+#endif // GAMEDISTANCE_H
@@ -0,0 +1,480 @@
+#include "gameindex.h"
+
+#include "gamecommitment.h"
+#include "headers.h"
+#include "huntercoin.h"
+
+using namespace Game;
+
+bool
+PlayerFilter::Matches (const PlayerState& pl,
+                       const std::string& rewardAddress) const
+{
+  if (fAddress && rewardAddress != address)
+    return false;
+  if (fColor && pl.color != color)
+    return false;
+
+  if (fTile)
+    {
+      bool found = false;
+      BOOST_FOREACH (const PAIRTYPE(int, CharacterState)& c, pl.characters)
+        if (c.second.coord == tile)
+          {
+            found = true;
+            break;
+          }
+      if (!found)
+        return false;
+    }
+
+  return true;
+}
+
+/**
+ * The indexes for one game state.  For each player, the indexed keys are
+ * remembered as well so that its old entries can be removed when it
+ * changes.
+ */
+class PlayerIndex
+{
+
+private:
+
+  struct Entry
+  {
+    std::string address;
+    int color;
+    /* Tiles of all characters (may contain duplicates).  */
+    std::vector<Coord> tiles;
+  };
+
+  typedef std::set<PlayerID> NameSet;
+  /* For tiles, count the player's characters on it.  */
+  typedef std::map<PlayerID, unsigned> NameCounts;
+
+  bool fValid;
+  int nHeight;
+  uint256 hashBlock;
+
+  std::map<PlayerID, Entry> entries;
+  std::map<std::string, NameSet> byAddress;
+  std::map<int, NameSet> byColor;
+  std::map<Coord, NameCounts> byTile;
+
+  /* Players without reward address.  The addresses of their names are
+     not part of the game state.  They are looked up in the name DB when
+     first needed (by the caller, without holding the index lock) and kept
+     until the player changes or its name is updated by a name tx.  */
+  NameSet noAddress;
+  NameSet unresolved;
+  std::map<PlayerID, std::string> nameAddresses;
+  std::map<std::string, NameSet> byNameAddress;
+
+  void Add (const PlayerID& name, const PlayerState& pl);
+  void Remove (const PlayerID& name);
+
+  void ClearNameAddress (const PlayerID& name);
+  const std::string& GetRewardAddress (const PlayerID& name,
+                                       const PlayerState& pl) const;
+
+public:
+
+  PlayerIndex ()
+    : fValid(false), nHeight(-1), hashBlock(0)
+  {}
+
+  inline bool
+  Has (const GameState& state) const
+  {
+    return fValid && hashBlock == state.hashBlock && nHeight == state.nHeight;
+  }
+
+  /* Whether to switch the index to the given state when it is queried.
+     Queries for older states use a temporary index instead.  */
+  inline bool
+  ShouldReplace (const GameState& state) const
+  {
+    return !fValid || nHeight <= state.nHeight;
+  }
+
+  /* Names whose addresses have to be looked up before a query by
+     address.  */
+  inline const NameSet&
+  GetUnresolved () const
+  {
+    return unresolved;
+  }
+
+  void Resolve (const NameSet& names,
+                const std::map<PlayerID, std::string>& addresses);
+
+  void Rebuild (const GameState& state);
+  void Update (const GameState& state, const StateChangeSet& changes,
+               const std::set<PlayerID>& updatedNames);
+  void Find (const GameState& state, const PlayerFilter& filter,
+             std::vector<PlayerID>& out) const;
+
+};
+
+void
+PlayerIndex::Add (const PlayerID& name, const PlayerState& pl)
+{
+  Entry e;
+  e.address = pl.address;
+  e.color = pl.color;
+  BOOST_FOREACH (const PAIRTYPE(int, CharacterState)& c, pl.characters)
+    e.tiles.push_back (c.second.coord);
+
+  if (!e.address.empty ())
+    byAddress[e.address].insert (name);
+  else
+    {
+      noAddress.insert (name);
+      unresolved.insert (name);
+    }
+  byColor[e.color].insert (name);
+  BOOST_FOREACH (const Coord& c, e.tiles)
+    ++byTile[c][name];
+
+  entries[name] = e;
+}
+
+void
+PlayerIndex::Remove (const PlayerID& name)
+{
+  std::map<PlayerID, Entry>::iterator mi = entries.find (name);
+  if (mi == entries.end ())
+    return;
+  const Entry& e = mi->second;
+
+  if (!e.address.empty ())
+    {
+      std::map<std::string, NameSet>::iterator ai = byAddress.find (e.address);
+      assert (ai != byAddress.end ());
+      ai->second.erase (name);
+      if (ai->second.empty ())
+        byAddress.erase (ai);
+    }
+  else
+    {
+      ClearNameAddress (name);
+      noAddress.erase (name);
+      unresolved.erase (name);
+    }
+
+  std::map<int, NameSet>::iterator ci = byColor.find (e.color);
+  assert (ci != byColor.end ());
+  ci->second.erase (name);
+  if (ci->second.empty ())
+    byColor.erase (ci);
+
+  BOOST_FOREACH (const Coord& c, e.tiles)
+    {
+      std::map<Coord, NameCounts>::iterator ti = byTile.find (c);
+      assert (ti != byTile.end ());
+      NameCounts::iterator ni = ti->second.find (name);
+      assert (ni != ti->second.end () && ni->second > 0);
+      if (--ni->second == 0)
+        ti->second.erase (ni);
+      if (ti->second.empty ())
+        byTile.erase (ti);
+    }
+
+  entries.erase (mi);
+}
+
+void
+PlayerIndex::ClearNameAddress (const PlayerID& name)
+{
+  const std::map<PlayerID, std::string>::iterator mi
+    = nameAddresses.find (name);
+  if (mi == nameAddresses.end ())
+    return;
+
+  const std::map<std::string, NameSet>::iterator ai
+    = byNameAddress.find (mi->second);
+  assert (ai != byNameAddress.end ());
+  ai->second.erase (name);
+  if (ai->second.empty ())
+    byNameAddress.erase (ai);
+
+  nameAddresses.erase (mi);
+}
+
+/* Store the looked up addresses of the given names.  Names that were
+   changed in the mean time are left alone.  Names without address have
+   no (or a spent) name output and are not paid to any address.  */
+void
+PlayerIndex::Resolve (const NameSet& names,
+                      const std::map<PlayerID, std::string>& addresses)
+{
+  BOOST_FOREACH (const PlayerID& name, names)
+    {
+      if (unresolved.erase (name) == 0)
+        continue;
+
+      const std::map<PlayerID, std::string>::const_iterator mi
+        = addresses.find (name);
+      if (mi == addresses.end ())
+        {
+          printf ("PlayerIndex: no address found for name %s\n",
+                  name.c_str ());
+          continue;
+        }
+
+      nameAddresses[name] = mi->second;
+      byNameAddress[mi->second].insert (name);
+    }
+}
+
+const std::string&
+PlayerIndex::GetRewardAddress (const PlayerID& name,
+                               const PlayerState& pl) const
+{
+  static const std::string EMPTY;
+
+  if (!pl.address.empty ())
+    return pl.address;
+
+  const std::map<PlayerID, std::string>::const_iterator mi
+    = nameAddresses.find (name);
+  if (mi == nameAddresses.end ())
+    return EMPTY;
+  return mi->second;
+}
+
+void
+PlayerIndex::Rebuild (const GameState& state)
+{
+  entries.clear ();
+  byAddress.clear ();
+  byColor.clear ();
+  byTile.clear ();
+  noAddress.clear ();
+  unresolved.clear ();
+  nameAddresses.clear ();
+  byNameAddress.clear ();
+
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p, state.players)
+    Add (p.first, p.second);
+
+  fValid = true;
+  nHeight = state.nHeight;
+  hashBlock = state.hashBlock;
+}
+
+void
+PlayerIndex::Update (const GameState& state, const StateChangeSet& changes,
+                     const std::set<PlayerID>& updatedNames)
+{
+  /* Names updated in the block may have been transferred.  */
+  BOOST_FOREACH (const PlayerID& name, updatedNames)
+    if (noAddress.count (name) > 0)
+      {
+        ClearNameAddress (name);
+        unresolved.insert (name);
+      }
+
+  BOOST_FOREACH (const PlayerID& name, changes.players)
+    {
+      Remove (name);
+
+      const PlayerStateMap::const_iterator mi = state.players.find (name);
+      if (mi != state.players.end ())
+        Add (name, mi->second);
+    }
+
+  nHeight = state.nHeight;
+  hashBlock = state.hashBlock;
+}
+
+void
+PlayerIndex::Find (const GameState& state, const PlayerFilter& filter,
+                   std::vector<PlayerID>& out) const
+{
+  assert (Has (state));
+  assert (!filter.IsEmpty ());
+  out.clear ();
+
+  /* Find the smallest candidate list among the enabled criteria.  If any
+     of them has no entry at all, there are no matches.  */
+  const NameSet* pset = NULL;
+  const NameCounts* pcounts = NULL;
+  size_t best = 0;
+  bool first = true;
+
+  /* Players paid to the address, either directly or through their name.
+     Usually only one of both is non-empty, so that the set is only
+     copied if needed.  */
+  NameSet addressNames;
+  if (filter.fAddress)
+    {
+      assert (unresolved.empty ());
+
+      std::map<std::string, NameSet>::const_iterator mi, ni;
+      mi = byAddress.find (filter.address);
+      ni = byNameAddress.find (filter.address);
+      if (mi == byAddress.end () && ni == byNameAddress.end ())
+        return;
+
+      if (ni == byNameAddress.end ())
+        pset = &mi->second;
+      else if (mi == byAddress.end ())
+        pset = &ni->second;
+      else
+        {
+          addressNames = mi->second;
+          addressNames.insert (ni->second.begin (), ni->second.end ());
+          pset = &addressNames;
+        }
+      best = pset->size ();
+      first = false;
+    }
+
+  if (filter.fColor)
+    {
+      std::map<int, NameSet>::const_iterator mi = byColor.find (filter.color);
+      if (mi == byColor.end ())
+        return;
+      if (first || mi->second.size () < best)
+        {
+          pset = &mi->second;
+          best = pset->size ();
+          first = false;
+        }
+    }
+
+  if (filter.fTile)
+    {
+      std::map<Coord, NameCounts>::const_iterator mi = byTile.find (filter.tile);
+      if (mi == byTile.end ())
+        return;
+      if (first || mi->second.size () < best)
+        {
+          pset = NULL;
+          pcounts = &mi->second;
+        }
+    }
+
+  /* Check the remaining criteria for each candidate directly.  */
+  std::vector<PlayerID> candidates;
+  if (pset)
+    candidates.assign (pset->begin (), pset->end ());
+  else
+    {
+      assert (pcounts);
+      BOOST_FOREACH (const PAIRTYPE(PlayerID, unsigned)& p, *pcounts)
+        candidates.push_back (p.first);
+    }
+
+  BOOST_FOREACH (const PlayerID& name, candidates)
+    {
+      const PlayerStateMap::const_iterator mi = state.players.find (name);
+      assert (mi != state.players.end ());
+      if (filter.Matches (mi->second, GetRewardAddress (name, mi->second)))
+        out.push_back (name);
+    }
+}
+
+static CCriticalSection cs_playerIndex;
+static PlayerIndex playerIndex;
+
+/* Look up the addresses holding the given names at the state's height.
+   Returns false if some of them were updated after it.  */
+static bool
+LookupNameAddresses (const GameState& state, const std::set<PlayerID>& names,
+                     std::map<PlayerID, std::string>& addresses)
+{
+  std::set<vchType> vchNames;
+  BOOST_FOREACH (const PlayerID& name, names)
+    vchNames.insert (vchFromString (name));
+
+  std::map<vchType, std::string> vchAddresses;
+  std::set<vchType> tooNew;
+  CNameDB dbName("r");
+  if (!GetNameAddressesAtHeight (dbName, vchNames, state.nHeight,
+                                 vchAddresses, tooNew))
+    return false;
+  if (!tooNew.empty ())
+    return false;
+
+  addresses.clear ();
+  typedef std::pair<const vchType, std::string> AddressEntry;
+  BOOST_FOREACH (const AddressEntry& a, vchAddresses)
+    addresses.insert (std::make_pair (stringFromVch (a.first), a.second));
+
+  return true;
+}
+
+/* Number of attempts to resolve the name addresses for the indexed state
+   while new blocks keep coming in.  */
+static const unsigned MAX_LOOKUP_TRIES = 3;
+
+bool
+Game::FindPlayers (const GameState& state, const PlayerFilter& filter,
+                   std::vector<PlayerID>& out)
+{
+  /* The name DB is read without holding cs_playerIndex (or cs_main):  A
+     block being connected updates the index while it holds the name DB
+     transaction, and reads of the name DB may wait for that.  */
+  for (unsigned nTry = 0; nTry < MAX_LOOKUP_TRIES; ++nTry)
+    {
+      bool fIndexed = false;
+      std::set<PlayerID> names;
+      CRITICAL_BLOCK(cs_playerIndex)
+        {
+          if (!playerIndex.Has (state) && playerIndex.ShouldReplace (state))
+            playerIndex.Rebuild (state);
+          fIndexed = playerIndex.Has (state);
+          if (fIndexed)
+            {
+              if (!filter.fAddress || playerIndex.GetUnresolved ().empty ())
+                {
+                  playerIndex.Find (state, filter, out);
+                  return true;
+                }
+              names = playerIndex.GetUnresolved ();
+            }
+        }
+      if (!fIndexed)
+        break;
+
+      /* If names were updated after the state, a new block has been
+         attached and the state is no longer the indexed one.  */
+      std::map<PlayerID, std::string> addresses;
+      if (!LookupNameAddresses (state, names, addresses))
+        continue;
+
+      CRITICAL_BLOCK(cs_playerIndex)
+        if (playerIndex.Has (state))
+          playerIndex.Resolve (names, addresses);
+    }
+
+  /* Queries for older states use a temporary index.  The name addresses
+     are resolved at the state's height, which fails for names that were
+     updated since then.  */
+  PlayerIndex tmp;
+  tmp.Rebuild (state);
+  if (filter.fAddress && !tmp.GetUnresolved ().empty ())
+    {
+      const std::set<PlayerID> names = tmp.GetUnresolved ();
+      std::map<PlayerID, std::string> addresses;
+      if (!LookupNameAddresses (state, names, addresses))
+        return false;
+      tmp.Resolve (names, addresses);
+    }
+  tmp.Find (state, filter, out);
+
+  return true;
+}
+
+void
+Game::AdvancePlayerIndex (const GameState& inState, const GameState& outState,
+                          const StateChangeSet& changes,
+                          const std::set<PlayerID>& updatedNames)
+{
+  CRITICAL_BLOCK(cs_playerIndex)
+    if (playerIndex.Has (inState))
+      playerIndex.Update (outState, changes, updatedNames);
+}
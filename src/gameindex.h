@@ -0,0 +1,89 @@
+#ifndef GAMEINDEX_H
+#define GAMEINDEX_H
+
+#include "gamestate.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+// Secondary indexes over the players of a game state:  by reward address,
+// by colour and by the tiles occupied by their characters.  They are
+// maintained for the most recent state, updated incrementally with each
+// step, so that lookups need not scan the whole world.  Players without
+// a reward address are paid to the address holding their name, which is
+// looked up in the name DB when first needed and again only after the
+// name is updated.
+
+namespace Game
+{
+
+struct StateChangeSet;
+
+/**
+ * Filter for player lookups.  All enabled criteria must match.
+ */
+struct PlayerFilter
+{
+
+  bool fAddress;
+  std::string address;
+
+  bool fColor;
+  int color;
+
+  bool fTile;
+  Coord tile;
+
+  PlayerFilter ()
+    : fAddress(false), fColor(false), color(-1), fTile(false)
+  {}
+
+  inline bool
+  IsEmpty () const
+  {
+    return !fAddress && !fColor && !fTile;
+  }
+
+  /**
+   * Check a player against the filter directly.
+   * @param pl The player's state.
+   * @param rewardAddress The address the player is paid to, which is the
+   *                      one of its name if pl.address is empty.
+   */
+  bool Matches (const PlayerState& pl, const std::string& rewardAddress) const;
+
+};
+
+/**
+ * Find all players matching the filter.  The index for the state is used
+ * (and built first if it is not yet the indexed one).  The cost is
+ * proportional to the size of the smallest matching index entry.  When
+ * filtering by address, the addresses of names not yet known are looked
+ * up at the state's height.  Older states use a temporary index.
+ * @param state The game state to query.
+ * @param filter The filter criteria.  Must not be empty.
+ * @param out Names of matching players (sorted) are returned here.
+ * @return False if filtering by address and the address of a name at the
+ *         state's height is not known, since it was updated later.
+ */
+bool FindPlayers (const GameState& state, const PlayerFilter& filter,
+                  std::vector<PlayerID>& out);
+
+/**
+ * Notify about a performed game step or its rollback.  If the index holds
+ * the old state, it is updated for the changed players.  Otherwise nothing
+ * is done.
+ * @param inState The state before the step.
+ * @param outState The state after it.
+ * @param changes Changed entities between both states.
+ * @param updatedNames Names updated by name txs in the block, whose
+ *                     addresses have to be looked up again.
+ */
+void AdvancePlayerIndex (const GameState& inState, const GameState& outState,
+                         const StateChangeSet& changes,
+                         const std::set<PlayerID>& updatedNames);
+
+}
+
+#endif // GAMEINDEX_H
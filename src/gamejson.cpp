@@ -0,0 +1,260 @@
+#include "gamejson.h"
+
+#include "gamecommitment.h"
+#include "headers.h"
+
+#include "json/json_spirit_writer_template.h"
+
+using namespace Game;
+using namespace json_spirit;
+
+/**
+ * Encoded JSON fragments of a single game state.  The players are kept in
+ * the same (sorted) order as in the game state, so that the assembled
+ * text matches the encoding of GameState::ToJsonValue exactly.  The
+ * assembled text is kept as well until the state changes, so that the
+ * fragments are only joined once per block and not for every query.
+ */
+class GameStateJsonCache
+{
+
+private:
+
+  typedef std::map<PlayerID, std::string> FragmentMap;
+
+  bool fValid;
+  int nHeight;
+  uint256 hashBlock;
+
+  FragmentMap players;
+  FragmentMap deadPlayers;
+  std::string loot;
+  std::string hearts;
+  std::string banks;
+
+  mutable bool fAssembled;
+  mutable std::string assembled;
+
+  static inline std::string
+  Encode (const Value& val)
+  {
+    return write_string (val, false);
+  }
+
+  static std::string
+  PlayerToJson (const GameState& state, const PlayerID& name,
+                const PlayerState& pl)
+  {
+    const int crownIndex = (name == state.crownHolder.player
+                              ? state.crownHolder.index : -1);
+    return Encode (pl.ToJsonValue (crownIndex));
+  }
+
+  /* Re-encode (or remove) the fragment of a single player.  */
+  static void
+  UpdatePlayer (const GameState& state, const PlayerID& name,
+                FragmentMap& fragments)
+  {
+    const PlayerStateMap::const_iterator mi = state.players.find (name);
+    if (mi == state.players.end ())
+      fragments.erase (name);
+    else
+      fragments[name] = PlayerToJson (state, name, mi->second);
+  }
+
+public:
+
+  GameStateJsonCache ()
+    : fValid(false), nHeight(-1), hashBlock(0), fAssembled(false)
+  {}
+
+  inline bool
+  Has (const GameState& state) const
+  {
+    return fValid && hashBlock == state.hashBlock && nHeight == state.nHeight;
+  }
+
+  /* Whether the cache should switch to the given state if it is
+     queried.  This is the case for states at least as new as the cached
+     one (also on a different branch after a reorg).  */
+  inline bool
+  ShouldReplace (const GameState& state) const
+  {
+    return !fValid || nHeight <= state.nHeight;
+  }
+
+  void Rebuild (const GameState& state);
+  void Update (const GameState& inState, const GameState& outState,
+               const StateChangeSet& changes);
+  const std::string& Assemble (const GameState& state) const;
+
+};
+
+void
+GameStateJsonCache::Rebuild (const GameState& state)
+{
+  players.clear ();
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p, state.players)
+    players.insert (std::make_pair (p.first,
+                                    PlayerToJson (state, p.first, p.second)));
+
+  deadPlayers.clear ();
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p,
+                 state.dead_players_chat)
+    deadPlayers.insert (std::make_pair (p.first,
+                                        Encode (p.second.ToJsonValue (-1,
+                                                                      true))));
+
+  loot = Encode (state.LootToJsonValue ());
+  hearts = Encode (state.HeartsToJsonValue ());
+  banks = Encode (state.BanksToJsonValue ());
+
+  fAssembled = false;
+  assembled.clear ();
+
+  fValid = true;
+  nHeight = state.nHeight;
+  hashBlock = state.hashBlock;
+}
+
+void
+GameStateJsonCache::Update (const GameState& inState,
+                            const GameState& outState,
+                            const StateChangeSet& changes)
+{
+  assert (Has (inState));
+
+  BOOST_FOREACH (const PlayerID& name, changes.players)
+    UpdatePlayer (outState, name, players);
+
+  /* The crown holder's JSON contains the crown, so both the old and new
+     holder have to be re-encoded if it changed.  */
+  if (inState.crownHolder.player != outState.crownHolder.player
+      || inState.crownHolder.index != outState.crownHolder.index)
+    {
+      if (!inState.crownHolder.player.empty ())
+        UpdatePlayer (outState, inState.crownHolder.player, players);
+      if (!outState.crownHolder.player.empty ())
+        UpdatePlayer (outState, outState.crownHolder.player, players);
+    }
+
+  BOOST_FOREACH (const PlayerID& name, changes.deadPlayersChat)
+    {
+      const PlayerStateMap::const_iterator mi
+        = outState.dead_players_chat.find (name);
+      if (mi == outState.dead_players_chat.end ())
+        deadPlayers.erase (name);
+      else
+        deadPlayers[name] = Encode (mi->second.ToJsonValue (-1, true));
+    }
+
+  if (!changes.loot.empty ())
+    loot = Encode (outState.LootToJsonValue ());
+  if (!changes.hearts.empty ())
+    hearts = Encode (outState.HeartsToJsonValue ());
+  if (!changes.banks.empty ())
+    banks = Encode (outState.BanksToJsonValue ());
+
+  fAssembled = false;
+  assembled.clear ();
+
+  nHeight = outState.nHeight;
+  hashBlock = outState.hashBlock;
+
+  if (fDebug)
+    printf ("GameStateJsonCache: re-encoded %u players for block @%d\n",
+            static_cast<unsigned> (changes.players.size ()), nHeight);
+}
+
+/* Append the fragments of a player map as members of an object.  */
+static void
+AppendPlayers (const std::map<PlayerID, std::string>& fragments, bool& fFirst,
+               std::string& out)
+{
+  typedef std::map<PlayerID, std::string> FragmentMap;
+  for (FragmentMap::const_iterator mi = fragments.begin ();
+       mi != fragments.end (); ++mi)
+    {
+      if (!fFirst)
+        out += ',';
+      fFirst = false;
+      out += write_string (Value (mi->first), false);
+      out += ':';
+      out += mi->second;
+    }
+}
+
+const std::string&
+GameStateJsonCache::Assemble (const GameState& state) const
+{
+  assert (Has (state));
+  if (fAssembled)
+    return assembled;
+
+  /* The globals are few and cheap, encode them as an object and splice
+     its members in after the cached sections.  */
+  Object globals;
+  state.AddGlobalsToJson (globals);
+  const std::string globalsText = Encode (globals);
+  assert (globalsText.size () >= 2);
+
+  assembled.clear ();
+  assembled.reserve (64 + 256 * (players.size () + deadPlayers.size ())
+                     + loot.size () + hearts.size () + banks.size ()
+                     + globalsText.size ());
+
+  assembled += "{\"players\":{";
+  bool fFirst = true;
+  AppendPlayers (players, fFirst, assembled);
+  AppendPlayers (deadPlayers, fFirst, assembled);
+  assembled += "},\"loot\":";
+  assembled += loot;
+  assembled += ",\"hearts\":";
+  assembled += hearts;
+  assembled += ",\"banks\":";
+  assembled += banks;
+  if (globalsText.size () > 2)
+    {
+      assembled += ',';
+      assembled.append (globalsText, 1, globalsText.size () - 2);
+    }
+  assembled += '}';
+
+  fAssembled = true;
+
+  return assembled;
+}
+
+static CCriticalSection cs_jsonCache;
+static GameStateJsonCache jsonCache;
+
+std::string
+Game::GetGameStateJson (const GameState& state)
+{
+  CRITICAL_BLOCK(cs_jsonCache)
+    {
+      if (!jsonCache.Has (state))
+        {
+          /* Do not replace the cache for queries of old states.  */
+          if (!jsonCache.ShouldReplace (state))
+            return write_string (state.ToJsonValue (), false);
+          jsonCache.Rebuild (state);
+        }
+
+      return jsonCache.Assemble (state);
+    }
+
+  /* Not reached.  */
+  assert (false);
+  return "";
+}
+
+void
+Game::AdvanceGameStateJson (const GameState& inState,
+                            const GameState& outState,
+                            const StateChangeSet& changes)
+{
+  CRITICAL_BLOCK(cs_jsonCache)
+    if (jsonCache.Has (inState))
+      jsonCache.Update (inState, outState, changes);
+}
@@ -0,0 +1,46 @@
+#ifndef GAMEJSON_H
+#define GAMEJSON_H
+
+#include "gamestate.h"
+
+#include <string>
+
+// Cache of the JSON representation of recent game states.  game_getstate
+// is polled every block by many clients, and most players do not change
+// between blocks.  The encoded JSON fragments of each player and of the
+// loot, hearts and banks sections are thus kept and only the changed ones
+// are re-encoded after a step.  The full text is put together once per
+// block and handed to the RPC server as is.
+
+namespace Game
+{
+
+struct StateChangeSet;
+
+/**
+ * Return the encoded JSON of the given game state, equal to the compact
+ * write_string of GameState::ToJsonValue.  If the cache holds the state,
+ * the text is assembled from the cached fragments once and then returned
+ * for all queries of the same state.  If the state is newer than the
+ * cached one, the cache is rebuilt for it.  Older states are
+ * converted directly.
+ * @param state The game state.
+ * @return Its JSON text.
+ */
+std::string GetGameStateJson (const GameState& state);
+
+/**
+ * Notify about a performed game step.  If the cache holds the old state,
+ * only the fragments of changed players and sections are re-encoded for
+ * the new one.  Otherwise nothing is done (the cache is filled on the
+ * next query).
+ * @param inState The state before the step.
+ * @param outState The state after it.
+ * @param changes Changed entities between both states.
+ */
+void AdvanceGameStateJson (const GameState& inState, const GameState& outState,
+                           const StateChangeSet& changes);
+
+}
+
+#endif // GAMEJSON_H
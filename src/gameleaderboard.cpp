@@ -0,0 +1,555 @@
+#include "gameleaderboard.h"
+
+#include "gamecommitment.h"
+#include "gamedb.h"
+#include "headers.h"
+
+#include <boost/noncopyable.hpp>
+
+using namespace Game;
+
+/* ************************************************************************** */
+/* RankedSet.  */
+
+/**
+ * Set of values with logarithmic insertion, removal and rank lookup.  It
+ * is a treap whose nodes are augmented with the size of their subtree.
+ */
+template<typename T>
+  class RankedSet : private boost::noncopyable
+{
+
+private:
+
+  struct Node
+  {
+    T val;
+    unsigned prio;
+    unsigned size;
+    Node* left;
+    Node* right;
+
+    Node (const T& v, unsigned p)
+      : val(v), prio(p), size(1), left(NULL), right(NULL)
+    {}
+  };
+
+  Node* root;
+
+  /* State of the priority generator (xorshift).  */
+  unsigned rndState;
+
+  unsigned
+  NextPriority ()
+  {
+    rndState ^= rndState << 13;
+    rndState ^= rndState >> 17;
+    rndState ^= rndState << 5;
+    return rndState;
+  }
+
+  static inline unsigned
+  Size (const Node* n)
+  {
+    return n ? n->size : 0;
+  }
+
+  static inline void
+  Pull (Node* n)
+  {
+    n->size = 1 + Size (n->left) + Size (n->right);
+  }
+
+  /* Split into the nodes less than v and the others.  */
+  static void
+  Split (Node* n, const T& v, Node*& l, Node*& r)
+  {
+    if (!n)
+      {
+        l = r = NULL;
+        return;
+      }
+
+    if (n->val < v)
+      {
+        Split (n->right, v, n->right, r);
+        l = n;
+      }
+    else
+      {
+        Split (n->left, v, l, n->left);
+        r = n;
+      }
+    Pull (n);
+  }
+
+  static Node*
+  Merge (Node* a, Node* b)
+  {
+    if (!a)
+      return b;
+    if (!b)
+      return a;
+
+    if (a->prio > b->prio)
+      {
+        a->right = Merge (a->right, b);
+        Pull (a);
+        return a;
+      }
+
+    b->left = Merge (a, b->left);
+    Pull (b);
+    return b;
+  }
+
+  static bool
+  Erase (Node*& n, const T& v)
+  {
+    if (!n)
+      return false;
+
+    bool res;
+    if (v < n->val)
+      res = Erase (n->left, v);
+    else if (n->val < v)
+      res = Erase (n->right, v);
+    else
+      {
+        Node* old = n;
+        n = Merge (n->left, n->right);
+        delete old;
+        return true;
+      }
+
+    if (res)
+      Pull (n);
+    return res;
+  }
+
+  static void
+  Free (Node* n)
+  {
+    if (!n)
+      return;
+    Free (n->left);
+    Free (n->right);
+    delete n;
+  }
+
+public:
+
+  RankedSet ()
+    : root(NULL), rndState(2463534242u)
+  {}
+
+  ~RankedSet ()
+  {
+    Free (root);
+  }
+
+  inline unsigned
+  size () const
+  {
+    return Size (root);
+  }
+
+  void
+  clear ()
+  {
+    Free (root);
+    root = NULL;
+  }
+
+  /* Insert a value, which must not yet be in the set.  */
+  void
+  insert (const T& v)
+  {
+    Node *l, *r;
+    Split (root, v, l, r);
+    root = Merge (Merge (l, new Node (v, NextPriority ())), r);
+  }
+
+  bool
+  erase (const T& v)
+  {
+    return Erase (root, v);
+  }
+
+  /* Return the number of values less than v.  */
+  unsigned
+  rank (const T& v) const
+  {
+    unsigned res = 0;
+    const Node* n = root;
+    while (n)
+      {
+        if (n->val < v)
+          {
+            res += Size (n->left) + 1;
+            n = n->right;
+          }
+        else
+          n = n->left;
+      }
+
+    return res;
+  }
+
+  /* Return the smallest count values in order.  */
+  void
+  first (unsigned count, std::vector<T>& out) const
+  {
+    out.clear ();
+
+    std::vector<const Node*> stack;
+    const Node* n = root;
+    while ((n || !stack.empty ()) && out.size () < count)
+      {
+        if (n)
+          {
+            stack.push_back (n);
+            n = n->left;
+          }
+        else
+          {
+            n = stack.back ();
+            stack.pop_back ();
+            out.push_back (n->val);
+            n = n->right;
+          }
+      }
+  }
+
+};
+
+/* ************************************************************************** */
+/* Leaderboard.  */
+
+bool
+Game::ParseLeaderboardType (const std::string& name, LeaderboardType& type)
+{
+  if (name == "loot")
+    type = LEADERBOARD_LOOT;
+  else if (name == "hunters")
+    type = LEADERBOARD_HUNTERS;
+  else if (name == "vaults")
+    type = LEADERBOARD_VAULTS;
+  else if (name == "kills")
+    type = LEADERBOARD_KILLS;
+  else
+    return false;
+
+  return true;
+}
+
+/**
+ * A single leaderboard.  Entries are ordered by decreasing score and then
+ * by id.  Entries with zero score are not kept.
+ */
+class Leaderboard
+{
+
+private:
+
+  struct Key
+  {
+    int64_t score;
+    std::string id;
+
+    Key (int64_t s, const std::string& i)
+      : score(s), id(i)
+    {}
+
+    inline bool
+    operator< (const Key& k) const
+    {
+      if (score != k.score)
+        return score > k.score;
+      return id < k.id;
+    }
+  };
+
+  std::map<std::string, int64_t> scores;
+  RankedSet<Key> ranked;
+
+public:
+
+  void
+  Clear ()
+  {
+    scores.clear ();
+    ranked.clear ();
+  }
+
+  inline unsigned
+  Size () const
+  {
+    return scores.size ();
+  }
+
+  inline int64_t
+  GetScore (const std::string& id) const
+  {
+    const std::map<std::string, int64_t>::const_iterator mi = scores.find (id);
+    if (mi == scores.end ())
+      return 0;
+    return mi->second;
+  }
+
+  void
+  Set (const std::string& id, int64_t score)
+  {
+    const std::map<std::string, int64_t>::iterator mi = scores.find (id);
+    if (mi != scores.end ())
+      {
+        if (mi->second == score)
+          return;
+        ranked.erase (Key (mi->second, id));
+        scores.erase (mi);
+      }
+
+    if (score != 0)
+      {
+        scores.insert (std::make_pair (id, score));
+        ranked.insert (Key (score, id));
+      }
+  }
+
+  void
+  Top (unsigned count, std::vector<LeaderboardEntry>& out) const
+  {
+    std::vector<Key> keys;
+    ranked.first (count, keys);
+
+    out.clear ();
+    for (unsigned i = 0; i < keys.size (); ++i)
+      {
+        LeaderboardEntry e;
+        e.id = keys[i].id;
+        e.score = keys[i].score;
+        e.rank = i + 1;
+        out.push_back (e);
+      }
+  }
+
+  bool
+  Lookup (const std::string& id, LeaderboardEntry& e) const
+  {
+    const std::map<std::string, int64_t>::const_iterator mi = scores.find (id);
+    if (mi == scores.end ())
+      return false;
+
+    e.id = id;
+    e.score = mi->second;
+    e.rank = ranked.rank (Key (mi->second, id)) + 1;
+    return true;
+  }
+
+};
+
+/* All leaderboards for one game state.  */
+class Leaderboards
+{
+
+private:
+
+  bool fValid;
+  int nHeight;
+  uint256 hashBlock;
+  int nKillsSince;
+
+  Leaderboard boards[NUM_LEADERBOARDS];
+
+  static inline std::string
+  CharacterKey (const PlayerID& name, int index)
+  {
+    return CharacterID (name, index).ToString ();
+  }
+
+  void
+  AddPlayer (const PlayerID& name, const PlayerState& pl)
+  {
+    BOOST_FOREACH (const PAIRTYPE(int, CharacterState)& c, pl.characters)
+      boards[LEADERBOARD_LOOT].Set (CharacterKey (name, c.first),
+                                    c.second.loot.nAmount);
+    boards[LEADERBOARD_HUNTERS].Set (name, pl.characters.size ());
+  }
+
+  void
+  RemovePlayer (const PlayerID& name, const PlayerState& pl)
+  {
+    BOOST_FOREACH (const PAIRTYPE(int, CharacterState)& c, pl.characters)
+      boards[LEADERBOARD_LOOT].Set (CharacterKey (name, c.first), 0);
+    boards[LEADERBOARD_HUNTERS].Set (name, 0);
+  }
+
+public:
+
+  Leaderboards ()
+    : fValid(false), nHeight(-1), hashBlock(0), nKillsSince(-1)
+  {}
+
+  inline bool
+  Has (const GameState& state) const
+  {
+    return fValid && hashBlock == state.hashBlock && nHeight == state.nHeight;
+  }
+
+  void Rebuild (const GameState& state, int nSince,
+                const std::map<PlayerID, int64_t>& kills);
+  void Update (const GameState& inState, const GameState& outState,
+               const StateChangeSet& changes, const KillList& kills,
+               int nSign);
+  void Query (LeaderboardType type, unsigned count, const std::string& id,
+              LeaderboardResult& res) const;
+
+};
+
+void
+Leaderboards::Rebuild (const GameState& state, int nSince,
+                       const std::map<PlayerID, int64_t>& kills)
+{
+  for (unsigned i = 0; i < NUM_LEADERBOARDS; ++i)
+    boards[i].Clear ();
+
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p, state.players)
+    AddPlayer (p.first, p.second);
+#ifdef PERMANENT_LUGGAGE
+  BOOST_FOREACH (const PAIRTYPE(std::string, StorageVault)& v, state.vault)
+    boards[LEADERBOARD_VAULTS].Set (v.first, v.second.nGems);
+#endif
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, int64_t)& k, kills)
+    boards[LEADERBOARD_KILLS].Set (k.first, k.second);
+
+  fValid = true;
+  nHeight = state.nHeight;
+  hashBlock = state.hashBlock;
+  nKillsSince = nSince;
+}
+
+/* Update the boards from inState to outState, which is either the next
+   state (nSign = 1) or the parent (nSign = -1) when a block is
+   disconnected.  The kills are those of the block between both.  */
+void
+Leaderboards::Update (const GameState& inState, const GameState& outState,
+                      const StateChangeSet& changes, const KillList& kills,
+                      int nSign)
+{
+  assert (Has (inState));
+
+  BOOST_FOREACH (const PlayerID& name, changes.players)
+    {
+      PlayerStateMap::const_iterator mi = inState.players.find (name);
+      if (mi != inState.players.end ())
+        RemovePlayer (name, mi->second);
+
+      mi = outState.players.find (name);
+      if (mi != outState.players.end ())
+        AddPlayer (name, mi->second);
+    }
+
+#ifdef PERMANENT_LUGGAGE
+  BOOST_FOREACH (const std::string& addr, changes.vaults)
+    {
+      std::map<std::string, StorageVault>::const_iterator mi;
+      mi = outState.vault.find (addr);
+      if (mi == outState.vault.end ())
+        boards[LEADERBOARD_VAULTS].Set (addr, 0);
+      else
+        boards[LEADERBOARD_VAULTS].Set (addr, mi->second.nGems);
+    }
+#endif
+
+  Leaderboard& killBoard = boards[LEADERBOARD_KILLS];
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerID)& k, kills)
+    killBoard.Set (k.first, killBoard.GetScore (k.first) + nSign);
+
+  nHeight = outState.nHeight;
+  hashBlock = outState.hashBlock;
+}
+
+void
+Leaderboards::Query (LeaderboardType type, unsigned count,
+                     const std::string& id, LeaderboardResult& res) const
+{
+  assert (type >= 0 && type < NUM_LEADERBOARDS);
+  const Leaderboard& board = boards[type];
+
+  res.nHeight = nHeight;
+  res.hashBlock = hashBlock;
+  res.nKillsSince = nKillsSince;
+  res.nEntries = board.Size ();
+  board.Top (count, res.top);
+
+  res.fFound = false;
+  if (!id.empty ())
+    res.fFound = board.Lookup (id, res.entry);
+}
+
+void
+Game::GetStepKills (const StepResult& stepResult, KillList& kills)
+{
+  /* Count each killed player at most once per killing player, even if
+     multiple of its characters took part.  */
+  std::set<std::pair<PlayerID, PlayerID> > unique;
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, KilledByInfo)& k,
+                 stepResult.GetKilledBy ())
+    if (k.second.reason == KilledByInfo::KILLED_DESTRUCT
+        && k.second.killer.player != k.first)
+      unique.insert (std::make_pair (k.second.killer.player, k.first));
+
+  kills.assign (unique.begin (), unique.end ());
+}
+
+static CCriticalSection cs_leaderboards;
+static Leaderboards leaderboards;
+
+void
+Game::QueryLeaderboard (const GameState& state, LeaderboardType type,
+                        unsigned count, const std::string& id,
+                        LeaderboardResult& res)
+{
+  bool fHas;
+  CRITICAL_BLOCK(cs_leaderboards)
+    fHas = leaderboards.Has (state);
+
+  /* The game DB is read without holding cs_leaderboards, since blocks
+     update the boards while their DB transaction is open.  */
+  int nSince = state.nHeight + 1;
+  std::map<PlayerID, int64_t> kills;
+  if (!fHas && !ReadKillCounts (state.nHeight, nSince, kills))
+    {
+      printf ("QueryLeaderboard: failed to read the kills @%d\n",
+              state.nHeight);
+      nSince = state.nHeight + 1;
+      kills.clear ();
+    }
+
+  CRITICAL_BLOCK(cs_leaderboards)
+    {
+      if (!leaderboards.Has (state))
+        leaderboards.Rebuild (state, nSince, kills);
+      leaderboards.Query (type, count, id, res);
+    }
+}
+
+void
+Game::AdvanceLeaderboards (const GameState& inState, const GameState& outState,
+                           const StateChangeSet& changes,
+                           const KillList& kills)
+{
+  CRITICAL_BLOCK(cs_leaderboards)
+    if (leaderboards.Has (inState))
+      leaderboards.Update (inState, outState, changes, kills, 1);
+}
+
+void
+Game::RollbackLeaderboards (const GameState& state, const GameState& parent,
+                            const StateChangeSet& changes,
+                            const KillList& kills)
+{
+  CRITICAL_BLOCK(cs_leaderboards)
+    if (leaderboards.Has (state))
+      leaderboards.Update (state, parent, changes, kills, -1);
+}
@@ -0,0 +1,127 @@
+#ifndef GAMELEADERBOARD_H
+#define GAMELEADERBOARD_H
+
+#include "gamestate.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Leaderboards (richest loot carriers, most hunters, biggest vaults and
+// top killers) for the current game state.  They are kept in
+// order-statistic trees and updated from each step's changes, so that
+// top-K and rank queries do not need to sort the whole state.  The kills
+// are not part of the game state.  They are stored per block in the game
+// DB and summed up from there when the boards are rebuilt.
+
+namespace Game
+{
+
+struct StateChangeSet;
+
+/* The available leaderboards.  */
+enum LeaderboardType
+{
+  LEADERBOARD_LOOT = 0,   /* Characters by carried loot.  */
+  LEADERBOARD_HUNTERS,    /* Players by number of hunters.  */
+  LEADERBOARD_VAULTS,     /* Vaults by gem balance (only with
+                             PERMANENT_LUGGAGE).  */
+  LEADERBOARD_KILLS,      /* Players by number of kills.  */
+
+  NUM_LEADERBOARDS
+};
+
+/**
+ * Parse the name of a leaderboard.
+ * @param name The name ("loot", "hunters", "vaults" or "kills").
+ * @param type Set to the type.
+ * @return False if the name is unknown.
+ */
+bool ParseLeaderboardType (const std::string& name, LeaderboardType& type);
+
+/* Kills of a block as pairs of killing and killed player.  Each pair is
+   counted once, even if several characters of the killer took part.  */
+typedef std::vector<std::pair<PlayerID, PlayerID> > KillList;
+
+/**
+ * Extract the kills of a step for the leaderboard.
+ * @param stepResult The step's result.
+ * @param kills Fill in the kills here.
+ */
+void GetStepKills (const StepResult& stepResult, KillList& kills);
+
+/* One entry of a leaderboard.  */
+struct LeaderboardEntry
+{
+
+  /* Player name, character ID ("name.index") or vault address.  */
+  std::string id;
+  int64_t score;
+  /* 1-based rank on the board.  */
+  unsigned rank;
+
+};
+
+/* Result of a leaderboard query.  */
+struct LeaderboardResult
+{
+
+  /* Height and block of the state the board refers to.  */
+  int nHeight;
+  uint256 hashBlock;
+
+  /* Height from which on kills are recorded in the game DB.  */
+  int nKillsSince;
+
+  /* Total number of entries on the board.  */
+  unsigned nEntries;
+
+  std::vector<LeaderboardEntry> top;
+
+  /* Entry of the queried id, if any and found.  */
+  bool fFound;
+  LeaderboardEntry entry;
+
+};
+
+/**
+ * Query a leaderboard for the given (current) state.  If the boards do not
+ * yet refer to it, they are rebuilt, with the kills read from the game DB.
+ * @param state The game state.
+ * @param type The board to query.
+ * @param count Number of top entries to return.
+ * @param id If not empty, also look up the rank of this id.
+ * @param res Fill in the result.
+ */
+void QueryLeaderboard (const GameState& state, LeaderboardType type,
+                       unsigned count, const std::string& id,
+                       LeaderboardResult& res);
+
+/**
+ * Notify about a performed game step.  If the boards refer to the old
+ * state, they are updated with the changes and kills of the step.
+ * @param inState The state before the step.
+ * @param outState The state after it.
+ * @param changes Changed entities between both states.
+ * @param kills The kills of the step.
+ */
+void AdvanceLeaderboards (const GameState& inState, const GameState& outState,
+                          const StateChangeSet& changes,
+                          const KillList& kills);
+
+/**
+ * Notify about a disconnected block.  If the boards refer to the state
+ * after it, they are moved back to the parent and its kills are taken
+ * off the counts again.
+ * @param state The state after the block.
+ * @param parent The state before it.
+ * @param changes Changed entities between both states.
+ * @param kills The kills of the block.
+ */
+void RollbackLeaderboards (const GameState& state, const GameState& parent,
+                           const StateChangeSet& changes,
+                           const KillList& kills);
+
+}
+
+#endif // GAMELEADERBOARD_H
@@ -1,16 +1,25 @@
 #include "gamemovecreator.h"
 #include "gamemap.h"
+#include "util.h"
 
 #include <deque>
+#include <queue>
 
 #ifndef Q_MOC_RUN
+#include <boost/bind.hpp>
 #include <boost/graph/astar_search.hpp>
 #include <boost/graph/grid_graph.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
 #include <boost/unordered_map.hpp>
 #endif
 
 using namespace Game;
 
+// The original path finder based on the Boost Graph Library.  FindPath
+// now uses the flat-array search below, and this one is only kept as
+// reference for the unit tests and BenchmarkFindPath.
+
 struct neighbor_iterator;
 
 // Model of:
@@ -242,24 +251,8 @@ private:
     V const defaultValue;
 };
 
-// Helper function for creating waypoints (linear path segments)
-bool CheckLinearPath(const Game::Coord &start, const Game::Coord &target)
-{
-    CharacterState tmp;
-    tmp.from = tmp.coord = start;
-    tmp.waypoints.push_back(target);
-    while (!tmp.waypoints.empty())
-        tmp.MoveTowardsWaypoint();
-    return tmp.coord == target;
-}
-
-std::vector<Coord> FindPath(const Coord &start, const Coord &goal)
+bool FindPathReference(const Coord &start, const Coord &goal, std::deque<Coord> &solution)
 {
-    std::vector<Game::Coord> waypoints;
-
-    if (!WalkableCoord(start) || !WalkableCoord(goal))
-        return waypoints;
-
     boost::static_property_map<int> weight(1);
 
     // The predecessor map is a vertex-to-vertex mapping.
@@ -301,39 +294,1559 @@ std::vector<Coord> FindPath(const Coord &start, const Coord &goal)
     }
 
     if (!found)
-        return waypoints;
+        return false;
 
     // Walk backwards from the goal through the predecessor chain adding
     // vertices to the solution path.
-    std::deque<Game::Coord> solution;
+    solution.clear();
     for (Coord u = goal; u != start; u = predecessor[u])
         solution.push_front(u);
 
-    // Generate waypoints by linearizing parts of path
-    waypoints.push_back(start);
-    while (!solution.empty())
+    return true;
+}
+
+// Landmark tables for the ALT heuristic.  For a few landmark cells, the
+// length of the shortest path to every other cell is computed once by a
+// breadth-first search.  By the triangle inequality, the distance from a
+// cell to the goal is then at least the difference of their distances to
+// any landmark.  This bound follows the detours around obstacles, where
+// the Chebyshev distance badly underestimates.  The landmarks are spread
+// out over the map:  each one is the cell farthest away from the centre
+// of the map and the landmarks chosen before it.  Each table takes half a
+// megabyte, and building it only takes a few milliseconds, so the tables
+// are computed on first use rather than cached on disk.
+
+class PathLandmarks
+{
+public:
+    static const unsigned short UNREACHABLE = 0xFFFF;
+
+    explicit PathLandmarks(int n);
+
+    int GetCount() const { return nLandmarks; }
+
+    // Distances of a cell to all landmarks
+    const unsigned short *GetDistances(int v) const
+    {
+        return nLandmarks > 0 ? &table[v * nLandmarks] : NULL;
+    }
+
+    // Lower bound for the path length between two cells
+    int Estimate(const unsigned short *from, const unsigned short *to) const
+    {
+        int h = 0;
+        for (int i = 0; i < nLandmarks; i++)
+        {
+            if (from[i] == UNREACHABLE || to[i] == UNREACHABLE)
+                continue;
+            const int d = abs(from[i] - to[i]);
+            if (d > h)
+                h = d;
+        }
+        return h;
+    }
+
+private:
+    int nLandmarks;
+    // Distances by cell and then landmark, so that the distances needed
+    // for one heuristic evaluation are next to each other
+    std::vector<unsigned short> table;
+
+    static void ComputeDistances(int source, std::vector<unsigned short> &out);
+};
+
+const unsigned short PathLandmarks::UNREACHABLE;
+
+void PathLandmarks::ComputeDistances(int source, std::vector<unsigned short> &out)
+{
+    out.assign(MAP_WIDTH * MAP_HEIGHT, UNREACHABLE);
+    std::vector<int> queue;
+    queue.reserve(MAP_WIDTH * MAP_HEIGHT);
+
+    out[source] = 0;
+    queue.push_back(source);
+    for (unsigned i = 0; i < queue.size(); i++)
+    {
+        const int u = queue[i];
+        const int ux = u % MAP_WIDTH, uy = u / MAP_WIDTH;
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                if (dx == 0 && dy == 0)
+                    continue;
+                const int x = ux + dx, y = uy + dy;
+                if (!WalkableCoord(x, y))
+                    continue;
+                const int v = y * MAP_WIDTH + x;
+                if (out[v] != UNREACHABLE)
+                    continue;
+                out[v] = out[u] + 1;
+                queue.push_back(v);
+            }
+    }
+}
+
+PathLandmarks::PathLandmarks(int n)
+    : nLandmarks(0)
+{
+    const int nCells = MAP_WIDTH * MAP_HEIGHT;
+
+    // Start the selection from the walkable cell closest to the centre
+    const Coord centre(MAP_WIDTH / 2, MAP_HEIGHT / 2);
+    int seed = -1, seedDist = 0;
+    for (int v = 0; v < nCells; v++)
+    {
+        const Coord c(v % MAP_WIDTH, v / MAP_WIDTH);
+        if (!WalkableCoord(c))
+            continue;
+        const int d = distLInf(c, centre);
+        if (seed < 0 || d < seedDist)
+        {
+            seed = v;
+            seedDist = d;
+        }
+    }
+    if (seed < 0 || n <= 0)
+        return;
+
+    // Smallest distance of each cell to the landmarks chosen so far
+    std::vector<unsigned short> nearest, distances;
+    ComputeDistances(seed, nearest);
+
+    std::vector< std::vector<unsigned short> > tables;
+    while (static_cast<int>(tables.size()) < n)
+    {
+        int best = -1;
+        for (int v = 0; v < nCells; v++)
+            if (nearest[v] != UNREACHABLE && (best < 0 || nearest[v] > nearest[best]))
+                best = v;
+        if (best < 0 || nearest[best] == 0)
+            break;
+
+        ComputeDistances(best, distances);
+        for (int v = 0; v < nCells; v++)
+            nearest[v] = std::min(nearest[v], distances[v]);
+        tables.push_back(distances);
+    }
+
+    nLandmarks = tables.size();
+    table.resize(nCells * nLandmarks);
+    for (int v = 0; v < nCells; v++)
+        for (int i = 0; i < nLandmarks; i++)
+            table[v * nLandmarks + i] = tables[i][v];
+
+    printf("PathLandmarks: computed distances from %d landmarks\n", nLandmarks);
+}
+
+static CCriticalSection cs_pathLandmarks;
+static PathLandmarks *pathLandmarks = NULL;
+
+static const PathLandmarks &GetPathLandmarks()
+{
+    CRITICAL_BLOCK(cs_pathLandmarks)
+        if (!pathLandmarks)
+            pathLandmarks = new PathLandmarks(static_cast<int>(GetArg("-pathlandmarks", 8)));
+    return *pathLandmarks;
+}
+
+// Abstract graph for hierarchical path finding (HPA*).  The map is divided
+// into square clusters.  Where two neighbouring clusters share a run of
+// walkable cells on both sides of their border (an entrance), one pair of
+// cells in the middle of the run, or the pairs at both ends of long runs,
+// become nodes joined by an edge of length one.  Within a cluster, the
+// nodes are joined by edges as long as the shortest path between them that
+// stays inside the cluster.  The map never changes, so these distances are
+// computed only once.  Crossings between clusters that are only possible
+// diagonally are not part of the graph, so a search in it may fail even
+// though a path exists.
+class PathClusters
+{
+public:
+    static const int CLUSTER_SIZE = 16;
+    static const int CLUSTERS_X = (MAP_WIDTH + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    static const int CLUSTERS_Y = (MAP_HEIGHT + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    static const int UNREACHABLE = -1;
+
+    // Edges as (target node, length)
+    typedef std::pair<int, int> Edge;
+
+    PathClusters();
+
+    static int GetCluster(const Coord &c)
+    {
+        return (c.y / CLUSTER_SIZE) * CLUSTERS_X + c.x / CLUSTER_SIZE;
+    }
+
+    // Index of a cell within its cluster for ClusterDistances
+    static int GetLocalIndex(const Coord &c)
+    {
+        return (c.y % CLUSTER_SIZE) * CLUSTER_SIZE + c.x % CLUSTER_SIZE;
+    }
+
+    // Distances from source to the cells of its cluster on paths that do
+    // not leave the cluster, by GetLocalIndex
+    static void ClusterDistances(const Coord &source, std::vector<int> &out);
+
+    int GetNodeCount() const { return nodes.size(); }
+    const Coord &GetNode(int n) const { return nodes[n]; }
+    const std::vector<Edge> &GetEdges(int n) const { return edges[n]; }
+    const std::vector<int> &GetClusterNodes(int cluster) const { return clusterNodes[cluster]; }
+
+private:
+    std::vector<Coord> nodes;
+    std::vector< std::vector<Edge> > edges;
+    std::vector< std::vector<int> > clusterNodes;
+
+    // Node of each cell that is one, used while building the graph
+    std::map<int, int> cellNodes;
+
+    int AddNode(const Coord &c);
+    void AddTransition(const Coord &a, const Coord &b);
+    void AddEntrance(const Coord &a, const Coord &b, int dx, int dy, int length);
+};
+
+const int PathClusters::UNREACHABLE;
+
+void PathClusters::ClusterDistances(const Coord &source, std::vector<int> &out)
+{
+    const int x0 = source.x - source.x % CLUSTER_SIZE;
+    const int y0 = source.y - source.y % CLUSTER_SIZE;
+    const int x1 = std::min(x0 + CLUSTER_SIZE, MAP_WIDTH);
+    const int y1 = std::min(y0 + CLUSTER_SIZE, MAP_HEIGHT);
+
+    out.assign(CLUSTER_SIZE * CLUSTER_SIZE, UNREACHABLE);
+    std::vector<Coord> queue;
+    queue.reserve(CLUSTER_SIZE * CLUSTER_SIZE);
+
+    out[GetLocalIndex(source)] = 0;
+    queue.push_back(source);
+    for (unsigned i = 0; i < queue.size(); i++)
+    {
+        const Coord u = queue[i];
+        const int du = out[GetLocalIndex(u)];
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                const Coord v(u.x + dx, u.y + dy);
+                if (v.x < x0 || v.x >= x1 || v.y < y0 || v.y >= y1 || !WalkableCoord(v))
+                    continue;
+                int &dv = out[GetLocalIndex(v)];
+                if (dv != UNREACHABLE)
+                    continue;
+                dv = du + 1;
+                queue.push_back(v);
+            }
+    }
+}
+
+int PathClusters::AddNode(const Coord &c)
+{
+    const int cell = c.y * MAP_WIDTH + c.x;
+    std::map<int, int>::const_iterator mi = cellNodes.find(cell);
+    if (mi != cellNodes.end())
+        return mi->second;
+
+    const int n = nodes.size();
+    nodes.push_back(c);
+    edges.push_back(std::vector<Edge>());
+    clusterNodes[GetCluster(c)].push_back(n);
+    cellNodes[cell] = n;
+    return n;
+}
+
+void PathClusters::AddTransition(const Coord &a, const Coord &b)
+{
+    const int na = AddNode(a);
+    const int nb = AddNode(b);
+    edges[na].push_back(Edge(nb, 1));
+    edges[nb].push_back(Edge(na, 1));
+}
+
+// Add the transitions for an entrance of the given length, which starts
+// with the pair of cells a and b (on either side of the border) and
+// continues in direction (dx, dy)
+void PathClusters::AddEntrance(const Coord &a, const Coord &b, int dx, int dy, int length)
+{
+    if (length < 6)
+    {
+        const int mid = length / 2;
+        AddTransition(Coord(a.x + mid * dx, a.y + mid * dy), Coord(b.x + mid * dx, b.y + mid * dy));
+        return;
+    }
+
+    const int last = length - 1;
+    AddTransition(a, b);
+    AddTransition(Coord(a.x + last * dx, a.y + last * dy), Coord(b.x + last * dx, b.y + last * dy));
+}
+
+PathClusters::PathClusters()
+    : clusterNodes(CLUSTERS_X * CLUSTERS_Y)
+{
+    // Entrances on the borders between clusters left and right of each
+    // other, and then between clusters above and below each other.  Runs
+    // are split where the border between the next clusters begins.
+    for (int dir = 0; dir < 2; dir++)
+    {
+        const int dx = (dir == 0 ? 0 : 1), dy = 1 - dx;
+        const int nBorders = (dir == 0 ? CLUSTERS_X : CLUSTERS_Y);
+        const int nLength = (dir == 0 ? MAP_HEIGHT : MAP_WIDTH);
+        for (int k = 1; k < nBorders; k++)
+        {
+            int run = 0;
+            for (int i = 0; i <= nLength; i++)
+            {
+                // The cells at position i on both sides of the border
+                const Coord b = (dir == 0 ? Coord(k * CLUSTER_SIZE, i) : Coord(i, k * CLUSTER_SIZE));
+                const Coord a(b.x - dy, b.y - dx);
+                const bool fOpen = (i < nLength && WalkableCoord(a) && WalkableCoord(b));
+
+                if (run > 0 && (!fOpen || i % CLUSTER_SIZE == 0))
+                {
+                    AddEntrance(Coord(a.x - run * dx, a.y - run * dy),
+                                Coord(b.x - run * dx, b.y - run * dy), dx, dy, run);
+                    run = 0;
+                }
+                if (fOpen)
+                    run++;
+            }
+        }
+    }
+    cellNodes.clear();
+
+    // Paths between the nodes of each cluster
+    size_t nEdges = 0;
+    std::vector<int> distances;
+    for (int cluster = 0; cluster < CLUSTERS_X * CLUSTERS_Y; cluster++)
+    {
+        const std::vector<int> &members = clusterNodes[cluster];
+        for (unsigned i = 0; i < members.size(); i++)
+        {
+            ClusterDistances(nodes[members[i]], distances);
+            for (unsigned j = 0; j < members.size(); j++)
+            {
+                const int d = distances[GetLocalIndex(nodes[members[j]])];
+                if (i != j && d != UNREACHABLE)
+                    edges[members[i]].push_back(Edge(members[j], d));
+            }
+        }
+    }
+    for (unsigned n = 0; n < edges.size(); n++)
+        nEdges += edges[n].size();
+
+    printf("PathClusters: %d clusters with %u nodes and %u edges\n",
+           CLUSTERS_X * CLUSTERS_Y, (unsigned)nodes.size(), (unsigned)nEdges);
+}
+
+static CCriticalSection cs_pathClusters;
+static PathClusters *pathClusters = NULL;
+
+static const PathClusters &GetPathClusters()
+{
+    CRITICAL_BLOCK(cs_pathClusters)
+        if (!pathClusters)
+            pathClusters = new PathClusters();
+    return *pathClusters;
+}
+
+// A* search over the map grid with all per-cell data in flat arrays that
+// are allocated once per thread.  Instead of clearing the arrays for every
+// search, each cell carries the number of the search that last touched it,
+// and cells with an older number count as unvisited.
+//
+// The search reproduces the order in which the Boost version above visits
+// cells exactly, so that both return the same paths:  neighbours are
+// examined in the same order, the open list is the same 4-ary heap, and
+// the heuristic is the Chebyshev distance (diagonal steps cost the same as
+// straight ones, so the octile distance would overestimate).  In the Boost
+// version, all cells share index zero in the vertex index map and thus
+// also share a single slot of the heap's position map.  Decreasing the key
+// of an open cell therefore restores the heap order at the position that
+// was written last rather than at the position of that cell.  The heap
+// below keeps the same single slot in lastIndex.
+class GridSearch
+{
+public:
+    GridSearch()
+        : stamp(GRID_CELLS, 0), generation(0),
+          dist(GRID_CELLS), cost(GRID_CELLS), pred(GRID_CELLS),
+          color(GRID_CELLS), lastIndex(-1), nExpanded(0), fFallback(false)
+    {
+    }
+
+    bool Run(const Coord &start, const Coord &goal, std::deque<Coord> &solution);
+    bool RunJumpPoints(const Coord &start, const Coord &goal, std::deque<Coord> &solution);
+    bool RunLandmarks(const Coord &start, const Coord &goal, std::deque<Coord> &solution);
+    bool RunHierarchical(const Coord &start, const Coord &goal, std::deque<Coord> &solution);
+
+    // Number of cells expanded by the last search
+    int GetExpanded() const { return nExpanded; }
+
+    // Whether the last hierarchical search had to fall back to Run
+    bool GetFallback() const { return fFallback; }
+
+private:
+    static const int GRID_CELLS = MAP_WIDTH * MAP_HEIGHT;
+
+    enum { WHITE = 0, GRAY, BLACK };
+
+    std::vector<unsigned> stamp;
+    unsigned generation;
+
+    std::vector<int> dist;
+    std::vector<int> cost;
+    std::vector<int> pred;
+    std::vector<unsigned char> color;
+
+    std::vector<int> heap;
+    int lastIndex;
+
+    int nExpanded;
+    bool fFallback;
+
+    void Touch(int v)
+    {
+        if (stamp[v] != generation)
+        {
+            stamp[v] = generation;
+            dist[v] = std::numeric_limits<int>::max();
+            cost[v] = 0;
+            color[v] = WHITE;
+        }
+    }
+
+    void NextGeneration()
+    {
+        if (++generation == 0)
+        {
+            std::fill(stamp.begin(), stamp.end(), 0);
+            generation = 1;
+        }
+    }
+
+    void SiftUp(int index);
+    void SiftDown();
+    void Push(int v);
+    void Pop();
+
+    // Clusters along a path in the graph of PathClusters.  For each cluster,
+    // this holds the last node of the path in it and the length of the
+    // path from there to the goal, or -1 for clusters not on the path.
+    struct Corridor
+    {
+        std::vector<Coord> exit;
+        std::vector<int> remaining;
+    };
+
+    bool RunCorridor(const Coord &start, const Coord &goal, const Corridor &corridor, std::deque<Coord> &solution);
+};
+
+void GridSearch::SiftUp(int index)
+{
+    const int v = heap[index];
+    const int c = cost[v];
+    while (index > 0)
+    {
+        const int parent = (index - 1) / 4;
+        if (!(c < cost[heap[parent]]))
+            break;
+        heap[index] = heap[parent];
+        index = parent;
+    }
+    heap[index] = v;
+    lastIndex = index;
+}
+
+void GridSearch::SiftDown()
+{
+    const int size = heap.size();
+    const int v = heap[0];
+    const int c = cost[v];
+    int index = 0;
+    for (;;)
+    {
+        const int first = index * 4 + 1;
+        if (first >= size)
+            break;
+        const int last = std::min(first + 4, size);
+        int best = first;
+        int bestCost = cost[heap[first]];
+        for (int i = first + 1; i < last; i++)
+            if (cost[heap[i]] < bestCost)
+            {
+                best = i;
+                bestCost = cost[heap[i]];
+            }
+        if (!(bestCost < c))
+            break;
+        heap[index] = heap[best];
+        index = best;
+    }
+    heap[index] = v;
+    lastIndex = index;
+}
+
+void GridSearch::Push(int v)
+{
+    heap.push_back(v);
+    SiftUp(heap.size() - 1);
+}
+
+void GridSearch::Pop()
+{
+    lastIndex = -1;
+    if (heap.size() == 1)
+    {
+        heap.pop_back();
+        return;
+    }
+    heap[0] = heap.back();
+    heap.pop_back();
+    lastIndex = 0;
+    SiftDown();
+}
+
+bool GridSearch::Run(const Coord &start, const Coord &goal, std::deque<Coord> &solution)
+{
+    NextGeneration();
+    heap.clear();
+    lastIndex = -1;
+    nExpanded = 0;
+
+    const int s = start.y * MAP_WIDTH + start.x;
+    const int g = goal.y * MAP_WIDTH + goal.x;
+
+    Touch(s);
+    dist[s] = 0;
+    color[s] = GRAY;
+    Push(s);
+
+    bool found = false;
+    while (!heap.empty())
+    {
+        const int u = heap[0];
+        Pop();
+        if (u == g)
+        {
+            found = true;
+            break;
+        }
+        nExpanded++;
+
+        const int ux = u % MAP_WIDTH, uy = u / MAP_WIDTH;
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                if (dx == 0 && dy == 0)
+                    continue;
+                const int x = ux + dx, y = uy + dy;
+                if (!WalkableCoord(x, y))
+                    continue;
+                const int v = y * MAP_WIDTH + x;
+                Touch(v);
+
+                // Edges are undirected, so (like boost::relax) also try to
+                // shorten the path to u through v
+                if (dist[u] + 1 < dist[v])
+                {
+                    dist[v] = dist[u] + 1;
+                    pred[v] = u;
+                }
+                else if (color[v] != WHITE && dist[v] + 1 < dist[u])
+                {
+                    dist[u] = dist[v] + 1;
+                    pred[u] = v;
+                }
+                else
+                    continue;
+
+                cost[v] = dist[v] + distLInf(Coord(x, y), goal);
+                if (color[v] == GRAY)
+                {
+                    // Decrease-key, see above
+                    if (lastIndex >= 0)
+                        SiftUp(lastIndex);
+                }
+                else
+                {
+                    // New or reopened cell
+                    color[v] = GRAY;
+                    Push(v);
+                }
+            }
+        color[u] = BLACK;
+    }
+
+    if (!found)
+        return false;
+
+    solution.clear();
+    for (int v = g; v != s; v = pred[v])
+        solution.push_front(Coord(v % MAP_WIDTH, v / MAP_WIDTH));
+
+    return true;
+}
+
+// Jump point search.  Since all eight steps cost the same, most shortest
+// paths have many equally long permutations, and plain A* expands all of
+// them.  Jump point search only expands cells where a shortest path may
+// have to change direction:  from each such "jump point", it scans along
+// straight and diagonal lines until it hits an obstacle, the goal, or a
+// cell with a forced neighbour (one that can be reached optimally only
+// through this cell because of an obstacle next to the line).  Diagonal
+// steps past obstacle corners are allowed, as in the plain search.
+
+static inline bool Blocked(int x, int y)
+{
+    return !WalkableCoord(x, y);
+}
+
+static inline int Sign(int x)
+{
+    return x > 0 ? 1 : (x < 0 ? -1 : 0);
+}
+
+// Scan horizontally from (x, y) in direction dx.  Returns the jump point
+// found (as cell index) or -1.  This walks the rows of ObstacleMap
+// directly, since it is the innermost loop of the search.
+static int JumpHorizontal(int x, int y, int dx, const Coord &goal)
+{
+    const unsigned char *row = ObstacleMap[y];
+    const unsigned char *above = (y > 0 ? ObstacleMap[y - 1] : NULL);
+    const unsigned char *below = (y + 1 < MAP_HEIGHT ? ObstacleMap[y + 1] : NULL);
+
+    for (;;)
+    {
+        x += dx;
+        if (x < 0 || x >= MAP_WIDTH || row[x] != 0)
+            return -1;
+        if (x == goal.x && y == goal.y)
+            return y * MAP_WIDTH + x;
+
+        const int next = x + dx;
+        if (next < 0 || next >= MAP_WIDTH)
+            continue;
+        if (above && above[x] != 0 && above[next] == 0)
+            return y * MAP_WIDTH + x;
+        if (below && below[x] != 0 && below[next] == 0)
+            return y * MAP_WIDTH + x;
+    }
+}
+
+static int JumpVertical(int x, int y, int dy, const Coord &goal)
+{
+    for (;;)
+    {
+        y += dy;
+        if (Blocked(x, y))
+            return -1;
+        if (x == goal.x && y == goal.y)
+            return y * MAP_WIDTH + x;
+
+        if ((Blocked(x - 1, y) && !Blocked(x - 1, y + dy))
+            || (Blocked(x + 1, y) && !Blocked(x + 1, y + dy)))
+            return y * MAP_WIDTH + x;
+    }
+}
+
+static int JumpDiagonal(int x, int y, int dx, int dy, const Coord &goal)
+{
+    for (;;)
+    {
+        x += dx;
+        y += dy;
+        if (Blocked(x, y))
+            return -1;
+        if (x == goal.x && y == goal.y)
+            return y * MAP_WIDTH + x;
+
+        if ((Blocked(x - dx, y) && !Blocked(x - dx, y + dy))
+            || (Blocked(x, y - dy) && !Blocked(x + dx, y - dy)))
+            return y * MAP_WIDTH + x;
+
+        // A diagonal step is only worthwhile if one of the straight lines
+        // from here leads to a jump point
+        if (JumpHorizontal(x, y, dx, goal) >= 0 || JumpVertical(x, y, dy, goal) >= 0)
+            return y * MAP_WIDTH + x;
+    }
+}
+
+static int Jump(int x, int y, int dx, int dy, const Coord &goal)
+{
+    if (dy == 0)
+        return JumpHorizontal(x, y, dx, goal);
+    if (dx == 0)
+        return JumpVertical(x, y, dy, goal);
+    return JumpDiagonal(x, y, dx, dy, goal);
+}
+
+// Collect the directions in which to continue from (x, y) when it was
+// reached moving in direction (dx, dy).  These are the natural neighbours
+// in the direction of movement and the forced neighbours.
+static int PrunedDirections(int x, int y, int dx, int dy, int dirs[][2])
+{
+    int n = 0;
+    if (dx == 0 && dy == 0)
+    {
+        for (int ddy = -1; ddy <= 1; ddy++)
+            for (int ddx = -1; ddx <= 1; ddx++)
+                if (ddx != 0 || ddy != 0)
+                {
+                    dirs[n][0] = ddx;
+                    dirs[n][1] = ddy;
+                    n++;
+                }
+        return n;
+    }
+
+#define ADD_DIRECTION(a, b) do { dirs[n][0] = (a); dirs[n][1] = (b); n++; } while (0)
+    if (dx != 0 && dy != 0)
+    {
+        ADD_DIRECTION(dx, 0);
+        ADD_DIRECTION(0, dy);
+        ADD_DIRECTION(dx, dy);
+        if (Blocked(x - dx, y))
+            ADD_DIRECTION(-dx, dy);
+        if (Blocked(x, y - dy))
+            ADD_DIRECTION(dx, -dy);
+    }
+    else if (dx != 0)
+    {
+        ADD_DIRECTION(dx, 0);
+        if (Blocked(x, y + 1))
+            ADD_DIRECTION(dx, 1);
+        if (Blocked(x, y - 1))
+            ADD_DIRECTION(dx, -1);
+    }
+    else
+    {
+        ADD_DIRECTION(0, dy);
+        if (Blocked(x + 1, y))
+            ADD_DIRECTION(1, dy);
+        if (Blocked(x - 1, y))
+            ADD_DIRECTION(-1, dy);
+    }
+#undef ADD_DIRECTION
+
+    return n;
+}
+
+bool GridSearch::RunJumpPoints(const Coord &start, const Coord &goal, std::deque<Coord> &solution)
+{
+    NextGeneration();
+    nExpanded = 0;
+
+    const int s = start.y * MAP_WIDTH + start.x;
+    const int g = goal.y * MAP_WIDTH + goal.x;
+
+    // Open list ordered by estimated total length.  Instead of updating
+    // entries, improved cells are pushed again and stale entries skipped.
+    typedef std::pair<int, int> OpenEntry;
+    std::priority_queue<OpenEntry, std::vector<OpenEntry>, std::greater<OpenEntry> > open;
+
+    Touch(s);
+    dist[s] = 0;
+    pred[s] = s;
+    color[s] = GRAY;
+    open.push(OpenEntry(distLInf(start, goal), s));
+
+    bool found = false;
+    while (!open.empty())
     {
-        // Find prefix of solution that can be linearized
+        const int u = open.top().second;
+        open.pop();
+        if (color[u] == BLACK)
+            continue;
+        color[u] = BLACK;
+        if (u == g)
+        {
+            found = true;
+            break;
+        }
+        nExpanded++;
+
+        const int ux = u % MAP_WIDTH, uy = u / MAP_WIDTH;
+        const int px = pred[u] % MAP_WIDTH, py = pred[u] / MAP_WIDTH;
+
+        int dirs[8][2];
+        const int nDirs = PrunedDirections(ux, uy, Sign(ux - px), Sign(uy - py), dirs);
+        for (int i = 0; i < nDirs; i++)
+        {
+            const int v = Jump(ux, uy, dirs[i][0], dirs[i][1], goal);
+            if (v < 0)
+                continue;
+            Touch(v);
+            if (color[v] == BLACK)
+                continue;
+
+            const Coord c(v % MAP_WIDTH, v / MAP_WIDTH);
+            const int d = dist[u] + distLInf(Coord(ux, uy), c);
+            if (d < dist[v])
+            {
+                dist[v] = d;
+                pred[v] = u;
+                color[v] = GRAY;
+                open.push(OpenEntry(d + distLInf(c, goal), v));
+            }
+        }
+    }
+
+    if (!found)
+        return false;
+
+    // Expand the straight and diagonal lines between the jump points
+    solution.clear();
+    for (int v = g; v != s; v = pred[v])
+    {
+        int x = v % MAP_WIDTH, y = v / MAP_WIDTH;
+        const int px = pred[v] % MAP_WIDTH, py = pred[v] / MAP_WIDTH;
+        const int dx = Sign(px - x), dy = Sign(py - y);
+        while (x != px || y != py)
+        {
+            solution.push_front(Coord(x, y));
+            x += dx;
+            y += dy;
+        }
+    }
+
+    return true;
+}
+
+// A* search with the ALT heuristic (see PathLandmarks), combined with the
+// Chebyshev distance.  Unlike in Run, the open list is a plain priority
+// queue that may hold outdated entries, which are skipped.  Among cells
+// with the same estimate, those farther from the start are expanded first.
+bool GridSearch::RunLandmarks(const Coord &start, const Coord &goal, std::deque<Coord> &solution)
+{
+    const PathLandmarks &landmarks = GetPathLandmarks();
+
+    NextGeneration();
+    nExpanded = 0;
 
-        // Binary search
-        int start = 0;
-        int end = solution.size();
-        while (start < end - 1)
+    const int s = start.y * MAP_WIDTH + start.x;
+    const int g = goal.y * MAP_WIDTH + goal.x;
+    const unsigned short *goalDistances = landmarks.GetDistances(g);
+
+    // Entries are (estimate, -distance, cell)
+    typedef std::pair<std::pair<int, int>, int> OpenEntry;
+    std::priority_queue<OpenEntry, std::vector<OpenEntry>, std::greater<OpenEntry> > open;
+
+    Touch(s);
+    dist[s] = 0;
+    color[s] = GRAY;
+    open.push(OpenEntry(std::make_pair(0, 0), s));
+
+    bool found = false;
+    while (!open.empty())
+    {
+        const int u = open.top().second;
+        open.pop();
+        if (color[u] == BLACK)
+            continue;
+        color[u] = BLACK;
+        if (u == g)
         {
-            int mid = (start + end) / 2;
+            found = true;
+            break;
+        }
+        nExpanded++;
+
+        const int ux = u % MAP_WIDTH, uy = u / MAP_WIDTH;
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                if (dx == 0 && dy == 0)
+                    continue;
+                const int x = ux + dx, y = uy + dy;
+                if (!WalkableCoord(x, y))
+                    continue;
+                const int v = y * MAP_WIDTH + x;
+                Touch(v);
+                if (color[v] == BLACK || dist[u] + 1 >= dist[v])
+                    continue;
+
+                dist[v] = dist[u] + 1;
+                pred[v] = u;
+                color[v] = GRAY;
+                const int h = std::max(distLInf(Coord(x, y), goal),
+                                       landmarks.Estimate(landmarks.GetDistances(v), goalDistances));
+                open.push(OpenEntry(std::make_pair(dist[v] + h, -dist[v]), v));
+            }
+    }
+
+    if (!found)
+        return false;
+
+    solution.clear();
+    for (int v = g; v != s; v = pred[v])
+        solution.push_front(Coord(v % MAP_WIDTH, v / MAP_WIDTH));
+
+    return true;
+}
+
+// A* search that only enters cells of the clusters in the corridor, which
+// must include those of start and goal.  The estimate for a cell is the
+// distance to the target node of its cluster (see RunHierarchical) plus the
+// remaining length of the abstract path from there.  This leads the search
+// along the corridor, but may overestimate where the corridor has
+// shortcuts, so the path found is not always the shortest one within it.
+bool GridSearch::RunCorridor(const Coord &start, const Coord &goal, const Corridor &corridor, std::deque<Coord> &solution)
+{
+    NextGeneration();
+
+    const int s = start.y * MAP_WIDTH + start.x;
+    const int g = goal.y * MAP_WIDTH + goal.x;
+
+    // Entries are (estimate, -distance, cell) as in RunLandmarks
+    typedef std::pair<std::pair<int, int>, int> OpenEntry;
+    std::priority_queue<OpenEntry, std::vector<OpenEntry>, std::greater<OpenEntry> > open;
+
+    Touch(s);
+    dist[s] = 0;
+    color[s] = GRAY;
+    open.push(OpenEntry(std::make_pair(0, 0), s));
+
+    bool found = false;
+    while (!open.empty())
+    {
+        const int u = open.top().second;
+        open.pop();
+        if (color[u] == BLACK)
+            continue;
+        color[u] = BLACK;
+        if (u == g)
+        {
+            found = true;
+            break;
+        }
+        nExpanded++;
+
+        const int ux = u % MAP_WIDTH, uy = u / MAP_WIDTH;
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                if (dx == 0 && dy == 0)
+                    continue;
+                const Coord c(ux + dx, uy + dy);
+                if (!WalkableCoord(c))
+                    continue;
+                const int cluster = PathClusters::GetCluster(c);
+                if (corridor.remaining[cluster] < 0)
+                    continue;
+                const int v = c.y * MAP_WIDTH + c.x;
+                Touch(v);
+                if (color[v] == BLACK || dist[u] + 1 >= dist[v])
+                    continue;
+
+                dist[v] = dist[u] + 1;
+                pred[v] = u;
+                color[v] = GRAY;
+                const int h = std::max(distLInf(c, goal),
+                                       distLInf(c, corridor.exit[cluster]) + corridor.remaining[cluster]);
+                open.push(OpenEntry(std::make_pair(dist[v] + h, -dist[v]), v));
+            }
+    }
+
+    if (!found)
+        return false;
+
+    solution.clear();
+    for (int v = g; v != s; v = pred[v])
+        solution.push_front(Coord(v % MAP_WIDTH, v / MAP_WIDTH));
+
+    return true;
+}
+
+// Hierarchical search (see PathClusters).  Start and goal are connected to
+// the nodes of their clusters, then the abstract graph is searched with A*,
+// and finally the path on the grid is found by RunCorridor within the
+// clusters that the abstract path passes through.  The result is often a
+// few steps longer than a shortest path.  If the abstract graph has no
+// path, the plain search over the whole map is used instead.
+bool GridSearch::RunHierarchical(const Coord &start, const Coord &goal, std::deque<Coord> &solution)
+{
+    const PathClusters &clusters = GetPathClusters();
+
+    nExpanded = 0;
+    fFallback = false;
+
+    // Start and goal get the node numbers after those of the graph
+    const int nNodes = clusters.GetNodeCount();
+    const int s = nNodes, g = nNodes + 1;
+    const int startCluster = PathClusters::GetCluster(start);
+    const int goalCluster = PathClusters::GetCluster(goal);
+
+    std::vector<int> fromStart, toGoal;
+    PathClusters::ClusterDistances(start, fromStart);
+    PathClusters::ClusterDistances(goal, toGoal);
+
+    std::vector<int> nodeDist(nNodes + 2, std::numeric_limits<int>::max());
+    std::vector<int> nodePred(nNodes + 2, -1);
+    std::vector<bool> closed(nNodes + 2, false);
+
+    typedef std::pair<int, int> OpenEntry;
+    std::priority_queue<OpenEntry, std::vector<OpenEntry>, std::greater<OpenEntry> > open;
+
+    nodeDist[s] = 0;
+    open.push(OpenEntry(distLInf(start, goal), s));
+
+    bool found = false;
+    while (!open.empty())
+    {
+        const int u = open.top().second;
+        open.pop();
+        if (closed[u])
+            continue;
+        closed[u] = true;
+        if (u == g)
+        {
+            found = true;
+            break;
+        }
+
+        // Collect the edges of u, including those to start and goal
+        std::vector<PathClusters::Edge> edges;
+        if (u == s)
+        {
+            const std::vector<int> &members = clusters.GetClusterNodes(startCluster);
+            for (unsigned i = 0; i < members.size(); i++)
+            {
+                const int d = fromStart[PathClusters::GetLocalIndex(clusters.GetNode(members[i]))];
+                if (d != PathClusters::UNREACHABLE)
+                    edges.push_back(PathClusters::Edge(members[i], d));
+            }
+            if (startCluster == goalCluster && fromStart[PathClusters::GetLocalIndex(goal)] != PathClusters::UNREACHABLE)
+                edges.push_back(PathClusters::Edge(g, fromStart[PathClusters::GetLocalIndex(goal)]));
+        }
+        else
+        {
+            edges = clusters.GetEdges(u);
+            const Coord &c = clusters.GetNode(u);
+            if (PathClusters::GetCluster(c) == goalCluster && toGoal[PathClusters::GetLocalIndex(c)] != PathClusters::UNREACHABLE)
+                edges.push_back(PathClusters::Edge(g, toGoal[PathClusters::GetLocalIndex(c)]));
+        }
+
+        for (unsigned i = 0; i < edges.size(); i++)
+        {
+            const int v = edges[i].first;
+            const int d = nodeDist[u] + edges[i].second;
+            if (closed[v] || d >= nodeDist[v])
+                continue;
+
+            nodeDist[v] = d;
+            nodePred[v] = u;
+            open.push(OpenEntry(d + (v == g ? 0 : distLInf(clusters.GetNode(v), goal)), v));
+        }
+    }
+
+    if (found)
+    {
+        // For each cluster, aim at the node two steps further along the
+        // path than the last one in the cluster, which is normally where
+        // the path leaves the next cluster.  Aiming at the cluster's own
+        // exit would pull the path towards each transition.
+        std::vector<int> path;
+        for (int v = g; v != s; v = nodePred[v])
+            path.push_back(v);
+
+        Corridor corridor;
+        corridor.exit.resize(PathClusters::CLUSTERS_X * PathClusters::CLUSTERS_Y);
+        corridor.remaining.assign(PathClusters::CLUSTERS_X * PathClusters::CLUSTERS_Y, -1);
+        corridor.exit[goalCluster] = goal;
+        corridor.remaining[goalCluster] = 0;
+        for (unsigned i = 1; i < path.size(); i++)
+        {
+            const int cluster = PathClusters::GetCluster(clusters.GetNode(path[i]));
+            if (corridor.remaining[cluster] >= 0)
+                continue;
+            const int target = path[i < 2 ? 0 : i - 2];
+            corridor.exit[cluster] = (target == g ? goal : clusters.GetNode(target));
+            corridor.remaining[cluster] = nodeDist[g] - nodeDist[target];
+        }
+        if (corridor.remaining[startCluster] < 0)
+        {
+            corridor.exit[startCluster] = start;
+            corridor.remaining[startCluster] = nodeDist[g];
+        }
+
+        if (RunCorridor(start, goal, corridor, solution))
+            return true;
+    }
+
+    fFallback = true;
+    const int nCorridorExpanded = nExpanded;
+    const bool fFound = Run(start, goal, solution);
+    nExpanded += nCorridorExpanded;
+    return fFound;
+}
+
+static boost::thread_specific_ptr<GridSearch> gridSearch;
+
+bool FindPathGrid(const Coord &start, const Coord &goal, std::deque<Coord> &solution, PathMode mode)
+{
+    if (!gridSearch.get())
+        gridSearch.reset(new GridSearch());
+    if (mode == PATH_JPS)
+        return gridSearch->RunJumpPoints(start, goal, solution);
+    if (mode == PATH_ALT)
+        return gridSearch->RunLandmarks(start, goal, solution);
+    if (mode == PATH_HPA)
+        return gridSearch->RunHierarchical(start, goal, solution);
+    return gridSearch->Run(start, goal, solution);
+}
+
+bool ParsePathMode(const std::string &str, PathMode &mode)
+{
+    if (str == "astar")
+        mode = PATH_ASTAR;
+    else if (str == "jps")
+        mode = PATH_JPS;
+    else if (str == "alt")
+        mode = PATH_ALT;
+    else if (str == "hpa")
+        mode = PATH_HPA;
+    else
+        return false;
+    return true;
+}
+
+// Offset of the minor coordinate after moving offset steps along the major
+// axis towards a waypoint at (du, dv), rounded like in CoordUpd in
+// CharacterState::MoveTowardsWaypoint
+static inline int LineOffset(int offset, int du, int dv)
+{
+    if (dv == 0)
+        return 0;
+    const int tmp = offset * dv;
+    int res = (abs(tmp) + abs(du) / 2) / du;
+    if (tmp < 0)
+        res = -res;
+    return res;
+}
+
+// Helper function for creating waypoints (linear path segments).  Checks
+// that a character moving from start straight to target only crosses
+// walkable tiles.  This computes the tiles of the line directly with the
+// rules of CharacterState::MoveTowardsWaypoint instead of simulating the
+// movement.
+bool CheckLinearPath(const Game::Coord &start, const Game::Coord &target)
+{
+    const int dx = target.x - start.x;
+    const int dy = target.y - start.y;
+
+    if (abs(dx) > abs(dy))
+    {
+        const int step = (dx > 0 ? 1 : -1);
+        for (int off = step; off != dx + step; off += step)
+            if (!IsWalkable(start.x + off, start.y + LineOffset(off, dx, dy)))
+                return false;
+    }
+    else if (dy != 0)
+    {
+        const int step = (dy > 0 ? 1 : -1);
+        for (int off = step; off != dy + step; off += step)
+            if (!IsWalkable(start.x + LineOffset(off, dy, dx), start.y + off))
+                return false;
+    }
+
+    return true;
+}
+
+// Linearize the path by finding the longest linear prefix with a binary
+// search for each segment (as earlier versions did).  Since a line may be
+// blocked to a tile on the path but not to a later one, this does not
+// always find the longest prefix.
+void LinearizeBisect(const Coord &start, const std::deque<Coord> &solution, std::vector<Coord> &waypoints)
+{
+    waypoints.clear();
+    waypoints.push_back(start);
+    for (int i = 0; i < (int)solution.size(); )
+    {
+        int lo = i;
+        int hi = solution.size();
+        while (lo < hi - 1)
+        {
+            const int mid = (lo + hi) / 2;
             if (CheckLinearPath(waypoints.back(), solution[mid]))
-                start = mid;
+                lo = mid;
             else
-                end = mid;
+                hi = mid;
         }
-        solution.erase(solution.begin(), solution.begin() + start);
-        waypoints.push_back(solution.front());
-        solution.pop_front();
+        waypoints.push_back(solution[lo]);
+        i = lo + 1;
     }
+}
 
+// Linearize the path by string pulling:  from each waypoint, continue from
+// the farthest tile of the path that can be reached in a straight line.
+// A straight line of n steps is itself a path of n steps, so on a shortest
+// path only tiles whose Chebyshev distance from the waypoint equals their
+// distance along the path can be reachable.  Those tiles form a prefix of
+// the rest of the path, which is found by extending it one tile at a time.
+// Only the tiles in this prefix are then tried, from its end backwards.
+// (For paths that are not shortest, this may miss reachable tiles.  The
+// result is then still valid, just with more waypoints.)
+static void LinearizeScan(const Coord &start, const std::deque<Coord> &solution, std::vector<Coord> &waypoints)
+{
+    waypoints.clear();
+    waypoints.push_back(start);
+    for (int i = 0; i < (int)solution.size(); )
+    {
+        const Coord &from = waypoints.back();
+        int last = i;
+        while (last + 1 < (int)solution.size()
+               && distLInf(from, solution[last + 1]) == last + 2 - i)
+            last++;
+
+        // The next tile on the path is always reachable
+        int farthest = i;
+        for (int j = last; j > i; j--)
+            if (CheckLinearPath(from, solution[j]))
+            {
+                farthest = j;
+                break;
+            }
+        waypoints.push_back(solution[farthest]);
+        i = farthest + 1;
+    }
+}
+
+// Generate waypoints by linearizing parts of the path.  Going to the
+// farthest tile each time usually needs fewer waypoints, but not always,
+// so use the shorter of both results.  The binary search takes only a
+// fraction of the time of the scan.
+static void LinearizePath(const Coord &start, const std::deque<Coord> &solution, std::vector<Coord> &waypoints)
+{
+    std::vector<Game::Coord> bisected;
+    LinearizeScan(start, solution, waypoints);
+    LinearizeBisect(start, solution, bisected);
+    if (bisected.size() < waypoints.size())
+        waypoints.swap(bisected);
+}
+
+std::vector<Coord> FindPath(const Coord &start, const Coord &goal, PathMode mode)
+{
+    std::vector<Game::Coord> waypoints;
+
+    if (!WalkableCoord(start) || !WalkableCoord(goal))
+        return waypoints;
+
+    std::deque<Game::Coord> solution;
+    if (!FindPathGrid(start, goal, solution, mode))
+        return waypoints;
+
+    LinearizePath(start, solution, waypoints);
     return waypoints;
 }
 
+// Queries shared between the threads of FindPaths
+struct PathWork
+{
+    std::vector<PathQuery> *queries;
+    PathMode mode;
+
+    boost::mutex mut;
+    size_t nNext;
+};
+
+static void PathWorker(PathWork *work)
+{
+    for (;;)
+    {
+        size_t i;
+        {
+            boost::lock_guard<boost::mutex> lock(work->mut);
+            if (work->nNext >= work->queries->size())
+                return;
+            i = work->nNext++;
+        }
+
+        PathQuery &q = (*work->queries)[i];
+        if (!q.strError.empty())
+            continue;
+        if (!WalkableCoord(q.start))
+            q.strError = "start is not walkable";
+        else if (!WalkableCoord(q.goal))
+            q.strError = "goal is not walkable";
+        else
+        {
+            q.path = FindPath(q.start, q.goal, work->mode);
+            if (q.path.empty())
+                q.strError = "no path found";
+        }
+    }
+}
+
+// Threads that run the queries of FindPaths.  They are kept between
+// calls, so that their search buffers are allocated only once, and at
+// most one per core (besides the calling thread) is ever started.
+class PathThreadPool
+{
+    boost::mutex mut;
+    boost::condition_variable cvWork, cvDone;
+    boost::thread_group threads;
+    unsigned nStarted;
+
+    // Current batch (or NULL), a counter to tell batches apart, and the
+    // number of pool threads that may still join and that are running it
+    PathWork *work;
+    unsigned nBatch;
+    unsigned nFree;
+    unsigned nActive;
+
+    // Only one batch is run at a time
+    boost::mutex mutRun;
+
+    void Loop()
+    {
+        boost::unique_lock<boost::mutex> lock(mut);
+        unsigned nSeen = 0;
+        for (;;)
+        {
+            while (work == NULL || nSeen == nBatch || nFree == 0)
+                cvWork.wait(lock);
+
+            nSeen = nBatch;
+            --nFree;
+            ++nActive;
+            PathWork *w = work;
+            lock.unlock();
+            PathWorker(w);
+            lock.lock();
+            --nActive;
+            cvDone.notify_all();
+        }
+    }
+
+public:
+
+    PathThreadPool()
+        : nStarted(0), work(NULL), nBatch(0), nFree(0), nActive(0)
+    {}
+
+    // Run the work on the calling thread and nThreads - 1 pool threads
+    void Run(PathWork &w, unsigned nThreads)
+    {
+        boost::lock_guard<boost::mutex> run(mutRun);
+        {
+            boost::lock_guard<boost::mutex> lock(mut);
+            for (; nStarted < nThreads - 1; nStarted++)
+                threads.create_thread(boost::bind(&PathThreadPool::Loop, this));
+            work = &w;
+            nBatch++;
+            nFree = nThreads - 1;
+        }
+        cvWork.notify_all();
+
+        PathWorker(&w);
+
+        // All queries have been taken, wait for those still running.  Pool
+        // threads that did not join in time must not see the batch later.
+        boost::unique_lock<boost::mutex> lock(mut);
+        while (nActive > 0)
+            cvDone.wait(lock);
+        work = NULL;
+        nFree = 0;
+    }
+};
+
+void FindPaths(std::vector<PathQuery> &queries, PathMode mode, unsigned nThreads)
+{
+    // More threads than cores do not help, and each needs its own buffers
+    const unsigned nCores = std::max(1u, boost::thread::hardware_concurrency());
+    if (nThreads == 0 || nThreads > nCores)
+        nThreads = nCores;
+    nThreads = std::min<unsigned>(nThreads, std::max<size_t>(queries.size(), 1));
+
+    PathWork work;
+    work.queries = &queries;
+    work.mode = mode;
+    work.nNext = 0;
+
+    if (nThreads == 1)
+    {
+        PathWorker(&work);
+        return;
+    }
+
+    // Never destroyed, since its threads wait for work until the end
+    static PathThreadPool *pool = new PathThreadPool();
+    pool->Run(work, nThreads);
+}
+
+bool CheckWaypoints(const std::vector<Coord> &waypoints, const Coord &goal)
+{
+    CharacterState tmp;
+    tmp.from = tmp.coord = waypoints.front();
+    tmp.waypoints = PathToCharacterWaypoints(waypoints);
+    while (!tmp.waypoints.empty())
+        tmp.MoveTowardsWaypoint();
+    return tmp.coord == goal;
+}
+
+static Coord RandomWalkableCoord()
+{
+    for (;;)
+    {
+        const Coord c(GetRandInt(MAP_WIDTH), GetRandInt(MAP_HEIGHT));
+        if (WalkableCoord(c))
+            return c;
+    }
+}
+
+// Walkable tile nearest to a corner of the map (cx and cy are 0 for the
+// left or top and 1 for the right or bottom side)
+static Coord WalkableNearCorner(int cx, int cy)
+{
+    for (int d = 0; d < std::max(MAP_WIDTH, MAP_HEIGHT); d++)
+        for (int a = 0; a <= d; a++)
+        {
+            const int offsets[2][2] = {{a, d}, {d, a}};
+            for (int k = 0; k < 2; k++)
+            {
+                const int x = cx ? MAP_WIDTH - 1 - offsets[k][0] : offsets[k][0];
+                const int y = cy ? MAP_HEIGHT - 1 - offsets[k][1] : offsets[k][1];
+                if (IsInsideMap(x, y) && IsWalkable(x, y))
+                    return Coord(x, y);
+            }
+        }
+    assert(false);
+    return Coord(0, 0);
+}
+
+// Time FindPath between opposite corners of the map, which gives the
+// longest paths and thus the worst case for the waypoint generation
+static void BenchmarkCrossMap(PathBenchmark &res)
+{
+    const Coord corners[4] = {WalkableNearCorner(0, 0), WalkableNearCorner(1, 1),
+                              WalkableNearCorner(1, 0), WalkableNearCorner(0, 1)};
+    for (int i = 0; i < 4; i++)
+    {
+        const Coord &start = corners[i];
+        const Coord &goal = corners[i ^ 1];
+
+        std::deque<Coord> solution;
+        int64 nTime = GetTimeMicros();
+        if (!FindPathGrid(start, goal, solution))
+            continue;
+        const int64 nSearch = GetTimeMicros() - nTime;
+
+        nTime = GetTimeMicros();
+        const std::vector<Coord> waypoints = FindPath(start, goal);
+        const int64 nFindPath = GetTimeMicros() - nTime;
+
+        std::vector<Coord> linearized;
+        nTime = GetTimeMicros();
+        LinearizePath(start, solution, linearized);
+        const int64 nLinearize = GetTimeMicros() - nTime;
+
+        res.nCrossPaths++;
+        res.nCrossMaxLength = std::max<int>(res.nCrossMaxLength, solution.size());
+        res.nCrossMaxWaypoints = std::max<int>(res.nCrossMaxWaypoints, waypoints.size() - 1);
+        res.nCrossSearchMicros = std::max(res.nCrossSearchMicros, nSearch);
+        res.nCrossFindPathMicros = std::max(res.nCrossFindPathMicros, nFindPath);
+        res.nCrossLinearizeMicros = std::max(res.nCrossLinearizeMicros, nLinearize);
+        if (waypoints.empty() || !CheckWaypoints(waypoints, goal))
+        {
+            printf("BenchmarkFindPath: invalid waypoints from (%d, %d) to (%d, %d)\n",
+                   start.x, start.y, goal.x, goal.y);
+            res.nInvalidWaypoints++;
+        }
+    }
+}
+
+void BenchmarkFindPath(int nPairs, PathBenchmark &res)
+{
+    res = PathBenchmark();
+
+    for (int i = 0; i < nPairs; i++)
+    {
+        const Coord start = RandomWalkableCoord();
+        const Coord goal = RandomWalkableCoord();
+
+        std::deque<Coord> reference, solution;
+        int64 nTime = GetTimeMicros();
+        FindPathReference(start, goal, reference);
+        res.nReferenceMicros += GetTimeMicros() - nTime;
+
+        nTime = GetTimeMicros();
+        const bool fFound = FindPathGrid(start, goal, solution);
+        res.nGridMicros += GetTimeMicros() - nTime;
+
+        res.nGridExpanded += gridSearch->GetExpanded();
+
+        std::deque<Coord> jump;
+        nTime = GetTimeMicros();
+        const bool fJump = FindPathGrid(start, goal, jump, PATH_JPS);
+        res.nJumpMicros += GetTimeMicros() - nTime;
+        res.nJumpExpanded += gridSearch->GetExpanded();
+
+        std::deque<Coord> landmark;
+        nTime = GetTimeMicros();
+        const bool fLandmark = FindPathGrid(start, goal, landmark, PATH_ALT);
+        res.nLandmarkMicros += GetTimeMicros() - nTime;
+        res.nLandmarkExpanded += gridSearch->GetExpanded();
+
+        std::deque<Coord> hierarchical;
+        nTime = GetTimeMicros();
+        const bool fHierarchical = FindPathGrid(start, goal, hierarchical, PATH_HPA);
+        res.nHierarchicalMicros += GetTimeMicros() - nTime;
+        res.nHierarchicalExpanded += gridSearch->GetExpanded();
+        if (gridSearch->GetFallback())
+            res.nHierarchicalFallbacks++;
+
+        res.nPairs++;
+        if (fFound)
+        {
+            res.nFound++;
+
+            nTime = GetTimeMicros();
+            const std::vector<Coord> waypoints = FindPath(start, goal);
+            res.nWaypointMicros += GetTimeMicros() - nTime;
+            res.nWaypoints += waypoints.size() - 1;
+
+            std::vector<Coord> linearized;
+            nTime = GetTimeMicros();
+            LinearizePath(start, solution, linearized);
+            res.nLinearizeMicros += GetTimeMicros() - nTime;
+            if (waypoints.empty() || !CheckWaypoints(waypoints, goal))
+            {
+                printf("BenchmarkFindPath: invalid waypoints from (%d, %d) to (%d, %d)\n",
+                       start.x, start.y, goal.x, goal.y);
+                res.nInvalidWaypoints++;
+            }
+        }
+        // The plain search may return a longer path than necessary (see
+        // GridSearch), but the other searches must never do so
+        if (fJump != fFound || jump.size() > solution.size())
+        {
+            printf("BenchmarkFindPath: jump point search failed from (%d, %d) to (%d, %d)\n",
+                   start.x, start.y, goal.x, goal.y);
+            res.nJumpLonger++;
+        }
+        if (fLandmark != fFound || landmark.size() > solution.size())
+        {
+            printf("BenchmarkFindPath: landmark search failed from (%d, %d) to (%d, %d)\n",
+                   start.x, start.y, goal.x, goal.y);
+            res.nLandmarkLonger++;
+        }
+        // The hierarchical search may find longer paths, but must find one.
+        // Compare with the ALT search, which always finds a shortest path.
+        if (fHierarchical != fFound)
+        {
+            printf("BenchmarkFindPath: hierarchical search failed from (%d, %d) to (%d, %d)\n",
+                   start.x, start.y, goal.x, goal.y);
+            res.nHierarchicalLonger++;
+        }
+        else if (hierarchical.size() > landmark.size())
+        {
+            res.nHierarchicalLonger++;
+            res.nHierarchicalExtraSteps += hierarchical.size() - landmark.size();
+        }
+    }
+
+    BenchmarkCrossMap(res);
+}
+
 std::vector<Coord> *UpdateQueuedPath(const CharacterState &ch, QueuedMoves &queuedMoves, const Game::CharacterID &chid)
 {
     QueuedMoves::iterator qm = queuedMoves.find(chid.player);
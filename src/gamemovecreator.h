@@ -5,9 +5,131 @@
 
 #include "gamestate.h"
 
+#include <deque>
+#include <string>
 #include <vector>
 
-std::vector<Game::Coord> FindPath(const Game::Coord &start, const Game::Coord &goal);
+// Search algorithm used by FindPath.  Except for PATH_HPA, all find
+// shortest paths, but they may choose different ones among paths of the
+// same length.
+enum PathMode
+{
+    // A* over all cells (the algorithm used by earlier versions)
+    PATH_ASTAR,
+    // Jump point search, much faster for long paths
+    PATH_JPS,
+    // A* with a heuristic based on distances to landmark cells (ALT),
+    // which expands far fewer cells on paths around large obstacles
+    PATH_ALT,
+    // Hierarchical search over precomputed paths between clusters of the
+    // map (HPA*), refined by A* within the clusters it passes.  This is the
+    // fastest for paths across the map, but may return slightly longer
+    // paths than the other modes.
+    PATH_HPA
+};
+
+// Parse the name of a path mode ("astar", "jps", "alt" or "hpa")
+bool ParsePathMode(const std::string &str, PathMode &mode);
+
+std::vector<Game::Coord> FindPath(const Game::Coord &start, const Game::Coord &goal, PathMode mode = PATH_ASTAR);
+
+// Search a path with the given algorithm and put the coordinates along it
+// (excluding the start) into solution.  FindPath turns this into waypoints.
+bool FindPathGrid(const Game::Coord &start, const Game::Coord &goal, std::deque<Game::Coord> &solution, PathMode mode = PATH_ASTAR);
+
+// Search a shortest path with the Boost Graph Library, as earlier versions
+// did.  In PATH_ASTAR mode, FindPathGrid returns exactly the same paths.
+bool FindPathReference(const Game::Coord &start, const Game::Coord &goal, std::deque<Game::Coord> &solution);
+
+// Turn a path as returned by FindPathGrid into waypoints with a binary
+// search for the longest straight prefix of each segment, as earlier
+// versions did.  FindPath never returns more waypoints than this.
+void LinearizeBisect(const Game::Coord &start, const std::deque<Game::Coord> &solution, std::vector<Game::Coord> &waypoints);
+
+// Check that a character following the waypoints returned by FindPath
+// arrives at the goal, by simulating its movement
+bool CheckWaypoints(const std::vector<Game::Coord> &waypoints, const Game::Coord &goal);
+
+// One query for FindPaths
+struct PathQuery
+{
+    Game::Coord start, goal;
+    // Waypoints as returned by FindPath
+    std::vector<Game::Coord> path;
+    // Reason why no path was found, or empty.  Queries that have this set
+    // already are skipped by FindPaths.
+    std::string strError;
+};
+
+// Run FindPath for several queries in parallel on nThreads threads (0 for
+// one per core), at most one per core.  The threads are kept for later
+// calls, and each uses its own search buffers.
+void FindPaths(std::vector<PathQuery> &queries, PathMode mode, unsigned nThreads = 0);
+
+// Result of BenchmarkFindPath
+struct PathBenchmark
+{
+    int nPairs;
+    int nFound;
+    // Total time spent in the Boost Graph and the flat-array search
+    int64 nReferenceMicros;
+    int64 nGridMicros;
+    // Pairs for which jump point search or the ALT search returned a
+    // longer path or none
+    int nJumpLonger;
+    int64 nJumpMicros;
+    int nLandmarkLonger;
+    int64 nLandmarkMicros;
+    // Total number of cells expanded by the searches
+    int64 nGridExpanded;
+    int64 nJumpExpanded;
+    int64 nLandmarkExpanded;
+    // Hierarchical search:  paths that are longer than those of the ALT
+    // search (which are shortest) and by how many steps in total, pairs
+    // for which it fell back to the plain search, and time and expanded
+    // cells
+    int nHierarchicalLonger;
+    int64 nHierarchicalExtraSteps;
+    int nHierarchicalFallbacks;
+    int64 nHierarchicalMicros;
+    int64 nHierarchicalExpanded;
+    // Waypoints returned by FindPath (in A* mode) in total, time taken by
+    // FindPath including the search and by turning the paths into
+    // waypoints alone, and number of paths for which moving along the
+    // waypoints does not arrive at the goal
+    int64 nWaypoints;
+    int64 nWaypointMicros;
+    int64 nLinearizeMicros;
+    int nInvalidWaypoints;
+    // Worst case of FindPath, measured between opposite corners of the
+    // map:  number of such paths, longest path and most waypoints among
+    // them, and largest time taken by the search alone, by FindPath and
+    // by turning the path into waypoints
+    int nCrossPaths;
+    int nCrossMaxLength;
+    int nCrossMaxWaypoints;
+    int64 nCrossSearchMicros;
+    int64 nCrossFindPathMicros;
+    int64 nCrossLinearizeMicros;
+
+    PathBenchmark()
+        : nPairs(0), nFound(0), nReferenceMicros(0), nGridMicros(0),
+          nJumpLonger(0), nJumpMicros(0), nLandmarkLonger(0), nLandmarkMicros(0),
+          nGridExpanded(0), nJumpExpanded(0), nLandmarkExpanded(0),
+          nHierarchicalLonger(0), nHierarchicalExtraSteps(0), nHierarchicalFallbacks(0),
+          nHierarchicalMicros(0), nHierarchicalExpanded(0),
+          nWaypoints(0), nWaypointMicros(0), nLinearizeMicros(0), nInvalidWaypoints(0),
+          nCrossPaths(0), nCrossMaxLength(0), nCrossMaxWaypoints(0),
+          nCrossSearchMicros(0), nCrossFindPathMicros(0), nCrossLinearizeMicros(0)
+    {
+    }
+};
+
+// Time the path searches and the original Boost Graph implementation on
+// random pairs of walkable coordinates.  That the plain search returns
+// the same paths as the original is checked by the unit tests.
+// FindPath is also timed on paths across the whole map.
+void BenchmarkFindPath(int nPairs, PathBenchmark &res);
 
 struct QueuedMove
 {
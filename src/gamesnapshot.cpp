@@ -0,0 +1,1071 @@
+#include "gamesnapshot.h"
+
+#include "gamecommitment.h"
+#include "gamestate.h"
+#include "headers.h"
+
+#include <stdexcept>
+
+using namespace Game;
+
+/* Format byte at the start of each snapshot, and flags.  */
+static const unsigned char SNAPSHOT_FORMAT = 1;
+static const unsigned char SNAPSHOT_COMPRESSED = 1;
+
+/* Upper bound for the decoded size, to reject garbage early.  */
+static const uint64 MAX_SNAPSHOT_SIZE = (1 << 30);
+
+/* The columns of a snapshot.  */
+enum SnapshotColumn
+{
+  COL_GLOBALS = 0,  /* Normal serialisation of the global fields.  */
+  COL_NAMES,        /* Front-coded dictionary of player names.  */
+  COL_IDS,          /* Gaps between name and character indices.  */
+  COL_COUNTS,       /* Entity counts and other small numbers.  */
+  COL_BYTES,        /* Colours, directions and other byte fields.  */
+  COL_COORDS,       /* Delta-coded coordinates.  */
+  COL_AMOUNTS,      /* Coin amounts.  */
+  COL_HEIGHTS,      /* Block heights relative to the state's height.  */
+  COL_STRINGS,      /* Messages and addresses.  */
+  COL_EXTRA,        /* Normal serialisation of PERMANENT_LUGGAGE fields.  */
+  NUM_COLUMNS
+};
+
+/* ************************************************************************** */
+/* Variable-length integers.  */
+
+/* Signed values are zigzag-coded, so that small negative numbers are
+   short as well.  */
+
+static inline uint64
+ZigZag (int64 n)
+{
+  return (static_cast<uint64> (n) << 1) ^ static_cast<uint64> (n >> 63);
+}
+
+static inline int64
+UnZigZag (uint64 n)
+{
+  return static_cast<int64> ((n >> 1) ^ (0 - (n & 1)));
+}
+
+class ColumnWriter
+{
+
+public:
+
+  std::vector<unsigned char> data;
+
+  inline void
+  WriteByte (unsigned char b)
+  {
+    data.push_back (b);
+  }
+
+  void
+  WriteVarInt (uint64 n)
+  {
+    while (n >= 0x80)
+      {
+        data.push_back ((n & 0x7F) | 0x80);
+        n >>= 7;
+      }
+    data.push_back (n);
+  }
+
+  inline void
+  WriteSigned (int64 n)
+  {
+    WriteVarInt (ZigZag (n));
+  }
+
+  inline void
+  WriteBytes (const unsigned char* pch, size_t n)
+  {
+    data.insert (data.end (), pch, pch + n);
+  }
+
+  inline void
+  WriteString (const std::string& str)
+  {
+    WriteVarInt (str.size ());
+    WriteBytes (reinterpret_cast<const unsigned char*> (str.data ()),
+                str.size ());
+  }
+
+};
+
+class ColumnReader
+{
+
+private:
+
+  const unsigned char* pcur;
+  const unsigned char* pend;
+
+  inline void
+  Need (size_t n) const
+  {
+    if (static_cast<size_t> (pend - pcur) < n)
+      throw std::runtime_error ("snapshot data too short");
+  }
+
+public:
+
+  ColumnReader ()
+    : pcur(NULL), pend(NULL)
+  {}
+
+  ColumnReader (const unsigned char* pch, size_t n)
+    : pcur(pch), pend(pch + n)
+  {}
+
+  inline size_t
+  size () const
+  {
+    return pend - pcur;
+  }
+
+  inline unsigned char
+  ReadByte ()
+  {
+    Need (1);
+    return *pcur++;
+  }
+
+  uint64
+  ReadVarInt ()
+  {
+    uint64 res = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+      {
+        const unsigned char b = ReadByte ();
+        res |= static_cast<uint64> (b & 0x7F) << shift;
+        if (!(b & 0x80))
+          return res;
+      }
+    throw std::runtime_error ("snapshot varint too long");
+  }
+
+  inline int64
+  ReadSigned ()
+  {
+    return UnZigZag (ReadVarInt ());
+  }
+
+  const unsigned char*
+  ReadBytes (size_t n)
+  {
+    Need (n);
+    const unsigned char* res = pcur;
+    pcur += n;
+    return res;
+  }
+
+  std::string
+  ReadString ()
+  {
+    const uint64 n = ReadVarInt ();
+    Need (n);
+    const char* pch = reinterpret_cast<const char*> (ReadBytes (n));
+    return std::string (pch, pch + n);
+  }
+
+};
+
+/* ************************************************************************** */
+/* LZ77 compression.  */
+
+/* The compressed data is a sequence of tokens, each consisting of a
+   literal run followed by a back-reference.  The token byte holds both
+   lengths in its nibbles (the match length minus LZ_MIN_MATCH), where 15
+   means that more length bytes follow.  The last token has only
+   literals.  */
+
+static const unsigned LZ_MIN_MATCH = 4;
+static const unsigned LZ_MAX_OFFSET = 0xFFFF;
+static const unsigned LZ_HASH_BITS = 14;
+
+static void
+LzWriteLength (size_t n, std::vector<unsigned char>& out)
+{
+  for (; n >= 255; n -= 255)
+    out.push_back (255);
+  out.push_back (n);
+}
+
+static void
+LzWriteToken (const unsigned char* pLiterals, size_t nLiterals,
+              size_t nOffset, size_t nMatch, std::vector<unsigned char>& out)
+{
+  const size_t nMatchCode = (nMatch > 0 ? nMatch - LZ_MIN_MATCH : 0);
+  out.push_back ((std::min<size_t> (nLiterals, 15) << 4)
+                 | std::min<size_t> (nMatchCode, 15));
+  if (nLiterals >= 15)
+    LzWriteLength (nLiterals - 15, out);
+  out.insert (out.end (), pLiterals, pLiterals + nLiterals);
+
+  if (nMatch == 0)
+    return;
+  out.push_back (nOffset & 0xFF);
+  out.push_back (nOffset >> 8);
+  if (nMatchCode >= 15)
+    LzWriteLength (nMatchCode - 15, out);
+}
+
+static inline uint32_t
+LzRead32 (const unsigned char* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t> (p[3]) << 24);
+}
+
+void
+Game::LzCompress (const std::vector<unsigned char>& in,
+                  std::vector<unsigned char>& out)
+{
+  const unsigned char* const pch = (in.empty () ? NULL : &in[0]);
+  const size_t n = in.size ();
+
+  std::vector<int> table(1 << LZ_HASH_BITS, -1);
+  size_t anchor = 0;
+  size_t i = 0;
+  while (i + LZ_MIN_MATCH <= n)
+    {
+      const uint32_t seq = LzRead32 (pch + i);
+      const unsigned h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+      const int cand = table[h];
+      table[h] = i;
+
+      if (cand < 0 || i - cand > LZ_MAX_OFFSET || LzRead32 (pch + cand) != seq)
+        {
+          ++i;
+          continue;
+        }
+
+      size_t len = LZ_MIN_MATCH;
+      while (i + len < n && pch[cand + len] == pch[i + len])
+        ++len;
+
+      LzWriteToken (pch + anchor, i - anchor, i - cand, len, out);
+      i += len;
+      anchor = i;
+    }
+
+  LzWriteToken (pch + anchor, n - anchor, 0, 0, out);
+}
+
+static size_t
+LzReadLength (ColumnReader& in, size_t n)
+{
+  if (n < 15)
+    return n;
+
+  unsigned char b;
+  do
+    {
+      b = in.ReadByte ();
+      n += b;
+    }
+  while (b == 255);
+
+  return n;
+}
+
+void
+Game::LzDecompress (const unsigned char* pch, size_t n, size_t nSize,
+                    std::vector<unsigned char>& out)
+{
+  out.clear ();
+  out.reserve (nSize);
+
+  ColumnReader in(pch, n);
+  loop
+    {
+      const unsigned char token = in.ReadByte ();
+
+      const size_t nLiterals = LzReadLength (in, token >> 4);
+      if (nLiterals > nSize - out.size ())
+        throw std::runtime_error ("snapshot decompression overflow");
+      const unsigned char* pLiterals = in.ReadBytes (nLiterals);
+      out.insert (out.end (), pLiterals, pLiterals + nLiterals);
+
+      if (in.size () == 0)
+        break;
+
+      size_t nOffset = in.ReadByte ();
+      nOffset |= static_cast<size_t> (in.ReadByte ()) << 8;
+      const size_t nMatch = LzReadLength (in, token & 0x0F) + LZ_MIN_MATCH;
+      if (nOffset == 0 || nOffset > out.size ()
+          || nMatch > nSize - out.size ())
+        throw std::runtime_error ("snapshot decompression: invalid match");
+
+      /* Matches may overlap their own output, so copy byte-wise.  */
+      const size_t start = out.size () - nOffset;
+      for (size_t i = 0; i < nMatch; ++i)
+        out.push_back (out[start + i]);
+    }
+
+  if (out.size () != nSize)
+    throw std::runtime_error ("snapshot decompression: size mismatch");
+}
+
+/* ************************************************************************** */
+/* Encoding.  */
+
+class SnapshotEncoder
+{
+
+private:
+
+  const GameState& state;
+
+  ColumnWriter cols[NUM_COLUMNS];
+  CDataStream extra;
+
+  std::map<PlayerID, unsigned> nameIndex;
+
+  /* Heights are mostly close to the state's height, or -1 for unset.  */
+  void
+  WriteHeight (int h)
+  {
+    if (h == -1)
+      cols[COL_HEIGHTS].WriteVarInt (0);
+    else
+      cols[COL_HEIGHTS].WriteVarInt (1 + ZigZag (static_cast<int64> (state.nHeight) - h));
+  }
+
+  /* Coordinates in sorted sets are ordered by y first.  */
+  void
+  WriteSortedCoord (const Coord& c, Coord& prev)
+  {
+    cols[COL_COORDS].WriteSigned (static_cast<int64> (c.y) - prev.y);
+    if (c.y == prev.y)
+      cols[COL_COORDS].WriteSigned (static_cast<int64> (c.x) - prev.x);
+    else
+      cols[COL_COORDS].WriteSigned (c.x);
+    prev = c;
+  }
+
+  void
+  WriteDelta (const Coord& c, const Coord& ref)
+  {
+    cols[COL_COORDS].WriteSigned (static_cast<int64> (c.x) - ref.x);
+    cols[COL_COORDS].WriteSigned (static_cast<int64> (c.y) - ref.y);
+  }
+
+  void WriteNames ();
+  void WriteCharacter (const CharacterState& c);
+  void WritePlayer (const PlayerState& p);
+  void WritePlayers (const PlayerStateMap& players);
+
+public:
+
+  explicit SnapshotEncoder (const GameState& s)
+    : state(s), extra(SER_DISK, VERSION)
+  {}
+
+  /* Encode the state and write all columns to out.  */
+  void Encode (ColumnWriter& out);
+
+};
+
+void
+SnapshotEncoder::WriteNames ()
+{
+  std::set<PlayerID> names;
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p, state.players)
+    names.insert (p.first);
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p,
+                 state.dead_players_chat)
+    names.insert (p.first);
+
+  /* Each name is written as length of the prefix shared with the
+     previous one and the remaining suffix.  */
+  ColumnWriter& col = cols[COL_NAMES];
+  col.WriteVarInt (names.size ());
+  std::string prev;
+  BOOST_FOREACH (const PlayerID& name, names)
+    {
+      size_t nShared = 0;
+      while (nShared < prev.size () && nShared < name.size ()
+             && prev[nShared] == name[nShared])
+        ++nShared;
+      col.WriteVarInt (nShared);
+      col.WriteString (name.substr (nShared));
+
+      const unsigned idx = nameIndex.size ();
+      nameIndex.insert (std::make_pair (name, idx));
+      prev = name;
+    }
+}
+
+void
+SnapshotEncoder::WriteCharacter (const CharacterState& c)
+{
+  cols[COL_COORDS].WriteSigned (c.coord.x);
+  cols[COL_COORDS].WriteSigned (c.coord.y);
+  WriteDelta (c.from, c.coord);
+
+  cols[COL_COUNTS].WriteVarInt (c.waypoints.size ());
+  Coord prev = c.coord;
+  BOOST_FOREACH (const Coord& wp, c.waypoints)
+    {
+      WriteDelta (wp, prev);
+      prev = wp;
+    }
+
+  cols[COL_BYTES].WriteByte (c.dir);
+  cols[COL_BYTES].WriteByte (c.stay_in_spawn_area);
+
+  cols[COL_AMOUNTS].WriteSigned (c.loot.nAmount);
+  WriteHeight (c.loot.firstBlock);
+  WriteHeight (c.loot.lastBlock);
+  WriteHeight (c.loot.collectedFirstBlock);
+  WriteHeight (c.loot.collectedLastBlock);
+
+#ifdef PERMANENT_LUGGAGE
+  extra << c.rpg_gems_in_purse;
+#ifdef AUX_STORAGE_VERSION2
+  extra << c.cs_reserve1 << c.cs_reserve2 << c.cs_reserve3 << c.cs_reserve4
+        << c.cs_reserve5 << c.cs_reserve6;
+#endif
+#endif
+}
+
+void
+SnapshotEncoder::WritePlayer (const PlayerState& p)
+{
+  cols[COL_BYTES].WriteByte (p.color);
+
+  cols[COL_COUNTS].WriteVarInt (p.characters.size ());
+  int64 prevIndex = -1;
+  BOOST_FOREACH (const PAIRTYPE(int, CharacterState)& c, p.characters)
+    {
+      cols[COL_IDS].WriteSigned (c.first - prevIndex - 1);
+      prevIndex = c.first;
+      WriteCharacter (c.second);
+    }
+  cols[COL_IDS].WriteSigned (p.next_character_index);
+
+  cols[COL_COUNTS].WriteSigned (p.remainingLife);
+  cols[COL_STRINGS].WriteString (p.message);
+  WriteHeight (p.message_block);
+  cols[COL_STRINGS].WriteString (p.address);
+  cols[COL_STRINGS].WriteString (p.addressLock);
+
+  cols[COL_AMOUNTS].WriteSigned (p.lockedCoins);
+  cols[COL_AMOUNTS].WriteSigned (p.value - p.lockedCoins);
+
+#ifdef PERMANENT_LUGGAGE
+  extra << p.playernameaddress << p.playerflags;
+#ifdef AUX_STORAGE_VERSION2
+  extra << p.pl_reserve1 << p.pl_reserve2 << p.pl_reserve3 << p.pl_reserve4
+        << p.pl_reserve5 << p.pl_reserve6
+        << p.pl_str_reserve1 << p.pl_str_reserve2;
+#endif
+#endif
+}
+
+void
+SnapshotEncoder::WritePlayers (const PlayerStateMap& players)
+{
+  cols[COL_COUNTS].WriteVarInt (players.size ());
+  int64 prev = -1;
+  BOOST_FOREACH (const PAIRTYPE(PlayerID, PlayerState)& p, players)
+    {
+      const int64 idx = nameIndex[p.first];
+      cols[COL_IDS].WriteVarInt (idx - prev - 1);
+      prev = idx;
+      WritePlayer (p.second);
+    }
+}
+
+void
+SnapshotEncoder::Encode (ColumnWriter& out)
+{
+  {
+    GameState globals;
+    globals.CopyGlobals (state);
+    globals.banks.clear ();
+    CDataStream ss(SER_DISK, VERSION);
+    ss << globals;
+    cols[COL_GLOBALS].WriteBytes (reinterpret_cast<const unsigned char*> (&ss[0]),
+                                  ss.size ());
+  }
+
+  WriteNames ();
+  WritePlayers (state.players);
+  WritePlayers (state.dead_players_chat);
+
+  Coord prev;
+  cols[COL_COUNTS].WriteVarInt (state.loot.size ());
+  for (std::map<Coord, LootInfo>::const_iterator i = state.loot.begin ();
+       i != state.loot.end (); ++i)
+    {
+      WriteSortedCoord (i->first, prev);
+      cols[COL_AMOUNTS].WriteSigned (i->second.nAmount);
+      WriteHeight (i->second.firstBlock);
+      WriteHeight (i->second.lastBlock);
+    }
+
+  prev = Coord ();
+  cols[COL_COUNTS].WriteVarInt (state.hearts.size ());
+  BOOST_FOREACH (const Coord& c, state.hearts)
+    WriteSortedCoord (c, prev);
+
+  prev = Coord ();
+  cols[COL_COUNTS].WriteVarInt (state.banks.size ());
+  for (std::map<Coord, unsigned>::const_iterator i = state.banks.begin ();
+       i != state.banks.end (); ++i)
+    {
+      WriteSortedCoord (i->first, prev);
+      cols[COL_COUNTS].WriteVarInt (i->second);
+    }
+
+#ifdef PERMANENT_LUGGAGE
+  extra << state.vault;
+#endif
+  if (!extra.empty ())
+    cols[COL_EXTRA].WriteBytes (reinterpret_cast<const unsigned char*> (&extra[0]),
+                                extra.size ());
+
+  for (unsigned i = 0; i < NUM_COLUMNS; ++i)
+    {
+      out.WriteVarInt (cols[i].data.size ());
+      if (!cols[i].data.empty ())
+        out.WriteBytes (&cols[i].data[0], cols[i].data.size ());
+    }
+}
+
+/* ************************************************************************** */
+/* Decoding.  */
+
+class SnapshotDecoder
+{
+
+private:
+
+  GameState& state;
+  const int nVersion;
+
+  ColumnReader cols[NUM_COLUMNS];
+  CDataStream extra;
+
+  std::vector<PlayerID> names;
+
+  int
+  ReadHeight ()
+  {
+    const uint64 v = cols[COL_HEIGHTS].ReadVarInt ();
+    if (v == 0)
+      return -1;
+    return state.nHeight - UnZigZag (v - 1);
+  }
+
+  void
+  ReadSortedCoord (Coord& c, Coord& prev)
+  {
+    c.y = prev.y + cols[COL_COORDS].ReadSigned ();
+    if (c.y == prev.y)
+      c.x = prev.x + cols[COL_COORDS].ReadSigned ();
+    else
+      c.x = cols[COL_COORDS].ReadSigned ();
+    prev = c;
+  }
+
+  void
+  ReadDelta (Coord& c, const Coord& ref)
+  {
+    c.x = ref.x + cols[COL_COORDS].ReadSigned ();
+    c.y = ref.y + cols[COL_COORDS].ReadSigned ();
+  }
+
+  void ReadNames ();
+  void ReadCharacter (CharacterState& c);
+  void ReadPlayer (PlayerState& p);
+  void ReadPlayers (PlayerStateMap& players);
+
+public:
+
+  SnapshotDecoder (GameState& s, int nVer)
+    : state(s), nVersion(nVer), extra(SER_DISK, nVer)
+  {}
+
+  /* Decode the state from the columns in the data.  */
+  void Decode (ColumnReader& in);
+
+};
+
+void
+SnapshotDecoder::ReadNames ()
+{
+  ColumnReader& col = cols[COL_NAMES];
+  const uint64 n = col.ReadVarInt ();
+  std::string prev;
+  for (uint64 i = 0; i < n; ++i)
+    {
+      const uint64 nShared = col.ReadVarInt ();
+      if (nShared > prev.size ())
+        throw std::runtime_error ("snapshot: invalid name prefix");
+      const std::string name = prev.substr (0, nShared) + col.ReadString ();
+      names.push_back (name);
+      prev = name;
+    }
+}
+
+void
+SnapshotDecoder::ReadCharacter (CharacterState& c)
+{
+  c.coord.x = cols[COL_COORDS].ReadSigned ();
+  c.coord.y = cols[COL_COORDS].ReadSigned ();
+  ReadDelta (c.from, c.coord);
+
+  const uint64 nWaypoints = cols[COL_COUNTS].ReadVarInt ();
+  c.waypoints.clear ();
+  Coord prev = c.coord;
+  for (uint64 i = 0; i < nWaypoints; ++i)
+    {
+      Coord wp;
+      ReadDelta (wp, prev);
+      c.waypoints.push_back (wp);
+      prev = wp;
+    }
+
+  c.dir = cols[COL_BYTES].ReadByte ();
+  c.stay_in_spawn_area = cols[COL_BYTES].ReadByte ();
+
+  c.loot.nAmount = cols[COL_AMOUNTS].ReadSigned ();
+  c.loot.firstBlock = ReadHeight ();
+  c.loot.lastBlock = ReadHeight ();
+  c.loot.collectedFirstBlock = ReadHeight ();
+  c.loot.collectedLastBlock = ReadHeight ();
+
+#ifdef PERMANENT_LUGGAGE
+  extra >> c.rpg_gems_in_purse;
+#ifdef AUX_STORAGE_VERSION2
+  extra >> c.cs_reserve1 >> c.cs_reserve2 >> c.cs_reserve3 >> c.cs_reserve4
+        >> c.cs_reserve5 >> c.cs_reserve6;
+#endif
+#endif
+}
+
+void
+SnapshotDecoder::ReadPlayer (PlayerState& p)
+{
+  p.color = cols[COL_BYTES].ReadByte ();
+
+  const uint64 nCharacters = cols[COL_COUNTS].ReadVarInt ();
+  p.characters.clear ();
+  int64 prevIndex = -1;
+  for (uint64 i = 0; i < nCharacters; ++i)
+    {
+      const int index = prevIndex + 1 + cols[COL_IDS].ReadSigned ();
+      prevIndex = index;
+      CharacterState c;
+      ReadCharacter (c);
+      p.characters.insert (p.characters.end (), std::make_pair (index, c));
+    }
+  p.next_character_index = cols[COL_IDS].ReadSigned ();
+
+  p.remainingLife = cols[COL_COUNTS].ReadSigned ();
+  p.message = cols[COL_STRINGS].ReadString ();
+  p.message_block = ReadHeight ();
+  p.address = cols[COL_STRINGS].ReadString ();
+  p.addressLock = cols[COL_STRINGS].ReadString ();
+
+  p.lockedCoins = cols[COL_AMOUNTS].ReadSigned ();
+  p.value = p.lockedCoins + cols[COL_AMOUNTS].ReadSigned ();
+
+#ifdef PERMANENT_LUGGAGE
+  extra >> p.playernameaddress >> p.playerflags;
+#ifdef AUX_STORAGE_VERSION2
+  extra >> p.pl_reserve1 >> p.pl_reserve2 >> p.pl_reserve3 >> p.pl_reserve4
+        >> p.pl_reserve5 >> p.pl_reserve6
+        >> p.pl_str_reserve1 >> p.pl_str_reserve2;
+#endif
+#endif
+}
+
+void
+SnapshotDecoder::ReadPlayers (PlayerStateMap& players)
+{
+  const uint64 n = cols[COL_COUNTS].ReadVarInt ();
+  players.clear ();
+  int64 prev = -1;
+  for (uint64 i = 0; i < n; ++i)
+    {
+      const uint64 idx = prev + 1 + cols[COL_IDS].ReadVarInt ();
+      if (idx >= names.size ())
+        throw std::runtime_error ("snapshot: invalid name index");
+      prev = idx;
+
+      PlayerState p;
+      ReadPlayer (p);
+      players.insert (players.end (), std::make_pair (names[idx], p));
+    }
+}
+
+void
+SnapshotDecoder::Decode (ColumnReader& in)
+{
+  for (unsigned i = 0; i < NUM_COLUMNS; ++i)
+    {
+      const uint64 n = in.ReadVarInt ();
+      if (n > in.size ())
+        throw std::runtime_error ("snapshot: column too long");
+      cols[i] = ColumnReader (in.ReadBytes (n), n);
+    }
+
+  {
+    const size_t n = cols[COL_GLOBALS].size ();
+    const char* pch = reinterpret_cast<const char*> (cols[COL_GLOBALS].ReadBytes (n));
+    CDataStream ss(pch, pch + n, SER_DISK, nVersion);
+    GameState globals;
+    ss >> globals;
+    state = GameState ();
+    state.CopyGlobals (globals);
+
+    /* The constructor sets the original banks, but the snapshot holds
+       the complete set.  */
+    state.banks.clear ();
+  }
+  {
+    const size_t n = cols[COL_EXTRA].size ();
+    const char* pch = reinterpret_cast<const char*> (cols[COL_EXTRA].ReadBytes (n));
+    extra = CDataStream (pch, pch + n, SER_DISK, nVersion);
+  }
+
+  ReadNames ();
+  ReadPlayers (state.players);
+  ReadPlayers (state.dead_players_chat);
+
+  Coord prev;
+  const uint64 nLoot = cols[COL_COUNTS].ReadVarInt ();
+  for (uint64 i = 0; i < nLoot; ++i)
+    {
+      Coord c;
+      ReadSortedCoord (c, prev);
+      LootInfo loot;
+      loot.nAmount = cols[COL_AMOUNTS].ReadSigned ();
+      loot.firstBlock = ReadHeight ();
+      loot.lastBlock = ReadHeight ();
+      state.loot.insert (state.loot.end (), std::make_pair (c, loot));
+    }
+
+  prev = Coord ();
+  const uint64 nHearts = cols[COL_COUNTS].ReadVarInt ();
+  for (uint64 i = 0; i < nHearts; ++i)
+    {
+      Coord c;
+      ReadSortedCoord (c, prev);
+      state.hearts.insert (state.hearts.end (), c);
+    }
+
+  prev = Coord ();
+  const uint64 nBanks = cols[COL_COUNTS].ReadVarInt ();
+  for (uint64 i = 0; i < nBanks; ++i)
+    {
+      Coord c;
+      ReadSortedCoord (c, prev);
+      const unsigned life = cols[COL_COUNTS].ReadVarInt ();
+      state.banks.insert (state.banks.end (), std::make_pair (c, life));
+    }
+
+#ifdef PERMANENT_LUGGAGE
+  extra >> state.vault;
+#endif
+}
+
+/* ************************************************************************** */
+
+void
+Game::EncodeSnapshot (const GameState& state, bool fCompress,
+                      std::vector<unsigned char>& out)
+{
+  ColumnWriter payload;
+  SnapshotEncoder enc(state);
+  enc.Encode (payload);
+
+  ColumnWriter res;
+  res.WriteByte (SNAPSHOT_FORMAT);
+  res.WriteVarInt (VERSION);
+  res.WriteByte (fCompress ? SNAPSHOT_COMPRESSED : 0);
+  res.WriteVarInt (payload.data.size ());
+  if (fCompress)
+    LzCompress (payload.data, res.data);
+  else if (!payload.data.empty ())
+    res.WriteBytes (&payload.data[0], payload.data.size ());
+
+  out.swap (res.data);
+}
+
+void
+Game::DecodeSnapshot (const unsigned char* pch, size_t nSize, GameState& state)
+{
+  ColumnReader in(pch, nSize);
+  if (in.ReadByte () != SNAPSHOT_FORMAT)
+    throw std::runtime_error ("unknown snapshot format");
+  const int nVersion = in.ReadVarInt ();
+  const unsigned char flags = in.ReadByte ();
+  const uint64 nRawSize = in.ReadVarInt ();
+  if (nRawSize > MAX_SNAPSHOT_SIZE)
+    throw std::runtime_error ("snapshot too large");
+
+  const size_t nRest = in.size ();
+  const unsigned char* pRest = in.ReadBytes (nRest);
+
+  std::vector<unsigned char> raw;
+  if (flags & SNAPSHOT_COMPRESSED)
+    LzDecompress (pRest, nRest, nRawSize, raw);
+  else
+    {
+      if (nRest != nRawSize)
+        throw std::runtime_error ("snapshot size mismatch");
+      raw.assign (pRest, pRest + nRest);
+    }
+
+  ColumnReader payload(raw.empty () ? NULL : &raw[0], raw.size ());
+  SnapshotDecoder dec(state, nVersion);
+  dec.Decode (payload);
+}
+
+bool
+Game::CheckSnapshot (const GameState& state, SnapshotCheck& res)
+{
+  CDataStream ssOrig(SER_DISK, VERSION);
+  ssOrig << state;
+  res.nSerialisedSize = ssOrig.size ();
+  res.fMatch = true;
+
+  for (unsigned i = 0; i < 2; ++i)
+    {
+      const bool fCompress = (i == 1);
+      std::vector<unsigned char> data;
+      EncodeSnapshot (state, fCompress, data);
+      if (fCompress)
+        res.nCompressedSize = data.size ();
+      else
+        res.nColumnarSize = data.size ();
+
+      GameState decoded;
+      try
+        {
+          DecodeSnapshot (&data[0], data.size (), decoded);
+        }
+      catch (const std::exception& e)
+        {
+          printf ("CheckSnapshot: decoding failed: %s\n", e.what ());
+          res.fMatch = false;
+          continue;
+        }
+
+      CDataStream ss(SER_DISK, VERSION);
+      ss << decoded;
+      if (ss.size () != ssOrig.size ()
+          || !std::equal (ss.begin (), ss.end (), ssOrig.begin ()))
+        {
+          printf ("CheckSnapshot: mismatch after round-trip (compressed: %d)\n",
+                  fCompress);
+          res.fMatch = false;
+        }
+    }
+
+  return res.fMatch;
+}
+
+/* ************************************************************************** */
+/* Snapshot files.  */
+
+static const unsigned SNAPSHOT_FILE_MAGIC = 0x48475346;
+static const int SNAPSHOT_FILE_FORMAT = 1;
+
+/* Size of the chunks in which the encoded state is written.  */
+static const unsigned SNAPSHOT_CHUNK_SIZE = 1 << 20;
+
+static inline uint256
+ChainChunkHash (const uint256& hashPrev, const uint256& hashChunk)
+{
+  return Hash (BEGIN(hashPrev), END(hashPrev), BEGIN(hashChunk), END(hashChunk));
+}
+
+bool
+Game::WriteSnapshotFile (const std::string& strFile, const GameState& state,
+                         SnapshotFileHeader& hdr)
+{
+  std::vector<unsigned char> data;
+  EncodeSnapshot (state, true, data);
+
+  hdr = SnapshotFileHeader ();
+  hdr.nFormat = SNAPSHOT_FILE_FORMAT;
+  hdr.nHeight = state.nHeight;
+  hdr.hashBlock = state.hashBlock;
+  hdr.hashStateRoot = GetStateCommitment (state).GetRoot ();
+  hdr.nSize = data.size ();
+
+  /* The content hash goes into the header, so compute the chunk hashes
+     before writing anything.  */
+  std::vector<uint256> chunkHashes;
+  for (size_t nPos = 0; nPos < data.size (); nPos += SNAPSHOT_CHUNK_SIZE)
+    {
+      const size_t nEnd = std::min<size_t> (nPos + SNAPSHOT_CHUNK_SIZE,
+                                            data.size ());
+      const uint256 hash = Hash (data.begin () + nPos, data.begin () + nEnd);
+      chunkHashes.push_back (hash);
+      hdr.hashContent = ChainChunkHash (hdr.hashContent, hash);
+    }
+  hdr.nChunks = chunkHashes.size ();
+
+  FILE* file = fopen (strFile.c_str (), "wb");
+  if (!file)
+    return error ("WriteSnapshotFile: failed to open %s", strFile.c_str ());
+
+  try
+    {
+      CAutoFile fileout(file, SER_DISK, VERSION);
+      fileout << SNAPSHOT_FILE_MAGIC << hdr;
+      for (unsigned i = 0; i < hdr.nChunks; ++i)
+        {
+          const size_t nPos = i * SNAPSHOT_CHUNK_SIZE;
+          const unsigned nChunk = std::min<size_t> (SNAPSHOT_CHUNK_SIZE,
+                                                    data.size () - nPos);
+          fileout << nChunk;
+          fileout.write (reinterpret_cast<const char*> (&data[nPos]), nChunk);
+          fileout << chunkHashes[i];
+        }
+    }
+  catch (const std::exception& e)
+    {
+      return error ("WriteSnapshotFile: %s", e.what ());
+    }
+
+  return true;
+}
+
+/**
+ * Read the chunks of a snapshot file and check their hashes.  If pout is
+ * not NULL, the data is appended to it.
+ */
+static bool
+ReadSnapshotChunks (CAutoFile& filein, const SnapshotFileHeader& hdr,
+                    std::vector<unsigned char>* pout)
+{
+  uint256 hashContent = 0;
+  uint64 nRemaining = hdr.nSize;
+  std::vector<unsigned char> chunk;
+  for (unsigned i = 0; i < hdr.nChunks; ++i)
+    {
+      unsigned nChunk;
+      filein >> nChunk;
+      if (nChunk != std::min<uint64> (SNAPSHOT_CHUNK_SIZE, nRemaining))
+        return error ("ReadSnapshotChunks: chunk %u has wrong size", i);
+      nRemaining -= nChunk;
+
+      chunk.resize (nChunk);
+      filein.read (reinterpret_cast<char*> (&chunk[0]), nChunk);
+      uint256 hash;
+      filein >> hash;
+      if (hash != Hash (chunk.begin (), chunk.end ()))
+        return error ("ReadSnapshotChunks: chunk %u is corrupt", i);
+      hashContent = ChainChunkHash (hashContent, hash);
+
+      if (pout)
+        pout->insert (pout->end (), chunk.begin (), chunk.end ());
+    }
+
+  if (hashContent != hdr.hashContent)
+    return error ("ReadSnapshotChunks: content hash mismatch");
+
+  return true;
+}
+
+/* Open a snapshot file and read its header.  */
+static FILE*
+OpenSnapshotFile (const std::string& strFile, SnapshotFileHeader& hdr)
+{
+  FILE* file = fopen (strFile.c_str (), "rb");
+  if (!file)
+    {
+      error ("OpenSnapshotFile: failed to open %s", strFile.c_str ());
+      return NULL;
+    }
+
+  CAutoFile filein(file, SER_DISK, VERSION);
+  unsigned nMagic;
+  try
+    {
+      filein >> nMagic >> hdr;
+    }
+  catch (const std::exception& e)
+    {
+      error ("OpenSnapshotFile: %s: %s", strFile.c_str (), e.what ());
+      return NULL;
+    }
+
+  if (nMagic != SNAPSHOT_FILE_MAGIC || hdr.nFormat != SNAPSHOT_FILE_FORMAT)
+    {
+      error ("OpenSnapshotFile: %s is not a snapshot file", strFile.c_str ());
+      return NULL;
+    }
+  if (hdr.nSize == 0 || hdr.nSize > MAX_SNAPSHOT_SIZE
+      || hdr.nChunks != (hdr.nSize + SNAPSHOT_CHUNK_SIZE - 1)
+                          / SNAPSHOT_CHUNK_SIZE)
+    {
+      error ("OpenSnapshotFile: %s has an invalid size", strFile.c_str ());
+      return NULL;
+    }
+
+  return filein.release ();
+}
+
+bool
+Game::VerifySnapshotFile (const std::string& strFile, SnapshotFileHeader& hdr)
+{
+  FILE* file = OpenSnapshotFile (strFile, hdr);
+  if (!file)
+    return false;
+
+  try
+    {
+      CAutoFile filein(file, SER_DISK, VERSION);
+      return ReadSnapshotChunks (filein, hdr, NULL);
+    }
+  catch (const std::exception& e)
+    {
+      return error ("VerifySnapshotFile: %s", e.what ());
+    }
+}
+
+bool
+Game::ReadSnapshotFile (const std::string& strFile, SnapshotFileHeader& hdr,
+                        GameState& state)
+{
+  FILE* file = OpenSnapshotFile (strFile, hdr);
+  if (!file)
+    return false;
+
+  /* The chunk hashes are checked while the data is read, so that a
+     corrupt or truncated file is rejected before anything is decoded.  */
+  try
+    {
+      std::vector<unsigned char> data;
+      data.reserve (hdr.nSize);
+      {
+        CAutoFile filein(file, SER_DISK, VERSION);
+        if (!ReadSnapshotChunks (filein, hdr, &data))
+          return false;
+      }
+
+      DecodeSnapshot (&data[0], data.size (), state);
+    }
+  catch (const std::exception& e)
+    {
+      return error ("ReadSnapshotFile: %s", e.what ());
+    }
+
+  if (state.nHeight != hdr.nHeight || state.hashBlock != hdr.hashBlock)
+    return error ("ReadSnapshotFile: state does not match the header");
+  if (GetStateCommitment (state).GetRoot () != hdr.hashStateRoot)
+    return error ("ReadSnapshotFile: commitment root mismatch");
+
+  return true;
+}
@@ -0,0 +1,160 @@
+#ifndef GAMESNAPSHOT_H
+#define GAMESNAPSHOT_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Compact encoding of full game states for storage.  Instead of writing
+// each entity with all its fields in a row (as the normal serialisation
+// does), the fields are split into columns of similar values:  player
+// names go into a front-coded dictionary and are referenced by index,
+// coordinates are delta-coded against their neighbours, and counts,
+// amounts and block heights are written as variable-length integers.
+// The columns are optionally compressed with a small LZ77 coder, which
+// works well since each column is quite uniform.
+//
+// Fields that only exist with PERMANENT_LUGGAGE and the global fields of
+// the state are kept in their normal serialisation in separate columns.
+//
+// Snapshot files (game_dumpsnapshot and -loadgamesnapshot) hold one such
+// encoded state to bootstrap the game DB of another node.  The header
+// names the block and the state's commitment root, and the data is split
+// into chunks with their own hashes, so that a file can be verified
+// chunk by chunk before anything is decoded.
+
+namespace Game
+{
+
+struct GameState;
+
+/**
+ * Compress data with the LZ77 coder used for snapshot columns.
+ * @param in The data to compress.
+ * @param out Append the compressed data here.
+ */
+void LzCompress (const std::vector<unsigned char>& in,
+                 std::vector<unsigned char>& out);
+
+/**
+ * Decompress data produced by LzCompress.
+ * @param pch Start of the compressed data.
+ * @param n Size of the compressed data.
+ * @param nSize Size the data must decompress to.
+ * @param out Set to the decompressed data.
+ * @throws std::runtime_error if the data is invalid or does not
+ *         decompress to exactly nSize bytes.
+ */
+void LzDecompress (const unsigned char* pch, size_t n, size_t nSize,
+                   std::vector<unsigned char>& out);
+
+/**
+ * Encode a game state as snapshot.
+ * @param state The state to encode.
+ * @param fCompress Whether to compress the columns.
+ * @param out Put the encoded bytes here.
+ */
+void EncodeSnapshot (const GameState& state, bool fCompress,
+                     std::vector<unsigned char>& out);
+
+/**
+ * Decode a snapshot produced by EncodeSnapshot.
+ * @param pch Start of the encoded data.
+ * @param nSize Size of the encoded data.
+ * @param state Set to the decoded state.
+ * @throws std::runtime_error if the data is invalid.
+ */
+void DecodeSnapshot (const unsigned char* pch, size_t nSize,
+                     GameState& state);
+
+/* Result of CheckSnapshot.  */
+struct SnapshotCheck
+{
+  /* Size of the state in the normal serialisation.  */
+  size_t nSerialisedSize;
+  /* Size of the snapshot without and with compression.  */
+  size_t nColumnarSize;
+  size_t nCompressedSize;
+  /* Whether both snapshots decode to a state that serialises exactly
+     as the original one.  */
+  bool fMatch;
+};
+
+/**
+ * Encode the state as snapshot with and without compression, decode
+ * it again and compare the results to the normal serialisation.
+ * @param state The state to check.
+ * @param res Fill in the sizes and result here.
+ * @return True if the round-trip reproduced the state.
+ */
+bool CheckSnapshot (const GameState& state, SnapshotCheck& res);
+
+/* Header of a snapshot file.  */
+struct SnapshotFileHeader
+{
+  int nFormat;
+  /* Height and block hash of the state.  */
+  int nHeight;
+  uint256 hashBlock;
+  /* Root of the state's commitment (as returned by game_getstateroot),
+     which can be compared to the one of a trusted node.  */
+  uint256 hashStateRoot;
+  /* Size of the encoded state and number of chunks it is split into.  */
+  uint64 nSize;
+  unsigned nChunks;
+  /* Hash chained over the hashes of all chunks.  */
+  uint256 hashContent;
+
+  SnapshotFileHeader ()
+    : nFormat(0), nHeight(-1), hashBlock(0), hashStateRoot(0),
+      nSize(0), nChunks(0), hashContent(0)
+  {}
+
+  IMPLEMENT_SERIALIZE
+  (
+    READWRITE(nFormat);
+    READWRITE(nHeight);
+    READWRITE(hashBlock);
+    READWRITE(hashStateRoot);
+    READWRITE(nSize);
+    READWRITE(nChunks);
+    READWRITE(hashContent);
+  )
+};
+
+/**
+ * Write a game state to a snapshot file.
+ * @param strFile The file to write.
+ * @param state The state to write.
+ * @param hdr Set to the header written.
+ * @return True on success.
+ */
+bool WriteSnapshotFile (const std::string& strFile, const GameState& state,
+                        SnapshotFileHeader& hdr);
+
+/**
+ * Check the header and all chunk hashes of a snapshot file.  Only one
+ * chunk is held in memory at a time.
+ * @param strFile The file to check.
+ * @param hdr Set to the file's header.
+ * @return True if the file is intact.
+ */
+bool VerifySnapshotFile (const std::string& strFile, SnapshotFileHeader& hdr);
+
+/**
+ * Verify and read a snapshot file.  The decoded state is also checked
+ * against the block and commitment root in the header.
+ * @param strFile The file to read.
+ * @param hdr Set to the file's header.
+ * @param state Set to the state.
+ * @return True on success.
+ */
+bool ReadSnapshotFile (const std::string& strFile, SnapshotFileHeader& hdr,
+                       GameState& state);
+
+}
+
+#endif // GAMESNAPSHOT_H
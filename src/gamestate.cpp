@@ -137,58 +137,64 @@ DropHeart (int nHeight)
   return nHeight % heartEvery == 0;
 }
 
-/* Ensure that walkableTiles is filled.  */
+/* Ensure that walkableTiles is filled.  The lock is needed since steps
+   may be performed on several threads (when verifying the history).  */
+static CCriticalSection cs_walkableTiles;
+
 static void
 FillWalkableTiles ()
 {
-    // for FORK_TIMESAVE -- less possible player and bank spawn tiles
-    if (walkableTiles_ts_players.empty ())
+    CRITICAL_BLOCK(cs_walkableTiles)
     {
-        for (int x = 0; x < MAP_WIDTH; ++x)
-          for (int y = 0; y < MAP_HEIGHT; ++y)
-            if (IsWalkable (x, y))
-            {
-                if ( ! (SpawnMap[y][x] & SPAWNMAPFLAG_PLAYER) ) // note: player spawn tiles and bank spawn tiles are separated
-                  continue;
+        // for FORK_TIMESAVE -- less possible player and bank spawn tiles
+        if (walkableTiles_ts_players.empty ())
+        {
+            for (int x = 0; x < MAP_WIDTH; ++x)
+              for (int y = 0; y < MAP_HEIGHT; ++y)
+                if (IsWalkable (x, y))
+                {
+                    if ( ! (SpawnMap[y][x] & SPAWNMAPFLAG_PLAYER) ) // note: player spawn tiles and bank spawn tiles are separated
+                      continue;
 
-              walkableTiles_ts_players.push_back (Coord (x, y));
-            }
+                  walkableTiles_ts_players.push_back (Coord (x, y));
+                }
+
+            /* Do not forget to sort in the order defined by operator<!  */
+            std::sort (walkableTiles_ts_players.begin (), walkableTiles_ts_players.end ());
+            assert (!walkableTiles_ts_players.empty ());
+        }
+        if (walkableTiles_ts_banks.empty ())
+        {
+            for (int x = 0; x < MAP_WIDTH; ++x)
+              for (int y = 0; y < MAP_HEIGHT; ++y)
+                if (IsWalkable (x, y))
+                {
+                    if ( ! (SpawnMap[y][x] & SPAWNMAPFLAG_BANK) )
+                      continue;
+
+                  walkableTiles_ts_banks.push_back (Coord (x, y));
+                }
+
+            /* Do not forget to sort in the order defined by operator<!  */
+            std::sort (walkableTiles_ts_banks.begin (), walkableTiles_ts_banks.end ());
+            assert (!walkableTiles_ts_banks.empty ());
+        }
+
+        if (!walkableTiles.empty ())
+          return;
 
-        /* Do not forget to sort in the order defined by operator<!  */
-        std::sort (walkableTiles_ts_players.begin (), walkableTiles_ts_players.end ());
-        assert (!walkableTiles_ts_players.empty ());
-    }
-    if (walkableTiles_ts_banks.empty ())
-    {
         for (int x = 0; x < MAP_WIDTH; ++x)
           for (int y = 0; y < MAP_HEIGHT; ++y)
             if (IsWalkable (x, y))
             {
-                if ( ! (SpawnMap[y][x] & SPAWNMAPFLAG_BANK) )
-                  continue;
-
-              walkableTiles_ts_banks.push_back (Coord (x, y));
+              walkableTiles.push_back (Coord (x, y));
             }
 
         /* Do not forget to sort in the order defined by operator<!  */
-        std::sort (walkableTiles_ts_banks.begin (), walkableTiles_ts_banks.end ());
-        assert (!walkableTiles_ts_banks.empty ());
-    }
+        std::sort (walkableTiles.begin (), walkableTiles.end ());
 
-    if (!walkableTiles.empty ())
-      return;
-
-    for (int x = 0; x < MAP_WIDTH; ++x)
-      for (int y = 0; y < MAP_HEIGHT; ++y)
-        if (IsWalkable (x, y))
-        {
-          walkableTiles.push_back (Coord (x, y));
-        }
-
-    /* Do not forget to sort in the order defined by operator<!  */
-    std::sort (walkableTiles.begin (), walkableTiles.end ());
-
-    assert (!walkableTiles.empty ());
+        assert (!walkableTiles.empty ());
+    }
 }
 
 } // namespace Game
@@ -485,6 +491,7 @@ void Move::ApplyCommon(GameState &state) const
             PlayerState &pl = state.dead_players_chat[player];
             pl.message = *message;
             pl.message_block = state.nHeight;
+            state.touched.DeadPlayerChat (player);
         }
         return;
     }
@@ -757,6 +764,7 @@ CharactersOnTiles::DrawLife (GameState& state, StepResult& result)
       PlayerStateMap::iterator vit = state.players.find (a.chid.player);
       assert (vit != state.players.end ());
       PlayerState& victim = vit->second;
+      state.touched.Player (a.chid.player);
 
       /* In case of life steal, actually draw life.  The coins are not yet
          added to the attacker, but instead their total amount is saved
@@ -909,6 +917,7 @@ CharactersOnTiles::DistributeDrawnLife (RandomGenerator& rnd,
 
           toSpend -= damage;
           plIt->second->value += damage;
+          state.touched.Player (alive[ind].player);
 
           /* Do not use a silly trick like swapping in the last element.
              We want to keep the array ordered at all times.  The order is
@@ -1307,6 +1316,7 @@ int zhunt_playermap[Game::MAP_HEIGHT][Game::MAP_WIDTH];
 //int AI_playermap[MAP_HEIGHT][MAP_WIDTH][NUM_TEAM_COLORS];
 long long AI_coinmap[RPG_MAP_HEIGHT][RPG_MAP_WIDTH];
 long long AI_coinmap_copy[RPG_MAP_HEIGHT][RPG_MAP_WIDTH];
+static CCriticalSection cs_AI_coinmap;
 
 
 // Simple straight-line motion
@@ -1675,6 +1685,54 @@ GameState::UpdateVersion(int oldVersion)
     }
 }
 
+void
+GameState::CopyGlobals (const GameState& from)
+{
+#ifdef PERMANENT_LUGGAGE
+  gemSpawnPos = from.gemSpawnPos;
+  gemSpawnState = from.gemSpawnState;
+
+  feed_nextexp_price = from.feed_nextexp_price;
+  feed_prevexp_price = from.feed_prevexp_price;
+  feed_reward_dividend = from.feed_reward_dividend;
+  feed_reward_divisor = from.feed_reward_divisor;
+  feed_reward_remaining = from.feed_reward_remaining;
+  upgrade_test = from.upgrade_test;
+  liquidity_reward_remaining = from.liquidity_reward_remaining;
+  auction_settle_price = from.auction_settle_price;
+  auction_last_price = from.auction_last_price;
+  auction_last_chronon = from.auction_last_chronon;
+#ifdef AUX_STORAGE_VERSION2
+#ifdef AUX_STORAGE_VERSION3
+  gs_reserve31 = from.gs_reserve31;
+  gs_reserve32 = from.gs_reserve32;
+  gs_reserve33 = from.gs_reserve33;
+  gs_reserve34 = from.gs_reserve34;
+  crd_nextexp_price = from.crd_nextexp_price;
+#endif
+  crd_last_price = from.crd_last_price;
+  crd_last_size = from.crd_last_size;
+  crd_prevexp_price = from.crd_prevexp_price;
+  crd_mm_orderlimits = from.crd_mm_orderlimits;
+  crd_last_chronon = from.crd_last_chronon;
+  zhunt_gemSpawnState = from.zhunt_gemSpawnState;
+  zhunt_RNG = from.zhunt_RNG;
+  gs_reserve8 = from.gs_reserve8;
+  auction_settle_conservative = from.auction_settle_conservative;
+  gs_reserve10 = from.gs_reserve10;
+  gs_str_reserve1 = from.gs_str_reserve1;
+  gs_str_reserve2 = from.gs_str_reserve2;
+#endif
+#endif
+
+  crownPos = from.crownPos;
+  crownHolder = from.crownHolder;
+  gameFund = from.gameFund;
+  nHeight = from.nHeight;
+  nDisasterHeight = from.nDisasterHeight;
+  hashBlock = from.hashBlock;
+}
+
 json_spirit::Value GameState::ToJsonValue() const
 {
     using namespace json_spirit;
@@ -1694,10 +1752,22 @@ json_spirit::Value GameState::ToJsonValue() const
 
     obj.push_back(Pair("players", subobj));
 
+    obj.push_back(Pair("loot", LootToJsonValue()));
+    obj.push_back(Pair("hearts", HeartsToJsonValue()));
+    obj.push_back(Pair("banks", BanksToJsonValue()));
+    AddGlobalsToJson(obj);
+
+    return obj;
+}
+
+json_spirit::Value GameState::LootToJsonValue() const
+{
+    using namespace json_spirit;
+
     Array arr;
     BOOST_FOREACH(const PAIRTYPE(Coord, LootInfo) &p, loot)
     {
-        subobj.clear();
+        Object subobj;
         subobj.push_back(Pair("x", p.first.x));
         subobj.push_back(Pair("y", p.first.y));
         subobj.push_back(Pair("amount", ValueFromAmount(p.second.nAmount)));
@@ -1707,30 +1777,48 @@ json_spirit::Value GameState::ToJsonValue() const
         subobj.push_back(Pair("blockRange", blk_rng));
         arr.push_back(subobj);
     }
-    obj.push_back(Pair("loot", arr));
 
-    arr.clear ();
+    return arr;
+}
+
+json_spirit::Value GameState::HeartsToJsonValue() const
+{
+    using namespace json_spirit;
+
+    Array arr;
     BOOST_FOREACH (const Coord& c, hearts)
       {
-        subobj.clear ();
+        Object subobj;
         subobj.push_back (Pair ("x", c.x));
         subobj.push_back (Pair ("y", c.y));
         arr.push_back (subobj);
       }
-    obj.push_back (Pair ("hearts", arr));
 
-    arr.clear ();
+    return arr;
+}
+
+json_spirit::Value GameState::BanksToJsonValue() const
+{
+    using namespace json_spirit;
+
+    Array arr;
     BOOST_FOREACH (const PAIRTYPE(Coord, unsigned)& b, banks)
       {
-        subobj.clear ();
+        Object subobj;
         subobj.push_back (Pair ("x", b.first.x));
         subobj.push_back (Pair ("y", b.first.y));
         subobj.push_back (Pair ("life", static_cast<int> (b.second)));
         arr.push_back (subobj);
       }
-    obj.push_back (Pair ("banks", arr));
 
-    subobj.clear();
+    return arr;
+}
+
+void GameState::AddGlobalsToJson(json_spirit::Object& obj) const
+{
+    using namespace json_spirit;
+
+    Object subobj;
     subobj.push_back(Pair("x", crownPos.x));
     subobj.push_back(Pair("y", crownPos.y));
     if (!crownHolder.player.empty())
@@ -1744,14 +1832,13 @@ json_spirit::Value GameState::ToJsonValue() const
     obj.push_back (Pair("height", nHeight));
     obj.push_back (Pair("disasterHeight", nDisasterHeight));
     obj.push_back (Pair("hashBlock", hashBlock.ToString().c_str()));
-
-    return obj;
 }
 
 void GameState::AddLoot(Coord coord, int64_t nAmount)
 {
     if (nAmount == 0)
         return;
+    touched.Loot (coord);
     std::map<Coord, LootInfo>::iterator mi = loot.find(coord);
     if (mi != loot.end())
     {
@@ -1901,6 +1988,7 @@ void GameState::DivideLootAmongPlayers()
            some of them will get nothing.  */
         if (lootInfo.nAmount > 0)
           {
+            touched.Player (i->pid);
             const int64_t rem = i->ch->CollectLoot (lootInfo, nHeight,
                                                     i->carryCap);
             AddLoot (coord, rem - lootInfo.nAmount);
@@ -1951,6 +2039,7 @@ GameState::CrownBonus (int64_t nAmount)
     {
       PlayerState& p = players[crownHolder.player];
       CharacterState& ch = p.characters[crownHolder.index];
+      touched.Player (crownHolder.player);
 
       const LootInfo loot(nAmount, nHeight);
       const int64_t cap = GetCarryingCapacity (nHeight, crownHolder.index == 0,
@@ -1998,8 +2087,8 @@ GameState::GetCoinsOnMap () const
 
 void GameState::CollectHearts(RandomGenerator &rnd)
 {
-    std::map<Coord, std::vector<PlayerState*> > playersOnHeartTile;
-    for (std::map<PlayerID, PlayerState>::iterator mi = players.begin(); mi != players.end(); mi++)
+    std::map<Coord, std::vector<PlayerStateMap::iterator> > playersOnHeartTile;
+    for (PlayerStateMap::iterator mi = players.begin(); mi != players.end(); mi++)
     {
         PlayerState *pl = &mi->second;
         if (!pl->CanSpawnCharacter())
@@ -2009,13 +2098,13 @@ void GameState::CollectHearts(RandomGenerator &rnd)
             const CharacterState &ch = pc.second;
 
             if (hearts.count(ch.coord))
-                playersOnHeartTile[ch.coord].push_back(pl);
+                playersOnHeartTile[ch.coord].push_back(mi);
         }
     }
-    for (std::map<Coord, std::vector<PlayerState*> >::iterator mi = playersOnHeartTile.begin(); mi != playersOnHeartTile.end(); mi++)
+    for (std::map<Coord, std::vector<PlayerStateMap::iterator> >::iterator mi = playersOnHeartTile.begin(); mi != playersOnHeartTile.end(); mi++)
     {
         const Coord &c = mi->first;
-        std::vector<PlayerState*> &v = mi->second;
+        std::vector<PlayerStateMap::iterator> &v = mi->second;
         int n = v.size();
         int i;
         for (;;)
@@ -2026,15 +2115,17 @@ void GameState::CollectHearts(RandomGenerator &rnd)
                 break;
             }
             i = n == 1 ? 0 : rnd.GetIntRnd(n);
-            if (v[i]->CanSpawnCharacter())
+            if (v[i]->second.CanSpawnCharacter())
                 break;
             v.erase(v.begin() + i);
             n--;
         }
         if (i >= 0)
         {
-            v[i]->SpawnCharacter(nHeight, rnd);
+            v[i]->second.SpawnCharacter(nHeight, rnd);
             hearts.erase(c);
+            touched.Player (v[i]->first);
+            touched.Heart (c);
         }
     }
 }
@@ -2188,7 +2279,10 @@ GameState::FinaliseKills (StepResult& step)
 
   /* Erase killed players from the state.  */
   BOOST_FOREACH(const PlayerID& victim, killedPlayers)
-    players.erase (victim);
+    {
+      players.erase (victim);
+      touched.Player (victim);
+    }
 }
 
 bool
@@ -2225,6 +2319,7 @@ GameState::KillSpawnArea (StepResult& step)
         {
           const int i = pc.first;
           CharacterState &ch = pc.second;
+          const int oldStay = ch.stay_in_spawn_area;
 
           // process logout timer
           if (ForkInEffect (FORK_TIMESAVE, nHeight))
@@ -2256,6 +2351,8 @@ GameState::KillSpawnArea (StepResult& step)
                   ch.stay_in_spawn_area++;
               }
 
+              if (ch.stay_in_spawn_area != oldStay)
+                  touched.Player (p.first);
               if (CHARACTER_NO_LOGOUT(ch.stay_in_spawn_area))
                   continue;
           }
@@ -2264,11 +2361,14 @@ GameState::KillSpawnArea (StepResult& step)
               if (!IsBank (ch.coord))
               {
                 ch.stay_in_spawn_area = 0;
+                if (oldStay != 0)
+                  touched.Player (p.first);
                 continue;
               }
 
               /* Make sure to increment the counter in every case.  */
               assert (IsBank (ch.coord));
+              touched.Player (p.first);
               const int maxStay = MaxStayOnBank (nHeight);
               if (ch.stay_in_spawn_area++ < maxStay || maxStay == -1)
                 continue;
@@ -2284,6 +2384,8 @@ GameState::KillSpawnArea (StepResult& step)
              iterator 'pc'.  */
           toErase.insert(i);
         }
+      if (!toErase.empty ())
+        touched.Player (p.first);
       BOOST_FOREACH(int i, toErase)
         p.second.characters.erase(i);
     }
@@ -2302,11 +2404,16 @@ GameState::ApplyDisaster (RandomGenerator& rng)
       assert (p.second.remainingLife == -1);
 
       p.second.remainingLife = rng.GetIntRnd (POISON_MIN_LIFE, POISON_MAX_LIFE);
+      touched.Player (p.first);
     }
 
   /* Remove all hearts from the map.  */
   if (ForkInEffect (FORK_LESSHEARTS, nHeight))
-    hearts.clear ();
+    {
+      BOOST_FOREACH (const Coord& c, hearts)
+        touched.Heart (c);
+      hearts.clear ();
+    }
 
   /* Reset disaster counter.  */
   nDisasterHeight = nHeight;
@@ -2322,6 +2429,7 @@ GameState::DecrementLife (StepResult& step)
 
       assert (p.second.remainingLife > 0);
       --p.second.remainingLife;
+      touched.Player (p.first);
 
       if (p.second.remainingLife == 0)
         {
@@ -2337,6 +2445,8 @@ GameState::RemoveHeartedCharacters (StepResult& step)
   assert (IsForkHeight (FORK_LIFESTEAL, nHeight));
 
   /* Get rid of all hearts on the map.  */
+  BOOST_FOREACH (const Coord& c, hearts)
+    touched.Heart (c);
   hearts.clear ();
 
   /* Immediately kill all hearted characters.  */
@@ -2357,6 +2467,8 @@ GameState::RemoveHeartedCharacters (StepResult& step)
              iterator 'pc'.  */
           toErase.insert (i);
         }
+      if (!toErase.empty ())
+        touched.Player (p.first);
       BOOST_FOREACH (int i, toErase)
         p.second.characters.erase (i);
     }
@@ -2467,6 +2579,12 @@ GameState::UpdateBanks (RandomGenerator& rng)
     }
   }
 
+  /* The life of all banks changes, so all of them are recorded.  */
+  BOOST_FOREACH (const PAIRTYPE(Coord, unsigned)& b, banks)
+    touched.Bank (b.first);
+  BOOST_FOREACH (const PAIRTYPE(Coord, unsigned)& b, newBanks)
+    touched.Bank (b.first);
+
   banks.swap (newBanks);
   assert (banks.size () == DYNBANKS_NUM_BANKS);
 }
@@ -2484,6 +2602,41 @@ CollectedBounty::UpdateAddress (const GameState& state)
   address = i->second.address;
 }
 
+unsigned
+StateChangeSet::size () const
+{
+  return players.size () + deadPlayersChat.size () + loot.size ()
+          + hearts.size () + banks.size () + vaults.size ();
+}
+
+namespace
+{
+
+/* Records the changes to a state into a change set while in scope.  */
+class StateChangeRecording
+{
+
+private:
+
+  GameState& state;
+
+public:
+
+  inline StateChangeRecording (GameState& s, StateChangeSet& changes)
+    : state(s)
+  {
+    state.touched.Start (changes);
+  }
+
+  inline ~StateChangeRecording ()
+  {
+    state.touched.Stop ();
+  }
+
+};
+
+} // anonymous namespace
+
 bool Game::PerformStep(const GameState &inState, const StepData &stepData, GameState &outState, StepResult &stepResult)
 {
     BOOST_FOREACH(const Move &m, stepData.vMoves)
@@ -2502,8 +2655,18 @@ bool Game::PerformStep(const GameState &inState, const StepData &stepData, GameS
 
     stepResult = StepResult();
 
+    /* Record the changed entities from here on.  The chat of last block's
+       dead players is gone, and all players that sent a move change.  */
+    const StateChangeRecording recording(outState, stepResult.changes);
+    BOOST_FOREACH(const PAIRTYPE(PlayerID, PlayerState)& p, inState.dead_players_chat)
+        outState.touched.DeadPlayerChat (p.first);
+    BOOST_FOREACH(const Move& m, stepData.vMoves)
+        outState.touched.Player (m.player);
+
 
-    // grabbing coins
+    // grabbing coins (locked since steps may run on several threads
+    // when verifying the history)
+    CRITICAL_BLOCK(cs_AI_coinmap)
     for (int y = 0; y < Game::MAP_HEIGHT; y++)
     for (int x = 0; x < Game::MAP_WIDTH; x++)
     {
@@ -4117,6 +4280,11 @@ bool Game::PerformStep(const GameState &inState, const StepData &stepData, GameS
             }
 #endif
 
+            /* Characters without waypoints only reset their starting
+               point, which usually is the coordinate already.  */
+            if (!pc.second.waypoints.empty () || pc.second.from != pc.second.coord)
+                outState.touched.Player (p.first);
+
             // can't move in spectator mode, moving will lose spawn protection
             if ((ForkInEffect (FORK_TIMESAVE, outState.nHeight)) &&
                 ( ! (pc.second.waypoints.empty()) ))
@@ -4677,6 +4845,7 @@ bool Game::PerformStep(const GameState &inState, const StepData &stepData, GameS
                 CollectedBounty b(p.first, i, ch.loot, p.second.address);
                 stepResult.bounties.push_back (b);
                 ch.loot = CollectedLootInfo();
+                outState.touched.Player (p.first);
             }
         }
 
@@ -4764,6 +4933,7 @@ bool Game::PerformStep(const GameState &inState, const StepData &stepData, GameS
             heart.y = rnd.GetIntRnd(MAP_HEIGHT);
         } while (!IsWalkable(heart) || IsOriginalSpawnArea (heart));
         outState.hearts.insert(heart);
+        outState.touched.Heart (heart);
     }
 
     outState.CollectHearts(rnd);
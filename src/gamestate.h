@@ -138,6 +138,105 @@ struct Coord
 
 typedef std::vector<Coord> WaypointVector;
 
+/**
+ * Keys of all entities that differ between two game states.  PerformStep
+ * records them while it changes the state, so that the data derived from
+ * game states (commitment, JSON, indexes and deltas) can be updated with
+ * the changed entities only.  The sets may also contain entities that were
+ * touched but ended up unchanged.
+ */
+struct StateChangeSet
+{
+
+  std::set<PlayerID> players;
+  std::set<PlayerID> deadPlayersChat;
+  std::set<Coord> loot;
+  std::set<Coord> hearts;
+  std::set<Coord> banks;
+  std::set<std::string> vaults;
+
+  /** Total number of changed entities.  */
+  unsigned size () const;
+
+};
+
+/**
+ * Records changed entities into a StateChangeSet while PerformStep builds
+ * a new state.  It is not copied along with the game state, so that only
+ * the state being built records anything.
+ */
+class StateChangeRecorder
+{
+
+private:
+
+  StateChangeSet* pChanges;
+
+public:
+
+  inline StateChangeRecorder ()
+    : pChanges(NULL)
+  {}
+
+  inline StateChangeRecorder (const StateChangeRecorder&)
+    : pChanges(NULL)
+  {}
+
+  inline StateChangeRecorder&
+  operator= (const StateChangeRecorder&)
+  {
+    return *this;
+  }
+
+  inline void
+  Start (StateChangeSet& changes)
+  {
+    pChanges = &changes;
+  }
+
+  inline void
+  Stop ()
+  {
+    pChanges = NULL;
+  }
+
+  inline void
+  Player (const PlayerID& name)
+  {
+    if (pChanges)
+      pChanges->players.insert (name);
+  }
+
+  inline void
+  DeadPlayerChat (const PlayerID& name)
+  {
+    if (pChanges)
+      pChanges->deadPlayersChat.insert (name);
+  }
+
+  inline void
+  Loot (const Coord& c)
+  {
+    if (pChanges)
+      pChanges->loot.insert (c);
+  }
+
+  inline void
+  Heart (const Coord& c)
+  {
+    if (pChanges)
+      pChanges->hearts.insert (c);
+  }
+
+  inline void
+  Bank (const Coord& c)
+  {
+    if (pChanges)
+      pChanges->banks.insert (c);
+  }
+
+};
+
 struct Move
 {
     PlayerID player;
@@ -598,6 +697,12 @@ struct LootInfo
         READWRITE(firstBlock);
         READWRITE(lastBlock);
     )
+
+    bool operator==(const LootInfo &that) const
+    {
+        return nAmount == that.nAmount && firstBlock == that.firstBlock && lastBlock == that.lastBlock;
+    }
+    bool operator!=(const LootInfo &that) const { return !(*this == that); }
 };
 
 struct CollectedLootInfo : public LootInfo
@@ -663,6 +768,13 @@ struct CollectedLootInfo : public LootInfo
         READWRITE(collectedLastBlock);
         assert (!IsRefund ());
     )
+
+    bool operator==(const CollectedLootInfo &that) const
+    {
+        return LootInfo::operator==(that)
+            && collectedFirstBlock == that.collectedFirstBlock && collectedLastBlock == that.collectedLastBlock;
+    }
+    bool operator!=(const CollectedLootInfo &that) const { return !(*this == that); }
 };
 
 struct CharacterState
@@ -726,6 +838,25 @@ struct CharacterState
 #endif
     )
 
+    /* Field-wise comparison.  This is used to find the characters that
+       changed in a game step without serialising them.  */
+    bool operator==(const CharacterState &that) const
+    {
+        return coord == that.coord && dir == that.dir && from == that.from
+            && waypoints == that.waypoints && loot == that.loot
+            && stay_in_spawn_area == that.stay_in_spawn_area
+#ifdef PERMANENT_LUGGAGE
+            && rpg_gems_in_purse == that.rpg_gems_in_purse
+#ifdef AUX_STORAGE_VERSION2
+            && cs_reserve1 == that.cs_reserve1 && cs_reserve2 == that.cs_reserve2
+            && cs_reserve3 == that.cs_reserve3 && cs_reserve4 == that.cs_reserve4
+            && cs_reserve5 == that.cs_reserve5 && cs_reserve6 == that.cs_reserve6
+#endif
+#endif
+            ;
+    }
+    bool operator!=(const CharacterState &that) const { return !(*this == that); }
+
     void Spawn(unsigned nHeight, int color, RandomGenerator &rnd);
 
     void StopMoving()
@@ -853,6 +984,27 @@ struct PlayerState
 #endif
     {}
 
+    /* Field-wise comparison (including all characters).  */
+    bool operator==(const PlayerState &that) const
+    {
+        return color == that.color && lockedCoins == that.lockedCoins && value == that.value
+            && next_character_index == that.next_character_index
+            && remainingLife == that.remainingLife
+            && message == that.message && message_block == that.message_block
+            && address == that.address && addressLock == that.addressLock
+#ifdef PERMANENT_LUGGAGE
+            && playernameaddress == that.playernameaddress && playerflags == that.playerflags
+#ifdef AUX_STORAGE_VERSION2
+            && pl_reserve1 == that.pl_reserve1 && pl_reserve2 == that.pl_reserve2
+            && pl_reserve3 == that.pl_reserve3 && pl_reserve4 == that.pl_reserve4
+            && pl_reserve5 == that.pl_reserve5 && pl_reserve6 == that.pl_reserve6
+            && pl_str_reserve1 == that.pl_str_reserve1 && pl_str_reserve2 == that.pl_str_reserve2
+#endif
+#endif
+            && characters == that.characters;
+    }
+    bool operator!=(const PlayerState &that) const { return !(*this == that); }
+
     void SpawnCharacter(unsigned nHeight, RandomGenerator &rnd);
     bool CanSpawnCharacter()
     {
@@ -942,7 +1094,11 @@ struct GameState
     // mainly for managing game states rather than as part of game
     // state, though it can be used as a random seed)
     uint256 hashBlock;
-    
+
+    /* Records the entities changed by PerformStep while it builds
+       this state.  Not part of the state itself.  */
+    StateChangeRecorder touched;
+
     IMPLEMENT_SERIALIZE
     (
       /* Should be only ever written to disk.  */
@@ -1019,8 +1175,19 @@ struct GameState
 
     void UpdateVersion(int oldVersion);
 
+    /* Copy all fields except for the entity maps (players, dead players'
+       chat, vaults, loot, hearts and banks) from another state.  */
+    void CopyGlobals(const GameState& from);
+
     json_spirit::Value ToJsonValue() const;
 
+    /* Parts of ToJsonValue.  They are also used to construct the JSON
+       incrementally from cached fragments (see gamejson.h).  */
+    json_spirit::Value LootToJsonValue() const;
+    json_spirit::Value HeartsToJsonValue() const;
+    json_spirit::Value BanksToJsonValue() const;
+    void AddGlobalsToJson(json_spirit::Object& obj) const;
+
     // Helper functions
     void AddLoot(Coord coord, int64_t nAmount);
     void DivideLootAmongPlayers();
@@ -1203,6 +1370,9 @@ public:
 
     int64_t nTaxAmount;
 
+    /* Entities changed by the step.  */
+    StateChangeSet changes;
+
     StepResult() : nTaxAmount(0) { }
 
     /* Insert information about a killed player.  */
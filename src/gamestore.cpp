@@ -0,0 +1,781 @@
+#include "gamestore.h"
+
+#include "gamesnapshot.h"
+#include "gamestate.h"
+#include "headers.h"
+
+#include <boost/filesystem.hpp>
+
+#ifndef __WXMSW__
+#include <sys/mman.h>
+#endif
+
+using namespace Game;
+
+/* Magic number at the start of each record and the index file.  */
+static const unsigned STORE_MAGIC = 0x48475331;
+static const unsigned INDEX_VERSION = 1;
+
+/* Record types.  States were first stored in their normal serialisation,
+   new ones are written as compressed snapshots.  */
+static const unsigned RECORD_STATE = 0;
+static const unsigned RECORD_ERASED = 1;
+static const unsigned RECORD_SNAPSHOT = 2;
+
+static inline bool
+IsStateRecord (unsigned nType)
+{
+  return nType == RECORD_STATE || nType == RECORD_SNAPSHOT;
+}
+
+/* Serialised size of a record header:  magic, type, height, serialisation
+   version, payload size and checksum (all 32 bit).  */
+static const unsigned HEADER_SIZE = 6 * 4;
+
+/* A new segment is started when the active one would grow beyond this.  */
+static const unsigned MAX_SEGMENT_SIZE = 128 << 20;
+
+/* Maximum number of bytes copied per compaction step.  */
+static const unsigned COMPACT_BYTES_PER_STEP = 8 << 20;
+
+/* ************************************************************************** */
+/* CMappedSegment.  */
+
+/**
+ * Read-only memory mapping of a whole segment file.  It is shared between
+ * the store and readers, so that a segment removed by compaction stays
+ * mapped until the last reader is done with it.
+ */
+class CMappedSegment : private boost::noncopyable
+{
+
+private:
+
+#ifdef __WXMSW__
+  HANDLE hFile;
+  HANDLE hMap;
+#else
+  int fd;
+#endif
+
+public:
+
+  const char* data;
+  unsigned len;
+
+  CMappedSegment ()
+    :
+#ifdef __WXMSW__
+      hFile(INVALID_HANDLE_VALUE), hMap(NULL),
+#else
+      fd(-1),
+#endif
+      data(NULL), len(0)
+  {}
+
+  ~CMappedSegment ();
+
+  bool Map (const boost::filesystem::path& path);
+
+};
+
+CMappedSegment::~CMappedSegment ()
+{
+#ifdef __WXMSW__
+  if (data)
+    UnmapViewOfFile (data);
+  if (hMap)
+    CloseHandle (hMap);
+  if (hFile != INVALID_HANDLE_VALUE)
+    CloseHandle (hFile);
+#else
+  if (data)
+    munmap (const_cast<char*> (data), len);
+  if (fd != -1)
+    close (fd);
+#endif
+}
+
+bool
+CMappedSegment::Map (const boost::filesystem::path& path)
+{
+  assert (!data);
+
+  const boost::uintmax_t size = boost::filesystem::file_size (path);
+  if (size == 0)
+    return true;
+  if (size > MAX_SEGMENT_SIZE + HEADER_SIZE + MAX_SIZE)
+    return error ("CMappedSegment: %s is too large", path.string ().c_str ());
+  len = size;
+
+#ifdef __WXMSW__
+  hFile = CreateFileA (path.string ().c_str (), GENERIC_READ,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return error ("CMappedSegment: failed to open %s", path.string ().c_str ());
+  hMap = CreateFileMapping (hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!hMap)
+    return error ("CMappedSegment: CreateFileMapping failed");
+  data = static_cast<const char*> (MapViewOfFile (hMap, FILE_MAP_READ,
+                                                  0, 0, len));
+  if (!data)
+    return error ("CMappedSegment: MapViewOfFile failed");
+#else
+  fd = open (path.string ().c_str (), O_RDONLY);
+  if (fd == -1)
+    return error ("CMappedSegment: failed to open %s", path.string ().c_str ());
+  void* p = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return error ("CMappedSegment: mmap failed, errno %d", errno);
+  data = static_cast<const char*> (p);
+#endif
+
+  return true;
+}
+
+/* ************************************************************************** */
+/* Record headers.  */
+
+/* Header of a record as stored in front of the payload.  */
+struct StoreRecordHeader
+{
+
+  unsigned nMagic;
+  unsigned nType;
+  unsigned nHeight;
+  unsigned nVersion;
+  unsigned nSize;
+  unsigned nChecksum;
+
+  IMPLEMENT_SERIALIZE
+  (
+    READWRITE(nMagic);
+    READWRITE(nType);
+    READWRITE(nHeight);
+    READWRITE(nVersion);
+    READWRITE(nSize);
+    READWRITE(nChecksum);
+  )
+
+  /* Parse the header at the given position of a mapping.  */
+  bool
+  Parse (const char* pch, unsigned nAvailable)
+  {
+    if (nAvailable < HEADER_SIZE)
+      return false;
+
+    CBufferReader reader(pch, pch + HEADER_SIZE);
+    reader >> *this;
+
+    return nMagic == STORE_MAGIC && nSize <= nAvailable - HEADER_SIZE;
+  }
+
+};
+
+static unsigned
+GetPayloadChecksum (const char* pch, unsigned nSize)
+{
+  uint256 hash = Hash (pch, pch + nSize);
+  const unsigned char* p = hash.begin ();
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+/* ************************************************************************** */
+/* CGameStore.  */
+
+CGameStore::CGameStore (const boost::filesystem::path& d)
+  : dir(d), nActive(0), fileActive(NULL), fDirty(false),
+    nCompactSegment(0), nCompactOffset(0)
+{}
+
+CGameStore::~CGameStore ()
+{
+  Close ();
+}
+
+boost::filesystem::path
+CGameStore::GetSegmentPath (unsigned nSegment) const
+{
+  return dir / strprintf ("seg%06u.dat", nSegment);
+}
+
+boost::filesystem::path
+CGameStore::GetIndexPath () const
+{
+  return dir / "index.dat";
+}
+
+bool
+CGameStore::Open ()
+{
+  CRITICAL_BLOCK(cs_store)
+    {
+      assert (!fileActive);
+      boost::filesystem::create_directories (dir);
+
+      /* Find the existing segments.  */
+      segments.clear ();
+      index.clear ();
+      boost::filesystem::directory_iterator end;
+      for (boost::filesystem::directory_iterator i(dir); i != end; ++i)
+        {
+          const std::string name = i->path ().filename ().string ();
+          unsigned id;
+          char dummy;
+          if (sscanf (name.c_str (), "seg%u.da%c", &id, &dummy) == 2
+              && name == GetSegmentPath (id).filename ().string ())
+            segments[id].nLength = boost::filesystem::file_size (i->path ());
+        }
+
+      if (!LoadIndex ())
+        {
+          printf ("CGameStore: rebuilding index of %s\n",
+                  dir.string ().c_str ());
+          if (!Rescan ())
+            return false;
+          fDirty = true;
+        }
+
+      unsigned nLast = 1;
+      if (!segments.empty ())
+        nLast = segments.rbegin ()->first;
+      if (!OpenActive (nLast))
+        return false;
+
+      printf ("CGameStore: %u states in %u segments\n",
+              static_cast<unsigned> (index.size ()),
+              static_cast<unsigned> (segments.size ()));
+    }
+
+  return true;
+}
+
+void
+CGameStore::Close ()
+{
+  CRITICAL_BLOCK(cs_store)
+    {
+      if (!fileActive)
+        return;
+
+      SaveIndex ();
+      fclose (fileActive);
+      fileActive = NULL;
+
+      for (std::map<unsigned, Segment>::iterator i = segments.begin ();
+           i != segments.end (); ++i)
+        i->second.mapping.reset ();
+      RemoveSegments ();
+    }
+}
+
+bool
+CGameStore::Flush ()
+{
+  CRITICAL_BLOCK(cs_store)
+    if (fDirty)
+      return SaveIndex ();
+
+  return true;
+}
+
+bool
+CGameStore::LoadIndex ()
+{
+  FILE* file = fopen (GetIndexPath ().string ().c_str (), "rb");
+  if (!file)
+    return false;
+
+  std::map<unsigned, unsigned> lengths;
+  try
+    {
+      CAutoFile filein(file, SER_DISK, VERSION);
+
+      unsigned nMagic, nVersion;
+      filein >> nMagic >> nVersion;
+      if (nMagic != STORE_MAGIC || nVersion != INDEX_VERSION)
+        return false;
+
+      filein >> lengths >> index;
+    }
+  catch (const std::exception& e)
+    {
+      printf ("CGameStore: failed to read index: %s\n", e.what ());
+      index.clear ();
+      return false;
+    }
+
+  /* The index is only valid if it matches the segments on disk exactly.
+     Otherwise records were appended after it was saved (e. g., due to
+     a crash).  */
+  bool ok = (lengths.size () == segments.size ());
+  for (std::map<unsigned, Segment>::const_iterator i = segments.begin ();
+       ok && i != segments.end (); ++i)
+    {
+      const std::map<unsigned, unsigned>::const_iterator mi
+        = lengths.find (i->first);
+      ok = (mi != lengths.end () && mi->second == i->second.nLength);
+    }
+  for (std::map<unsigned, Location>::const_iterator i = index.begin ();
+       ok && i != index.end (); ++i)
+    {
+      const std::map<unsigned, Segment>::iterator mi
+        = segments.find (i->second.nSegment);
+      ok = (mi != segments.end ()
+            && i->second.nOffset + i->second.nSize <= mi->second.nLength);
+      if (ok)
+        mi->second.nLive += i->second.nSize;
+    }
+
+  if (!ok)
+    {
+      index.clear ();
+      for (std::map<unsigned, Segment>::iterator i = segments.begin ();
+           i != segments.end (); ++i)
+        i->second.nLive = 0;
+    }
+
+  return ok;
+}
+
+bool
+CGameStore::SaveIndex ()
+{
+  /* Write to a temporary file first and rename it, so that a crash
+     leaves either the old or the new index.  */
+  const boost::filesystem::path pathTmp = dir / "index.dat.new";
+
+  FILE* file = fopen (pathTmp.string ().c_str (), "wb");
+  if (!file)
+    return error ("CGameStore: failed to write index");
+
+  std::map<unsigned, unsigned> lengths;
+  for (std::map<unsigned, Segment>::const_iterator i = segments.begin ();
+       i != segments.end (); ++i)
+    lengths[i->first] = i->second.nLength;
+
+  try
+    {
+      CAutoFile fileout(file, SER_DISK, VERSION);
+      fileout << STORE_MAGIC << INDEX_VERSION << lengths << index;
+    }
+  catch (const std::exception& e)
+    {
+      return error ("CGameStore: failed to write index: %s", e.what ());
+    }
+
+  try
+    {
+      boost::filesystem::remove (GetIndexPath ());
+      boost::filesystem::rename (pathTmp, GetIndexPath ());
+    }
+  catch (const boost::filesystem::filesystem_error& e)
+    {
+      return error ("CGameStore: failed to replace index: %s", e.what ());
+    }
+
+  fDirty = false;
+  return true;
+}
+
+bool
+CGameStore::Rescan ()
+{
+  index.clear ();
+  for (std::map<unsigned, Segment>::iterator i = segments.begin ();
+       i != segments.end (); ++i)
+    {
+      i->second.nLive = 0;
+      if (!ScanSegment (i->first))
+        return false;
+    }
+
+  return true;
+}
+
+bool
+CGameStore::ScanSegment (unsigned nSegment)
+{
+  Segment& seg = segments[nSegment];
+  const boost::filesystem::path path = GetSegmentPath (nSegment);
+
+  boost::shared_ptr<CMappedSegment> mapping(new CMappedSegment ());
+  if (!mapping->Map (path))
+    return false;
+
+  unsigned nOffset = 0;
+  while (nOffset < mapping->len)
+    {
+      const char* pch = mapping->data + nOffset;
+      const unsigned nAvailable = mapping->len - nOffset;
+
+      StoreRecordHeader hdr;
+      if (!hdr.Parse (pch, nAvailable)
+          || hdr.nChecksum != GetPayloadChecksum (pch + HEADER_SIZE,
+                                                  hdr.nSize))
+        break;
+
+      Location loc;
+      loc.nSegment = nSegment;
+      loc.nOffset = nOffset;
+      loc.nSize = HEADER_SIZE + hdr.nSize;
+
+      if (IsStateRecord (hdr.nType))
+        SetLocation (hdr.nHeight, loc);
+      else
+        RemoveLocation (hdr.nHeight);
+
+      nOffset += loc.nSize;
+    }
+
+  /* Cut off an incomplete or corrupt tail (from a crash while
+     appending).  */
+  const unsigned nFileLength = mapping->len;
+  mapping.reset ();
+  if (nOffset < nFileLength)
+    {
+      printf ("CGameStore: truncating %s from %u to %u bytes\n",
+              path.string ().c_str (), nFileLength, nOffset);
+      boost::filesystem::resize_file (path, nOffset);
+    }
+  seg.nLength = nOffset;
+
+  return true;
+}
+
+bool
+CGameStore::OpenActive (unsigned nSegment)
+{
+  if (fileActive)
+    fclose (fileActive);
+
+  fileActive = fopen (GetSegmentPath (nSegment).string ().c_str (), "ab");
+  if (!fileActive)
+    return error ("CGameStore: failed to open segment %u", nSegment);
+
+  nActive = nSegment;
+  segments[nSegment];
+
+  return true;
+}
+
+bool
+CGameStore::Append (const char* pchHeader, const char* pch, unsigned nSize,
+                    Location& loc)
+{
+  if (!fileActive)
+    return error ("CGameStore: store is not open");
+
+  if (segments[nActive].nLength > 0
+      && segments[nActive].nLength + HEADER_SIZE + nSize > MAX_SEGMENT_SIZE)
+    if (!OpenActive (nActive + 1))
+      return false;
+
+  Segment& seg = segments[nActive];
+  if (fwrite (pchHeader, 1, HEADER_SIZE, fileActive) != HEADER_SIZE
+      || fwrite (pch, 1, nSize, fileActive) != nSize
+      || fflush (fileActive) != 0)
+    return error ("CGameStore: failed to append to segment %u", nActive);
+#ifdef __WXMSW__
+  _commit (_fileno (fileActive));
+#else
+  fsync (fileno (fileActive));
+#endif
+
+  loc.nSegment = nActive;
+  loc.nOffset = seg.nLength;
+  loc.nSize = HEADER_SIZE + nSize;
+  seg.nLength += loc.nSize;
+  fDirty = true;
+
+  return true;
+}
+
+bool
+CGameStore::AppendRecord (unsigned nType, unsigned nHeight, int nVersion,
+                          const char* pch, unsigned nSize, Location& loc)
+{
+  StoreRecordHeader hdr;
+  hdr.nMagic = STORE_MAGIC;
+  hdr.nType = nType;
+  hdr.nHeight = nHeight;
+  hdr.nVersion = nVersion;
+  hdr.nSize = nSize;
+  hdr.nChecksum = GetPayloadChecksum (pch, nSize);
+
+  CDataStream ss(SER_DISK, VERSION);
+  ss << hdr;
+  assert (ss.size () == HEADER_SIZE);
+
+  return Append (&ss[0], pch, nSize, loc);
+}
+
+boost::shared_ptr<CMappedSegment>
+CGameStore::GetMapping (unsigned nSegment, unsigned nEnd)
+{
+  Segment& seg = segments[nSegment];
+  if (!seg.mapping || seg.mapping->len < nEnd)
+    {
+      seg.mapping.reset (new CMappedSegment ());
+      if (!seg.mapping->Map (GetSegmentPath (nSegment))
+          || seg.mapping->len < nEnd)
+        {
+          seg.mapping.reset ();
+          error ("CGameStore: failed to map segment %u", nSegment);
+        }
+    }
+
+  return seg.mapping;
+}
+
+void
+CGameStore::SetLocation (unsigned nHeight, const Location& loc)
+{
+  RemoveLocation (nHeight);
+  index[nHeight] = loc;
+  segments[loc.nSegment].nLive += loc.nSize;
+  fDirty = true;
+}
+
+void
+CGameStore::RemoveLocation (unsigned nHeight)
+{
+  const std::map<unsigned, Location>::iterator mi = index.find (nHeight);
+  if (mi == index.end ())
+    return;
+
+  Segment& seg = segments[mi->second.nSegment];
+  assert (seg.nLive >= mi->second.nSize);
+  seg.nLive -= mi->second.nSize;
+  index.erase (mi);
+  fDirty = true;
+}
+
+void
+CGameStore::RemoveSegments ()
+{
+  std::set<unsigned> failed;
+  BOOST_FOREACH (unsigned id, pendingRemoval)
+    {
+      try
+        {
+          boost::filesystem::remove (GetSegmentPath (id));
+        }
+      catch (const boost::filesystem::filesystem_error& e)
+        {
+          /* This happens on Windows while a reader still has the
+             segment mapped.  Try again later.  */
+          failed.insert (id);
+        }
+    }
+  pendingRemoval.swap (failed);
+}
+
+bool
+CGameStore::Exists (unsigned nHeight) const
+{
+  CRITICAL_BLOCK(cs_store)
+    return index.count (nHeight) > 0;
+
+  /* Not reached.  */
+  return false;
+}
+
+bool
+CGameStore::Read (unsigned nHeight, GameState& state)
+{
+  Location loc;
+  boost::shared_ptr<CMappedSegment> mapping;
+  CRITICAL_BLOCK(cs_store)
+    {
+      const std::map<unsigned, Location>::const_iterator mi
+        = index.find (nHeight);
+      if (mi == index.end ())
+        return false;
+
+      loc = mi->second;
+      mapping = GetMapping (loc.nSegment, loc.nOffset + loc.nSize);
+    }
+  if (!mapping)
+    return false;
+
+  /* Deserialise outside of the lock.  The mapping stays valid even if
+     the segment is compacted away in the mean time.  */
+  const char* pch = mapping->data + loc.nOffset;
+  StoreRecordHeader hdr;
+  if (!hdr.Parse (pch, loc.nSize) || !IsStateRecord (hdr.nType)
+      || hdr.nHeight != nHeight)
+    return error ("CGameStore: invalid record for height %u", nHeight);
+
+  try
+    {
+      if (hdr.nType == RECORD_SNAPSHOT)
+        DecodeSnapshot (reinterpret_cast<const unsigned char*> (pch + HEADER_SIZE),
+                        hdr.nSize, state);
+      else
+        {
+          CBufferReader reader(pch + HEADER_SIZE,
+                               pch + HEADER_SIZE + hdr.nSize,
+                               SER_DISK, hdr.nVersion);
+          reader >> state;
+        }
+    }
+  catch (const std::exception& e)
+    {
+      return error ("CGameStore: failed to read state %u: %s",
+                    nHeight, e.what ());
+    }
+
+  return true;
+}
+
+bool
+CGameStore::Write (unsigned nHeight, const GameState& state)
+{
+  std::vector<unsigned char> data;
+  EncodeSnapshot (state, true, data);
+
+  CRITICAL_BLOCK(cs_store)
+    {
+      Location loc;
+      if (!AppendRecord (RECORD_SNAPSHOT, nHeight, VERSION,
+                         reinterpret_cast<const char*> (&data[0]),
+                         data.size (), loc))
+        return false;
+      SetLocation (nHeight, loc);
+    }
+
+  return true;
+}
+
+bool
+CGameStore::Erase (unsigned nHeight)
+{
+  CRITICAL_BLOCK(cs_store)
+    {
+      if (index.count (nHeight) == 0)
+        return true;
+
+      Location loc;
+      if (!AppendRecord (RECORD_ERASED, nHeight, VERSION, NULL, 0, loc))
+        return false;
+      RemoveLocation (nHeight);
+    }
+
+  return true;
+}
+
+void
+CGameStore::GetHeights (std::vector<unsigned>& out) const
+{
+  out.clear ();
+  CRITICAL_BLOCK(cs_store)
+    for (std::map<unsigned, Location>::const_iterator i = index.begin ();
+         i != index.end (); ++i)
+      out.push_back (i->first);
+}
+
+bool
+CGameStore::CompactStep ()
+{
+  CRITICAL_BLOCK(cs_store)
+    {
+      if (!fileActive)
+        return false;
+      RemoveSegments ();
+
+      /* Pick the sealed segment with the smallest fraction of live data,
+         if it is at most half full.  */
+      if (nCompactSegment == 0)
+        {
+          double best = 0.5;
+          for (std::map<unsigned, Segment>::const_iterator
+                i = segments.begin (); i != segments.end (); ++i)
+            {
+              if (i->first == nActive || i->second.nLength == 0)
+                continue;
+              const double frac = static_cast<double> (i->second.nLive)
+                                    / i->second.nLength;
+              if (frac <= best)
+                {
+                  best = frac;
+                  nCompactSegment = i->first;
+                }
+            }
+
+          if (nCompactSegment == 0)
+            return false;
+          nCompactOffset = 0;
+          printf ("CGameStore: compacting segment %u\n", nCompactSegment);
+        }
+
+      const Segment& seg = segments[nCompactSegment];
+      boost::shared_ptr<CMappedSegment> mapping
+        = GetMapping (nCompactSegment, seg.nLength);
+      if (!mapping)
+        {
+          nCompactSegment = 0;
+          return false;
+        }
+
+      /* Tombstones need to be kept as long as older segments exist, which
+         may still contain the erased state.  */
+      const bool fOldest = (segments.begin ()->first == nCompactSegment);
+
+      unsigned nCopied = 0;
+      while (nCompactOffset < seg.nLength && nCopied < COMPACT_BYTES_PER_STEP)
+        {
+          const char* pch = mapping->data + nCompactOffset;
+          StoreRecordHeader hdr;
+          if (!hdr.Parse (pch, seg.nLength - nCompactOffset))
+            {
+              error ("CGameStore: invalid record in segment %u at %u",
+                     nCompactSegment, nCompactOffset);
+              nCompactSegment = 0;
+              return false;
+            }
+          const unsigned nSize = HEADER_SIZE + hdr.nSize;
+
+          bool fCopy = false;
+          const std::map<unsigned, Location>::const_iterator mi
+            = index.find (hdr.nHeight);
+          if (IsStateRecord (hdr.nType))
+            fCopy = (mi != index.end ()
+                     && mi->second.nSegment == nCompactSegment
+                     && mi->second.nOffset == nCompactOffset);
+          else
+            fCopy = (!fOldest && mi == index.end ());
+
+          if (fCopy)
+            {
+              Location loc;
+              if (!Append (pch, pch + HEADER_SIZE, hdr.nSize, loc))
+                {
+                  nCompactSegment = 0;
+                  return false;
+                }
+              if (IsStateRecord (hdr.nType))
+                SetLocation (hdr.nHeight, loc);
+              nCopied += nSize;
+            }
+
+          nCompactOffset += nSize;
+        }
+
+      if (nCompactOffset < seg.nLength)
+        return true;
+
+      /* Everything is copied, remove the segment.  The index must be
+         saved before, so that it never refers to the removed file.  */
+      printf ("CGameStore: removing compacted segment %u\n", nCompactSegment);
+      segments.erase (nCompactSegment);
+      SaveIndex ();
+      pendingRemoval.insert (nCompactSegment);
+      nCompactSegment = 0;
+      mapping.reset ();
+      RemoveSegments ();
+    }
+
+  return true;
+}
@@ -0,0 +1,152 @@
+#ifndef GAMESTORE_H
+#define GAMESTORE_H
+
+#include "serialize.h"
+#include "util.h"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <cstdio>
+#include <map>
+#include <set>
+#include <vector>
+
+// Append-only storage engine for full game states, as alternative to
+// keeping them as BDB values in the game DB.  States are appended as
+// records to segment files, which are memory-mapped for reading so that
+// states can be decoded directly from the mapped bytes.  New states are
+// written as compressed snapshots (see gamesnapshot.h), while records in
+// the normal serialisation are still read.  Erasing a state appends a
+// tombstone record.  Segments with mostly dead records are compacted in
+// the background by copying their live records to the end of the store
+// and removing the old file.
+//
+// The segment files are authoritative; the height-to-offset index is
+// kept in memory and saved to a small index file on flush.  If it does
+// not match the segments on startup, it is rebuilt by scanning them.
+
+namespace Game
+{
+class GameState;
+}
+
+class CMappedSegment;
+
+class CGameStore : private boost::noncopyable
+{
+
+private:
+
+  /* Position of a record in the store.  */
+  struct Location
+  {
+    unsigned nSegment;
+    unsigned nOffset;
+    /* Size of the full record (header and payload).  */
+    unsigned nSize;
+
+    IMPLEMENT_SERIALIZE
+    (
+      READWRITE(nSegment);
+      READWRITE(nOffset);
+      READWRITE(nSize);
+    )
+  };
+
+  /* Per-segment book-keeping.  */
+  struct Segment
+  {
+    /* Length of the segment file.  */
+    unsigned nLength;
+    /* Bytes of the records that are still referenced by the index.  */
+    unsigned nLive;
+    /* Current mapping of the file (may be shorter than nLength after
+       appends, in which case it is re-created on demand).  */
+    boost::shared_ptr<CMappedSegment> mapping;
+
+    Segment ()
+      : nLength(0), nLive(0)
+    {}
+  };
+
+  boost::filesystem::path dir;
+  mutable CCriticalSection cs_store;
+
+  std::map<unsigned, Location> index;
+  std::map<unsigned, Segment> segments;
+
+  /* Segment to which new records are appended.  */
+  unsigned nActive;
+  FILE* fileActive;
+
+  /* Whether the index changed since it was last saved.  */
+  bool fDirty;
+
+  /* Removed segments whose files could not be deleted yet (because
+     they are still mapped on platforms where this matters).  */
+  std::set<unsigned> pendingRemoval;
+
+  /* Segment currently being compacted (0 if none) and the offset of the
+     next record to look at.  */
+  unsigned nCompactSegment;
+  unsigned nCompactOffset;
+
+  boost::filesystem::path GetSegmentPath (unsigned nSegment) const;
+  boost::filesystem::path GetIndexPath () const;
+
+  bool LoadIndex ();
+  bool SaveIndex ();
+  bool Rescan ();
+  bool ScanSegment (unsigned nSegment);
+
+  bool OpenActive (unsigned nSegment);
+  bool Append (const char* pchHeader, const char* pch, unsigned nSize,
+               Location& loc);
+  bool AppendRecord (unsigned nType, unsigned nHeight, int nVersion,
+                     const char* pch, unsigned nSize, Location& loc);
+  boost::shared_ptr<CMappedSegment> GetMapping (unsigned nSegment,
+                                                unsigned nEnd);
+
+  void SetLocation (unsigned nHeight, const Location& loc);
+  void RemoveLocation (unsigned nHeight);
+  void RemoveSegments ();
+
+public:
+
+  explicit CGameStore (const boost::filesystem::path& d);
+  ~CGameStore ();
+
+  /**
+   * Open the store, creating the directory if necessary and loading or
+   * rebuilding the index.
+   * @return True on success.
+   */
+  bool Open ();
+
+  /* Save the index and close all files.  */
+  void Close ();
+
+  /* Save the index if it changed.  */
+  bool Flush ();
+
+  bool Exists (unsigned nHeight) const;
+  bool Read (unsigned nHeight, Game::GameState& state);
+  bool Write (unsigned nHeight, const Game::GameState& state);
+  bool Erase (unsigned nHeight);
+
+  /* Return the heights of all stored states in ascending order.  */
+  void GetHeights (std::vector<unsigned>& out) const;
+
+  /**
+   * Perform a bounded amount of compaction work.  This copies a few live
+   * records out of the most fragmented sealed segment, and removes the
+   * segment once nothing is left in it.
+   * @return True if there is more work to do.
+   */
+  bool CompactStep ();
+
+};
+
+#endif // GAMESTORE_H
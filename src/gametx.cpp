@@ -54,20 +54,36 @@ CreateGameTransactions (CNameDB& nameDb, const GameState& gameState,
   // Transaction hashes must be unique
   outvgametx.clear ();
 
+  const PlayerSet& killedPlayers = stepResult.GetKilledPlayers ();
+  const KilledByMap& killedBy = stepResult.GetKilledBy ();
+
+  /* Look up the name transactions of all killed players and bounty
+     recipients in one batch.  This avoids lots of random reads for
+     blocks with many kills (e. g., disasters).  */
+  std::set<vchType> names;
+  BOOST_FOREACH(const PlayerID &victim, killedPlayers)
+    names.insert (vchFromString (victim));
+  BOOST_FOREACH(const CollectedBounty& bounty, stepResult.bounties)
+    names.insert (vchFromString (bounty.character.player));
+
+  std::map<vchType, CTransaction> nameTxs;
+  if (!GetTxOfNamesAtHeight (nameDb, names, gameState.nHeight, nameTxs))
+    return error ("CreateGameTransactions: name lookup failed");
+
   CTransaction txNew;
   txNew.SetGameTx ();
 
   // Destroy name-coins of killed players
-  const PlayerSet& killedPlayers = stepResult.GetKilledPlayers ();
-  const KilledByMap& killedBy = stepResult.GetKilledBy ();
   txNew.vin.reserve (killedPlayers.size ());
   BOOST_FOREACH(const PlayerID &victim, killedPlayers)
     {
       const vchType vchName = vchFromString (victim);
-      CTransaction tx;
-      if (!GetTxOfNameAtHeight (nameDb, vchName, gameState.nHeight, tx))
+      const std::map<vchType, CTransaction>::const_iterator mi
+        = nameTxs.find (vchName);
+      if (mi == nameTxs.end ())
         return error ("Game engine killed a non-existing player %s",
                       victim.c_str ());
+      const CTransaction& tx = mi->second;
 
       if (fDebug)
         printf ("  killed: %s\n", victim.c_str ());
@@ -145,9 +161,11 @@ CreateGameTransactions (CNameDB& nameDb, const GameState& gameState,
   BOOST_FOREACH(const CollectedBounty& bounty, stepResult.bounties)
     {
       const vchType vchName = vchFromString (bounty.character.player);
-      CTransaction tx;
-      if (!GetTxOfNameAtHeight (nameDb, vchName, gameState.nHeight, tx))
+      const std::map<vchType, CTransaction>::const_iterator mi
+        = nameTxs.find (vchName);
+      if (mi == nameTxs.end ())
         return error ("Game engine created bounty for non-existing player");
+      const CTransaction& tx = mi->second;
 
       CTxOut txout;
       txout.nValue = bounty.loot.nAmount;
@@ -11,8 +11,14 @@
 #include "huntercoin.h"
 
 #include "gamestate.h"
+#include "gamecommitment.h"
 #include "gamedb.h"
+#include "gamedistance.h"
+#include "gameindex.h"
+#include "gamejson.h"
+#include "gameleaderboard.h"
 #include "gamemovecreator.h"
+#include "gamesnapshot.h"
 #include "gametx.h"
 
 #include "bitcoinrpc.h"
@@ -523,6 +529,101 @@ GetTxOfNameAtHeight (CNameDB& dbName, const vchType& vchName,
   return true;
 }
 
+/* Read the transactions of the given name index entries in the order of
+   their position on disk.  */
+static bool
+ReadTxsOfNames (const std::map<vchType, CNameIndex>& nidx,
+                std::map<vchType, CTransaction>& txs)
+{
+  typedef std::pair<unsigned, unsigned> DiskPos;
+  std::map<DiskPos, std::map<vchType, CNameIndex>::const_iterator> byPos;
+  for (std::map<vchType, CNameIndex>::const_iterator i = nidx.begin ();
+       i != nidx.end (); ++i)
+    {
+      const CDiskTxPos& pos = i->second.txPos;
+      byPos.insert (std::make_pair (DiskPos (pos.nTxFile, pos.nTxPos), i));
+    }
+
+  typedef std::pair<const DiskPos,
+                    std::map<vchType, CNameIndex>::const_iterator> PosEntry;
+  BOOST_FOREACH (const PosEntry& p, byPos)
+    {
+      CTransaction tx;
+      if (!tx.ReadFromDisk (p.second->second.txPos))
+        return error ("ReadTxsOfNames: could not read tx from disk");
+      txs.insert (std::make_pair (p.second->first, tx));
+    }
+
+  return true;
+}
+
+/* Batch version of GetTxOfNameAtHeight.  The name index entries are read
+   in one sorted pass, and the transactions are then read in the order of
+   their position on disk.  Names that do not exist are missing from the
+   result map.  */
+bool
+GetTxOfNamesAtHeight (CNameDB& dbName, const std::set<vchType>& names,
+                      int nHeight, std::map<vchType, CTransaction>& txs)
+{
+  txs.clear ();
+
+  std::map<vchType, CNameIndex> nidx;
+  if (!dbName.ReadNames (names, nidx))
+    return false;
+
+  for (std::map<vchType, CNameIndex>::const_iterator i = nidx.begin ();
+       i != nidx.end (); ++i)
+    if (nHeight != -1 && nHeight < static_cast<int> (i->second.nHeight))
+      return error ("GetTxOfNamesAtHeight: height mismatch for %s,"
+                    " want %d got %d",
+                    stringFromVch (i->first).c_str (),
+                    nHeight, i->second.nHeight);
+
+  return ReadTxsOfNames (nidx, txs);
+}
+
+/* Look up the addresses holding the given names at the given height.  The
+   name DB only keeps the latest update of each name, so the names updated
+   after the height cannot be resolved and are returned in tooNew instead.
+   Names that do not exist are missing from both results.  */
+bool
+GetNameAddressesAtHeight (CNameDB& dbName, const std::set<vchType>& names,
+                          int nHeight,
+                          std::map<vchType, std::string>& addresses,
+                          std::set<vchType>& tooNew)
+{
+  addresses.clear ();
+  tooNew.clear ();
+
+  std::map<vchType, CNameIndex> nidx;
+  if (!dbName.ReadNames (names, nidx))
+    return false;
+
+  std::map<vchType, CNameIndex>::iterator i = nidx.begin ();
+  while (i != nidx.end ())
+    if (nHeight < static_cast<int> (i->second.nHeight))
+      {
+        tooNew.insert (i->first);
+        nidx.erase (i++);
+      }
+    else
+      ++i;
+
+  std::map<vchType, CTransaction> txs;
+  if (!ReadTxsOfNames (nidx, txs))
+    return false;
+
+  typedef std::pair<const vchType, CTransaction> TxEntry;
+  BOOST_FOREACH (const TxEntry& t, txs)
+    {
+      std::string address;
+      if (GetNameAddress (t.second, address))
+        addresses.insert (std::make_pair (t.first, address));
+    }
+
+  return true;
+}
+
 bool GetNameAddress(const CTransaction& tx, std::string& strAddress)
 {
     uint160 hash160;
@@ -2420,7 +2521,49 @@ name_pending (const Array& params, bool fHelp)
   return res;
 }
 
-Value game_getstate(const Array& params, bool fHelp)
+/* Look up the game state at the height given as the RPC parameter with
+   the given index (if it exists) or the current state otherwise.  This
+   is the common part of the game state query RPCs.  */
+static void
+GetGameStateForRpc (const Array& params, unsigned paramIndex,
+                    Game::GameStatePtr& state)
+{
+  int64 height = nBestHeight;
+  if (params.size () > paramIndex)
+    height = params[paramIndex].get_int64 ();
+  else if (IsInitialBlockDownload ())
+    throw JSONRPCError (RPC_CLIENT_IN_INITIAL_DOWNLOAD,
+                        "huntercoin is downloading blocks...");
+
+  if (height < -1 || height > nBestHeight)
+    throw JSONRPCError (RPC_INVALID_PARAMS, "Invalid height specified");
+
+  CRITICAL_BLOCK(cs_main)
+    {
+      CBlockIndex* pindex;
+      if (height == -1)
+        pindex = NULL;
+      else
+        {
+          pindex = pindexBest;
+          while (pindex && pindex->nHeight > height)
+            pindex = pindex->pprev;
+          if (!pindex || pindex->nHeight != height)
+            throw JSONRPCError (RPC_DATABASE_ERROR,
+                                "Cannot find block at specified height");
+        }
+
+      DatabaseSet dbset("r");
+      if (!GetGameState (dbset, pindex, state))
+        throw JSONRPCError (RPC_DATABASE_ERROR,
+                            "Cannot compute game state at specified height");
+    }
+}
+
+/* Look up the state queried by game_getstate.  */
+static void
+GetStateForGetState (const Array& params, bool fHelp,
+                     Game::GameStatePtr& state)
 {
     if (fHelp || params.size() > 1)
         throw runtime_error(
@@ -2428,45 +2571,32 @@ Value game_getstate(const Array& params, bool fHelp)
                 "Returns game state, either the most recent one or at given height (-1 = initial state, 0 = state after genesis block, k = state after k-th block for k>0)\n"
                 );
 
-    int64 height = nBestHeight;
-
-    if (params.size() > 0)
-    {
-        height = params[0].get_int64();
-    }
-    else if (IsInitialBlockDownload())
-            throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "huntercoin is downloading blocks...");
-
-    if (height < -1 || height > nBestHeight)
-        throw JSONRPCError(RPC_INVALID_PARAMS, "Invalid height specified");
+    GetGameStateForRpc(params, 0, state);
+}
 
-    Game::GameState state;
+Value game_getstate(const Array& params, bool fHelp)
+{
+    Game::GameStatePtr state;
+    GetStateForGetState (params, fHelp, state);
 
-    CRITICAL_BLOCK(cs_main)
-    {
-        CBlockIndex* pindex;
-        if (height == -1)
-            pindex = NULL;
-        else
-        {
-            pindex = pindexBest;
-            while (pindex && pindex->nHeight > height)
-                pindex = pindex->pprev;
-            if (!pindex || pindex->nHeight != height)
-                throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot find block at specified height");
-        }
+    return state->ToJsonValue ();
+}
 
-        DatabaseSet dbset("r");
-        if (!GetGameState (dbset, pindex, state))
-            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot compute game state at specified height");
-    }
+/* Variant of game_getstate for the RPC server, which returns the cached
+   JSON text of the state without decoding and encoding it again.  */
+static std::string
+game_getstate_raw (const Array& params, bool fHelp)
+{
+    Game::GameStatePtr state;
+    GetStateForGetState (params, fHelp, state);
 
-    return state.ToJsonValue();
+    return Game::GetGameStateJson (*state);
 }
 
 /* Wait for the next block to be found and processed (blocking in a waiting
    thread) and return the new state when it is done.  */
-Value game_waitforchange (const Array& params, bool fHelp)
+static Game::GameStatePtr
+WaitForStateChange (const Array& params, bool fHelp)
 {
   if (fHelp || params.size () > 1)
     throw runtime_error (
@@ -2494,10 +2624,7 @@ Value game_waitforchange (const Array& params, bool fHelp)
       CRITICAL_BLOCK(cs_main)
         {
           if (lastHash != hashBestChain)
-            {
-              const Game::GameState& state = GetCurrentGameState ();
-              return state.ToJsonValue();
-            }
+            return GetCurrentGameState ();
         }
 
       /* Wait on the condition variable.  */
@@ -2505,6 +2632,19 @@ Value game_waitforchange (const Array& params, bool fHelp)
     }
 }
 
+Value game_waitforchange (const Array& params, bool fHelp)
+{
+  const Game::GameStatePtr state = WaitForStateChange (params, fHelp);
+  return state->ToJsonValue ();
+}
+
+static std::string
+game_waitforchange_raw (const Array& params, bool fHelp)
+{
+  const Game::GameStatePtr state = WaitForStateChange (params, fHelp);
+  return Game::GetGameStateJson (*state);
+}
+
 Value game_getplayerstate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -2513,47 +2653,211 @@ Value game_getplayerstate(const Array& params, bool fHelp)
                 "Returns player state. Similar to game_getstate, but filters the name.\n"
                 );
 
-    int64 height = nBestHeight;
+    Game::GameStatePtr state;
+    GetGameStateForRpc(params, 1, state);
 
-    if (params.size() > 1)
-    {
-        height = params[1].get_int64();
-    }
-    else if (IsInitialBlockDownload())
-            throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "huntercoin is downloading blocks...");
+    Game::PlayerID player_name = params[0].get_str();
+    std::map<Game::PlayerID, Game::PlayerState>::const_iterator mi = state->players.find(player_name);
+    if (mi == state->players.end())
+        throw JSONRPCError(RPC_DATABASE_ERROR, "No such player");
+
+    int crown_index = player_name == state->crownHolder.player ? state->crownHolder.index : -1;
+    return mi->second.ToJsonValue(crown_index);
+}
 
+/* Return the root of the hash tree over the game state's contents.  This
+   can be used to compare game states between nodes cheaply.  */
+Value
+game_getstateroot (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () > 2)
+    throw runtime_error (
+            "game_getstateroot [height] [verify=false]\n"
+            "Return the root hash of the commitment over the game state's\n"
+            "contents (players, loot, hearts, banks, vaults and global\n"
+            "fields), either the most recent one or at the given height.\n"
+            "If verify is true, the commitment is also recomputed from\n"
+            "scratch and compared to the incrementally maintained one.\n");
 
-    if (height < -1 || height > nBestHeight)
-        throw JSONRPCError(RPC_INVALID_PARAMS, "Invalid height specified");
+  bool fVerify = false;
+  if (params.size () > 1)
+    fVerify = params[1].get_bool ();
 
-    Game::GameState state;
+  Game::GameStatePtr pstate;
+  GetGameStateForRpc (params, 0, pstate);
+  const Game::GameState& state = *pstate;
 
-    CRITICAL_BLOCK(cs_main)
+  const Game::StateCommitment c = Game::GetStateCommitment (state);
+
+  Object res;
+  res.push_back (Pair ("height", state.nHeight));
+  res.push_back (Pair ("blockhash", state.hashBlock.GetHex ()));
+  res.push_back (Pair ("root", c.GetRoot ().GetHex ()));
+  res.push_back (Pair ("entities", static_cast<int> (c.GetNumEntities ())));
+
+  if (fVerify)
     {
-        CBlockIndex* pindex;
-        if (height == -1)
-            pindex = NULL;
-        else
+      Game::StateCommitment full;
+      full.Build (state);
+      res.push_back (Pair ("verified", full.GetRoot () == c.GetRoot ()));
+    }
+
+  return res;
+}
+
+/* Look up players by reward address, colour and/or occupied tile using
+   the game state's indexes.  */
+Value
+game_findplayers (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () < 1 || params.size () > 2)
+    throw runtime_error (
+            "game_findplayers {\"address\":addr,\"color\":n,"
+            "\"tile\":[x,y]} [height]\n"
+            "Return the players that match all given criteria:  Their\n"
+            "reward address (or the address holding their name if they\n"
+            "have none), their colour and/or a tile on which one of\n"
+            "their characters stands.  The result has the same format\n"
+            "as the players in game_getstate.  For a past height, the\n"
+            "address filter fails if a name was updated since then.\n");
+
+  const Object& filterObj = params[0].get_obj ();
+  Game::PlayerFilter filter;
+  BOOST_FOREACH (const Pair& p, filterObj)
+    {
+      if (p.name_ == "address")
         {
-            pindex = pindexBest;
-            while (pindex && pindex->nHeight > height)
-                pindex = pindex->pprev;
-            if (!pindex || pindex->nHeight != height)
-                throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot find block at specified height");
+          filter.fAddress = true;
+          filter.address = p.value_.get_str ();
         }
+      else if (p.name_ == "color")
+        {
+          filter.fColor = true;
+          filter.color = p.value_.get_int ();
+        }
+      else if (p.name_ == "tile")
+        {
+          const Array& tile = p.value_.get_array ();
+          if (tile.size () != 2)
+            throw JSONRPCError (RPC_INVALID_PARAMETER, "invalid tile given");
+          filter.fTile = true;
+          filter.tile = Game::Coord (tile[0].get_int (), tile[1].get_int ());
+        }
+      else
+        throw JSONRPCError (RPC_INVALID_PARAMETER,
+                            "unknown filter: " + p.name_);
+    }
+  if (filter.IsEmpty ())
+    throw JSONRPCError (RPC_INVALID_PARAMETER, "no filter criteria given");
+
+  Game::GameStatePtr pstate;
+  GetGameStateForRpc (params, 1, pstate);
+  const Game::GameState& state = *pstate;
 
-        DatabaseSet dbset("r");
-        if (!GetGameState (dbset, pindex, state))
-            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot compute game state at specified height");
+  std::vector<Game::PlayerID> names;
+  if (!Game::FindPlayers (state, filter, names))
+    throw JSONRPCError (RPC_DATABASE_ERROR,
+                        "name addresses at this height are no longer known");
+
+  Object res;
+  BOOST_FOREACH (const Game::PlayerID& name, names)
+    {
+      const Game::PlayerStateMap::const_iterator mi = state.players.find (name);
+      assert (mi != state.players.end ());
+      const int crownIndex = (name == state.crownHolder.player
+                                ? state.crownHolder.index : -1);
+      res.push_back (Pair (name, mi->second.ToJsonValue (crownIndex)));
     }
 
-    Game::PlayerID player_name = params[0].get_str();
-    std::map<Game::PlayerID, Game::PlayerState>::const_iterator mi = state.players.find(player_name);
-    if (mi == state.players.end())
-        throw JSONRPCError(RPC_DATABASE_ERROR, "No such player");
+  return res;
+}
 
-    int crown_index = player_name == state.crownHolder.player ? state.crownHolder.index : -1;
-    return mi->second.ToJsonValue(crown_index);
+/* Query the leaderboards of the current game state.  */
+Value
+game_leaderboard (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () < 1 || params.size () > 3)
+    throw runtime_error (
+            "game_leaderboard <board> [count=10] [id]\n"
+            "Return the top entries of a leaderboard for the current\n"
+            "game state.  board is one of \"loot\" (characters by carried\n"
+            "loot), \"hunters\" (players by number of hunters), \"vaults\"\n"
+            "(vaults by gem balance, only with permanent luggage) or\n"
+            "\"kills\" (players by kills since the height given as \"since\"\n"
+            "in the result).  If id is given, also return the rank of this\n"
+            "player, character or vault.\n");
+
+  Game::LeaderboardType type;
+  if (!Game::ParseLeaderboardType (params[0].get_str (), type))
+    throw JSONRPCError (RPC_INVALID_PARAMETER, "unknown leaderboard");
+#ifndef PERMANENT_LUGGAGE
+  if (type == Game::LEADERBOARD_VAULTS)
+    throw JSONRPCError (RPC_INVALID_PARAMETER,
+                        "the vaults leaderboard needs permanent luggage,"
+                        " which is not enabled in this build");
+#endif
+
+  int count = 10;
+  if (params.size () > 1)
+    count = params[1].get_int ();
+  if (count < 0)
+    throw JSONRPCError (RPC_INVALID_PARAMETER, "invalid count");
+
+  std::string id;
+  if (params.size () > 2)
+    id = params[2].get_str ();
+
+  if (IsInitialBlockDownload ())
+    throw JSONRPCError (RPC_CLIENT_IN_INITIAL_DOWNLOAD,
+                        "huntercoin is downloading blocks...");
+
+  Game::LeaderboardResult lb;
+  CRITICAL_BLOCK(cs_main)
+    Game::QueryLeaderboard (*GetCurrentGameState (), type, count, id, lb);
+
+  /* Loot and gems are coin amounts, the others simple counts.  */
+  const bool fAmount = (type == Game::LEADERBOARD_LOOT
+                        || type == Game::LEADERBOARD_VAULTS);
+
+  Object res;
+  res.push_back (Pair ("height", lb.nHeight));
+  res.push_back (Pair ("blockhash", lb.hashBlock.GetHex ()));
+  if (type == Game::LEADERBOARD_KILLS)
+    res.push_back (Pair ("since", lb.nKillsSince));
+  res.push_back (Pair ("entries", static_cast<int> (lb.nEntries)));
+
+  Array top;
+  BOOST_FOREACH (const Game::LeaderboardEntry& e, lb.top)
+    {
+      Object obj;
+      obj.push_back (Pair ("rank", static_cast<int> (e.rank)));
+      obj.push_back (Pair ("id", e.id));
+      if (fAmount)
+        obj.push_back (Pair ("score", ValueFromAmount (e.score)));
+      else
+        obj.push_back (Pair ("score", e.score));
+      top.push_back (obj);
+    }
+  res.push_back (Pair ("top", top));
+
+  if (!id.empty ())
+    {
+      if (lb.fFound)
+        {
+          Object obj;
+          obj.push_back (Pair ("rank", static_cast<int> (lb.entry.rank)));
+          obj.push_back (Pair ("id", lb.entry.id));
+          if (fAmount)
+            obj.push_back (Pair ("score", ValueFromAmount (lb.entry.score)));
+          else
+            obj.push_back (Pair ("score", lb.entry.score));
+          res.push_back (Pair ("entry", obj));
+        }
+      else
+        res.push_back (Pair ("entry", Value::null));
+    }
+
+  return res;
 }
 
 /* Give access to the game's shortest path algorithm to calculate
@@ -2561,10 +2865,17 @@ Value game_getplayerstate(const Array& params, bool fHelp)
 Value
 game_getpath (const Array& params, bool fHelp)
 {
-  if (fHelp || params.size () != 2)
-    throw runtime_error ("game_getpath [fromX,fromY] [toX,toY]\n"
+  if (fHelp || params.size () < 2 || params.size () > 3)
+    throw runtime_error ("game_getpath [fromX,fromY] [toX,toY] [mode=astar]\n"
                          "Return a set of way points that travels in a\n"
-                         "shortest path between the given coordinates.\n");
+                         "shortest path between the given coordinates.\n"
+                         "mode selects the search algorithm:  \"astar\",\n"
+                         "\"jps\" (jump point search, faster for long paths),\n"
+                         "\"alt\" (A* with landmark distances, see\n"
+                         "-pathlandmarks) or \"hpa\" (hierarchical search\n"
+                         "over clusters of the map, fastest for long paths).\n"
+                         "All but \"hpa\" find shortest paths, but not always\n"
+                         "the same.\n");
 
   if (params[0].type () != array_type || params[1].type () != array_type)
     throw runtime_error ("arguments must be arrays");
@@ -2578,7 +2889,11 @@ game_getpath (const Array& params, bool fHelp)
   const Game::Coord fromC(from[0].get_int (), from[1].get_int ());
   const Game::Coord toC(to[0].get_int (), to[1].get_int ());
 
-  std::vector<Game::Coord> path = FindPath (fromC, toC);
+  PathMode mode = PATH_ASTAR;
+  if (params.size () > 2 && !ParsePathMode (params[2].get_str (), mode))
+    throw JSONRPCError (RPC_INVALID_PARAMS, "Invalid path mode");
+
+  std::vector<Game::Coord> path = FindPath (fromC, toC, mode);
 
   Array res;
   bool first = true;
@@ -2597,6 +2912,409 @@ game_getpath (const Array& params, bool fHelp)
   return res;
 }
 
+/* Parse a coordinate given as [x, y].  */
+static bool
+ParsePathCoord (const Value& val, Game::Coord& c)
+{
+  if (val.type () != array_type)
+    return false;
+  const Array& arr = val.get_array ();
+  if (arr.size () != 2 || arr[0].type () != int_type
+      || arr[1].type () != int_type)
+    return false;
+
+  c = Game::Coord (arr[0].get_int (), arr[1].get_int ());
+  return true;
+}
+
+/* Solve many path queries at once, in parallel.  This saves bots that plan
+   moves for many hunters a round trip per path.  */
+Value
+game_getpaths (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () < 1 || params.size () > 3)
+    throw runtime_error (
+            "game_getpaths [[[fromX,fromY],[toX,toY]],...] [mode=astar]"
+            " [threads=0]\n"
+            "Compute the paths for a list of queries like game_getpath,\n"
+            "in parallel on the given number of threads, at most one per\n"
+            "core (0 for one per core).  Returns an array with an object\n"
+            "for each query in order, which holds either the way points\n"
+            "as \"path\" or the reason why no path was found as \"error\".\n");
+
+  if (params[0].type () != array_type)
+    throw runtime_error ("queries must be an array");
+  const Array& arr = params[0].get_array ();
+
+  PathMode mode = PATH_ASTAR;
+  if (params.size () > 1 && !ParsePathMode (params[1].get_str (), mode))
+    throw JSONRPCError (RPC_INVALID_PARAMS, "Invalid path mode");
+
+  int nThreads = 0;
+  if (params.size () > 2)
+    nThreads = params[2].get_int ();
+  if (nThreads < 0)
+    throw JSONRPCError (RPC_INVALID_PARAMS, "Invalid number of threads");
+
+  std::vector<PathQuery> queries(arr.size ());
+  for (unsigned i = 0; i < arr.size (); ++i)
+    {
+      const Value& q = arr[i];
+      if (q.type () != array_type || q.get_array ().size () != 2
+          || !ParsePathCoord (q.get_array ()[0], queries[i].start)
+          || !ParsePathCoord (q.get_array ()[1], queries[i].goal))
+        queries[i].strError = "invalid coordinates given";
+    }
+
+  FindPaths (queries, mode, nThreads);
+
+  Array res;
+  BOOST_FOREACH (const PathQuery& q, queries)
+    {
+      Object obj;
+      if (!q.strError.empty ())
+        obj.push_back (Pair ("error", q.strError));
+      else
+        {
+          /* Skip the start like game_getpath.  */
+          Array path;
+          for (unsigned i = 1; i < q.path.size (); ++i)
+            {
+              path.push_back (q.path[i].x);
+              path.push_back (q.path[i].y);
+            }
+          obj.push_back (Pair ("path", path));
+        }
+      res.push_back (obj);
+    }
+
+  return res;
+}
+
+/* Look up tiles in one of the distance fields of the current state.  */
+Value
+game_getdistancefield (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () != 2)
+    throw runtime_error (
+            "game_getdistancefield <field> [[x,y],...]\n"
+            "Return for each of the given tiles the walking distance to\n"
+            "the nearest target, which target that is and the next tile\n"
+            "on a shortest path to it.  field is one of \"banks\",\n"
+            "\"harvest\" (tiles of the harvest areas, with the area's\n"
+            "index) or \"crown\".  Tiles from which no target can be\n"
+            "reached have \"reachable\" set to false.\n");
+
+  Game::DistanceFieldType type;
+  if (!Game::ParseDistanceFieldType (params[0].get_str (), type))
+    throw JSONRPCError (RPC_INVALID_PARAMETER, "unknown distance field");
+
+  if (params[1].type () != array_type)
+    throw JSONRPCError (RPC_INVALID_PARAMETER, "tiles must be an array");
+  const Array& arr = params[1].get_array ();
+  std::vector<Game::Coord> tiles(arr.size ());
+  for (unsigned i = 0; i < arr.size (); ++i)
+    if (!ParsePathCoord (arr[i], tiles[i]))
+      throw JSONRPCError (RPC_INVALID_PARAMETER, "invalid coordinates given");
+
+  if (IsInitialBlockDownload ())
+    throw JSONRPCError (RPC_CLIENT_IN_INITIAL_DOWNLOAD,
+                        "huntercoin is downloading blocks...");
+
+  Game::DistanceFieldResult df;
+  CRITICAL_BLOCK(cs_main)
+    Game::QueryDistanceField (*GetCurrentGameState (), type, tiles, df);
+
+  Object res;
+  res.push_back (Pair ("height", df.nHeight));
+  res.push_back (Pair ("blockhash", df.hashBlock.GetHex ()));
+  res.push_back (Pair ("targets", static_cast<int> (df.nTargets)));
+
+  Array arrTiles;
+  BOOST_FOREACH (const Game::DistanceInfo& info, df.tiles)
+    {
+      Object obj;
+      obj.push_back (Pair ("x", info.tile.x));
+      obj.push_back (Pair ("y", info.tile.y));
+      obj.push_back (Pair ("reachable", info.fReachable));
+      if (info.fReachable)
+        {
+          obj.push_back (Pair ("distance", static_cast<int> (info.nDistance)));
+
+          Object target;
+          target.push_back (Pair ("x", info.target.x));
+          target.push_back (Pair ("y", info.target.y));
+          obj.push_back (Pair ("target", target));
+
+          Object next;
+          next.push_back (Pair ("x", info.next.x));
+          next.push_back (Pair ("y", info.next.y));
+          obj.push_back (Pair ("next", next));
+
+          if (type == Game::DISTANCE_HARVEST)
+            obj.push_back (Pair ("area", info.nArea));
+        }
+      arrTiles.push_back (obj);
+    }
+  res.push_back (Pair ("tiles", arrTiles));
+
+  return res;
+}
+
+/* Time the path search against the original implementation based on
+   the Boost Graph Library for random pairs of coordinates.  */
+Value
+game_benchpath (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () > 1)
+    throw runtime_error (
+            "game_benchpath [pairs=20]\n"
+            "Search paths between the given number of random pairs of\n"
+            "walkable coordinates with both the current path finder and\n"
+            "the original one based on the Boost Graph Library.  Returns\n"
+            "the average time and number of expanded cells per\n"
+            "search.  Jump point search and the ALT\n"
+            "search are run as well and checked to find paths that are no\n"
+            "longer than those of the other searches.  For the\n"
+            "hierarchical search, the number of longer paths and their\n"
+            "average excess length are reported.  Finally, the way\n"
+            "points returned by game_getpath are counted and checked by\n"
+            "simulating the movement along them, and the time for turning\n"
+            "the paths into way points is reported separately.  The worst\n"
+            "case of game_getpath is measured on paths between opposite\n"
+            "corners of the map.\n");
+
+  int nPairs = 20;
+  if (params.size () > 0)
+    nPairs = params[0].get_int ();
+  if (nPairs < 1)
+    throw JSONRPCError (RPC_INVALID_PARAMS, "Invalid number of pairs");
+
+  PathBenchmark bench;
+  BenchmarkFindPath (nPairs, bench);
+
+  Object res;
+  res.push_back (Pair ("pairs", bench.nPairs));
+  res.push_back (Pair ("found", bench.nFound));
+  res.push_back (Pair ("reference_ms",
+                       bench.nReferenceMicros / 1000.0 / bench.nPairs));
+  res.push_back (Pair ("grid_ms", bench.nGridMicros / 1000.0 / bench.nPairs));
+  res.push_back (Pair ("grid_expanded",
+                       static_cast<double> (bench.nGridExpanded) / bench.nPairs));
+  res.push_back (Pair ("jps_longer", bench.nJumpLonger));
+  res.push_back (Pair ("jps_ms", bench.nJumpMicros / 1000.0 / bench.nPairs));
+  res.push_back (Pair ("jps_expanded",
+                       static_cast<double> (bench.nJumpExpanded) / bench.nPairs));
+  res.push_back (Pair ("alt_longer", bench.nLandmarkLonger));
+  res.push_back (Pair ("alt_ms",
+                       bench.nLandmarkMicros / 1000.0 / bench.nPairs));
+  res.push_back (Pair ("alt_expanded",
+                       static_cast<double> (bench.nLandmarkExpanded)
+                         / bench.nPairs));
+  res.push_back (Pair ("hpa_longer", bench.nHierarchicalLonger));
+  if (bench.nHierarchicalLonger > 0)
+    res.push_back (Pair ("hpa_extra_steps",
+                         static_cast<double> (bench.nHierarchicalExtraSteps)
+                           / bench.nHierarchicalLonger));
+  res.push_back (Pair ("hpa_fallbacks", bench.nHierarchicalFallbacks));
+  res.push_back (Pair ("hpa_ms",
+                       bench.nHierarchicalMicros / 1000.0 / bench.nPairs));
+  res.push_back (Pair ("hpa_expanded",
+                       static_cast<double> (bench.nHierarchicalExpanded)
+                         / bench.nPairs));
+  if (bench.nFound > 0)
+    {
+      res.push_back (Pair ("waypoints",
+                           static_cast<double> (bench.nWaypoints)
+                             / bench.nFound));
+      res.push_back (Pair ("findpath_ms",
+                           bench.nWaypointMicros / 1000.0 / bench.nFound));
+      res.push_back (Pair ("linearize_ms",
+                           bench.nLinearizeMicros / 1000.0 / bench.nFound));
+    }
+  res.push_back (Pair ("invalid_waypoints", bench.nInvalidWaypoints));
+  if (bench.nCrossPaths > 0)
+    {
+      res.push_back (Pair ("crossmap_length", bench.nCrossMaxLength));
+      res.push_back (Pair ("crossmap_waypoints", bench.nCrossMaxWaypoints));
+      res.push_back (Pair ("crossmap_search_ms",
+                           bench.nCrossSearchMicros / 1000.0));
+      res.push_back (Pair ("crossmap_findpath_ms",
+                           bench.nCrossFindPathMicros / 1000.0));
+      res.push_back (Pair ("crossmap_linearize_ms",
+                           bench.nCrossLinearizeMicros / 1000.0));
+    }
+
+  return res;
+}
+
+/* Encode the game state as snapshot and check that it decodes to the same
+   state again.  This also reports how much space the encoding saves.  */
+Value
+game_checksnapshot (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () > 1)
+    throw runtime_error (
+            "game_checksnapshot [height]\n"
+            "Encode the game state (the current one or at the given height)\n"
+            "as columnar snapshot with and without compression, decode it\n"
+            "again and verify that the result is the same state.  Returns\n"
+            "the sizes of the normal serialisation and both snapshots.\n");
+
+  Game::GameStatePtr pstate;
+  GetGameStateForRpc (params, 0, pstate);
+
+  Game::SnapshotCheck check;
+  Game::CheckSnapshot (*pstate, check);
+
+  Object res;
+  res.push_back (Pair ("height", pstate->nHeight));
+  res.push_back (Pair ("serialised", static_cast<int> (check.nSerialisedSize)));
+  res.push_back (Pair ("columnar", static_cast<int> (check.nColumnarSize)));
+  res.push_back (Pair ("compressed", static_cast<int> (check.nCompressedSize)));
+  res.push_back (Pair ("match", check.fMatch));
+
+  return res;
+}
+
+Value
+game_dumpsnapshot (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () < 1 || params.size () > 2)
+    throw runtime_error (
+            "game_dumpsnapshot <file> [height]\n"
+            "Write the game state (the current one or at the given height)\n"
+            "to a snapshot file.  Another node that has the block chain can\n"
+            "import it with -loadgamesnapshot and reconstruct later states\n"
+            "from there.  The importing node must also be given the root\n"
+            "with -loadgamesnapshotroot, taken from game_getstateroot on a\n"
+            "trusted node.\n");
+
+  const std::string strFile = params[0].get_str ();
+
+  Game::GameStatePtr pstate;
+  GetGameStateForRpc (params, 1, pstate);
+
+  Game::SnapshotFileHeader hdr;
+  if (!Game::WriteSnapshotFile (strFile, *pstate, hdr))
+    throw JSONRPCError (RPC_MISC_ERROR, "Failed to write the snapshot file");
+
+  Object res;
+  res.push_back (Pair ("height", hdr.nHeight));
+  res.push_back (Pair ("blockhash", hdr.hashBlock.GetHex ()));
+  res.push_back (Pair ("root", hdr.hashStateRoot.GetHex ()));
+  res.push_back (Pair ("contenthash", hdr.hashContent.GetHex ()));
+  res.push_back (Pair ("size", static_cast<int> (hdr.nSize)));
+  res.push_back (Pair ("chunks", static_cast<int> (hdr.nChunks)));
+
+  return res;
+}
+
+/* Dump the game state to a snapshot file and read it back as it would be
+   imported with -loadgamesnapshot.  */
+Value
+game_checksnapshotfile (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () < 1 || params.size () > 2)
+    throw runtime_error (
+            "game_checksnapshotfile <file> [height]\n"
+            "Write the game state (the current one or at the given height)\n"
+            "to a snapshot file like game_dumpsnapshot, then read it back\n"
+            "with all the checks of -loadgamesnapshot, but without importing\n"
+            "it.  Returns the header and whether the state read back is the\n"
+            "same as the original one.\n");
+
+  const std::string strFile = params[0].get_str ();
+
+  Game::GameStatePtr pstate;
+  GetGameStateForRpc (params, 1, pstate);
+
+  Game::SnapshotFileHeader hdr;
+  if (!Game::WriteSnapshotFile (strFile, *pstate, hdr))
+    throw JSONRPCError (RPC_MISC_ERROR, "Failed to write the snapshot file");
+
+  Game::SnapshotFileHeader hdrRead;
+  Game::GameState state;
+  const bool fRead = ReadGameSnapshot (strFile, hdrRead, state);
+
+  Object res;
+  res.push_back (Pair ("height", hdr.nHeight));
+  res.push_back (Pair ("root", hdr.hashStateRoot.GetHex ()));
+  res.push_back (Pair ("size", static_cast<int> (hdr.nSize)));
+  res.push_back (Pair ("chunks", static_cast<int> (hdr.nChunks)));
+  res.push_back (Pair ("read", fRead));
+  res.push_back (Pair ("match",
+                       fRead && hdrRead.hashContent == hdr.hashContent
+                         && SerializeHash (state) == SerializeHash (*pstate)));
+
+  return res;
+}
+
+Value
+game_verifyhistory (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () > 2)
+    throw runtime_error (
+            "game_verifyhistory [threads=0] [fromheight=-1]\n"
+            "Re-verify the stored game states by replaying the blocks\n"
+            "between each two of them and comparing the result to the later\n"
+            "one.  The segments are replayed in parallel on the given number\n"
+            "of threads, at most one per core (0 for one per core).  Only\n"
+            "segments that end after fromheight are checked.  This may take\n"
+            "a long time.\n");
+
+  int nThreads = 0;
+  if (params.size () > 0)
+    nThreads = params[0].get_int ();
+  if (nThreads < 0)
+    throw JSONRPCError (RPC_INVALID_PARAMS, "Invalid number of threads");
+  int nFromHeight = -1;
+  if (params.size () > 1)
+    nFromHeight = params[1].get_int ();
+
+  const int64 nStart = GetTimeMillis ();
+  GameHistoryCheck check;
+  const bool fOk = VerifyGameHistory (nFromHeight, nThreads, check);
+
+  Array mismatches;
+  BOOST_FOREACH (int h, check.mismatches)
+    mismatches.push_back (h);
+
+  Object res;
+  res.push_back (Pair ("ok", fOk));
+  res.push_back (Pair ("threads", static_cast<int> (check.nThreads)));
+  res.push_back (Pair ("segments", static_cast<int> (check.nSegments)));
+  res.push_back (Pair ("verified", static_cast<int> (check.nVerified)));
+  res.push_back (Pair ("skipped", static_cast<int> (check.nSkipped)));
+  res.push_back (Pair ("mismatches", mismatches));
+  res.push_back (Pair ("seconds", (GetTimeMillis () - nStart) / 1000.0));
+
+  return res;
+}
+
+Value
+game_getrebuildstatus (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () != 0)
+    throw runtime_error ("game_getrebuildstatus\n"
+                         "Return whether the game database is being rebuilt\n"
+                         "in the background and how far this has come.  Game\n"
+                         "methods are refused until the rebuild is finished.\n");
+
+  int nHeight, nTarget;
+  const bool fRebuilding = GetGameDBRebuildProgress (nHeight, nTarget);
+
+  Object res;
+  res.push_back (Pair ("rebuilding", fRebuilding));
+  if (fRebuilding)
+    {
+      res.push_back (Pair ("height", nHeight));
+      res.push_back (Pair ("target", nTarget));
+    }
+
+  return res;
+}
+
 Value
 prune_gamedb (const Array& params, bool fHelp)
 {
@@ -2820,9 +3538,9 @@ analyseutxo (const Array& params, bool fHelp)
 
   /* Also calculate total number of coins on the map, so that we get the total
      money supply and can check it.  */
-  const Game::GameState& state = GetCurrentGameState ();
-  const int64 onMap = state.GetCoinsOnMap ();
-  const int64 gameFund = state.gameFund;
+  const Game::GameStatePtr state = GetCurrentGameState ();
+  const int64 onMap = state->GetCoinsOnMap ();
+  const int64 gameFund = state->gameFund;
   const int64 rewards = pindexBest->GetTotalRewards ();
 
   /* Construct the result.  */
@@ -2956,11 +3674,41 @@ CHooks* InitHook()
     mapCallTable.insert(make_pair("game_getstate", &game_getstate));
     mapCallTable.insert(make_pair("game_waitforchange", &game_waitforchange));
     mapCallTable.insert(make_pair("game_getplayerstate", &game_getplayerstate));
+    mapCallTable.insert(make_pair("game_getstateroot", &game_getstateroot));
+    mapCallTable.insert(make_pair("game_findplayers", &game_findplayers));
+    mapCallTable.insert(make_pair("game_leaderboard", &game_leaderboard));
+    mapCallTable.insert(make_pair("game_getdistancefield", &game_getdistancefield));
     mapCallTable.insert(make_pair("game_getpath", &game_getpath));
+    mapCallTable.insert(make_pair("game_getpaths", &game_getpaths));
+    mapCallTable.insert(make_pair("game_benchpath", &game_benchpath));
     mapCallTable.insert(make_pair("prune_gamedb", &prune_gamedb));
     mapCallTable.insert(make_pair("prune_nameindex", &prune_nameindex));
     mapCallTable.insert(make_pair("deletetransaction", &deletetransaction));
+    mapCallTable.insert(make_pair("game_getrebuildstatus", &game_getrebuildstatus));
+    mapCallTable.insert(make_pair("game_checksnapshot", &game_checksnapshot));
+    mapCallTable.insert(make_pair("game_verifyhistory", &game_verifyhistory));
+    mapCallTable.insert(make_pair("game_dumpsnapshot", &game_dumpsnapshot));
+    mapCallTable.insert(make_pair("game_checksnapshotfile", &game_checksnapshotfile));
+    mapRawCallTable.insert(make_pair("game_getstate", &game_getstate_raw));
+    mapRawCallTable.insert(make_pair("game_waitforchange", &game_waitforchange_raw));
     setCallAsync.insert("game_waitforchange");
+    setCallAsync.insert("game_verifyhistory");
+    setCallAsync.insert("game_benchpath");
+    setCallNeedsGameState.insert("game_getstate");
+    setCallNeedsGameState.insert("game_waitforchange");
+    setCallNeedsGameState.insert("game_getplayerstate");
+    setCallNeedsGameState.insert("game_getstateroot");
+    setCallNeedsGameState.insert("game_findplayers");
+    setCallNeedsGameState.insert("game_leaderboard");
+    setCallNeedsGameState.insert("game_getdistancefield");
+    setCallNeedsGameState.insert("game_getpath");
+    setCallNeedsGameState.insert("game_getpaths");
+    setCallNeedsGameState.insert("game_checksnapshot");
+    setCallNeedsGameState.insert("game_verifyhistory");
+    setCallNeedsGameState.insert("game_dumpsnapshot");
+    setCallNeedsGameState.insert("game_checksnapshotfile");
+    setCallNeedsGameState.insert("prune_gamedb");
+    setCallNeedsGameState.insert("analyseutxo");
     hashGenesisBlock = hashHuntercoinGenesisBlock[fTestNet ? 1 : 0];
     printf("Setup huntercoin genesis block %s\n", hashGenesisBlock.GetHex().c_str());
     return new CHuntercoinHooks();
@@ -3146,7 +3894,9 @@ CHuntercoinHooks::AcceptToMemoryPool (DatabaseSet& dbset,
     return error("%s: no output in name tx %s",
                  __func__, tx.ToString().c_str());
 
-  if (!IsMoveValid (GetCurrentGameState(), tx))
+  if (IsGameDBRebuilding ())
+    return error("%s: game state is being rebuilt", __func__);
+  if (!IsMoveValid (*GetCurrentGameState(), tx))
     return error("%s: invalid game move", __func__);
 
   int op, nOut;
@@ -3752,7 +4502,7 @@ bool
 CHuntercoinHooks::DisconnectBlock (CBlock& block, DatabaseSet& dbset,
                                    CBlockIndex* pindex)
 {
-  RollbackGameState (dbset.tx (), pindex);
+  RollbackGameState (dbset, pindex, block);
   return true;
 }
 
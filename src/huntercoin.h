@@ -45,6 +45,13 @@ bool NameAvailable (DatabaseSet& dbset, const vchType& vchName);
 bool GetTxOfName (CNameDB& dbName, const vchType& vchName, CTransaction& tx);
 bool GetTxOfNameAtHeight (CNameDB& dbName, const vchType& vchName,
                           int nHeight, CTransaction& tx);
+bool GetTxOfNamesAtHeight (CNameDB& dbName, const std::set<vchType>& names,
+                           int nHeight,
+                           std::map<vchType, CTransaction>& txs);
+bool GetNameAddressesAtHeight (CNameDB& dbName, const std::set<vchType>& names,
+                               int nHeight,
+                               std::map<vchType, std::string>& addresses,
+                               std::set<vchType>& tooNew);
 int IndexOfNameOutput(const CTransaction& tx);
 bool GetValueOfTxPos(const CNameIndex& txPos, std::vector<unsigned char>& vchValue, uint256& hash, int& nHeight);
 bool GetValueOfTxPos(const CDiskTxPos& txPos, std::vector<unsigned char>& vchValue, uint256& hash, int& nHeight);
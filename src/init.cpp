@@ -22,6 +22,12 @@ using namespace boost;
 
 void rescanfornames();
 
+// Declarations to avoid including full gamedb.h
+bool InitGameStore();
+void ShutdownGameStore();
+void LoadGameStateCache();
+bool ConvertGameDB(bool fToStore);
+
 CWallet* pwalletMain;
 string walletPath;
 
@@ -66,6 +72,7 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         DBFlush(false);
         StopNode();
+        ShutdownGameStore();
         DBFlush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -595,6 +602,27 @@ bool AppInit2(int argc, char* argv[])
       CUtxoDB db("cr+");
     }
 
+    /* Offline conversion between the game state storage engines.  */
+    if (mapArgs.count("-convertgamedb"))
+    {
+        const std::string strTarget = GetArg("-convertgamedb", "");
+        if (strTarget != "segment" && strTarget != "bdb")
+        {
+            wxMessageBox("Incorrect -convertgamedb parameter specified, expected segment or bdb", "Huntercoin");
+            return false;
+        }
+        if (!ConvertGameDB(strTarget == "segment"))
+            fprintf(stderr, "Error: game state conversion failed\n");
+        return false;
+    }
+
+    rpcWarmupStatus = "opening game state store";
+    if (!InitGameStore())
+    {
+        wxMessageBox(_("Error opening the game state store"), "Huntercoin");
+        return false;
+    }
+
     /* Load block index.  */
     rpcWarmupStatus = "loading block index";
     printf("Loading block index...\n");
@@ -615,6 +643,7 @@ bool AppInit2(int argc, char* argv[])
     rpcWarmupStatus = "upgrading game db";
     if (!UpgradeGameDB())
         printf("ERROR: GameDB update failed\n");
+    LoadGameStateCache();
 
     rpcWarmupStatus = "loading wallet";
     printf("Loading wallet...\n");
@@ -828,6 +857,14 @@ std::string HelpMessage()
         "  -datadir=<dir>   \t\t  " + _("Specify data directory\n") +
         "  -dbcache=<n>     \t\t  " + _("Set database cache size in megabytes (default: 25)") + "\n" +
         "  -dblogsize=<n>   \t\t  " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -gamekeyframes=<n> \t  " + _("Store a full game state every n blocks near the tip, less often further back (default: 64)") + "\n" +
+        "  -gamekeyframebudget=<n> \t" + _("Disk space for stored full game states (keyframes) in megabytes, not counting per-block deltas and undo data, 0 for no limit (default: 1024)") + "\n" +
+        "  -gamestatecache=<n> \t  " + _("Size of the in-memory game state cache in megabytes (default: 200)") + "\n" +
+        "  -gamestore=<engine> \t  " + _("Storage engine for full game states, bdb or segment (default: bdb)") + "\n" +
+        "  -convertgamedb=<engine> \t  " + _("Move the stored game states to the given engine and exit") + "\n" +
+        "  -loadgamesnapshot=<file> \t  " + _("Import the game state from a file written by game_dumpsnapshot") + "\n" +
+        "  -loadgamesnapshotroot=<hash> \t" + _("State root that the imported snapshot must have, as returned by game_getstateroot on a trusted node") + "\n" +
+        "  -pathlandmarks=<n> \t  " + _("Number of landmarks for the ALT path finding mode, more use more memory (default: 8)") + "\n" +
         "  -timeout=<n>     \t  "   + _("Specify connection timeout (in milliseconds)\n") +
         "  -proxy=<ip:port> \t  "   + _("Connect through socks4 proxy\n") +
         "  -dns             \t  "   + _("Allow DNS lookups for addnode and connect\n") +
@@ -2725,6 +2725,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 printf("  got inventory: %s  %s\n",
                        inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
+            // Blocks cannot be connected while the game DB is rebuilt,
+            // they are fetched from peers once it is done.
+            if (!fAlreadyHave && inv.type == MSG_BLOCK && IsGameDBRebuilding())
+                continue;
+
             if (!fAlreadyHave)
                 pfrom->AskFor(inv);
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
@@ -2948,6 +2953,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        if (IsGameDBRebuilding())
+        {
+            printf("ignoring block while the game DB is rebuilt\n");
+            return true;
+        }
+
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
     }
@@ -3809,7 +3820,7 @@ void static BitcoinMiner(CWallet *pwallet)
         if (fShutdown)
             return;
 
-        while (vNodes.empty() || IsInitialBlockDownload())
+        while (vNodes.empty() || IsInitialBlockDownload() || IsGameDBRebuilding())
         {
             MilliSleep(1000);
             if (fShutdown)
@@ -3952,7 +3963,7 @@ void static ScryptMiner(CWallet *pwallet)
         if (fShutdown)
             return;
 
-        while (vNodes.empty() || IsInitialBlockDownload())
+        while (vNodes.empty() || IsInitialBlockDownload() || IsGameDBRebuilding())
         {
             MilliSleep(1000);
             if (fShutdown)
@@ -201,11 +201,16 @@ public:
 
     bool updateGameState(bool &fRewardAddrChanged)
     {
+        // Try again later if the game DB is still being rebuilt
+        if (IsGameDBRebuilding())
+            return false;
+
         CTryCriticalBlock criticalBlock(cs_main);
         if (!criticalBlock.Entered())
             return false;
 
-        const Game::GameState &gameState = GetCurrentGameState();
+        const Game::GameStatePtr pGameState = GetCurrentGameState();
+        const Game::GameState &gameState = *pGameState;
 
 
         // pending tx monitor -- UI main loop
@@ -632,6 +637,10 @@ void NameTableModel::emitDataChanged(int idx)
 
 void NameTableModel::emitGameStateChanged()
 {
+    if (IsGameDBRebuilding())
+        return;
+
     LOCK(cs_main);
-    emit gameStateChanged(GetCurrentGameState());
+    const Game::GameStatePtr gameState = GetCurrentGameState();
+    emit gameStateChanged(*gameState);
 }
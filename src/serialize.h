@@ -1237,4 +1237,65 @@ public:
     }
 };
 
+/** Read-only stream over a fixed memory range, e. g. a memory-mapped file.
+ *  Unserializing from it does not copy the data into an intermediate
+ *  buffer first (as CDataStream would).
+ */
+class CBufferReader
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+    const char* pcur;
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn,
+                  int nTypeIn=SER_DISK, int nVersionIn=VERSION)
+      : pbegin(pbeginIn), pend(pendIn), pcur(pbeginIn),
+        nType(nTypeIn), nVersion(nVersionIn)
+    {}
+
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+    size_t tell() const          { return pcur - pbegin; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CBufferReader& read(char* pch, int nSize)
+    {
+        if (nSize < 0 || pend - pcur < nSize)
+            throw std::ios_base::failure("CBufferReader::read : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CBufferReader& ignore(int nSize)
+    {
+        if (nSize < 0 || pend - pcur < nSize)
+            throw std::ios_base::failure("CBufferReader::ignore : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+
 #endif
@@ -0,0 +1,200 @@
+#include <boost/test/unit_test.hpp>
+
+#include "gamemap.h"
+#include "gamemovecreator.h"
+#include "headers.h"
+
+using namespace Game;
+
+// Fixed pairs of walkable coordinates (start x, y and goal x, y)
+static const int pathPairs[][4] =
+{
+    // Between opposite corners and across the map
+    {0, 0, 501, 501},
+    {501, 0, 0, 501},
+    {0, 501, 501, 0},
+    {255, 10, 10, 255},
+    {10, 255, 480, 300},
+    // Through the centre and shorter paths
+    {250, 250, 100, 400},
+    {400, 100, 250, 250},
+    {30, 30, 123, 321},
+    {300, 450, 480, 300},
+    {250, 251, 250, 250},
+    {30, 30, 0, 0},
+};
+static const unsigned nPathPairs = sizeof(pathPairs) / sizeof(pathPairs[0]);
+
+static const PathMode pathModes[] = {PATH_ASTAR, PATH_JPS, PATH_ALT, PATH_HPA};
+static const unsigned nPathModes = sizeof(pathModes) / sizeof(pathModes[0]);
+
+// Check that the flat-array search returns exactly the path of the
+// original Boost Graph search.  Both break ties between paths of the same
+// length in the same way, so the paths must be identical, not only equally
+// long.
+static void
+CheckSamePath(const Coord& start, const Coord& goal, bool fReachable)
+{
+    std::deque<Coord> reference, solution;
+    const bool fReference = FindPathReference(start, goal, reference);
+    const bool fFound = FindPathGrid(start, goal, solution);
+
+    BOOST_CHECK_MESSAGE(fReference == fReachable && fFound == fReachable,
+                        strprintf("reachability from (%d, %d) to (%d, %d)",
+                                  start.x, start.y, goal.x, goal.y));
+    if (fReachable)
+        BOOST_CHECK_MESSAGE(solution == reference,
+                            strprintf("paths differ from (%d, %d) to (%d, %d)",
+                                      start.x, start.y, goal.x, goal.y));
+}
+
+// Check that the path consists of steps to neighbouring walkable tiles
+// and ends at the goal
+static bool
+IsValidPath(const Coord& start, const std::deque<Coord>& path, const Coord& goal)
+{
+    Coord last = start;
+    for (unsigned i = 0; i < path.size(); ++i)
+    {
+        if (distLInf(last, path[i]) != 1 || !IsWalkable(path[i].x, path[i].y))
+            return false;
+        last = path[i];
+    }
+    return last == goal;
+}
+
+// Run a search mode on the fixed pairs and check that it finds valid
+// paths that are at most nExtraPercent longer than those of the plain A*
+// search.  That one is not always shortest (see GridSearch), so the paths
+// may also be shorter.
+static void
+CheckSearchMode(PathMode mode, int nExtraPercent)
+{
+    for (unsigned i = 0; i < nPathPairs; ++i)
+    {
+        const Coord start(pathPairs[i][0], pathPairs[i][1]);
+        const Coord goal(pathPairs[i][2], pathPairs[i][3]);
+
+        std::deque<Coord> reference, solution;
+        BOOST_REQUIRE(FindPathGrid(start, goal, reference, PATH_ASTAR));
+        if (!FindPathGrid(start, goal, solution, mode))
+        {
+            BOOST_ERROR(strprintf("no path from (%d, %d) to (%d, %d)",
+                                  start.x, start.y, goal.x, goal.y));
+            continue;
+        }
+        BOOST_CHECK_MESSAGE(IsValidPath(start, solution, goal),
+                            strprintf("invalid path from (%d, %d) to (%d, %d)",
+                                      start.x, start.y, goal.x, goal.y));
+        BOOST_CHECK_MESSAGE(solution.size() * 100 <= reference.size() * (100 + nExtraPercent),
+                            strprintf("path of %u steps instead of %u from (%d, %d) to (%d, %d)",
+                                      (unsigned)solution.size(), (unsigned)reference.size(),
+                                      start.x, start.y, goal.x, goal.y));
+    }
+
+    // Only obstacles cannot be reached (see path_unreachable)
+    std::deque<Coord> solution;
+    BOOST_CHECK(!FindPathGrid(Coord(250, 250), Coord(200, 120), solution, mode));
+}
+
+// Check that the waypoints returned by FindPath lead to the goal
+static void
+CheckFindPath(PathMode mode)
+{
+    for (unsigned i = 0; i < nPathPairs; ++i)
+    {
+        const Coord start(pathPairs[i][0], pathPairs[i][1]);
+        const Coord goal(pathPairs[i][2], pathPairs[i][3]);
+
+        const std::vector<Coord> waypoints = FindPath(start, goal, mode);
+        BOOST_CHECK_MESSAGE(!waypoints.empty() && CheckWaypoints(waypoints, goal),
+                            strprintf("invalid waypoints from (%d, %d) to (%d, %d), mode %d",
+                                      start.x, start.y, goal.x, goal.y, (int)mode));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(path_tests)
+
+BOOST_AUTO_TEST_CASE(path_grid_matches_reference)
+{
+    for (unsigned i = 0; i < nPathPairs; ++i)
+    {
+        const Coord start(pathPairs[i][0], pathPairs[i][1]);
+        const Coord goal(pathPairs[i][2], pathPairs[i][3]);
+        BOOST_REQUIRE(IsWalkable(start.x, start.y) && IsWalkable(goal.x, goal.y));
+        CheckSamePath(start, goal, true);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(path_waypoints_bisect)
+{
+    // FindPath keeps the waypoints of the binary search if they are fewer,
+    // so it never returns more than earlier versions did
+    for (unsigned i = 0; i < nPathPairs; ++i)
+        for (unsigned m = 0; m < nPathModes; ++m)
+        {
+            const Coord start(pathPairs[i][0], pathPairs[i][1]);
+            const Coord goal(pathPairs[i][2], pathPairs[i][3]);
+
+            std::deque<Coord> solution;
+            BOOST_REQUIRE(FindPathGrid(start, goal, solution, pathModes[m]));
+            std::vector<Coord> bisected;
+            LinearizeBisect(start, solution, bisected);
+
+            const std::vector<Coord> waypoints = FindPath(start, goal, pathModes[m]);
+            BOOST_CHECK_MESSAGE(!waypoints.empty() && waypoints.size() <= bisected.size(),
+                                strprintf("%u waypoints instead of at most %u from (%d, %d) to (%d, %d), mode %d",
+                                          (unsigned)waypoints.size(), (unsigned)bisected.size(),
+                                          start.x, start.y, goal.x, goal.y, (int)pathModes[m]));
+        }
+}
+
+BOOST_AUTO_TEST_CASE(path_waypoints_valid)
+{
+    CheckFindPath(PATH_ASTAR);
+    CheckFindPath(PATH_JPS);
+    CheckFindPath(PATH_ALT);
+    CheckFindPath(PATH_HPA);
+}
+
+BOOST_AUTO_TEST_CASE(path_jps)
+{
+    // Jump point search returns shortest paths
+    CheckSearchMode(PATH_JPS, 0);
+}
+
+BOOST_AUTO_TEST_CASE(path_alt)
+{
+    // The landmark heuristic is admissible, so the paths are shortest
+    CheckSearchMode(PATH_ALT, 0);
+}
+
+BOOST_AUTO_TEST_CASE(path_hpa)
+{
+    // The hierarchical search may return slightly longer paths.  On the
+    // fixed pairs, they are less than 2% longer than those of A*.
+    CheckSearchMode(PATH_HPA, 2);
+}
+
+BOOST_AUTO_TEST_CASE(path_same_tile)
+{
+    std::deque<Coord> reference, solution;
+    const Coord c(250, 250);
+    BOOST_CHECK(FindPathReference(c, c, reference));
+    BOOST_CHECK(FindPathGrid(c, c, solution));
+    BOOST_CHECK(reference.empty() && solution.empty());
+
+    CheckSamePath(Coord(0, 0), Coord(0, 0), true);
+}
+
+BOOST_AUTO_TEST_CASE(path_unreachable)
+{
+    // The walkable part of the map is connected, so the only goals that
+    // cannot be reached are obstacles.  Both searches then exhaust the
+    // whole map, which takes a while with the reference search.
+    const Coord blocked(200, 120);
+    BOOST_REQUIRE(!IsWalkable(blocked.x, blocked.y));
+    CheckSamePath(Coord(250, 250), blocked, false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,492 @@
+#include <boost/test/unit_test.hpp>
+
+#include "gamecommitment.h"
+#include "gamedelta.h"
+#include "gamesnapshot.h"
+#include "gamestate.h"
+#include "headers.h"
+
+#include <boost/filesystem.hpp>
+
+#include <cstdio>
+#include <stdexcept>
+
+using namespace Game;
+
+/* Build a small state that uses all entity types and some corner cases of
+   the encoding:  names sharing a prefix, gaps in the character indices,
+   coordinates and heights below their reference values and long
+   strings.  */
+static GameState
+BuildTestState()
+{
+    GameState state;
+    state.nHeight = 1234;
+    state.nDisasterHeight = 1000;
+    state.hashBlock = uint256("0x5a5f9d1bc8a14a2f0a2b8e6b3e0c7f1d28e6f3a9d4c5b6a7988776655443322");
+    state.gameFund = 42 * COIN;
+    state.crownPos = Coord(250, 250);
+    state.crownHolder = CharacterID("alice", 3);
+
+    PlayerState& alice = state.players["alice"];
+    alice.color = 0;
+    alice.lockedCoins = 200 * COIN;
+    alice.value = 250 * COIN;
+    alice.next_character_index = 5;
+    alice.message = "hello";
+    alice.message_block = 1230;
+
+    CharacterState& general = alice.characters[0];
+    general.coord = Coord(10, 20);
+    general.dir = 6;
+    general.from = Coord(5, 22);
+    general.waypoints.push_back(Coord(30, 40));
+    general.waypoints.push_back(Coord(12, 3));
+    general.loot.Collect(LootInfo(7 * COIN, 1100), 1200);
+    general.loot.Collect(LootInfo(COIN, 1150), 1210);
+
+    CharacterState& hunter = alice.characters[3];
+    hunter.coord = Coord(0, 0);
+    hunter.dir = 2;
+    hunter.from = hunter.coord;
+    hunter.stay_in_spawn_area = 12;
+
+    PlayerState& alicia = state.players["alicia"];
+    alicia.color = 3;
+    alicia.lockedCoins = 100 * COIN;
+    alicia.value = 90 * COIN;
+    alicia.next_character_index = 2;
+    alicia.remainingLife = 7;
+    alicia.message = std::string(300, 'x');
+    alicia.message_block = 1234;
+    alicia.characters[1].coord = Coord(501, 498);
+    alicia.characters[1].from = Coord(480, 499);
+
+    PlayerState& bob = state.dead_players_chat["bob"];
+    bob.color = 2;
+    bob.message = "bye";
+    bob.message_block = 1234;
+
+    state.loot[Coord(100, 200)] = LootInfo(3 * COIN, 1200);
+    LootInfo old(COIN / 2, 900);
+    old.lastBlock = 1234;
+    state.loot[Coord(99, 201)] = old;
+
+    state.hearts.insert(Coord(50, 60));
+    state.hearts.insert(Coord(49, 61));
+
+    state.banks[Coord(1, 1)] = 20;
+    state.banks[Coord(500, 480)] = 5;
+
+    return state;
+}
+
+static Move
+ParseMove(const GameState& state, const PlayerID& name, const std::string& json)
+{
+    Move m;
+    BOOST_REQUIRE(m.Parse(name, json));
+
+    const PlayerStateMap::const_iterator mi = state.players.find(name);
+    const int64_t oldLocked = (mi == state.players.end() ? 0 : mi->second.lockedCoins);
+    m.newLocked = oldLocked + m.MinimumGameFee(state.nHeight + 1);
+
+    return m;
+}
+
+/* Number of steps of the test game played by BuildSteppedState.  */
+static const unsigned TEST_GAME_STEPS = 30;
+
+/* Perform the i-th step of a test game from the initial state, with a few
+   spawns and moves, so that the states have players, loot and a crown as
+   they come out of the game logic.  */
+static void
+StepTestGame(const GameState& state, unsigned i, GameState& next, StepResult& res)
+{
+    StepData data;
+    data.nTreasureAmount = 10 * COIN;
+    const int nHeight = state.nHeight + 1;
+    data.newHash = Hash(BEGIN(nHeight), END(nHeight));
+
+    if (i == 0)
+    {
+        data.vMoves.push_back(ParseMove(state, "alice", "{\"color\":0,\"msg\":\"hi\"}"));
+        data.vMoves.push_back(ParseMove(state, "bob", "{\"color\":1}"));
+        data.vMoves.push_back(ParseMove(state, "carol", "{\"color\":3}"));
+    }
+    else if (i == 1)
+    {
+        data.vMoves.push_back(ParseMove(state, "alice", "{\"0\":{\"wp\":[20,20]},\"1\":{\"wp\":[30,5]}}"));
+        data.vMoves.push_back(ParseMove(state, "bob", "{\"0\":{\"wp\":[480,20]}}"));
+    }
+    else if (i == 10)
+        data.vMoves.push_back(ParseMove(state, "dave", "{\"color\":2}"));
+
+    BOOST_REQUIRE(PerformStep(state, data, next, res));
+}
+
+static GameState
+BuildSteppedState()
+{
+    GameState state;
+    for (unsigned i = 0; i < TEST_GAME_STEPS; ++i)
+    {
+        GameState next;
+        StepResult res;
+        StepTestGame(state, i, next, res);
+        state = next;
+    }
+
+    return state;
+}
+
+static uint256
+GetRootFromScratch(const GameState& state)
+{
+    /* GetStateCommitment caches by block hash, which would hide
+       differences between states of the same block.  */
+    StateCommitment c;
+    c.Build(state);
+    return c.GetRoot();
+}
+
+static bool
+SerialiseEqual(const GameState& a, const GameState& b)
+{
+    CDataStream ssA(SER_DISK, VERSION);
+    ssA << a;
+    CDataStream ssB(SER_DISK, VERSION);
+    ssB << b;
+    return ssA.str() == ssB.str();
+}
+
+/* Encode and decode the state and check that the result serialises
+   exactly as the original and has the same commitment.  */
+static void
+CheckRoundTrip(const GameState& state, bool fCompress)
+{
+    std::vector<unsigned char> data;
+    EncodeSnapshot(state, fCompress, data);
+    BOOST_REQUIRE(!data.empty());
+
+    GameState decoded;
+    DecodeSnapshot(&data[0], data.size(), decoded);
+
+    BOOST_CHECK(SerialiseEqual(decoded, state));
+    BOOST_CHECK(GetRootFromScratch(decoded) == GetRootFromScratch(state));
+}
+
+static std::vector<char>
+ReadFileBytes(const std::string& strFile)
+{
+    std::vector<char> res;
+    FILE* file = fopen(strFile.c_str(), "rb");
+    BOOST_REQUIRE(file);
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+        res.insert(res.end(), buf, buf + n);
+    fclose(file);
+    return res;
+}
+
+static void
+WriteFileBytes(const std::string& strFile, const std::vector<char>& data)
+{
+    FILE* file = fopen(strFile.c_str(), "wb");
+    BOOST_REQUIRE(file);
+    if (!data.empty())
+        BOOST_REQUIRE(fwrite(&data[0], 1, data.size(), file) == data.size());
+    fclose(file);
+}
+
+static std::vector<unsigned char>
+LzRoundTrip(const std::vector<unsigned char>& in)
+{
+    std::vector<unsigned char> compressed;
+    LzCompress(in, compressed);
+
+    std::vector<unsigned char> out;
+    LzDecompress(compressed.empty() ? NULL : &compressed[0], compressed.size(),
+                 in.size(), out);
+    return out;
+}
+
+/* Decompress the given bytes, which must fail.  */
+static bool
+LzRejects(const std::vector<unsigned char>& data, size_t nSize)
+{
+    std::vector<unsigned char> out;
+    try
+    {
+        LzDecompress(data.empty() ? NULL : &data[0], data.size(), nSize, out);
+    }
+    catch (const std::runtime_error&)
+    {
+        return true;
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_SUITE(snapshot_tests)
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip_empty)
+{
+    GameState state;
+    CheckRoundTrip(state, false);
+    CheckRoundTrip(state, true);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip)
+{
+    const GameState state = BuildTestState();
+    CheckRoundTrip(state, false);
+    CheckRoundTrip(state, true);
+
+    SnapshotCheck check;
+    BOOST_CHECK(CheckSnapshot(state, check));
+    BOOST_CHECK(check.fMatch);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_reject_invalid)
+{
+    const GameState state = BuildTestState();
+    std::vector<unsigned char> data;
+    EncodeSnapshot(state, true, data);
+
+    GameState decoded;
+    BOOST_CHECK_THROW(DecodeSnapshot(&data[0], data.size() - 1, decoded),
+                      std::runtime_error);
+    BOOST_CHECK_THROW(DecodeSnapshot(&data[0], 3, decoded), std::runtime_error);
+
+    std::vector<unsigned char> wrongFormat(data);
+    ++wrongFormat[0];
+    BOOST_CHECK_THROW(DecodeSnapshot(&wrongFormat[0], wrongFormat.size(), decoded),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip_stepped)
+{
+    const GameState state = BuildSteppedState();
+    BOOST_CHECK(state.players.size() == 4);
+    BOOST_CHECK(!state.loot.empty());
+    CheckRoundTrip(state, false);
+    CheckRoundTrip(state, true);
+}
+
+BOOST_AUTO_TEST_CASE(commitment_incremental)
+{
+    /* The commitment is updated from the changes PerformStep records.
+       This must give the same root as a full build after every step.  */
+    GameState state;
+    StateCommitment c;
+    c.Build(state);
+    for (unsigned i = 0; i < TEST_GAME_STEPS; ++i)
+    {
+        GameState next;
+        StepResult res;
+        StepTestGame(state, i, next, res);
+        BOOST_CHECK(CheckChanges(state, next, res.changes));
+
+        c.Update(next, res.changes);
+        BOOST_CHECK_MESSAGE(c.GetRoot() == GetRootFromScratch(next),
+                            strprintf("commitment root mismatch @%d", next.nHeight));
+        state = next;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(delta_apply)
+{
+    /* A delta, stored and read back, must turn the parent into exactly
+       the state it was created from, and carry that state's root.  */
+    GameState state;
+    for (unsigned i = 0; i < TEST_GAME_STEPS; ++i)
+    {
+        GameState next;
+        StepResult res;
+        StepTestGame(state, i, next, res);
+
+        StateDelta delta;
+        delta.Create(state, next, res.changes, GetRootFromScratch(next));
+        CDataStream ss(SER_DISK, VERSION);
+        ss << delta;
+        StateDelta read;
+        ss >> read;
+
+        GameState applied(state);
+        BOOST_REQUIRE(read.Apply(applied));
+        BOOST_CHECK_MESSAGE(SerialiseEqual(applied, next),
+                            strprintf("delta mismatch @%d", next.nHeight));
+        BOOST_CHECK(read.GetStateRoot() == GetRootFromScratch(applied));
+        state = next;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(undo_apply)
+{
+    /* An undo record, stored and read back, must turn a stepped state back
+       into one that serialises exactly as its parent.  */
+    GameState state;
+    for (unsigned i = 0; i < TEST_GAME_STEPS; ++i)
+    {
+        GameState next;
+        StepResult res;
+        StepTestGame(state, i, next, res);
+
+        StateUndo undo;
+        undo.Create(state, next, res.changes, GetRootFromScratch(state));
+        CDataStream ss(SER_DISK, VERSION);
+        ss << undo;
+        StateUndo read;
+        ss >> read;
+
+        GameState undone(next);
+        BOOST_REQUIRE(read.Apply(undone));
+        BOOST_CHECK_MESSAGE(SerialiseEqual(undone, state),
+                            strprintf("undo mismatch @%d", next.nHeight));
+        BOOST_CHECK(read.GetStateRoot() == GetRootFromScratch(undone));
+        state = next;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_file)
+{
+    const GameState state = BuildSteppedState();
+    const std::string strFile = (boost::filesystem::temp_directory_path()
+                                 / boost::filesystem::unique_path("huntercoin-snapshot-%%%%%%%%")).string();
+
+    SnapshotFileHeader hdr;
+    BOOST_REQUIRE(WriteSnapshotFile(strFile, state, hdr));
+    BOOST_CHECK(hdr.nHeight == state.nHeight);
+    BOOST_CHECK(hdr.hashBlock == state.hashBlock);
+    BOOST_CHECK(hdr.hashStateRoot == GetRootFromScratch(state));
+
+    SnapshotFileHeader hdrRead;
+    GameState read;
+    BOOST_REQUIRE(ReadSnapshotFile(strFile, hdrRead, read));
+    BOOST_CHECK(hdrRead.hashStateRoot == hdr.hashStateRoot);
+    BOOST_CHECK(hdrRead.hashContent == hdr.hashContent);
+    BOOST_CHECK(SerialiseEqual(read, state));
+    BOOST_CHECK(GetRootFromScratch(read) == hdr.hashStateRoot);
+
+    /* Flip a byte in the chunk data, which follows the header and the
+       chunk size.  */
+    const std::vector<char> bytes = ReadFileBytes(strFile);
+    const size_t nChunkStart = sizeof(unsigned) + GetSerializeSize(hdr, SER_DISK, VERSION)
+                               + sizeof(unsigned);
+    BOOST_REQUIRE(bytes.size() > nChunkStart + 10);
+
+    std::vector<char> corrupt(bytes);
+    corrupt[nChunkStart + 10] ^= 0x01;
+    WriteFileBytes(strFile, corrupt);
+    BOOST_CHECK(!VerifySnapshotFile(strFile, hdrRead));
+    BOOST_CHECK(!ReadSnapshotFile(strFile, hdrRead, read));
+
+    /* Truncate the file inside the chunk data, before the chunk hash and
+       by a single byte.  */
+    const size_t truncated[] = {nChunkStart + 10, bytes.size() - sizeof(uint256), bytes.size() - 1};
+    for (unsigned i = 0; i < sizeof(truncated) / sizeof(truncated[0]); ++i)
+    {
+        WriteFileBytes(strFile, std::vector<char>(bytes.begin(), bytes.begin() + truncated[i]));
+        BOOST_CHECK(!VerifySnapshotFile(strFile, hdrRead));
+        BOOST_CHECK(!ReadSnapshotFile(strFile, hdrRead, read));
+    }
+
+    boost::filesystem::remove(strFile);
+}
+
+BOOST_AUTO_TEST_CASE(lz_roundtrip)
+{
+    std::vector<unsigned char> data;
+    BOOST_CHECK(LzRoundTrip(data) == data);
+
+    data.push_back('a');
+    data.push_back('b');
+    BOOST_CHECK(LzRoundTrip(data) == data);
+
+    /* Long runs need extra length bytes for the match length.  */
+    data.assign(1000, 'z');
+    BOOST_CHECK(LzRoundTrip(data) == data);
+
+    /* Pseudo-random bytes give long literal runs.  */
+    data.clear();
+    uint32_t x = 12345;
+    for (unsigned i = 0; i < 5000; ++i)
+    {
+        x = x * 1103515245 + 12345;
+        data.push_back(x >> 24);
+    }
+    BOOST_CHECK(LzRoundTrip(data) == data);
+
+    /* Repeat it with a distance beyond the maximum match offset, and
+       with overlapping matches of a short period.  */
+    const std::vector<unsigned char> random(data);
+    data.insert(data.end(), 70000, 0);
+    data.insert(data.end(), random.begin(), random.end());
+    for (unsigned i = 0; i < 3000; ++i)
+        data.push_back("abc"[i % 3]);
+    BOOST_CHECK(LzRoundTrip(data) == data);
+
+    std::vector<unsigned char> compressed;
+    LzCompress(data, compressed);
+    BOOST_CHECK(compressed.size() < data.size());
+}
+
+BOOST_AUTO_TEST_CASE(lz_decompress_tokens)
+{
+    /* One literal, then a match of length 4 at offset 1 (which overlaps
+       its own output) and an empty final token.  */
+    const unsigned char valid[] = {0x10, 'a', 0x01, 0x00, 0x00};
+    std::vector<unsigned char> data(valid, valid + sizeof(valid));
+    std::vector<unsigned char> out;
+    LzDecompress(&data[0], data.size(), 5, out);
+    BOOST_CHECK(out == std::vector<unsigned char>(5, 'a'));
+
+    /* Wrong expected size, either way.  */
+    BOOST_CHECK(LzRejects(data, 4));
+    BOOST_CHECK(LzRejects(data, 6));
+
+    /* Missing final token.  */
+    data.pop_back();
+    BOOST_CHECK(LzRejects(data, 5));
+}
+
+BOOST_AUTO_TEST_CASE(lz_reject_malformed)
+{
+    BOOST_CHECK(LzRejects(std::vector<unsigned char>(), 0));
+
+    /* More literals announced than present.  */
+    const unsigned char shortLiterals[] = {0x20, 'a'};
+    BOOST_CHECK(LzRejects(std::vector<unsigned char>(shortLiterals, shortLiterals + 2), 2));
+
+    /* More literals than the expected size.  */
+    const unsigned char tooMany[] = {0x20, 'a', 'b'};
+    BOOST_CHECK(LzRejects(std::vector<unsigned char>(tooMany, tooMany + 3), 1));
+
+    /* Extended literal length without its length bytes.  */
+    const unsigned char noLength[] = {0xF0};
+    BOOST_CHECK(LzRejects(std::vector<unsigned char>(noLength, noLength + 1), 100));
+
+    /* Match offsets of zero and before the start of the output.  */
+    const unsigned char zeroOffset[] = {0x10, 'a', 0x00, 0x00, 0x00};
+    BOOST_CHECK(LzRejects(std::vector<unsigned char>(zeroOffset, zeroOffset + 5), 5));
+    const unsigned char farOffset[] = {0x10, 'a', 0x02, 0x00, 0x00};
+    BOOST_CHECK(LzRejects(std::vector<unsigned char>(farOffset, farOffset + 5), 5));
+
+    /* Truncated offset.  */
+    const unsigned char halfOffset[] = {0x10, 'a', 0x01};
+    BOOST_CHECK(LzRejects(std::vector<unsigned char>(halfOffset, halfOffset + 3), 5));
+
+    /* Truncating real compressed data anywhere must fail as well.  */
+    std::vector<unsigned char> data;
+    for (unsigned i = 0; i < 500; ++i)
+        data.push_back("huntercoin"[i % 10] + i / 100);
+    std::vector<unsigned char> compressed;
+    LzCompress(data, compressed);
+    for (size_t n = 0; n < compressed.size(); ++n)
+        BOOST_CHECK(LzRejects(std::vector<unsigned char>(compressed.begin(),
+                                                         compressed.begin() + n),
+                              data.size()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,21 @@
+#define BOOST_TEST_MODULE Huntercoin Test Suite
+#include <boost/test/unit_test.hpp>
+
+#include "headers.h"
+#include "init.h"
+
+/* init.cpp is not linked into the test binary, so provide what the
+   rest of the code needs from it.  */
+
+CWallet* pwalletMain;
+std::string walletPath;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}